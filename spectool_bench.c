@@ -0,0 +1,560 @@
+/* Spectrum tools microbenchmarks
+ *
+ * Times the hot paths of the core - the sweep cache, network frame coding,
+ * the USB report ring and the capture, replay and synthetic phys - on fixed,
+ * generated data, and writes the results as JSON so they can be compared
+ * from release to release.
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "config.h"
+
+#include "spectool_container.h"
+#include "spectool_net.h"
+#include "spectool_net_client.h"
+#include "spectool_ring.h"
+#include "spectool_capture.h"
+#include "spectool_replay.h"
+#include "spectool_synth.h"
+
+/* Distinct sweeps cycled through by each benchmark */
+#define BENCH_POOL			64
+
+/* Same keyframe interval as the server */
+#define BENCH_KEYINT		16
+
+#define BENCH_DEVID			0x42454e43
+
+/* Base iterations of each benchmark, before scaling */
+#define BENCH_ITER			200000
+
+int bench_first = 1;
+double bench_scale = 1;
+char *bench_filter = NULL;
+
+void Usage(void) {
+	printf("spectool_bench [ options ]\n"
+		   " -f / --filter name           Only run benchmarks with name in their\n"
+		   "                              name\n"
+		   " -s / --scale factor          Scale the iteration counts\n"
+		   " -o / --output file           Write the results to a file instead of\n"
+		   "                              stdout\n");
+	return;
+}
+
+double bench_now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (double) tv.tv_sec * 1000000000.0f + (double) tv.tv_usec * 1000.0f;
+}
+
+int bench_wanted(const char *name) {
+	if (bench_filter == NULL)
+		return 1;
+
+	return strstr(name, bench_filter) != NULL;
+}
+
+int bench_iterations(int base, int samples) {
+	long n = (long) (base * bench_scale * 256 / samples);
+
+	if (n < 100)
+		n = 100;
+
+	return (int) n;
+}
+
+void bench_report(FILE *out, const char *name, int samples, int depth,
+				  long iterations, double ns, double bytes) {
+	fprintf(out, "%s\n    { \"name\": \"%s\", \"samples\": %d, ",
+			bench_first ? "" : ",", name, samples);
+
+	if (depth > 0)
+		fprintf(out, "\"depth\": %d, ", depth);
+
+	fprintf(out, "\"iterations\": %ld, \"ns_per_sweep\": %.1f",
+			iterations, ns / iterations);
+
+	if (bytes > 0)
+		fprintf(out, ", \"bytes_per_sweep\": %.1f, \"mb_per_sec\": %.1f",
+				bytes / iterations, (bytes / (1024 * 1024)) / (ns / 1000000000.0f));
+
+	fprintf(out, " }");
+
+	bench_first = 0;
+}
+
+/* Realistic sweeps from the synthetic phy, so the delta coding sees the kind
+ * of data it sees off the air */
+spectool_sample_sweep **bench_pool(int samples) {
+	spectool_sample_sweep **pool, *s;
+	spectool_phy phy;
+	int x = 0;
+
+	memset(&phy, 0, sizeof(spectool_phy));
+
+	if (spectool_synth_init_params(&phy, 0, samples, 0,
+								   SPECTOOL_SYNTH_SIG_ALL) < 0 ||
+		spectool_phy_open(&phy) < 0) {
+		fprintf(stderr, "Failed to make sweeps: %s\n", spectool_get_error(&phy));
+		exit(1);
+	}
+
+	pool = (spectool_sample_sweep **)
+		malloc(sizeof(spectool_sample_sweep *) * BENCH_POOL);
+
+	while (x < BENCH_POOL) {
+		if ((spectool_phy_poll(&phy) & SPECTOOL_POLL_SWEEPCOMPLETE) == 0)
+			continue;
+
+		s = spectool_phy_getsweep(&phy);
+
+		pool[x] = (spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(samples));
+		memcpy(pool[x], s, SPECTOOL_SWEEP_SIZE(samples));
+		pool[x]->phydev = NULL;
+
+		x++;
+	}
+
+	spectool_phy_close(&phy);
+
+	return pool;
+}
+
+void bench_cache(FILE *out, spectool_sample_sweep **pool, int samples, int depth) {
+	spectool_sweep_cache *c;
+	int x, n;
+	double start;
+
+	if (bench_wanted("cache_append") == 0)
+		return;
+
+	n = bench_iterations(BENCH_ITER, samples);
+	c = spectool_cache_alloc(depth, 1, 1);
+
+	/* Fill it first, so every append evicts */
+	for (x = 0; x < depth; x++)
+		spectool_cache_append(c, pool[x % BENCH_POOL]);
+
+	start = bench_now();
+
+	for (x = 0; x < n; x++)
+		spectool_cache_append(c, pool[x % BENCH_POOL]);
+
+	bench_report(out, "cache_append", samples, depth, n, bench_now() - start, 0);
+
+	spectool_cache_free(c);
+}
+
+/* Frames of BENCH_POOL sweeps, each in its own header like a lone sweep from
+ * the server */
+uint8_t **bench_frames(spectool_sample_sweep **pool, int samples, int delta) {
+	uint8_t **frames;
+	spectool_fr_header *h;
+	int x, len;
+
+	frames = (uint8_t **) malloc(sizeof(uint8_t *) * BENCH_POOL);
+
+	for (x = 0; x < BENCH_POOL; x++) {
+		frames[x] = (uint8_t *) malloc(spectool_fr_header_size() +
+					spectool_fr_sweepdelta_size(spectool_net_delta_max(samples)) +
+					spectool_fr_sweep_size(samples));
+		h = (spectool_fr_header *) frames[x];
+
+		if (delta)
+			len = spectool_net_encode_sweepdelta(h->data, BENCH_DEVID,
+								SPECTOOL_NET_SWEEPTYPE_CUR, x / BENCH_KEYINT,
+								(x % BENCH_KEYINT) == 0 ? NULL :
+								pool[x - (x % BENCH_KEYINT)]->sample_data,
+								pool[x]);
+		else
+			len = spectool_net_encode_sweep(h->data, BENCH_DEVID,
+											SPECTOOL_NET_SWEEPTYPE_CUR, pool[x]);
+
+		h->sentinel = htonl(SPECTOOL_NET_SENTINEL);
+		h->frame_len = htons(spectool_fr_header_size() + len);
+		h->proto_version = SPECTOOL_NET_PROTO_VERSION;
+		h->block_type = delta ? SPECTOOL_NET_FRAME_SWEEPDELTA :
+			SPECTOOL_NET_FRAME_SWEEP;
+		h->num_blocks = 1;
+	}
+
+	return frames;
+}
+
+void bench_encode(FILE *out, spectool_sample_sweep **pool, int samples, int delta) {
+	uint8_t *buf;
+	int x, n, k;
+	double start, bytes = 0;
+
+	if (bench_wanted(delta ? "net_encode_sweepdelta" : "net_encode_sweep") == 0)
+		return;
+
+	n = bench_iterations(BENCH_ITER * 4, samples);
+	buf = (uint8_t *) malloc(spectool_fr_sweepdelta_size(
+				spectool_net_delta_max(samples)) + spectool_fr_sweep_size(samples));
+
+	start = bench_now();
+
+	for (x = 0; x < n; x++) {
+		k = x % BENCH_POOL;
+
+		if (delta)
+			bytes += spectool_net_encode_sweepdelta(buf, BENCH_DEVID,
+								SPECTOOL_NET_SWEEPTYPE_CUR, k / BENCH_KEYINT,
+								(k % BENCH_KEYINT) == 0 ? NULL :
+								pool[k - (k % BENCH_KEYINT)]->sample_data,
+								pool[k]);
+		else
+			bytes += spectool_net_encode_sweep(buf, BENCH_DEVID,
+											   SPECTOOL_NET_SWEEPTYPE_CUR,
+											   pool[k]);
+	}
+
+	bench_report(out, delta ? "net_encode_sweepdelta" : "net_encode_sweep",
+				 samples, 0, n, bench_now() - start, bytes);
+
+	free(buf);
+}
+
+void bench_decode(FILE *out, spectool_sample_sweep **pool, int samples, int delta) {
+	spectool_server sr;
+	spectool_net_dev sni;
+	spectool_net_dev_aux aux;
+	spectool_phy phy;
+	uint8_t **frames;
+	char errstr[SPECTOOL_ERROR_MAX];
+	char junk[4096];
+	int x, n;
+	double start, bytes = 0;
+
+	if (bench_wanted(delta ? "net_decode_sweepdelta" : "net_decode_sweep") == 0)
+		return;
+
+	n = bench_iterations(BENCH_ITER, samples);
+	frames = bench_frames(pool, samples, delta);
+
+	/* A server which has advertised and enabled one device */
+	memset(&sr, 0, sizeof(spectool_server));
+	memset(&sni, 0, sizeof(spectool_net_dev));
+	memset(&aux, 0, sizeof(spectool_net_dev_aux));
+	memset(&phy, 0, sizeof(spectool_phy));
+
+	sni.device_id = BENCH_DEVID;
+	sni.num_samples = samples;
+	sni.start_khz = pool[0]->start_khz;
+	sni.res_hz = pool[0]->res_hz;
+	sni.amp_offset_mdbm = pool[0]->amp_offset_mdbm;
+	sni.amp_res_mdbm = pool[0]->amp_res_mdbm;
+	sni.rssi_max = pool[0]->rssi_max;
+	sni.phydev = &phy;
+	sr.devlist = &sni;
+
+	phy.auxptr = &aux;
+	phy.min_rssi_seen = -1;
+
+	/* Nobody reads the phy, so don't let the wakeups block */
+	pipe(aux.spipe);
+	fcntl(aux.spipe[0], F_SETFL, fcntl(aux.spipe[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(aux.spipe[1], F_SETFL, fcntl(aux.spipe[1], F_GETFL, 0) | O_NONBLOCK);
+
+	start = bench_now();
+
+	for (x = 0; x < n; x++) {
+		spectool_fr_header *h = (spectool_fr_header *) frames[x % BENCH_POOL];
+
+		if (delta) {
+			if (spectool_netcli_block_sweepdelta(&sr, h, errstr) < 0)
+				break;
+		} else {
+			if (spectool_netcli_block_sweep(&sr, h, errstr) < 0)
+				break;
+		}
+
+		bytes += ntohs(h->frame_len);
+
+		if ((x & 1023) == 0)
+			while (read(aux.spipe[0], junk, 4096) > 0)
+				;
+	}
+
+	if (x < n) {
+		fprintf(stderr, "Failed to decode frame %d: %s\n", x, errstr);
+		exit(1);
+	}
+
+	bench_report(out, delta ? "net_decode_sweepdelta" : "net_decode_sweep",
+				 samples, 0, n, bench_now() - start, bytes);
+
+	if (aux.sweep != NULL)
+		free(aux.sweep);
+	if (sni.key_data != NULL)
+		free(sni.key_data);
+	close(aux.spipe[0]);
+	close(aux.spipe[1]);
+
+	for (x = 0; x < BENCH_POOL; x++)
+		free(frames[x]);
+	free(frames);
+}
+
+int bench_ring_handler(spectool_phy *phydev, uint8_t *lbuf, int len) {
+	return SPECTOOL_POLL_NONE;
+}
+
+void bench_ring(FILE *out) {
+	spectool_ring *r;
+	spectool_phy phy;
+	uint8_t report[SPECTOOL_RING_SLOT_SZ];
+	char errstr[SPECTOOL_ERROR_MAX];
+	int x, y, n, count;
+	double start;
+
+	if (bench_wanted("ring_handoff") == 0)
+		return;
+
+	n = bench_iterations(BENCH_ITER * 20, 256) / 128;
+
+	r = (spectool_ring *) malloc(sizeof(spectool_ring));
+	spectool_ring_init(r);
+
+	if (spectool_ring_open(r, errstr) < 0) {
+		fprintf(stderr, "%s\n", errstr);
+		exit(1);
+	}
+
+	memset(&phy, 0, sizeof(spectool_phy));
+	memset(report, 0x5A, SPECTOOL_RING_SLOT_SZ);
+
+	start = bench_now();
+
+	/* Bursts of reports, as a USB device delivers them */
+	for (x = 0; x < n; x++) {
+		for (y = 0; y < 128; y++)
+			spectool_ring_put(r, report, SPECTOOL_RING_SLOT_SZ);
+
+		spectool_ring_drain(r, &phy, &bench_ring_handler, &count);
+	}
+
+	/* Reported per report rather than per sweep */
+	bench_report(out, "ring_handoff", SPECTOOL_RING_SLOT_SZ, 0, (long) n * 128,
+				 bench_now() - start, (double) n * 128 * SPECTOOL_RING_SLOT_SZ);
+
+	spectool_ring_close(r);
+	free(r);
+}
+
+void bench_capture(FILE *out, spectool_sample_sweep **pool, int samples) {
+	spectool_capture_writer w;
+	spectool_dev_spec spec;
+	spectool_phy phy;
+	char path[64];
+	char errstr[SPECTOOL_ERROR_MAX];
+	int x, n, fd, got;
+	double start;
+
+	if (bench_wanted("capture_write") == 0 && bench_wanted("replay_poll") == 0)
+		return;
+
+	n = bench_iterations(BENCH_ITER, samples);
+
+	snprintf(path, 64, "/tmp/spectool_bench_XXXXXX");
+	if ((fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "Failed to make a capture file: %s\n", strerror(errno));
+		exit(1);
+	}
+	close(fd);
+
+	memset(&spec, 0, sizeof(spectool_dev_spec));
+	spec.device_id = BENCH_DEVID;
+	snprintf(spec.device_name, SPECTOOL_PHY_NAME_MAX, "spectool_bench");
+
+	if (spectool_capture_create(&w, path, &spec, pool[0], errstr) < 0) {
+		fprintf(stderr, "%s\n", errstr);
+		exit(1);
+	}
+
+	start = bench_now();
+
+	for (x = 0; x < n; x++) {
+		pool[x % BENCH_POOL]->tm_start.tv_sec = x / 1000;
+		pool[x % BENCH_POOL]->tm_start.tv_usec = (x % 1000) * 1000;
+
+		if (spectool_capture_write(&w, pool[x % BENCH_POOL], errstr) < 0) {
+			fprintf(stderr, "%s\n", errstr);
+			exit(1);
+		}
+	}
+
+	if (spectool_capture_finish(&w, errstr) < 0) {
+		fprintf(stderr, "%s\n", errstr);
+		exit(1);
+	}
+
+	if (bench_wanted("capture_write"))
+		bench_report(out, "capture_write", samples, 0, n, bench_now() - start,
+					 (double) n * w.header.record_len);
+
+	/* Play it all back as fast as it goes */
+	if (bench_wanted("replay_poll")) {
+		memset(&phy, 0, sizeof(spectool_phy));
+
+		if (spectool_replay_init_path(&phy, path, 0, 0) < 0 ||
+			spectool_phy_open(&phy) < 0) {
+			fprintf(stderr, "%s\n", spectool_get_error(&phy));
+			exit(1);
+		}
+
+		got = 0;
+		start = bench_now();
+
+		while (got < n) {
+			x = spectool_phy_poll(&phy);
+
+			if ((x & SPECTOOL_POLL_ERROR))
+				break;
+
+			if ((x & SPECTOOL_POLL_SWEEPCOMPLETE) &&
+				spectool_phy_getsweep(&phy) != NULL)
+				got++;
+		}
+
+		bench_report(out, "replay_poll", samples, 0, got, bench_now() - start, 0);
+
+		spectool_phy_close(&phy);
+	}
+
+	unlink(path);
+}
+
+void bench_synth(FILE *out, int samples) {
+	spectool_phy phy;
+	int x, n, got = 0;
+	double start;
+
+	if (bench_wanted("synth_poll") == 0)
+		return;
+
+	n = bench_iterations(BENCH_ITER / 4, samples);
+
+	memset(&phy, 0, sizeof(spectool_phy));
+
+	if (spectool_synth_init_params(&phy, 0, samples, 0,
+								   SPECTOOL_SYNTH_SIG_ALL) < 0 ||
+		spectool_phy_open(&phy) < 0) {
+		fprintf(stderr, "%s\n", spectool_get_error(&phy));
+		exit(1);
+	}
+
+	start = bench_now();
+
+	while (got < n) {
+		x = spectool_phy_poll(&phy);
+
+		if ((x & SPECTOOL_POLL_SWEEPCOMPLETE))
+			got++;
+	}
+
+	bench_report(out, "synth_poll", samples, 0, got, bench_now() - start, 0);
+
+	spectool_phy_close(&phy);
+}
+
+int main(int argc, char *argv[]) {
+	static struct option long_options[] = {
+		{ "filter", required_argument, 0, 'f' },
+		{ "scale", required_argument, 0, 's' },
+		{ "output", required_argument, 0, 'o' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	int option_index;
+
+	static const int sizes[] = { 256, 4096 };
+	static const int depths[] = { 1, 16, 64, 256, 1024 };
+
+	spectool_sample_sweep **pool;
+	FILE *out = stdout;
+	int x, d;
+
+	while (1) {
+		int o = getopt_long(argc, argv, "f:s:o:h",
+							long_options, &option_index);
+
+		if (o < 0)
+			break;
+
+		if (o == 'h') {
+			Usage();
+			return 0;
+		} else if (o == 'f') {
+			bench_filter = strdup(optarg);
+		} else if (o == 's') {
+			if (sscanf(optarg, "%lf", &bench_scale) != 1 || bench_scale <= 0) {
+				fprintf(stderr, "Invalid scale, expected a positive number\n");
+				exit(1);
+			}
+		} else if (o == 'o') {
+			if ((out = fopen(optarg, "w")) == NULL) {
+				fprintf(stderr, "Failed to open %s: %s\n", optarg, strerror(errno));
+				exit(1);
+			}
+		} else {
+			Usage();
+			exit(1);
+		}
+	}
+
+	fprintf(out, "{\n  \"time\": %ld,\n  \"scale\": %g,\n"
+			"  \"benchmarks\": [", (long) time(NULL), bench_scale);
+
+	for (x = 0; x < (int) (sizeof(sizes) / sizeof(int)); x++) {
+		pool = bench_pool(sizes[x]);
+
+		for (d = 0; d < (int) (sizeof(depths) / sizeof(int)); d++)
+			bench_cache(out, pool, sizes[x], depths[d]);
+
+		bench_encode(out, pool, sizes[x], 0);
+		bench_encode(out, pool, sizes[x], 1);
+		bench_decode(out, pool, sizes[x], 0);
+		bench_decode(out, pool, sizes[x], 1);
+		bench_capture(out, pool, sizes[x]);
+		bench_synth(out, sizes[x]);
+
+		for (d = 0; d < BENCH_POOL; d++)
+			free(pool[d]);
+		free(pool);
+	}
+
+	bench_ring(out);
+
+	fprintf(out, "\n  ]\n}\n");
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
+
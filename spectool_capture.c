@@ -0,0 +1,400 @@
+/*
+ * Binary sweep capture files
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "spectool_capture.h"
+
+/* The sweep view has to fit behind the record fields; this fails to compile
+ * if it doesn't */
+typedef char spectool_capture_hdr_check[(sizeof(spectool_capture_rec) + 
+	offsetof(spectool_sample_sweep, sample_data) <= SPECTOOL_CAPTURE_REC_HDR) ? 1 : -1];
+
+#define CAP_ALIGN8(x)		(((x) + 7) & ~7)
+
+int spectool_capture_create(spectool_capture_writer *w, const char *path,
+							spectool_dev_spec *spec, spectool_sample_sweep *profile,
+							char *errstr) {
+	spectool_capture_header *h = &(w->header);
+
+	memset(w, 0, sizeof(spectool_capture_writer));
+
+	if ((w->file = fopen(path, "wb")) == NULL) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to create capture %s: %s",
+				 path, strerror(errno));
+		return -1;
+	}
+
+	memcpy(h->magic, SPECTOOL_CAPTURE_MAGIC, strlen(SPECTOOL_CAPTURE_MAGIC) + 1);
+	h->version = SPECTOOL_CAPTURE_VERSION;
+	h->byte_order = SPECTOOL_CAPTURE_BOM;
+	h->header_len = CAP_ALIGN8(sizeof(spectool_capture_header));
+
+	h->device_id = spec->device_id;
+	h->device_version = spec->device_version;
+	h->device_flags = spec->device_flags;
+	/* Phy names can be longer than the header has room for */
+	snprintf(h->device_name, SPECTOOL_CAPTURE_NAME_MAX, "%.*s",
+			 SPECTOOL_CAPTURE_NAME_MAX - 1, spec->device_name);
+
+	h->start_khz = profile->start_khz;
+	h->end_khz = profile->end_khz;
+	h->res_hz = profile->res_hz;
+	h->amp_offset_mdbm = profile->amp_offset_mdbm;
+	h->amp_res_mdbm = profile->amp_res_mdbm;
+	h->rssi_max = profile->rssi_max;
+	h->filter_bw_hz = profile->filter_bw_hz;
+	h->samples_per_point = profile->samples_per_point;
+	h->num_samples = profile->num_samples;
+
+	h->record_len = CAP_ALIGN8(SPECTOOL_CAPTURE_REC_HDR + profile->num_samples);
+	h->index_interval = SPECTOOL_CAPTURE_INTERVAL;
+
+	if ((w->recbuf = (uint8_t *) malloc(h->record_len)) == NULL) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to allocate capture record");
+		fclose(w->file);
+		w->file = NULL;
+		return -1;
+	}
+
+	memset(w->recbuf, 0, h->record_len);
+
+	/* The header is written again with the record count and index at the 
+	 * end; until then it says there's no index */
+	if (fwrite(h, sizeof(spectool_capture_header), 1, w->file) != 1 ||
+		fwrite(w->recbuf, 1, h->header_len - sizeof(spectool_capture_header),
+			   w->file) != h->header_len - sizeof(spectool_capture_header)) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to write capture %s: %s",
+				 path, strerror(errno));
+		fclose(w->file);
+		w->file = NULL;
+		free(w->recbuf);
+		return -1;
+	}
+
+	return 1;
+}
+
+int spectool_capture_write(spectool_capture_writer *w, spectool_sample_sweep *sweep,
+						   char *errstr) {
+	spectool_capture_header *h = &(w->header);
+	spectool_capture_rec *rec = (spectool_capture_rec *) w->recbuf;
+	spectool_capture_idx *ni;
+	uint32_t bucket;
+
+	if (sweep->num_samples != h->num_samples || sweep->start_khz != h->start_khz) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Sweep doesn't match the capture "
+				 "profile (%u samples from %u KHz, expected %u from %u KHz)",
+				 sweep->num_samples, sweep->start_khz, h->num_samples, 
+				 h->start_khz);
+		return -1;
+	}
+
+	/* First sweep of each interval gets an index entry */
+	bucket = sweep->tm_start.tv_sec / h->index_interval;
+
+	if (h->num_records == 0 || bucket != w->index_sec) {
+		if (h->index_count >= w->index_max) {
+			if (w->index_max == 0)
+				w->index_max = 1024;
+			else
+				w->index_max *= 2;
+
+			ni = (spectool_capture_idx *) realloc(w->index, 
+							sizeof(spectool_capture_idx) * w->index_max);
+
+			if (ni == NULL) {
+				snprintf(errstr, SPECTOOL_ERROR_MAX, 
+						 "Failed to allocate capture index");
+				return -1;
+			}
+
+			w->index = ni;
+		}
+
+		w->index[h->index_count].sec = sweep->tm_start.tv_sec;
+		w->index[h->index_count].pad0 = 0;
+		w->index[h->index_count].record = h->num_records;
+		h->index_count++;
+
+		w->index_sec = bucket;
+	}
+
+	rec->start_sec = sweep->tm_start.tv_sec;
+	rec->start_usec = sweep->tm_start.tv_usec;
+	rec->end_sec = sweep->tm_end.tv_sec;
+	rec->end_usec = sweep->tm_end.tv_usec;
+	rec->min_rssi_seen = sweep->min_rssi_seen;
+
+	memcpy(w->recbuf + SPECTOOL_CAPTURE_REC_HDR, sweep->sample_data, 
+		   h->num_samples);
+
+	if (fwrite(w->recbuf, h->record_len, 1, w->file) != 1) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to write capture record: %s",
+				 strerror(errno));
+		return -1;
+	}
+
+	h->num_records++;
+
+	return 1;
+}
+
+int spectool_capture_finish(spectool_capture_writer *w, char *errstr) {
+	spectool_capture_header *h = &(w->header);
+	int ret = 1;
+
+	if (w->file == NULL)
+		return 0;
+
+	h->index_offset = (uint64_t) h->header_len + 
+		h->num_records * (uint64_t) h->record_len;
+
+	if ((h->index_count > 0 && 
+		 fwrite(w->index, sizeof(spectool_capture_idx), h->index_count, 
+				w->file) != h->index_count) ||
+		fseek(w->file, 0, SEEK_SET) < 0 ||
+		fwrite(h, sizeof(spectool_capture_header), 1, w->file) != 1) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to write capture index: %s",
+				 strerror(errno));
+		ret = -1;
+	}
+
+	if (fclose(w->file) != 0 && ret > 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to close capture: %s",
+				 strerror(errno));
+		ret = -1;
+	}
+
+	w->file = NULL;
+
+	free(w->recbuf);
+	w->recbuf = NULL;
+	free(w->index);
+	w->index = NULL;
+
+	return ret;
+}
+
+int spectool_capture_open(spectool_capture *cap, const char *path, char *errstr) {
+	struct stat st;
+	spectool_capture_header *h;
+	uint64_t end;
+
+	memset(cap, 0, sizeof(spectool_capture));
+	cap->fd = -1;
+
+	if ((cap->fd = open(path, O_RDONLY)) < 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to open capture %s: %s",
+				 path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(cap->fd, &st) < 0 || 
+		st.st_size < (off_t) sizeof(spectool_capture_header)) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Capture %s is too short", path);
+		close(cap->fd);
+		return -1;
+	}
+
+	/* Private and writeable, sweep views are built in the record headers */
+	cap->map_len = st.st_size;
+	if ((cap->map = (uint8_t *) mmap(NULL, cap->map_len, PROT_READ | PROT_WRITE, 
+									 MAP_PRIVATE, cap->fd, 0)) == MAP_FAILED) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to map capture %s: %s",
+				 path, strerror(errno));
+		close(cap->fd);
+		return -1;
+	}
+
+	h = cap->header = (spectool_capture_header *) cap->map;
+
+	if (memcmp(h->magic, SPECTOOL_CAPTURE_MAGIC, 
+			   strlen(SPECTOOL_CAPTURE_MAGIC) + 1) != 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "%s is not a spectool capture", path);
+		spectool_capture_close(cap);
+		return -1;
+	}
+
+	if (h->byte_order != SPECTOOL_CAPTURE_BOM) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Capture %s was written on a host "
+				 "with the other byte order", path);
+		spectool_capture_close(cap);
+		return -1;
+	}
+
+	if (h->version > SPECTOOL_CAPTURE_VERSION) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Capture %s is version %u, we only "
+				 "understand up to %u", path, h->version, SPECTOOL_CAPTURE_VERSION);
+		spectool_capture_close(cap);
+		return -1;
+	}
+
+	if (h->header_len < sizeof(spectool_capture_header) || (h->header_len & 7) ||
+		h->header_len > cap->map_len || (h->record_len & 7) ||
+		h->record_len < SPECTOOL_CAPTURE_REC_HDR + h->num_samples) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Capture %s has a corrupt header", 
+				 path);
+		spectool_capture_close(cap);
+		return -1;
+	}
+
+	/* An unfinished capture is as many records as made it to disk */
+	if (h->index_offset == 0) {
+		cap->num_records = (cap->map_len - h->header_len) / h->record_len;
+	} else {
+		end = h->index_offset + 
+			(uint64_t) h->index_count * sizeof(spectool_capture_idx);
+
+		if (h->index_offset != h->header_len + 
+			h->num_records * (uint64_t) h->record_len || end > cap->map_len) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "Capture %s has a corrupt index", 
+					 path);
+			spectool_capture_close(cap);
+			return -1;
+		}
+
+		cap->num_records = h->num_records;
+		cap->index = (spectool_capture_idx *) (cap->map + h->index_offset);
+		cap->index_count = h->index_count;
+	}
+
+	cap->profile.name = h->device_name;
+	cap->profile.start_khz = h->start_khz;
+	cap->profile.end_khz = h->end_khz;
+	cap->profile.res_hz = h->res_hz;
+	cap->profile.amp_offset_mdbm = h->amp_offset_mdbm;
+	cap->profile.amp_res_mdbm = h->amp_res_mdbm;
+	cap->profile.rssi_max = h->rssi_max;
+	cap->profile.filter_bw_hz = h->filter_bw_hz;
+	cap->profile.samples_per_point = h->samples_per_point;
+	cap->profile.num_samples = h->num_samples;
+
+	return 1;
+}
+
+void spectool_capture_close(spectool_capture *cap) {
+	if (cap->map != NULL && cap->map != MAP_FAILED)
+		munmap(cap->map, cap->map_len);
+
+	if (cap->fd >= 0)
+		close(cap->fd);
+
+	cap->map = NULL;
+	cap->fd = -1;
+	cap->header = NULL;
+	cap->index = NULL;
+	cap->num_records = 0;
+}
+
+static inline uint8_t *capture_record(spectool_capture *cap, uint64_t n) {
+	return cap->map + cap->header->header_len + n * cap->header->record_len;
+}
+
+spectool_sample_sweep *spectool_capture_sweep(spectool_capture *cap, uint64_t n) {
+	uint8_t *r;
+	spectool_capture_rec rec;
+	spectool_sample_sweep *sweep;
+
+	if (n >= cap->num_records)
+		return NULL;
+
+	r = capture_record(cap, n);
+	memcpy(&rec, r, sizeof(spectool_capture_rec));
+
+	/* Lay the sweep over the end of the record header so its sample_data
+	 * is the record's samples */
+	sweep = (spectool_sample_sweep *) (r + SPECTOOL_CAPTURE_REC_HDR - 
+									   offsetof(spectool_sample_sweep, sample_data));
+
+	memcpy(sweep, &(cap->profile), offsetof(spectool_sample_sweep, sample_data));
+
+	sweep->name = NULL;
+	sweep->min_rssi_seen = rec.min_rssi_seen;
+	sweep->tm_start.tv_sec = rec.start_sec;
+	sweep->tm_start.tv_usec = rec.start_usec;
+	sweep->tm_end.tv_sec = rec.end_sec;
+	sweep->tm_end.tv_usec = rec.end_usec;
+	sweep->phydev = NULL;
+
+	return sweep;
+}
+
+int spectool_capture_time(spectool_capture *cap, uint64_t n, struct timeval *tv) {
+	spectool_capture_rec *rec;
+
+	if (n >= cap->num_records)
+		return -1;
+
+	rec = (spectool_capture_rec *) capture_record(cap, n);
+
+	tv->tv_sec = rec->start_sec;
+	tv->tv_usec = rec->start_usec;
+
+	return 1;
+}
+
+uint64_t spectool_capture_seek(spectool_capture *cap, struct timeval *tv) {
+	uint64_t lo = 0, hi = cap->num_records, mid;
+	unsigned int ilo, ihi, imid;
+	spectool_capture_rec *rec;
+
+	/* The index brackets the answer between the first sweep of the last 
+	 * interval starting no later than tv and the first of the next one */
+	if (cap->index_count > 0) {
+		ilo = 0;
+		ihi = cap->index_count;
+
+		while (ilo < ihi) {
+			imid = ilo + (ihi - ilo) / 2;
+
+			if (cap->index[imid].sec <= (uint32_t) tv->tv_sec)
+				ilo = imid + 1;
+			else
+				ihi = imid;
+		}
+
+		if (ilo > 0)
+			lo = cap->index[ilo - 1].record;
+		if (ilo < cap->index_count)
+			hi = cap->index[ilo].record;
+	}
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rec = (spectool_capture_rec *) capture_record(cap, mid);
+
+		if (rec->start_sec < (uint32_t) tv->tv_sec ||
+			(rec->start_sec == (uint32_t) tv->tv_sec && 
+			 rec->start_usec < (uint32_t) tv->tv_usec))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
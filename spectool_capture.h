@@ -0,0 +1,169 @@
+/*
+ * Binary sweep capture files
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SPECTOOL_CAPTURE_H__
+#define __SPECTOOL_CAPTURE_H__
+
+#include "config.h"
+
+#include <stdio.h>
+
+#ifdef HAVE_STDINT
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+
+#include "spectool_container.h"
+
+/*
+ * A capture holds the sweeps of one device in one profile:
+ *
+ *   header     device and profile, written at create and finished at close
+ *   records    one per sweep, all record_len long
+ *   index      (seconds, record) pairs, one for the first sweep of each
+ *              index_interval seconds, written at close
+ *
+ * Everything is in the byte order of the host that wrote it; the reader
+ * refuses files from the other kind of host.
+ *
+ * Each record starts with a fixed block of SPECTOOL_CAPTURE_REC_HDR bytes
+ * and the samples follow.  The record's own fields are at the front of the
+ * block and the rest is left as room for the reader to build a 
+ * spectool_sample_sweep in front of the samples, so a sweep can be handed 
+ * out of the mapped file without copying the sample data.
+ *
+ * A capture which was never closed (the writer crashed, say) has no index;
+ * the records are still readable and can still be seeked by time, just
+ * without the help.
+ */
+
+#define SPECTOOL_CAPTURE_MAGIC			"SPECCAP"
+#define SPECTOOL_CAPTURE_VERSION		1
+#define SPECTOOL_CAPTURE_BOM			0x1234
+
+#define SPECTOOL_CAPTURE_REC_HDR		128
+#define SPECTOOL_CAPTURE_INTERVAL		1
+
+#define SPECTOOL_CAPTURE_NAME_MAX		64
+
+typedef struct _spectool_capture_header {
+	char magic[8];
+	uint16_t version;
+	uint16_t byte_order;
+	uint32_t header_len;
+
+	/* Device */
+	uint32_t device_id;
+	uint8_t device_version;
+	uint8_t device_flags;
+	uint16_t pad0;
+	char device_name[SPECTOOL_CAPTURE_NAME_MAX];
+
+	/* Profile */
+	uint32_t start_khz;
+	uint32_t end_khz;
+	uint32_t res_hz;
+	int32_t amp_offset_mdbm;
+	int32_t amp_res_mdbm;
+	uint32_t rssi_max;
+	uint32_t filter_bw_hz;
+	uint32_t samples_per_point;
+	uint32_t num_samples;
+
+	/* Records */
+	uint32_t record_len;
+	uint64_t num_records;
+
+	/* Index, 0 until the capture is closed */
+	uint64_t index_offset;
+	uint32_t index_count;
+	uint32_t index_interval;
+} __attribute__ ((packed)) spectool_capture_header;
+
+typedef struct _spectool_capture_rec {
+	uint32_t start_sec;
+	uint32_t start_usec;
+	uint32_t end_sec;
+	uint32_t end_usec;
+	uint32_t min_rssi_seen;
+	uint32_t pad0;
+} __attribute__ ((packed)) spectool_capture_rec;
+
+typedef struct _spectool_capture_idx {
+	uint32_t sec;
+	uint32_t pad0;
+	uint64_t record;
+} __attribute__ ((packed)) spectool_capture_idx;
+
+/* Writer */
+typedef struct _spectool_capture_writer {
+	FILE *file;
+	spectool_capture_header header;
+
+	uint8_t *recbuf;
+
+	spectool_capture_idx *index;
+	unsigned int index_max;
+	/* Second the last index entry was made for */
+	uint32_t index_sec;
+} spectool_capture_writer;
+
+/* Start a capture for a device in a profile */
+int spectool_capture_create(spectool_capture_writer *w, const char *path,
+							spectool_dev_spec *spec, spectool_sample_sweep *profile,
+							char *errstr);
+/* Add a sweep; sweeps must be in time order and in the capture's profile */
+int spectool_capture_write(spectool_capture_writer *w, spectool_sample_sweep *sweep,
+						   char *errstr);
+/* Write the index and close the file */
+int spectool_capture_finish(spectool_capture_writer *w, char *errstr);
+
+/* Reader */
+typedef struct _spectool_capture {
+	int fd;
+	uint8_t *map;
+	size_t map_len;
+
+	spectool_capture_header *header;
+	uint64_t num_records;
+
+	spectool_capture_idx *index;
+	unsigned int index_count;
+
+	/* The capture profile, as a sweep with no samples */
+	spectool_sample_sweep profile;
+} spectool_capture;
+
+/* Map a capture */
+int spectool_capture_open(spectool_capture *cap, const char *path, char *errstr);
+void spectool_capture_close(spectool_capture *cap);
+
+#define spectool_capture_count(c)		((c)->num_records)
+
+/* Sweep n, backed by the mapping; valid until the capture is closed */
+spectool_sample_sweep *spectool_capture_sweep(spectool_capture *cap, uint64_t n);
+
+/* Start time of sweep n, without touching the sweep view */
+int spectool_capture_time(spectool_capture *cap, uint64_t n, struct timeval *tv);
+
+/* Number of the first sweep starting at or after tv, or the sweep count if
+ * there are none */
+uint64_t spectool_capture_seek(spectool_capture *cap, struct timeval *tv);
+
+#endif
+
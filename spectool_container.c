@@ -15,10 +15,14 @@
 #include <string.h>
 #include "config.h"
 #include "spectool_container.h"
+#include "spectool_simd.h"
 #include "wispy_hw_gen1.h"
 #include "wispy_hw_24x.h"
 #include "wispy_hw_dbx.h"
 #include "ubertooth_hw_u1.h"
+#include "spectool_replay.h"
+#include "spectool_synth.h"
+#include "spectool_stitch.h"
 
 int spectool_get_state(spectool_phy *phydev) {
 	return phydev->state;
@@ -63,11 +67,65 @@ int spectool_phy_close(spectool_phy *phydev) {
 	return (*(phydev->close_func))(phydev);
 }
 
+/* Close the sweep rate window if it's been open long enough */
+static void spectool_phy_rate(spectool_phy *phydev) {
+	struct timeval now;
+	unsigned long sweeps;
+	double el;
+
+	gettimeofday(&now, NULL);
+
+	el = (now.tv_sec - phydev->stats_window.tv_sec) +
+		(now.tv_usec - phydev->stats_window.tv_usec) / 1000000.0;
+
+	if (el < SPECTOOL_STATS_WINDOW)
+		return;
+
+	sweeps = __atomic_load_n(&(phydev->stats.sweeps), __ATOMIC_RELAXED);
+
+	phydev->stats.sweep_rate = (sweeps - phydev->stats_window_sweeps) / el;
+	phydev->stats_window_sweeps = sweeps;
+	phydev->stats_window = now;
+}
+
+void spectool_phy_getstats(spectool_phy *phydev, spectool_phy_stats *stats) {
+	/* A device which has stopped sweeping never closes its own window */
+	spectool_phy_rate(phydev);
+
+	stats->reports = __atomic_load_n(&(phydev->stats.reports), __ATOMIC_RELAXED);
+	stats->requeues = __atomic_load_n(&(phydev->stats.requeues), __ATOMIC_RELAXED);
+	stats->overruns = __atomic_load_n(&(phydev->stats.overruns), __ATOMIC_RELAXED);
+	stats->short_reports = 
+		__atomic_load_n(&(phydev->stats.short_reports), __ATOMIC_RELAXED);
+	stats->bad_base = __atomic_load_n(&(phydev->stats.bad_base), __ATOMIC_RELAXED);
+	stats->discarded = 
+		__atomic_load_n(&(phydev->stats.discarded), __ATOMIC_RELAXED);
+	stats->sweeps = __atomic_load_n(&(phydev->stats.sweeps), __ATOMIC_RELAXED);
+	stats->sweeps_dropped = 
+		__atomic_load_n(&(phydev->stats.sweeps_dropped), __ATOMIC_RELAXED);
+	stats->sweep_rate = phydev->stats.sweep_rate;
+}
+
+void spectool_phy_clearstats(spectool_phy *phydev) {
+	memset(&(phydev->stats), 0, sizeof(spectool_phy_stats));
+	phydev->stats_window_sweeps = 0;
+	gettimeofday(&(phydev->stats_window), NULL);
+}
+
 int spectool_phy_poll(spectool_phy *phydev) {
+	int r;
+
 	if (phydev->poll_func == NULL)
 		return SPECTOOL_POLL_ERROR;
 
-	return (*(phydev->poll_func))(phydev);
+	r = (*(phydev->poll_func))(phydev);
+
+	if ((r & SPECTOOL_POLL_SWEEPCOMPLETE)) {
+		SPECTOOL_PHY_COUNT(phydev, sweeps);
+		spectool_phy_rate(phydev);
+	}
+
+	return r;
 }
 
 int spectool_phy_getpollfd(spectool_phy *phydev) {
@@ -117,6 +175,14 @@ spectool_sweep_cache *spectool_cache_alloc(int nsweeps, int calc_peak, int calc_
 	c->roll_peak = NULL;
 	c->latest = NULL;
 
+	c->slab = NULL;
+	c->slab_stride = 0;
+
+	c->avg_sum = NULL;
+	c->peak_dq = NULL;
+	c->peak_dq_head = NULL;
+	c->peak_dq_len = NULL;
+
 	for (x = 0; x < nsweeps; x++) {
 		c->sweeplist[x] = NULL;
 	}
@@ -133,14 +199,24 @@ spectool_sweep_cache *spectool_cache_alloc(int nsweeps, int calc_peak, int calc_
 }
 
 void spectool_cache_free(spectool_sweep_cache *c) {
-	if (c->avg != NULL)
-		free(c->avg);
-	if (c->peak != NULL)
-		free(c->peak);
+	spectool_cache_clear(c);
 	free(c->sweeplist);
+	free(c);
 }
 
 void spectool_cache_clear(spectool_sweep_cache *c) {
+	int x;
+
+	for (x = 0; x < c->num_alloc; x++) {
+		c->sweeplist[x] = NULL;
+	}
+	c->latest = NULL;
+
+	if (c->slab != NULL)
+		free(c->slab);
+	c->slab = NULL;
+	c->slab_stride = 0;
+
 	if (c->avg != NULL)
 		free(c->avg);
 	c->avg = NULL;
@@ -153,20 +229,32 @@ void spectool_cache_clear(spectool_sweep_cache *c) {
 		free(c->roll_peak);
 	c->roll_peak = NULL;
 
-	c->pos = 0;
+	if (c->avg_sum != NULL)
+		free(c->avg_sum);
+	c->avg_sum = NULL;
+
+	if (c->peak_dq != NULL) {
+		free(c->peak_dq);
+		free(c->peak_dq_head);
+		free(c->peak_dq_len);
+	}
+	c->peak_dq = NULL;
+	c->peak_dq_head = NULL;
+	c->peak_dq_len = NULL;
+
+	c->pos = -1;
 	c->looped = 0;
 	c->num_used = 0;
 }
 
 void spectool_cache_append(spectool_sweep_cache *c, spectool_sample_sweep *s) {
-	int x, y, sum = 0;
-	int *avgdata, *avgsum;
-	int navg;
-	int nsampled;
+	unsigned int x;
+	int *dq, last;
+	spectool_sample_sweep *evict;
 
 	/* Make sure we don't overflow and crash, should be sufficient
 	 * to make sure that the new sweep is reasonable */
-	if (c->avg != NULL && c->avg->num_samples != s->num_samples) 
+	if (c->latest != NULL && c->latest->num_samples != s->num_samples) 
 		return;
 
 	if (c->pos == (c->num_alloc - 1)) {
@@ -179,108 +267,105 @@ void spectool_cache_append(spectool_sweep_cache *c, spectool_sample_sweep *s) {
 			c->num_used++;
 	}
 
-	if (c->sweeplist[c->pos] != NULL) {
-		free(c->sweeplist[c->pos]);
+	/* First sweep fixes the number of samples, so build the slab and the
+	 * accumulators */
+	if (c->slab == NULL) {
+		c->slab_stride = SPECTOOL_SWEEP_STRIDE(s->num_samples);
+		c->slab = (uint8_t *) malloc(c->slab_stride * c->num_alloc);
 	}
 
-	if (c->looped)
-		nsampled = c->num_alloc;
-	else
-		nsampled = c->pos;
+	if (c->calc_avg && c->avg_sum == NULL) {
+		c->avg_sum = (uint32_t *) calloc(s->num_samples, sizeof(uint32_t));
+	}
 
-	c->sweeplist[c->pos] = 
-		(spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(s->num_samples));
+	if (c->calc_peak && c->peak_dq == NULL) {
+		c->peak_dq = (int *) malloc(sizeof(int) * s->num_samples * c->num_alloc);
+		c->peak_dq_head = (int *) calloc(s->num_samples, sizeof(int));
+		c->peak_dq_len = (int *) calloc(s->num_samples, sizeof(int));
+	}
 
-	memcpy(c->sweeplist[c->pos], s, SPECTOOL_SWEEP_SIZE(s->num_samples));
+	/* Back the sweep we're about to overwrite out of the running sums, and
+	 * expire it from the head of any rolling peak window it still leads.  It's
+	 * the oldest sweep in the cache so it can only ever be at the head. */
+	evict = c->sweeplist[c->pos];
 
-	c->latest = c->sweeplist[c->pos];
+	if (evict != NULL) {
+		if (c->avg_sum != NULL)
+			spectool_simd_sub_u8_u32(c->avg_sum, evict->sample_data, s->num_samples);
 
-	if (c->avg == NULL && c->calc_avg) {
-		c->avg = (spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(s->num_samples));
-		memcpy(c->avg, s, SPECTOOL_SWEEP_SIZE(s->num_samples));
-	} else if (c->calc_avg) {
-		/* Reset average times */
-		c->avg->tm_start.tv_sec = 0;
-		c->avg->tm_start.tv_usec = 0;
-		c->avg->tm_end.tv_sec = 0;
-		c->avg->tm_end.tv_usec = 0;
-
-		/* Allocate a large int for summing */
-		avgdata = (int *) malloc(sizeof(int) * c->avg->num_samples);
-		avgsum = (int *) malloc(sizeof(int) * c->avg->num_samples);
-		for (x = 0; x < c->avg->num_samples; x++) {
-			avgdata[x] = 0;
-			avgsum[x] = 0;
-		}
+		if (c->peak_dq != NULL) {
+			for (x = 0; x < s->num_samples; x++) {
+				dq = &(c->peak_dq[x * c->num_alloc]);
 
-		/* Sum them up */
+				if (c->peak_dq_len[x] > 0 && dq[c->peak_dq_head[x]] == c->pos) {
+					c->peak_dq_head[x] = (c->peak_dq_head[x] + 1) % c->num_alloc;
+					c->peak_dq_len[x]--;
+				}
+			}
+		}
+	}
 
-		for (x = 0; x < nsampled; x++) {
-			if (c->sweeplist[x] == NULL)
-				continue;
+	/* Slots are reused in place */
+	c->sweeplist[c->pos] = 
+		(spectool_sample_sweep *) (c->slab + (c->slab_stride * c->pos));
 
-			for (y = 0; y < c->avg->num_samples; y++) {
-				avgdata[y] += c->sweeplist[x]->sample_data[y];
-				avgsum[y]++;
-			}
+	memcpy(c->sweeplist[c->pos], s, SPECTOOL_SWEEP_SIZE(s->num_samples));
 
-			/* Update the time of the average network */
-			if (c->sweeplist[x]->tm_start.tv_sec > c->avg->tm_start.tv_sec) {
-				c->avg->tm_start.tv_sec = c->sweeplist[x]->tm_start.tv_sec;
-				c->avg->tm_start.tv_usec = c->sweeplist[x]->tm_start.tv_usec;
-			} else if (c->sweeplist[x]->tm_start.tv_sec == c->avg->tm_start.tv_sec &&
-					   c->sweeplist[x]->tm_start.tv_usec > c->avg->tm_start.tv_usec) {
-				c->avg->tm_start.tv_usec = c->sweeplist[x]->tm_start.tv_usec;
-			}
-			if (c->sweeplist[x]->tm_end.tv_sec > c->avg->tm_end.tv_sec) {
-				c->avg->tm_end.tv_sec = c->sweeplist[x]->tm_end.tv_sec;
-				c->avg->tm_end.tv_usec = c->sweeplist[x]->tm_end.tv_usec;
-			} else if (c->sweeplist[x]->tm_end.tv_sec == c->avg->tm_end.tv_sec &&
-					   c->sweeplist[x]->tm_end.tv_usec > c->avg->tm_end.tv_usec) {
-				c->avg->tm_end.tv_usec = c->sweeplist[x]->tm_end.tv_usec;
-			}
+	c->latest = c->sweeplist[c->pos];
 
+	if (c->calc_avg) {
+		if (c->avg == NULL) {
+			c->avg = (spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(s->num_samples));
+			memcpy(c->avg, s, SPECTOOL_SWEEP_SIZE(s->num_samples));
 		}
 
-		for (x = 0; x < c->avg->num_samples; x++) {
-			if (avgsum[x] == 0) {
-				c->avg->sample_data[x] = 0;
-				continue;
-			}
+		/* The newest sweep is always the latest timestamp in the average */
+		c->avg->tm_start = s->tm_start;
+		c->avg->tm_end = s->tm_end;
 
-			c->avg->sample_data[x] = (float) avgdata[x] / (float) avgsum[x];
-		}
+		spectool_simd_add_u8_u32(c->avg_sum, s->sample_data, s->num_samples);
 
-		free(avgdata);
-		free(avgsum);
+		for (x = 0; x < s->num_samples; x++)
+			c->avg->sample_data[x] = c->avg_sum[x] / c->num_used;
 	}
 
 	/* Allocate or update the peak.  We don't track peak timelines */
-	if (c->peak == NULL && c->calc_peak) {
-		c->peak = (spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(s->num_samples));
-		memcpy(c->peak, s, SPECTOOL_SWEEP_SIZE(s->num_samples));
+	if (c->calc_peak) {
+		if (c->peak == NULL) {
+			c->peak = (spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(s->num_samples));
+			memcpy(c->peak, s, SPECTOOL_SWEEP_SIZE(s->num_samples));
 	
-		/* This will never be allocated if peak is not */
-		c->roll_peak = (spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(s->num_samples));
-		memcpy(c->roll_peak, s, SPECTOOL_SWEEP_SIZE(s->num_samples));
-	} else if (c->calc_peak) {
-
-		for (x = 0; x < c->peak->num_samples; x++) {
-			if (c->peak->sample_data[x] < s->sample_data[x]) {
-				c->peak->sample_data[x] = s->sample_data[x];
-			}
+			/* This will never be allocated if peak is not */
+			c->roll_peak = (spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(s->num_samples));
+			memcpy(c->roll_peak, s, SPECTOOL_SWEEP_SIZE(s->num_samples));
+		} else {
+			spectool_simd_max_u8(c->peak->sample_data, s->sample_data,
+								 c->peak->num_samples);
 		}
 
-		memcpy(c->roll_peak, s, SPECTOOL_SWEEP_SIZE(s->num_samples));
-		for (x = 0; x < nsampled; x++) {
-			for (y = 0; y < c->roll_peak->num_samples; y++) {
-				// printf("debug - compare sampled %d pos %d loop %d set %d sample %d\n", nsampled, c->pos, c->looped, x, y);
-				if (c->roll_peak->sample_data[y] < c->sweeplist[x]->sample_data[y]) {
-					c->roll_peak->sample_data[y] = c->sweeplist[x]->sample_data[y];
-				}
+		c->roll_peak->tm_start = s->tm_start;
+		c->roll_peak->tm_end = s->tm_end;
+
+		/* Drop anything from the tail of the window which the new sample
+		 * dominates, then append it; the head is the max of the window */
+		for (x = 0; x < s->num_samples; x++) {
+			dq = &(c->peak_dq[x * c->num_alloc]);
+
+			while (c->peak_dq_len[x] > 0) {
+				last = (c->peak_dq_head[x] + c->peak_dq_len[x] - 1) % c->num_alloc;
+
+				if (c->sweeplist[dq[last]]->sample_data[x] > s->sample_data[x])
+					break;
+
+				c->peak_dq_len[x]--;
 			}
-		}
 
+			dq[(c->peak_dq_head[x] + c->peak_dq_len[x]) % c->num_alloc] = c->pos;
+			c->peak_dq_len[x]++;
+
+			c->roll_peak->sample_data[x] =
+				c->sweeplist[dq[c->peak_dq_head[x]]]->sample_data[x];
+		}
 	}
 }
 
@@ -312,6 +397,21 @@ spectool_sample_sweep *spectool_cache_itr_next(spectool_sweep_cache *c, spectool
 	return c->sweeplist[i->pos_cur];
 }
 
+void spectool_rssi_lut_build(spectool_rssi_lut *lut, int amp_offset_mdbm, 
+							 int amp_res_mdbm) {
+	int x;
+
+	for (x = 0; x < 256; x++) {
+		lut->dbm[x] = SPECTOOL_RSSI_CONVERT(amp_offset_mdbm, amp_res_mdbm, x);
+		lut->dbm_f[x] = (float) x * ((double) amp_res_mdbm / 1000.0f) +
+			((double) amp_offset_mdbm / 1000.0f);
+	}
+
+	lut->amp_offset_mdbm = amp_offset_mdbm;
+	lut->amp_res_mdbm = amp_res_mdbm;
+	lut->valid = 1;
+}
+
 void spectool_device_scan_init(spectool_device_list *list) {
 	list->list = (spectool_device_rec *) malloc(sizeof(spectool_device_rec) * MAX_SCAN_RESULT);
 	list->num_devs = 0;
@@ -337,6 +437,19 @@ int spectool_device_scan(spectool_device_list *list) {
 		return -1;
 	}
 
+	if (spectool_replay_device_scan(list) < 0) {
+		return -1;
+	}
+
+	if (spectool_synth_device_scan(list) < 0) {
+		return -1;
+	}
+
+	/* Has to go last, it takes its members out of the list */
+	if (spectool_stitch_device_scan(list) < 0) {
+		return -1;
+	}
+
 	return list->num_devs;
 }
 
@@ -356,6 +469,8 @@ void spectool_device_scan_free(spectool_device_list *list) {
 }
 
 int spectool_device_init(spectool_phy *phydev, spectool_device_rec *rec) {
+	spectool_phy_clearstats(phydev);
+
 	return (*(rec->init_func))(phydev, rec);
 }
 
@@ -77,9 +77,37 @@ typedef struct _spectool_sample_sweep {
 
 #define SPECTOOL_SWEEP_SIZE(y)		(sizeof(spectool_sample_sweep) + (y))
 
+/* RSSI to dBm conversion table for a profile.  Samples are uint8 so the whole
+ * conversion fits in 256 entries, which saves the floating point math of
+ * SPECTOOL_RSSI_CONVERT on every sample drawn.  dbm matches
+ * SPECTOOL_RSSI_CONVERT exactly, dbm_f is the untruncated value */
+typedef struct _spectool_rssi_lut {
+	int valid;
+	int amp_offset_mdbm;
+	int amp_res_mdbm;
+	int dbm[256];
+	float dbm_f[256];
+} spectool_rssi_lut;
+
+void spectool_rssi_lut_build(spectool_rssi_lut *lut, int amp_offset_mdbm, 
+							 int amp_res_mdbm);
+
+#define SPECTOOL_RSSI_LUT(L,D)		((L)->dbm[(uint8_t) (D)])
+#define SPECTOOL_RSSI_LUT_F(L,D)	((L)->dbm_f[(uint8_t) (D)])
+
+/* Slab slot stride for a sweep of y samples, rounded up so each slot in the
+ * cache slab starts 16-byte aligned */
+#define SPECTOOL_SWEEP_STRIDE(y)	((SPECTOOL_SWEEP_SIZE(y) + 15) & ~((size_t) 15))
+
 /* Sweep record for aggregating multiple sweep points */
 typedef struct _spectool_sweep_cache {
+	/* Sweeplist entries point into a single slab of num_alloc fixed-stride
+	 * slots, allocated when the first sweep fixes the sample count.  Unused
+	 * slots remain NULL. */
 	spectool_sample_sweep **sweeplist;
+	uint8_t *slab;
+	size_t slab_stride;
+
 	spectool_sample_sweep *avg;
 	spectool_sample_sweep *peak;
 	spectool_sample_sweep *roll_peak;
@@ -88,6 +116,17 @@ typedef struct _spectool_sweep_cache {
 	int calc_peak, calc_avg;
 	int num_used;
 	uint32_t device_id;
+
+	/* Running per-bin sum of every cached sweep, so the average only has to
+	 * account for the sweep entering and the sweep being evicted */
+	uint32_t *avg_sum;
+
+	/* Per-bin monotonic deques of sweeplist slots for the rolling peak.  Each
+	 * bin has num_alloc entries starting at peak_dq[bin * num_alloc]; the head
+	 * of the deque is always the slot holding the bin maximum */
+	int *peak_dq;
+	int *peak_dq_head;
+	int *peak_dq_len;
 } spectool_sweep_cache;
 
 typedef struct _spectool_sweep_cache_itr {
@@ -145,6 +184,38 @@ typedef struct _spectool_dev_spec {
 
 #define SPECTOOL_DEV_SIZE(y)		(sizeof(spectool_dev_spec))
 
+/* Pipeline health counters.  The USB service threads add to these as well
+ * as the poll path, so they're only ever touched with relaxed atomics through
+ * SPECTOOL_PHY_COUNT, which costs nothing worth measuring per report.  Read
+ * them with spectool_phy_getstats */
+typedef struct _spectool_phy_stats {
+	/* USB reports handed to the driver */
+	unsigned long reports;
+	/* Times a service thread found the report ring full and waited */
+	unsigned long requeues;
+	/* Reports lost because the ring was full (async transport) */
+	unsigned long overruns;
+	/* Reports too short to decode */
+	unsigned long short_reports;
+	/* Reports with a sample offset outside the sweep */
+	unsigned long bad_base;
+	/* Reports thrown out while waiting for the start of a sweep */
+	unsigned long discarded;
+	/* Completed sweeps */
+	unsigned long sweeps;
+	/* Partial sweeps abandoned when a new sweep started */
+	unsigned long sweeps_dropped;
+	/* Completed sweeps per second over the last measurement window */
+	double sweep_rate;
+} spectool_phy_stats;
+
+#define SPECTOOL_PHY_COUNT_N(p, f, n) \
+	__atomic_fetch_add(&((p)->stats.f), (n), __ATOMIC_RELAXED)
+#define SPECTOOL_PHY_COUNT(p, f)		SPECTOOL_PHY_COUNT_N(p, f, 1)
+
+/* Shortest window the sweep rate is measured over, in seconds */
+#define SPECTOOL_STATS_WINDOW		1.0
+
 /* Central tracking structure for spectool device data and API callbacks */
 typedef struct _spectool_phy {
 	/* Phy capabilities */
@@ -175,6 +246,11 @@ typedef struct _spectool_phy {
 
 	/* Suggested delay for drawing */
 	int draw_agg_suggestion;
+
+	/* Pipeline counters, and the start of the current sweep rate window */
+	spectool_phy_stats stats;
+	struct timeval stats_window;
+	unsigned long stats_window_sweeps;
 } spectool_phy;
 
 #define SPECTOOL_PHY_SIZE		(sizeof(spectool_phy))
@@ -194,6 +270,10 @@ void spectool_phy_setname(spectool_phy *phydev, char *name);
 int spectool_phy_getdevid(spectool_phy *phydev);
 int spectool_phy_get_flags(spectool_phy *phydev);
 spectool_sample_sweep *spectool_phy_getcurprofile(spectool_phy *phydev);
+/* Snapshot the pipeline counters.  The sweep rate is kept up to date by
+ * spectool_phy_poll, so call this from the thread which polls the phy */
+void spectool_phy_getstats(spectool_phy *phydev, spectool_phy_stats *stats);
+void spectool_phy_clearstats(spectool_phy *phydev);
 
 /* Running states */
 #define SPECTOOL_STATE_CLOSED			0
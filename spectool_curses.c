@@ -15,6 +15,7 @@
 
 #include "spectool_container.h"
 #include "spectool_net_client.h"
+#include "spectool_simd.h"
 
 spectool_phy *dev = NULL;
 
@@ -48,6 +49,7 @@ int main(int argc, char *argv[]) {
 	spectool_device_list list;
 	int x = 0, r = 0, y = 0, ndev = 0;
 	spectool_sample_sweep *sb = NULL;
+	spectool_rssi_lut rssi_lut;
 	spectool_sweep_cache *sweepcache = NULL;
 	spectool_server sr;
 	char errstr[SPECTOOL_ERROR_MAX];
@@ -61,7 +63,7 @@ int main(int argc, char *argv[]) {
 
 	int amp_offset_mdbm = 0, amp_res_mdbm = 0, base_db_offset = 0;
 	int min_db_draw = 0, start_db = 0;
-	int nuse = 0, mod, avg, avgc, pos, group;
+	int nuse = 0, mod, avg, avgc, group, lo, hi;
 
 	int range = 0;
 	int device = -1;
@@ -217,6 +219,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	sweepcache = spectool_cache_alloc(50, 1, 1);
+	spectool_rssi_lut_build(&rssi_lut, amp_offset_mdbm, amp_res_mdbm);
 
 	/* Fire up curses */
 	initscr();
@@ -346,11 +349,10 @@ int main(int argc, char *argv[]) {
 
 				amp_offset_mdbm = ran->amp_offset_mdbm;
 				amp_res_mdbm = ran->amp_res_mdbm;
-				base_db_offset =
-					SPECTOOL_RSSI_CONVERT(amp_offset_mdbm, amp_res_mdbm,
-									   ran->rssi_max);
-				min_db_draw =
-					SPECTOOL_RSSI_CONVERT(amp_offset_mdbm, amp_res_mdbm, 0);
+				spectool_rssi_lut_build(&rssi_lut, amp_offset_mdbm, amp_res_mdbm);
+
+				base_db_offset = SPECTOOL_RSSI_LUT(&rssi_lut, ran->rssi_max);
+				min_db_draw = SPECTOOL_RSSI_LUT(&rssi_lut, 0);
 
 				continue;
 			} else if ((r & SPECTOOL_POLL_ERROR)) {
@@ -365,9 +367,8 @@ int main(int argc, char *argv[]) {
 				spectool_cache_append(sweepcache, sb);
 
 				min_db_draw =
-					SPECTOOL_RSSI_CONVERT(amp_offset_mdbm, amp_res_mdbm,
-									   sb->min_rssi_seen > 2 ?
-									   sb->min_rssi_seen - 1 : sb->min_rssi_seen);
+					SPECTOOL_RSSI_LUT(&rssi_lut, sb->min_rssi_seen > 2 ?
+									  sb->min_rssi_seen - 1 : sb->min_rssi_seen);
 
 			}
 		} while ((r & SPECTOOL_POLL_ADDITIONAL));
@@ -427,20 +428,22 @@ int main(int argc, char *argv[]) {
 			r = ((float) x / (float) (COLS - 7)) * 
 				(float) sweepcache->peak->num_samples;
 
-			for (pos = -1 * (group / 2); pos < (group / 2); pos++) {
-				if (r + pos >= sweepcache->peak->num_samples || r + pos < 0)
-					continue;
-
-				avg += sweepcache->peak->sample_data[r + pos];
-				avgc += sweepcache->latest->sample_data[r + pos];
-				nuse++;
-			}
+			lo = r - (group / 2);
+			hi = r + (group / 2);
+			if (lo < 0)
+				lo = 0;
+			if (hi > (int) sweepcache->peak->num_samples)
+				hi = sweepcache->peak->num_samples;
 
-			if (nuse == 0)
+			if (hi <= lo)
 				continue;
 
-			avg = SPECTOOL_RSSI_CONVERT(amp_offset_mdbm, amp_res_mdbm, (avg / nuse));
-			avgc = SPECTOOL_RSSI_CONVERT(amp_offset_mdbm, amp_res_mdbm, (avgc / nuse));
+			nuse = hi - lo;
+			avg = spectool_simd_sum_u8(sweepcache->peak->sample_data + lo, nuse);
+			avgc = spectool_simd_sum_u8(sweepcache->latest->sample_data + lo, nuse);
+
+			avg = SPECTOOL_RSSI_LUT(&rssi_lut, (avg / nuse));
+			avgc = SPECTOOL_RSSI_LUT(&rssi_lut, (avgc / nuse));
 
 			py = (float) (LINES - 4) *
 				(float) ((float) (abs(avg) + base_db_offset) /
@@ -480,20 +483,22 @@ int main(int argc, char *argv[]) {
 			r = ((float) x / (float) (COLS - 7)) * 
 				(float) sweepcache->avg->num_samples;
 
-			for (pos = -1 * (group / 2); pos < (group / 2); pos++) {
-				if (r + pos >= sweepcache->avg->num_samples || r + pos < 0)
-					continue;
+			lo = r - (group / 2);
+			hi = r + (group / 2);
+			if (lo < 0)
+				lo = 0;
+			if (hi > (int) sweepcache->avg->num_samples)
+				hi = sweepcache->avg->num_samples;
 
-				avg += sweepcache->avg->sample_data[r + pos];
-				avgc += sweepcache->latest->sample_data[r + pos];
-				nuse++;
-			}
-
-			if (nuse == 0)
+			if (hi <= lo)
 				continue;
 
-			avg = SPECTOOL_RSSI_CONVERT(amp_offset_mdbm, amp_res_mdbm, (avg / nuse));
-			avgc = SPECTOOL_RSSI_CONVERT(amp_offset_mdbm, amp_res_mdbm, (avgc / nuse));
+			nuse = hi - lo;
+			avg = spectool_simd_sum_u8(sweepcache->avg->sample_data + lo, nuse);
+			avgc = spectool_simd_sum_u8(sweepcache->latest->sample_data + lo, nuse);
+
+			avg = SPECTOOL_RSSI_LUT(&rssi_lut, (avg / nuse));
+			avgc = SPECTOOL_RSSI_LUT(&rssi_lut, (avgc / nuse));
 
 			py = (float) (LINES - 4) *
 				(float) ((float) (abs(avg) + base_db_offset) /
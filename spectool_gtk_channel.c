@@ -255,6 +255,8 @@ static gint spectool_channel_button_press(GtkWidget *widget,
 
 		wwidget->chanopts->hi_chan = -1;
 
+		/* Channel labels live in the static layer */
+		spectool_widget_invalidate_static(wwidget);
 	}
 
 	spectool_widget_update(GTK_WIDGET(wwidget));
@@ -306,6 +308,7 @@ static gboolean spectool_channel_mouse_move(GtkWidget *widget,
 	if ((ch = spectool_channel_find_chan_pt(channel, x, y)) >= -1) {
 		if (ch != wwidget->chanopts->hi_chan) {
 			wwidget->chanopts->hi_chan = ch;
+			spectool_widget_invalidate_static(wwidget);
 			spectool_widget_update(GTK_WIDGET(wwidget));
 
 			upd_iter = channel->update_list;
@@ -318,6 +321,7 @@ static gboolean spectool_channel_mouse_move(GtkWidget *widget,
 		}
 	} else if (wwidget->chanopts->hi_chan > -1) {
 		wwidget->chanopts->hi_chan = -1;
+		spectool_widget_invalidate_static(wwidget);
 		spectool_widget_update(GTK_WIDGET(wwidget));
 
 		upd_iter = channel->update_list;
@@ -453,7 +457,9 @@ static void spectool_channel_init(SpectoolChannel *channel) {
 	wwidget->draw_mouse_click_func = spectool_channel_button_press;
 
 	wwidget->draw_timeout = 1000;
-	wwidget->draw_func = spectool_channel_draw;
+	/* Labels only change with the profile or the mouse */
+	wwidget->draw_func = NULL;
+	wwidget->static_draw_func = spectool_channel_draw;
 	wwidget->update_func = spectool_channel_update;
 
 	wwidget->timeout_ref =
@@ -50,6 +50,144 @@ void spectool_widget_update(GtkWidget *widget);
 
 G_DEFINE_TYPE(SpectoolPlanar, spectool_planar, SPECTOOL_TYPE_WIDGET);
 
+/* Graph y of one sample */
+static int spectool_planar_sample_y(SpectoolWidget *wwidget, uint8_t sample) {
+	int py;
+	int sdb = SPECTOOL_RSSI_LUT(&(wwidget->rssi_lut), sample);
+
+	py = (float) wwidget->g_len_y * 
+		(float) ((float) (abs(sdb) + wwidget->base_db_offset) /
+				 (float) (abs(wwidget->min_db_draw) + 
+						  wwidget->base_db_offset));
+
+	if (py < wwidget->g_start_y)
+		py = wwidget->g_start_y;
+	if (py > wwidget->g_end_y)
+		py = wwidget->g_end_y;
+
+	return py;
+}
+
+/* Cut a sweep down to the lowest and highest y in each pixel column, reusing
+ * the last pass if nothing it depends on has changed.  Returns NULL when the
+ * sweep fits the graph and every sample can be drawn as it is.  gen is the
+ * generation of the peak and average; aged sweeps go by their timestamps */
+static spectool_planar_trace *spectool_planar_decimate(SpectoolPlanar *planar,
+													   SpectoolWidget *wwidget,
+													   int idx, 
+													   spectool_sample_sweep *sweep,
+													   unsigned int gen) {
+	spectool_planar_trace *tr;
+	int x, c, py;
+
+	if (idx < 0 || idx >= SPECTOOL_PLANAR_NUM_TRACES)
+		return NULL;
+
+	if (sweep->num_samples <= wwidget->g_len_x || wwidget->g_len_x <= 0)
+		return NULL;
+
+	tr = &(planar->traces[idx]);
+
+	if (tr->valid && tr->len_x == wwidget->g_len_x && 
+		tr->len_y == wwidget->g_len_y &&
+		tr->base_db == wwidget->base_db_offset && 
+		tr->min_db == wwidget->min_db_draw && tr->gen == gen &&
+		tr->tm_start.tv_sec == sweep->tm_start.tv_sec &&
+		tr->tm_start.tv_usec == sweep->tm_start.tv_usec &&
+		tr->tm_end.tv_sec == sweep->tm_end.tv_sec &&
+		tr->tm_end.tv_usec == sweep->tm_end.tv_usec)
+		return tr;
+
+	if (tr->num_cols != wwidget->g_len_x + 1) {
+		tr->num_cols = wwidget->g_len_x + 1;
+		tr->ymin = (int *) realloc(tr->ymin, sizeof(int) * tr->num_cols);
+		tr->ymax = (int *) realloc(tr->ymax, sizeof(int) * tr->num_cols);
+	}
+
+	for (c = 0; c < tr->num_cols; c++)
+		tr->ymin[c] = -1;
+
+	for (x = 0; x < sweep->num_samples; x++) {
+		c = (int) (x * wwidget->wbar);
+
+		if (c < 0)
+			c = 0;
+		if (c >= tr->num_cols)
+			c = tr->num_cols - 1;
+
+		py = spectool_planar_sample_y(wwidget, sweep->sample_data[x]);
+
+		if (tr->ymin[c] < 0) {
+			tr->ymin[c] = tr->ymax[c] = py;
+		} else if (py < tr->ymin[c]) {
+			tr->ymin[c] = py;
+		} else if (py > tr->ymax[c]) {
+			tr->ymax[c] = py;
+		}
+	}
+
+	tr->valid = 1;
+	tr->gen = gen;
+	tr->tm_start = sweep->tm_start;
+	tr->tm_end = sweep->tm_end;
+	tr->len_x = wwidget->g_len_x;
+	tr->len_y = wwidget->g_len_y;
+	tr->base_db = wwidget->base_db_offset;
+	tr->min_db = wwidget->min_db_draw;
+
+	return tr;
+}
+
+/* Add a sweep to the current path, one point per sample or, from a
+ * decimated trace, the low and high point of each column, in whichever 
+ * order keeps the line closest to where it came from */
+static void spectool_planar_trace_path(cairo_t *cr, SpectoolWidget *wwidget,
+									   spectool_planar_trace *tr,
+									   spectool_sample_sweep *sweep) {
+	int x, px, py, lasty;
+
+	if (tr == NULL) {
+		for (x = 0; x < sweep->num_samples; x++) {
+			px = wwidget->g_start_x + (int) (x * wwidget->wbar);
+
+			if (px < wwidget->g_start_x)
+				px = wwidget->g_start_x;
+			if (px > wwidget->g_end_x)
+				px = wwidget->g_end_x;
+
+			py = spectool_planar_sample_y(wwidget, sweep->sample_data[x]);
+
+			cairo_line_to(cr, px + 0.5, py + 0.5);
+		}
+
+		return;
+	}
+
+	lasty = wwidget->g_end_y;
+
+	for (x = 0; x < tr->num_cols; x++) {
+		if (tr->ymin[x] < 0)
+			continue;
+
+		px = wwidget->g_start_x + x;
+		if (px > wwidget->g_end_x)
+			px = wwidget->g_end_x;
+
+		if (tr->ymin[x] == tr->ymax[x]) {
+			cairo_line_to(cr, px + 0.5, tr->ymin[x] + 0.5);
+			lasty = tr->ymin[x];
+		} else if (abs(lasty - tr->ymin[x]) <= abs(lasty - tr->ymax[x])) {
+			cairo_line_to(cr, px + 0.5, tr->ymin[x] + 0.5);
+			cairo_line_to(cr, px + 0.5, tr->ymax[x] + 0.5);
+			lasty = tr->ymax[x];
+		} else {
+			cairo_line_to(cr, px + 0.5, tr->ymax[x] + 0.5);
+			cairo_line_to(cr, px + 0.5, tr->ymin[x] + 0.5);
+			lasty = tr->ymin[x];
+		}
+	}
+}
+
 void spectool_planar_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidget) {
 	SpectoolPlanar *planar;
 	cairo_text_extents_t extents;
@@ -75,31 +213,10 @@ void spectool_planar_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidge
 		cairo_save(cr);
 		cairo_new_path(cr);
 		cairo_move_to(cr, wwidget->g_start_x + 0.5, wwidget->g_end_y - 0.5);
-		for (x = 0; x < wwidget->sweepcache->avg->num_samples; x++) {
-			int px, py;
-			int sdb = SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
-										 wwidget->sweepcache->peak->sample_data[x]);
-
-			chpix = x * wwidget->wbar;
-
-			px = wwidget->g_start_x + chpix;
-			py = (float) wwidget->g_len_y * 
-				(float) ((float) (abs(sdb) + wwidget->base_db_offset) /
-						 (float) (abs(wwidget->min_db_draw) + 
-								  wwidget->base_db_offset));
-
-			if (px < wwidget->g_start_x)
-				px = wwidget->g_start_x;
-			if (px > wwidget->g_end_x)
-				px = wwidget->g_end_x;
-
-			if (py < wwidget->g_start_y)
-				py = wwidget->g_start_y;
-			if (py > wwidget->g_end_y)
-				py = wwidget->g_end_y;
-
-			cairo_line_to(cr, px + 0.5, py + 0.5);
-		}
+		spectool_planar_trace_path(cr, wwidget,
+				spectool_planar_decimate(planar, wwidget, SPECTOOL_PLANAR_TRACE_PEAK,
+										 wwidget->sweepcache->peak, planar->trace_gen),
+				wwidget->sweepcache->peak);
 		/* Close the path along the bottom */
 		cairo_line_to(cr, wwidget->g_end_x - 0.5, wwidget->g_end_y - 0.5);
 		cairo_line_to(cr, wwidget->g_start_x + 0.5, wwidget->g_end_y - 0.5);
@@ -118,29 +235,10 @@ void spectool_planar_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidge
 		cairo_save(cr);
 		cairo_new_path(cr);
 		cairo_move_to(cr, wwidget->g_start_x + 0.5, wwidget->g_end_y - 0.5);
-		for (x = 0; x < wwidget->sweepcache->avg->num_samples; x++) {
-			int px, py;
-			int sdb = SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
-										 wwidget->sweepcache->avg->sample_data[x]);
-			chpix = x * wwidget->wbar;
-
-			px = wwidget->g_start_x + chpix;
-			py = (float) wwidget->g_len_y * 
-				(float) ((float) (abs(sdb) + wwidget->base_db_offset) /
-						 (float) (abs(wwidget->min_db_draw) + 
-								  wwidget->base_db_offset));
-			if (px < wwidget->g_start_x)
-				px = wwidget->g_start_x;
-			if (px > wwidget->g_end_x)
-				px = wwidget->g_end_x;
-
-			if (py < wwidget->g_start_y)
-				py = wwidget->g_start_y;
-			if (py > wwidget->g_end_y)
-				py = wwidget->g_end_y;
-
-			cairo_line_to(cr, px + 0.5, py + 0.5);
-		}
+		spectool_planar_trace_path(cr, wwidget,
+				spectool_planar_decimate(planar, wwidget, SPECTOOL_PLANAR_TRACE_AVG,
+										 wwidget->sweepcache->avg, planar->trace_gen),
+				wwidget->sweepcache->avg);
 		/* Close the path along the bottom */
 		cairo_line_to(cr, wwidget->g_end_x - 0.5, wwidget->g_end_y - 0.5);
 		cairo_line_to(cr, wwidget->g_start_x + 0.5, wwidget->g_end_y - 0.5);
@@ -169,8 +267,8 @@ void spectool_planar_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidge
 		cairo_move_to(cr, wwidget->g_start_x + 0.5, wwidget->g_end_y - 0.5);
 		for (x = 0; x < wwidget->sweepcache->avg->num_samples; x++) {
 			int px, py;
-			int sdb = SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
-				wwidget->sweepcache->latest->sample_data[x]);
+			int sdb = SPECTOOL_RSSI_LUT(&(wwidget->rssi_lut),
+					wwidget->sweepcache->latest->sample_data[x]);
 			chpix = x * wwidget->wbar;
 
 			px = wwidget->g_start_x + chpix;
@@ -215,30 +313,14 @@ void spectool_planar_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidge
 				cairo_save(cr);
 				cairo_new_path(cr);
 				cairo_move_to(cr, wwidget->g_start_x + 0.5, wwidget->g_end_y - 0.5);
-				for (x = 0; x < sweep->num_samples; x++) {
-					int px, py;
-					int sdb = SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
-													sweep->sample_data[x]);
-					chpix = x * wwidget->wbar;
-
-					px = wwidget->g_start_x + chpix;
-					py = (float) wwidget->g_len_y * 
-						(float) ((float) (abs(sdb) + wwidget->base_db_offset) /
-								 (float) (abs(wwidget->min_db_draw) + 
-										  wwidget->base_db_offset));
-
-					if (px < wwidget->g_start_x)
-						px = wwidget->g_start_x;
-					if (px > wwidget->g_end_x)
-						px = wwidget->g_end_x;
-
-					if (py < wwidget->g_start_y)
-						py = wwidget->g_start_y;
-					if (py > wwidget->g_end_y)
-						py = wwidget->g_end_y;
-
-					cairo_line_to(cr, px + 0.5, py + 0.5);
-				}
+				/* Aged sweeps keep their cache slot, so the slot picks the
+				 * trace */
+				spectool_planar_trace_path(cr, wwidget,
+						spectool_planar_decimate(planar, wwidget, 
+								SPECTOOL_PLANAR_TRACE_AGE + 
+								(int) (((uint8_t *) sweep - planar->agecache->slab) / 
+									   planar->agecache->slab_stride), sweep, 0),
+						sweep);
 				cairo_line_to(cr, wwidget->g_end_x - 0.5, wwidget->g_end_y - 0.5);
 				cairo_close_path(cr);
 				/* Plot it */
@@ -272,8 +354,8 @@ void spectool_planar_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidge
 			
 		chpix = mkr->samp_num * wwidget->wbar;
 
-		sdb = SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
-					wwidget->sweepcache->latest->sample_data[mkr->samp_num]);
+		sdb = SPECTOOL_RSSI_LUT(&(wwidget->rssi_lut),
+				wwidget->sweepcache->latest->sample_data[mkr->samp_num]);
 
 		px = wwidget->g_start_x + chpix;
 		py = (float) wwidget->g_len_y * 
@@ -336,6 +418,7 @@ static void spectool_planar_wdr_sweep(int slot, int mode,
 #endif
 
 		spectool_cache_append(planar->agecache, sweep);
+		planar->trace_gen++;
 	}
 
 	if (tout != wwidget->draw_timeout) {
@@ -489,14 +572,14 @@ void spectool_planar_update(GtkWidget *widget) {
 			snprintf(freqt, 6, "%4d", freq);
 
 			snprintf(avgt, 6, "%d", 
-					 SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
-										wwidget->sweepcache->avg->sample_data[mkr->samp_num]));
+					 SPECTOOL_RSSI_LUT(&(wwidget->rssi_lut),
+							wwidget->sweepcache->avg->sample_data[mkr->samp_num]));
 			snprintf(maxt, 6, "%d",
-					 SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
-										wwidget->sweepcache->peak->sample_data[mkr->samp_num]));
+					 SPECTOOL_RSSI_LUT(&(wwidget->rssi_lut),
+							wwidget->sweepcache->peak->sample_data[mkr->samp_num]));
 			snprintf(curt, 6, "%d",
-					 SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
-										wwidget->sweepcache->latest->sample_data[mkr->samp_num]));
+					 SPECTOOL_RSSI_LUT(&(wwidget->rssi_lut),
+							wwidget->sweepcache->latest->sample_data[mkr->samp_num]));
 
 			gtk_list_store_set(GTK_LIST_STORE(model), &iter,
 							   0, mkr->pixbuf,
@@ -689,9 +772,18 @@ static void spectool_planar_class_init(SpectoolPlanarClass *class) {
 static void spectool_planar_destroy(GtkObject *object) {
 	SpectoolPlanar *planar = SPECTOOL_PLANAR(object);
 	SpectoolWidget *wwidget;
+	int x;
 
 	wwidget = SPECTOOL_WIDGET(planar);
 
+	for (x = 0; x < SPECTOOL_PLANAR_NUM_TRACES; x++) {
+		free(planar->traces[x].ymin);
+		free(planar->traces[x].ymax);
+		planar->traces[x].ymin = planar->traces[x].ymax = NULL;
+		planar->traces[x].num_cols = 0;
+		planar->traces[x].valid = 0;
+	}
+
 	GTK_OBJECT_CLASS(spectool_planar_parent_class)->destroy(object);
 }
 
@@ -802,7 +894,7 @@ static void spectool_planar_init(SpectoolPlanar *planar) {
 
 	spectool_widget_buildgui(wwidget);
 
-	planar->agecache = spectool_cache_alloc(10, 0, 0);
+	planar->agecache = spectool_cache_alloc(SPECTOOL_PLANAR_AGE_SWEEPS, 0, 0);
 
 	planar->mkr_list = NULL;
 	planar->cur_mkr = NULL;
@@ -53,6 +53,30 @@ typedef struct _SpectoolPlanar SpectoolPlanar;
 typedef struct _SpectoolPlanarClass SpectoolPlanarClass;
 
 #define SPECTOOL_PLANAR_NUM_SAMPLES		250
+#define SPECTOOL_PLANAR_AGE_SWEEPS		10
+
+/* A trace cut down to the highest and lowest point in each pixel column of
+ * the graph, for sweeps with more bins than the graph is wide.  It stays
+ * good until the graph changes size or scale, or the sweep it came from
+ * changes (a new generation for the peak and average, a new timestamp for
+ * the aged sweeps, whose cache slots get reused) */
+typedef struct _spectool_planar_trace {
+	int valid;
+	unsigned int gen;
+	struct timeval tm_start, tm_end;
+	int len_x, len_y, base_db, min_db;
+
+	/* ymin is -1 in columns no bin lands in */
+	int num_cols;
+	int *ymin, *ymax;
+} spectool_planar_trace;
+
+/* Trace slots: peak, average, and then one per aged sweep cache slot */
+#define SPECTOOL_PLANAR_TRACE_PEAK		0
+#define SPECTOOL_PLANAR_TRACE_AVG		1
+#define SPECTOOL_PLANAR_TRACE_AGE		2
+#define SPECTOOL_PLANAR_NUM_TRACES		(SPECTOOL_PLANAR_TRACE_AGE + \
+										 SPECTOOL_PLANAR_AGE_SWEEPS)
 
 typedef struct _spectool_planar_marker {
 	double r, g, b;
@@ -83,6 +107,11 @@ struct _SpectoolPlanar {
 	GtkWidget *mkr_newbutton, *mkr_delbutton;
 
 	spectool_sweep_cache *agecache;
+
+	/* Column decimated traces, and the generation of the peak and average,
+	 * which moves on with every sweep */
+	spectool_planar_trace traces[SPECTOOL_PLANAR_NUM_TRACES];
+	unsigned int trace_gen;
 };
 
 struct _SpectoolPlanarClass {
@@ -127,170 +127,163 @@ static gint spectool_spectral_configure(GtkWidget *widget,
 
 G_DEFINE_TYPE(SpectoolSpectral, spectool_spectral, SPECTOOL_TYPE_WIDGET);
 
-void spectool_spectral_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidget) {
-	SpectoolSpectral *spectral;
-	int nsamp, pos, sp;
-	int sh, b_s_y;
-	cairo_pattern_t *pattern;
-	cairo_matrix_t matrix;
-	GdkPixmap *linemap;
-	GdkColormap *cmap = gdk_colormap_get_system();
-	cairo_t *lcr;
+/* Rebuild the RSSI to pixel table when the dB scale moves.  Rows already in
+ * the waterfall keep the colors they were drawn with */
+static void spectool_spectral_build_lut(SpectoolSpectral *spectral,
+										SpectoolWidget *wwidget) {
+	int x, sdb, cpos;
+
+	if (spectral->wf_lut_valid &&
+		spectral->wf_lut_base_db == wwidget->base_db_offset &&
+		spectral->wf_lut_min_db == wwidget->min_db_draw)
+		return;
+
+	for (x = 0; x < 256; x++) {
+		sdb = SPECTOOL_RSSI_LUT(&(wwidget->rssi_lut), x);
+
+		cpos = 
+			(float) (spectral->colormap_len) * 
+			((float) (abs(sdb) + wwidget->base_db_offset) /
+			 (float) (abs(wwidget->min_db_draw) -
+					  abs(wwidget->base_db_offset)));
+
+		if (cpos < 0)
+			cpos = 0;
+		else if (cpos >= spectral->colormap_len)
+			cpos = spectral->colormap_len - 1;
+
+		cpos = spectral->colormap_len - cpos;
+
+		if (cpos >= spectral->colormap_len)
+			cpos = spectral->colormap_len - 1;
+
+		spectral->wf_lut[x] = 0xFF000000 |
+			((uint32_t) (SPECTOOL_SPECTRAL_COLOR(spectral->colormap, cpos, 0) * 255) << 16) |
+			((uint32_t) (SPECTOOL_SPECTRAL_COLOR(spectral->colormap, cpos, 1) * 255) << 8) |
+			(uint32_t) (SPECTOOL_SPECTRAL_COLOR(spectral->colormap, cpos, 2) * 255);
+	}
 
-	g_return_if_fail(widget != NULL);
+	spectral->wf_lut_base_db = wwidget->base_db_offset;
+	spectral->wf_lut_min_db = wwidget->min_db_draw;
+	spectral->wf_lut_valid = 1;
+}
 
-	spectral = SPECTOOL_SPECTRAL(wwidget);
+static void spectool_spectral_free_rows(SpectoolSpectral *spectral) {
+	if (spectral->wf_surface != NULL)
+		cairo_surface_destroy(spectral->wf_surface);
 
-	cairo_save(cr);
+	spectral->wf_surface = NULL;
+	spectral->wf_width = spectral->wf_rows = 0;
+	spectral->wf_head = spectral->wf_filled = 0;
+}
 
-	/* Figure out the height mod our number of samples...  wwidget->wbar is
-	 * the width of each rectangle */
-	sh = (double) wwidget->g_len_y / wwidget->sweepcache->num_alloc;
+/* Write a sweep into the waterfall as its newest row, one pixel per sample */
+static void spectool_spectral_push_row(SpectoolSpectral *spectral,
+									   SpectoolWidget *wwidget,
+									   spectool_sample_sweep *samp) {
+	uint32_t *row;
+	int x;
 
-	if (sh < 3)
-		sh = 3;
-	else
-		sh = sh + 1;
+	if (spectral->wf_surface == NULL || samp->num_samples != spectral->wf_width) {
+		spectool_spectral_free_rows(spectral);
 
-	/* Plot across for each sample, with funny looping to handle the
-	 * ring allocation.  The oldest sample is the first non-null sample
-	 * after the current position.  We want to go back /drawable/ samples,
-	 * so hack in a smarter decrement based on how we know the ring works.
-	 * Probably an ugly way of doing it. */
-	if (wwidget->sweepcache->pos >= (wwidget->g_len_y / sh)) {
-		nsamp = wwidget->sweepcache->pos - (wwidget->g_len_y / sh);
-	} else if (wwidget->sweepcache->sweeplist[wwidget->sweepcache->num_alloc - 1] !=
-			   NULL) {
-		nsamp = wwidget->sweepcache->num_alloc - ((wwidget->g_len_y / sh) -
-												  wwidget->sweepcache->pos);
-	} else {
-		nsamp = 0;
+		spectral->wf_surface = 
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32, samp->num_samples,
+									   wwidget->sweepcache->num_alloc);
+
+		if (cairo_surface_status(spectral->wf_surface) != CAIRO_STATUS_SUCCESS) {
+			spectool_spectral_free_rows(spectral);
+			return;
+		}
+
+		spectral->wf_width = samp->num_samples;
+		spectral->wf_rows = wwidget->sweepcache->num_alloc;
 	}
 
-	/* Catch rounding errors and other silliness */
-	if (nsamp < 0)
-		nsamp = 0;
+	spectool_spectral_build_lut(spectral, wwidget);
 
-	pos = 0;
-	while (nsamp != wwidget->sweepcache->pos && 
-		   pos <= wwidget->sweepcache->num_alloc) {
-		spectool_sample_sweep *samp;
+	spectral->wf_head = 
+		(spectral->wf_head + spectral->wf_rows - 1) % spectral->wf_rows;
 
-		/* Loop around the ring */
-		if (nsamp >= wwidget->sweepcache->num_alloc)
-			nsamp = 0;
+	cairo_surface_flush(spectral->wf_surface);
 
-		/* Skip empty allocations in the ring */
-		if (wwidget->sweepcache->sweeplist[nsamp] == NULL) {
-			nsamp++;
-			continue;
-		}
+	row = (uint32_t *) (cairo_image_surface_get_data(spectral->wf_surface) +
+						spectral->wf_head * 
+						cairo_image_surface_get_stride(spectral->wf_surface));
 
-		/* Skip ones too old to be seen */
-		if (sh * pos > wwidget->g_len_y) {
-			break;
-		}
+	for (x = 0; x < samp->num_samples; x++)
+		row[x] = spectral->wf_lut[samp->sample_data[x]];
 
-		/* Thrash out if we're outside our cache bounds, but it shouldn't
-		 * happen */
-		if (nsamp < 0 || nsamp >= spectral->line_cache_len) {
-			printf("debug - outside of cache range!  %d, cache %d\n",
-				   nsamp, spectral->line_cache_len);
-			return;
-		}
+	cairo_surface_mark_dirty_rectangle(spectral->wf_surface, 0, spectral->wf_head,
+									   spectral->wf_width, 1);
 
-		if (spectral->line_cache[nsamp] == NULL) {
-			/* Current sample */
-			samp = wwidget->sweepcache->sweeplist[nsamp];
-
-			linemap = gdk_pixmap_new(NULL, wwidget->g_len_x, sh, 
-									 cmap->visual->depth);
-			gdk_drawable_set_colormap(linemap, cmap);
-
-			/* Make a pattern for cairo to draw */
-			pattern = 
-				cairo_pattern_create_linear(0, 0, wwidget->g_len_x, 0);
-			lcr = gdk_cairo_create(linemap);
-			cairo_rectangle(lcr, 0, 0, wwidget->g_len_x, sh);
-			cairo_clip(lcr);
-
-			for (sp = 0; sp < samp->num_samples - 1; sp++) {
-				int cpos;
-				int sdb = 
-					SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
-									   samp->sample_data[sp]);
-
-				cpos = 
-					(float) (spectral->colormap_len) * 
-					((float) (abs(sdb) + wwidget->base_db_offset) /
-					 (float) (abs(wwidget->min_db_draw) -
-							  abs(wwidget->base_db_offset)));
-
-				if (cpos < 0)
-					cpos = 0;
-				else if (cpos >= spectral->colormap_len)
-					cpos = spectral->colormap_len - 1;
-
-				cpos = spectral->colormap_len - cpos;
-
-				/* Pattern add uses 0.0 - 1.0 for stop lengths so we have to calculate
-				 * them that way */
-				cairo_pattern_add_color_stop_rgb(pattern,
-								 (float) (sp) / (samp->num_samples - 1),
-								 SPECTOOL_SPECTRAL_COLOR(spectral->colormap, cpos, 0),
-								 SPECTOOL_SPECTRAL_COLOR(spectral->colormap, cpos, 1),
-								 SPECTOOL_SPECTRAL_COLOR(spectral->colormap, cpos, 2));
-			}
-
-			/* Draw a line over our pixmap */
-			cairo_set_source(lcr, pattern);
-			cairo_rectangle(lcr, -1, -1, wwidget->g_len_x + 1, sh + 1);
-			cairo_fill(lcr);
-			cairo_destroy(lcr);
-			cairo_pattern_destroy(pattern);
-			spectral->line_cache[nsamp] = linemap;
-		}
+	if (spectral->wf_filled < spectral->wf_rows)
+		spectral->wf_filled++;
+}
 
-		/* Top position of the pixmap line, drawing from the bottom up */
-		b_s_y = wwidget->g_end_y - ((pos + 1) * sh);
+/* Scale nrows rows of the waterfall, from row, onto the graph at y */
+static void spectool_spectral_blit(SpectoolSpectral *spectral, cairo_t *cr,
+								   SpectoolWidget *wwidget, int row, int nrows,
+								   int y, int sh) {
+	cairo_save(cr);
 
-		gdk_cairo_set_source_pixmap(cr, spectral->line_cache[nsamp], 
-									wwidget->g_start_x, b_s_y);
-		cairo_rectangle(cr, wwidget->g_start_x + 0.5, b_s_y + 0.5, 
-						wwidget->g_len_x, sh + 1);
-		cairo_fill(cr);
+	cairo_rectangle(cr, wwidget->g_start_x, y, wwidget->g_len_x, nrows * sh);
+	cairo_clip(cr);
 
-		nsamp++;
-		pos++;
+	cairo_translate(cr, wwidget->g_start_x, y);
+	cairo_scale(cr, (double) wwidget->g_len_x / spectral->wf_width, sh);
 
-	}
+	cairo_set_source_surface(cr, spectral->wf_surface, 0, -row);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+	cairo_paint(cr);
 
 	cairo_restore(cr);
 }
 
-static void spectool_spectral_size_allocate(GtkWidget *widget,
-										 GtkAllocation *allocation) {
-	SpectoolSpectral *spectral = SPECTOOL_SPECTRAL(widget);
-	int x;
+void spectool_spectral_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidget) {
+	SpectoolSpectral *spectral;
+	int sh, nvis, first, top;
 
-	GTK_WIDGET_CLASS(spectool_spectral_parent_class)->size_allocate(widget, allocation);
+	g_return_if_fail(widget != NULL);
 
-	/* Wipe the line cache on resize */
-	if (allocation->width != spectral->oldx ||
-		allocation->height != spectral->oldy) {
-		spectral->oldx = allocation->width;
-		spectral->oldy = allocation->height;
+	spectral = SPECTOOL_SPECTRAL(wwidget);
 
-		if (spectral->line_cache != NULL) {
-			for (x = 0; x < spectral->line_cache_len; x++) {
-				if (spectral->line_cache[x] != NULL) {
-					gdk_pixmap_unref(spectral->line_cache[x]);
-					spectral->line_cache[x] = NULL;
-				}
+	if (spectral->wf_surface == NULL || spectral->wf_filled == 0)
+		return;
 
-			}
-		}
-	}
+	/* Figure out the height mod our number of samples...  wwidget->wbar is
+	 * the width of each rectangle */
+	sh = (double) wwidget->g_len_y / wwidget->sweepcache->num_alloc;
+
+	if (sh < 3)
+		sh = 3;
+	else
+		sh = sh + 1;
+
+	/* Stack as many rows as fit up from the bottom, newest at the top */
+	nvis = wwidget->g_len_y / sh;
+
+	if (nvis > spectral->wf_filled)
+		nvis = spectral->wf_filled;
+
+	top = wwidget->g_end_y - (nvis * sh);
+
+	/* The newest rows run from the head to the bottom of the ring, and the
+	 * rest wrap around from its top, so it's two blits whatever the depth */
+	first = spectral->wf_rows - spectral->wf_head;
+
+	if (first > nvis)
+		first = nvis;
+
+	cairo_save(cr);
+
+	spectool_spectral_blit(spectral, cr, wwidget, spectral->wf_head, first, top, sh);
+
+	if (nvis > first)
+		spectool_spectral_blit(spectral, cr, wwidget, 0, nvis - first, 
+							   top + (first * sh), sh);
+
+	cairo_restore(cr);
 }
 
 static void spectool_spectral_class_init(SpectoolSpectralClass *class) {
@@ -303,7 +296,6 @@ static void spectool_spectral_class_init(SpectoolSpectralClass *class) {
 	widget_class = GTK_WIDGET_CLASS(class);
 
 	object_class->destroy = spectool_spectral_destroy;
-	widget_class->size_allocate = spectool_spectral_size_allocate;
 }
 
 static void spectool_spectral_destroy(GtkObject *object) {
@@ -312,6 +304,8 @@ static void spectool_spectral_destroy(GtkObject *object) {
 
 	wwidget = SPECTOOL_WIDGET(spectral);
 
+	spectool_spectral_free_rows(spectral);
+
 	GTK_OBJECT_CLASS(spectool_spectral_parent_class)->destroy(object);
 }
 
@@ -333,7 +327,7 @@ static void spectool_spectral_wdr_sweep(int slot, int mode,
 									 void *aux) {
 	SpectoolSpectral *spectral;
 	SpectoolWidget *wwidget;
-	int x, tout;
+	int tout;
 	spectool_phy *pd;
 
 	g_return_if_fail(aux != NULL);
@@ -364,35 +358,12 @@ static void spectool_spectral_wdr_sweep(int slot, int mode,
 	}
 
 	if ((mode & SPECTOOL_POLL_CONFIGURED)) {
-		/* Allocate the cache of lines to draw */
-		if (spectral->line_cache != NULL) {
-			for (x = 0; x < spectral->line_cache_len; x++) {
-				if (spectral->line_cache[x] != NULL) {
-					gdk_pixmap_unref(spectral->line_cache[x]);
-				}
-
-			}
-		}
-		free(spectral->line_cache);
-
-		spectral->line_cache = malloc(sizeof(GdkPixmap *) *
-									  wwidget->sweepcache->num_alloc);
-		spectral->line_cache_len = wwidget->sweepcache->num_alloc;
-		spectral->n_sweeps_delta = 0;
-
-		for (x = 0; x < spectral->line_cache_len; x++) {
-			spectral->line_cache[x] = NULL;
-		}
-	} else if ((mode & SPECTOOL_POLL_SWEEPCOMPLETE)) {
-		/* Null out this sweep in the cache so we have to recalculate it */
-		if (wwidget->sweepcache->pos >= 0 && 
-			wwidget->sweepcache->pos < spectral->line_cache_len) {
-			if (spectral->line_cache[wwidget->sweepcache->pos] != NULL)
-				gdk_pixmap_unref(spectral->line_cache[wwidget->sweepcache->pos]);
-			spectral->line_cache[wwidget->sweepcache->pos] = NULL;
-		}
-
-		spectral->n_sweeps_delta++;
+		/* New profile, start the waterfall over */
+		spectool_spectral_free_rows(spectral);
+		spectral->wf_lut_valid = 0;
+	} else if ((mode & SPECTOOL_POLL_SWEEPCOMPLETE) && sweep != NULL &&
+			   wwidget->sweepcache != NULL && wwidget->sweepcache->latest != NULL) {
+		spectool_spectral_push_row(spectral, wwidget, wwidget->sweepcache->latest);
 	}
 }
 
@@ -559,6 +530,9 @@ static void spectool_spectral_init(SpectoolSpectral *spectral) {
 	gtk_widget_show(legendh);
 	gtk_widget_show(spectral->legend_pix);
 
-	spectral->oldx = spectral->oldy = 0;
+	spectral->wf_surface = NULL;
+	spectral->wf_width = spectral->wf_rows = 0;
+	spectral->wf_head = spectral->wf_filled = 0;
+	spectral->wf_lut_valid = 0;
 }
 
@@ -67,11 +67,16 @@ struct _SpectoolSpectral {
 	float *colormap;
 	int colormap_len;
 
-	GdkPixmap **line_cache;
-	int line_cache_len;
-	int n_sweeps_delta;
-
-	int oldx, oldy;
+	/* Waterfall history, one row of pixels per sweep used as a ring.  wf_head
+	 * is the newest row and the rows after it, wrapping around, get older */
+	cairo_surface_t *wf_surface;
+	int wf_width, wf_rows;
+	int wf_head, wf_filled;
+
+	/* RSSI to pixel, and the dB scale it was built for */
+	uint32_t wf_lut[256];
+	int wf_lut_valid;
+	int wf_lut_base_db, wf_lut_min_db;
 };
 
 struct _SpectoolSpectralClass {
@@ -18,6 +18,7 @@
 #include <string.h>
 
 #include "spectool_gtk_topo.h"
+#include "spectool_simd.h"
 #include "spectool_gtk.h"
 
 #define KLUGE_NOISE_FLOOR -90
@@ -94,14 +95,172 @@ static gint spectool_topo_configure(GtkWidget *widget,
 
 G_DEFINE_TYPE(SpectoolTopo, spectool_topo, SPECTOOL_TYPE_WIDGET);
 
+static void spectool_topo_free_grid(SpectoolTopo *topo) {
+	if (topo->sample_counts != NULL) {
+		free(topo->sample_counts);
+		topo->sample_counts = NULL;
+	}
+
+	if (topo->row_scratch != NULL) {
+		free(topo->row_scratch);
+		topo->row_scratch = NULL;
+	}
+
+	if (topo->hist != NULL) {
+		free(topo->hist);
+		topo->hist = NULL;
+	}
+
+	if (topo->count_counts != NULL) {
+		free(topo->count_counts);
+		topo->count_counts = NULL;
+	}
+
+	if (topo->count_lut != NULL) {
+		free(topo->count_lut);
+		topo->count_lut = NULL;
+	}
+
+	if (topo->dirty_cells != NULL) {
+		free(topo->dirty_cells);
+		topo->dirty_cells = NULL;
+	}
+
+	if (topo->cell_dirty != NULL) {
+		free(topo->cell_dirty);
+		topo->cell_dirty = NULL;
+	}
+
+	if (topo->surface != NULL) {
+		cairo_surface_destroy(topo->surface);
+		topo->surface = NULL;
+	}
+
+	topo->num_dirty = 0;
+	topo->lut_peak = 0;
+}
+
+/* Count one row of samples into the grid, or take it back out */
+static void spectool_topo_count(SpectoolTopo *topo, uint8_t *data, int add) {
+	int x, c;
+	unsigned int sc;
+
+	spectool_simd_lut_u8_int(topo->row_scratch, data, topo->rssi_row, topo->scw);
+
+	for (x = 0; x < topo->scw; x++) {
+		c = topo->row_scratch[x] + x;
+		sc = topo->sample_counts[c];
+
+		if (add) {
+			if (sc > 0)
+				topo->count_counts[sc]--;
+			topo->count_counts[++sc]++;
+
+			/* Record the max peak count for easy math later */
+			if ((int) sc > topo->sweep_peak_max)
+				topo->sweep_peak_max = sc;
+		} else {
+			topo->count_counts[sc]--;
+			if (--sc > 0)
+				topo->count_counts[sc]++;
+
+			/* Last cell at the peak dropped, and it now holds the next
+			 * highest count; always 1 for math */
+			if ((int) sc + 1 == topo->sweep_peak_max && 
+				topo->count_counts[sc + 1] == 0 && sc > 0)
+				topo->sweep_peak_max = sc;
+		}
+
+		topo->sample_counts[c] = sc;
+
+		/* Repaint it next draw */
+		if (topo->cell_dirty[c] == 0) {
+			topo->cell_dirty[c] = 1;
+			topo->dirty_cells[topo->num_dirty++] = c;
+		}
+	}
+}
+
+/* Colors for every count the grid can hold, scaled to peak */
+static void spectool_topo_build_lut(SpectoolTopo *topo, int peak) {
+	int c, cpos;
+
+	for (c = 0; c <= topo->history; c++) {
+		cpos = (float) (topo->colormap_len - 1) * ((float) c / (float) peak);
+
+		if (cpos < 0) 
+			cpos = 0;
+		if (cpos >= topo->colormap_len) 
+			cpos = topo->colormap_len - 1;
+
+		topo->count_lut[c] = 0xFF000000 |
+			((uint32_t) (SPECTOOL_TOPO_COLOR(topo->colormap, cpos, 0) * 255) << 16) |
+			((uint32_t) (SPECTOOL_TOPO_COLOR(topo->colormap, cpos, 1) * 255) << 8) |
+			(uint32_t) (SPECTOOL_TOPO_COLOR(topo->colormap, cpos, 2) * 255);
+	}
+
+	topo->lut_peak = peak;
+}
+
+/* Bring the grid pixels up to date with the counts */
+static void spectool_topo_update_surface(SpectoolTopo *topo, int peak) {
+	uint8_t *data;
+	int stride, c, d;
+
+	if (topo->surface == NULL) {
+		topo->surface = 
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32, topo->scw, topo->sch);
+
+		if (cairo_surface_status(topo->surface) != CAIRO_STATUS_SUCCESS) {
+			cairo_surface_destroy(topo->surface);
+			topo->surface = NULL;
+			return;
+		}
+
+		topo->dirty_all = 1;
+	}
+
+	if (peak != topo->lut_peak) {
+		spectool_topo_build_lut(topo, peak);
+		topo->dirty_all = 1;
+	}
+
+	cairo_surface_flush(topo->surface);
+
+	data = cairo_image_surface_get_data(topo->surface);
+	stride = cairo_image_surface_get_stride(topo->surface);
+
+	if (topo->dirty_all) {
+		for (c = 0; c < topo->sch; c++) {
+			uint32_t *row = (uint32_t *) (data + c * stride);
+			unsigned int *counts = topo->sample_counts + c * topo->scw;
+
+			for (d = 0; d < topo->scw; d++)
+				row[d] = topo->count_lut[counts[d]];
+		}
+	} else {
+		for (d = 0; d < topo->num_dirty; d++) {
+			c = topo->dirty_cells[d];
+
+			((uint32_t *) (data + (c / topo->scw) * stride))[c % topo->scw] =
+				topo->count_lut[topo->sample_counts[c]];
+		}
+	}
+
+	for (d = 0; d < topo->num_dirty; d++)
+		topo->cell_dirty[topo->dirty_cells[d]] = 0;
+
+	topo->num_dirty = 0;
+	topo->dirty_all = 0;
+
+	cairo_surface_mark_dirty(topo->surface);
+}
+
 void spectool_topo_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidget) {
 	SpectoolTopo *topo;
 
 	float sh; 
-	double chpix;
-	cairo_pattern_t *pattern;
-
-	int samp, db;
+	int samp;
 
 	g_return_if_fail(IS_SPECTOOL_TOPO(wwidget));
 
@@ -112,15 +271,17 @@ void spectool_topo_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidget)
 		return;
 	}
 
+	if (topo->sample_counts == NULL)
+		return;
+
 	cairo_save(cr);
 
 	// Find a representative line to get our maximum
 	// 2/3rds down, up a bit to dodge noise floor
 	// int avg_db = (((abs(wwidget->min_db_draw) - abs(wwidget->base_db_offset)) / 3) * 2) - 3 - abs(wwidget->base_db_offset);;
 	// int avg_db = ((abs(wwidget->min_db_draw) / 3) * 2) - abs(wwidget->base_db_offset);
-	int mindb = SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, 
-									wwidget->amp_res_mdbm, 
-									wwidget->phydev->min_rssi_seen);
+	int mindb = SPECTOOL_RSSI_LUT(&(wwidget->rssi_lut), 
+								  wwidget->phydev->min_rssi_seen);
 	int avg_db = ((abs(mindb) / 3) * 2) - abs(wwidget->base_db_offset);
 	int avg_peak = 1;
 
@@ -135,59 +296,29 @@ void spectool_topo_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidget)
 	
 	// printf("peak %d\n", avg_peak);
 
-	/* Figure out the height based on the dbm range */
-	sh = (double) wwidget->g_len_y / (abs(wwidget->min_db_draw) - abs(wwidget->base_db_offset));
+	spectool_topo_update_surface(topo, avg_peak);
 
-	/* Plot along all the normalized DB ranges  */
-	for (db = 0; db < (abs(wwidget->min_db_draw) - abs(wwidget->base_db_offset)); db++) {
-		/* Make a pattern to draw our levels to, scaled to the graph and db
-		 * position so we don't matrix it */
-		pattern =
-			cairo_pattern_create_linear(wwidget->g_start_x,
-										wwidget->g_start_y + (sh * db),
-										wwidget->g_end_x,
-										wwidget->g_start_y + (sh * db) + 1);
-
-		/* Plot each sample count across that db */
-		for (samp = 0; samp < topo->scw; samp++) {
-			int cpos;
-
-			/*
-				printf("[%d,%d] %f ", samp, db,
-				((float) (topo->sample_counts[(db * topo->scw) + samp])));
-				*/
-
-			cpos = (float) (topo->colormap_len - 1) *
-				((float) (topo->sample_counts[(db * topo->scw) + samp]) /
-				 (float) avg_peak);
-
-			if (cpos < 0) cpos = 0;
-			if (cpos > topo->colormap_len) cpos = topo->colormap_len - 1;
-
-			cairo_pattern_add_color_stop_rgb(pattern,
-					(float) (samp) / (topo->scw),
-					SPECTOOL_TOPO_COLOR(topo->colormap, cpos, 0),
-					SPECTOOL_TOPO_COLOR(topo->colormap, cpos, 1),
-					SPECTOOL_TOPO_COLOR(topo->colormap, cpos, 2));
-		}
+	if (topo->surface == NULL) {
+		cairo_restore(cr);
+		return;
+	}
 
-		cairo_set_source(cr, pattern);
-		cairo_rectangle(cr, 
-						wwidget->g_start_x + 0.5, 
-						wwidget->g_start_y + (sh * db) + 0.5,
-						(float) wwidget->g_len_x, (float) sh + 1);
+	/* Figure out the height based on the dbm range */
+	sh = (double) wwidget->g_len_y / (abs(wwidget->min_db_draw) - abs(wwidget->base_db_offset));
 
-		/*
-		printf("debug - rectangle %f, %f .. %f, %f\n",
-						wwidget->g_start_x + 0.5, 
-						wwidget->g_start_y + (sh * db) + 0.5,
-						(float) wwidget->g_len_x, (float) sh + 1);
-						*/
+	/* One cell per normalized db row and sample, stretched over the graph;
+	 * filtering smooths across samples like the old per-row gradients did */
+	cairo_rectangle(cr, wwidget->g_start_x + 0.5, wwidget->g_start_y + 0.5,
+					(float) wwidget->g_len_x, sh * topo->sch + 1);
+	cairo_clip(cr);
 
-		cairo_fill(cr);
+	cairo_translate(cr, wwidget->g_start_x + 0.5, wwidget->g_start_y + 0.5);
+	cairo_scale(cr, (double) wwidget->g_len_x / topo->scw, sh);
 
-		cairo_pattern_destroy(pattern);
-	}
+	cairo_set_source_surface(cr, topo->surface, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BILINEAR);
+	cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+	cairo_paint(cr);
 
 	cairo_restore(cr);
 }
@@ -231,10 +362,7 @@ static void spectool_topo_destroy(GtkObject *object) {
 
 	wwidget = SPECTOOL_WIDGET(topo);
 
-	if (topo->sample_counts != NULL) {
-		free(topo->sample_counts);
-		topo->sample_counts = NULL;
-	}
+	spectool_topo_free_grid(topo);
 
 	GTK_OBJECT_CLASS(spectool_topo_parent_class)->destroy(object);
 }
@@ -249,7 +377,8 @@ static void spectool_topo_wdr_sweep(int slot, int mode,
 									 void *aux) {
 	SpectoolTopo *topo;
 	SpectoolWidget *wwidget;
-	int s, x, sc, tout;
+	int x, tout;
+	uint8_t *slot_data;
 	spectool_phy *pd;
 
 	g_return_if_fail(aux != NULL);
@@ -280,14 +409,9 @@ static void spectool_topo_wdr_sweep(int slot, int mode,
 	}
 
 	if ((mode & SPECTOOL_POLL_ERROR)) {
-		if (topo->sample_counts) {
-			free(topo->sample_counts);
-			topo->sample_counts = NULL;
-		}
+		spectool_topo_free_grid(topo);
 	} else if ((mode & SPECTOOL_POLL_CONFIGURED)) {
-		if (topo->sample_counts != NULL) {
-			free(topo->sample_counts);
-		}
+		spectool_topo_free_grid(topo);
 
 		// 2d plot; #samples wide, normalized dbrange high
 		topo->sch = abs(wwidget->min_db_draw) - abs(wwidget->base_db_offset);
@@ -297,60 +421,63 @@ static void spectool_topo_wdr_sweep(int slot, int mode,
 
 		topo->sample_counts = (unsigned int *)
 			malloc(sizeof(unsigned int) * topo->sch * topo->scw);
+		topo->row_scratch = (int *) malloc(sizeof(int) * topo->scw);
+		topo->hist = (uint8_t *) malloc(topo->history * topo->scw);
+		topo->count_counts = (unsigned int *)
+			malloc(sizeof(unsigned int) * (topo->history + 1));
+		topo->count_lut = (uint32_t *) 
+			malloc(sizeof(uint32_t) * (topo->history + 1));
+		topo->dirty_cells = (int *) malloc(sizeof(int) * topo->sch * topo->scw);
+		topo->cell_dirty = (uint8_t *) malloc(topo->sch * topo->scw);
+
+		/* Normalize every possible RSSI into our base offset once, so
+		 * bucketing a sweep is a table lookup per sample */
+		for (x = 0; x < 256; x++) {
+			int ndb = abs(SPECTOOL_RSSI_LUT(&(wwidget->rssi_lut), x)) - 
+				abs(wwidget->base_db_offset);
+
+			if (ndb < 0) 
+				ndb = 0;
+			if (ndb >= topo->sch) 
+				ndb = topo->sch - 1;
+
+			topo->rssi_row[x] = ndb * topo->scw;
+		}
 
 		memset(topo->sample_counts, 0,
 			   sizeof(unsigned int) * topo->sch * topo->scw);
+		memset(topo->count_counts, 0, 
+			   sizeof(unsigned int) * (topo->history + 1));
+		memset(topo->cell_dirty, 0, topo->sch * topo->scw);
+		topo->dirty_all = 1;
 
+		topo->hist_pos = 0;
+		topo->hist_fill = 0;
 		topo->sweep_count_num = 0;
 		/* always 1 for math */
 		topo->sweep_peak_max = 1;
 
-	} else if ((mode & SPECTOOL_POLL_SWEEPCOMPLETE)) {
-		topo->sweep_count_num = 0;
-		topo->sweep_peak_max = 1;
-
-		memset(topo->sample_counts, 0,
-			   sizeof(unsigned int) * topo->sch * topo->scw);
+	} else if ((mode & SPECTOOL_POLL_SWEEPCOMPLETE) && 
+			   topo->sample_counts != NULL && sweep != NULL) {
+		/* Only the sweep coming in and the one it pushes out of the history
+		 * change the grid */
+		slot_data = topo->hist + (topo->hist_pos * topo->scw);
 
-		int max = wwidget->sweepcache->pos;
-		if (wwidget->sweepcache->looped)
-			max = wwidget->sweepcache->num_alloc;
-
-		for (s = 0; s < max; s++) {
-			/* Copy the aggregate sweep (ie our peak data) over... */
-			for (x = 0; x < topo->scw && x < 
-				 wwidget->sweepcache->sweeplist[s]->num_samples; x++) {
-				int sdb = SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, 
-											 wwidget->amp_res_mdbm, 
-								wwidget->sweepcache->sweeplist[s]->sample_data[x]);
-
-#if 0
-				if (sdb < KLUGE_NOISE_FLOOR)
-					continue;
-#endif
-
-				// Normalize it into our base offset as an int
-				int ndb = abs(sdb) - abs(wwidget->base_db_offset); 
-
-				if (ndb < 0) 
-					ndb = 0;
-				if (ndb >= topo->sch) 
-					ndb = topo->sch - 1;
+		if (topo->hist_fill == topo->history) 
+			spectool_topo_count(topo, slot_data, 0);
+		else
+			topo->hist_fill++;
 
-				/* Increment that position */
-				sc = ++(topo->sample_counts[(ndb * topo->scw) + x]);
-				// sc = ++(topo->sample_counts[(x * topo->sch) + ndb]);
+		/* Short sweeps count as the floor past their end */
+		x = sweep->num_samples < topo->scw ? sweep->num_samples : topo->scw;
+		memcpy(slot_data, sweep->sample_data, x);
+		if (x < topo->scw)
+			memset(slot_data + x, 0, topo->scw - x);
 
-				/* Record the max peak count for easy math later */
-				if (sc > topo->sweep_peak_max) {
-					// printf("debug - sweep peak %d\n", sc);
-					topo->sweep_peak_max = sc;
-				}
+		spectool_topo_count(topo, slot_data, 1);
 
-			}
-
-			topo->sweep_count_num++;
-		}
+		topo->hist_pos = (topo->hist_pos + 1) % topo->history;
+		topo->sweep_count_num = topo->hist_fill;
 	}
 }
 
@@ -466,6 +593,7 @@ static void spectool_topo_init(SpectoolTopo *topo) {
 	wwidget = SPECTOOL_WIDGET(topo);
 
 	wwidget->sweep_num_samples = 60;
+	topo->history = SPECTOOL_TOPO_HISTORY;
 
 	wwidget->sweep_keep_avg = 0;
 	wwidget->sweep_keep_peak = 0;
@@ -52,6 +52,10 @@ G_BEGIN_DECLS
 typedef struct _SpectoolTopo SpectoolTopo;
 typedef struct _SpectoolTopoClass SpectoolTopoClass;
 
+/* Sweeps counted into the topo grid.  The grid keeps its own history, so
+ * this can go well past the widget sweep cache */
+#define SPECTOOL_TOPO_HISTORY			60
+
 /* Access the color array */
 #define SPECTOOL_TOPO_COLOR(a, b, c)	((a)[((b) * 3) + c])
 
@@ -69,6 +73,31 @@ struct _SpectoolTopo {
 	unsigned int *sample_counts;
 	int sch, scw;
 	int sweep_count_num, sweep_peak_max;
+
+	/* RSSI to offset of the matching row in sample_counts, and a scratch row
+	 * of offsets for bucketing a sweep */
+	int rssi_row[256];
+	int *row_scratch;
+
+	/* Raw samples of the last history sweeps, oldest at hist_pos once the
+	 * ring is full, so a sweep can be taken back out of the grid when it
+	 * ages out */
+	uint8_t *hist;
+	int history, hist_pos, hist_fill;
+
+	/* Count of counts: how many grid cells hold each count, so the peak
+	 * count can be walked down when the last cell holding it drops */
+	unsigned int *count_counts;
+
+	/* The grid as pixels, one per cell, scaled onto the graph in one paint.
+	 * Only cells whose count changed since the last draw are rewritten,
+	 * unless the colors moved with the peak used to scale them */
+	cairo_surface_t *surface;
+	uint32_t *count_lut;
+	int lut_peak;
+	int *dirty_cells;
+	uint8_t *cell_dirty;
+	int num_dirty, dirty_all;
 };
 
 struct _SpectoolTopoClass {
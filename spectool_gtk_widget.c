@@ -44,6 +44,25 @@ static GType spectool_widget_child_type (GtkContainer *container);
 
 G_DEFINE_TYPE(SpectoolWidget, spectool_widget, GTK_TYPE_BIN);
 
+static void spectool_widget_free_static(SpectoolWidget *wwidget) {
+	if (wwidget->static_back != NULL) {
+		cairo_surface_destroy(wwidget->static_back);
+		wwidget->static_back = NULL;
+	}
+
+	if (wwidget->static_front != NULL) {
+		cairo_surface_destroy(wwidget->static_front);
+		wwidget->static_front = NULL;
+	}
+
+	wwidget->static_valid = 0;
+}
+
+void spectool_widget_invalidate_static(SpectoolWidget *wwidget) {
+	wwidget->static_valid = 0;
+	wwidget->dirty = 1;
+}
+
 void spectoolchannelopts_init(SpectoolChannelOpts *in) {
 	in->chan_h = -1;
 	in->chanhit = NULL;
@@ -68,6 +87,8 @@ static void spectool_widget_destroy(GtkObject *object) {
 		wwidget->timeout_ref = -1;
 	}
 
+	spectool_widget_free_static(wwidget);
+
 	GTK_OBJECT_CLASS(spectool_widget_parent_class)->destroy(object);
 }
 
@@ -92,6 +113,7 @@ static void spectool_widget_wdr_sweep(int slot, int mode,
 
 	/* Generic sweep handler to add it to our cache, all things get this */
 	if ((mode & SPECTOOL_POLL_ERROR)) {
+		wwidget->static_valid = 0;
 		wwidget->phydev = NULL;
 		if (wwidget->sweepcache != NULL) {
 			spectool_cache_free(wwidget->sweepcache);
@@ -100,6 +122,9 @@ static void spectool_widget_wdr_sweep(int slot, int mode,
 		wdr_del_ref(wwidget->wdr, wwidget->wdr_slot);
 		wwidget->wdr_slot = -1;
 	} else if ((mode & SPECTOOL_POLL_CONFIGURED)) {
+		/* New profile, new scale and channels */
+		wwidget->static_valid = 0;
+
 		if (wwidget->sweepcache != NULL) {
 			spectool_cache_free(wwidget->sweepcache);
 			wwidget->sweepcache = NULL;
@@ -117,6 +142,9 @@ static void spectool_widget_wdr_sweep(int slot, int mode,
 		wwidget->amp_res_mdbm = 
 			spectool_phy_getcurprofile(wwidget->phydev)->amp_res_mdbm;
 
+		spectool_rssi_lut_build(&(wwidget->rssi_lut), wwidget->amp_offset_mdbm,
+								wwidget->amp_res_mdbm);
+
 		/*
 		wwidget->base_db_offset =
 			SPECTOOL_RSSI_CONVERT(wwidget->amp_offset_mdbm, wwidget->amp_res_mdbm,
@@ -436,6 +464,10 @@ static void spectool_widget_init(SpectoolWidget *widget) {
 	widget->offscreen = NULL;
 	widget->old_width = widget->old_height = 0;
 
+	widget->static_back = widget->static_front = NULL;
+	widget->static_valid = 0;
+	widget->static_draw_func = NULL;
+
 	widget->dirty = 0;
 }
 
@@ -458,6 +490,8 @@ static void spectool_widget_size_allocate(GtkWidget *widget,
 			wwidget->offscreen = NULL;
 		}
 
+		spectool_widget_free_static(wwidget);
+
 		wwidget->old_width = allocation->width;
 		wwidget->old_height = allocation->height;
 	}
@@ -483,14 +517,7 @@ static void spectool_widget_size_request (GtkWidget *widget, GtkRequisition *req
 }
 
 void spectool_widget_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidget) {
-	cairo_text_extents_t extents;
-	int x, chpix, maxcw, start_db;
-	const double dash_onoff[] = {2, 4};
-	const double dash_ononoff[] = {4, 2};
-
-	char mtext[128];
-
-	int chanmod;
+	int x;
 
 	g_return_if_fail(widget != NULL);
 	
@@ -514,59 +541,11 @@ void spectool_widget_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidge
 	cairo_paint(cr);
 	cairo_restore(cr);
 
-	/* Render the selected channel text on top of any other data */
-	if (wwidget->show_dbm || wwidget->show_dbm_lines) {
-		/* Draw the dBm lines and power labels */
-		maxcw = 0;
+	/* The dBm scale goes on top of any other data */
+	if (wwidget->static_valid && wwidget->static_front != NULL) {
 		cairo_save(cr);
-		cairo_set_line_width(cr, 0.5);
-
-		start_db = 0;
-		for (x = wwidget->base_db_offset - 1; x > wwidget->min_db_draw;
-			 x--) {
-			if (x % 10 == 0) {
-				start_db = x;
-				break;
-			}
-		}
-		
-		if (start_db == 0)
-			start_db = wwidget->base_db_offset;
-
-		for (x = start_db; x > wwidget->min_db_draw; x -= 10) {
-			int py;
-
-			py = (float) wwidget->g_len_y * 
-				(float) ((float) (abs(x) + wwidget->base_db_offset) /
-						 (float) (abs(wwidget->min_db_draw) +
-								  wwidget->base_db_offset));
-
-			cairo_set_source_rgb(cr, 1, 1, 1);
-
-			if (wwidget->show_dbm_lines) {
-				cairo_set_dash(cr, dash_onoff, 2, 0);
-				/* .5 hack for pixel alignment */
-				cairo_move_to(cr, wwidget->g_start_x, 
-							  wwidget->g_start_y + py + 0.5);
-				cairo_line_to(cr, wwidget->g_end_x, wwidget->g_start_y + py + 0.5);
-				cairo_stroke(cr);
-			}
-
-			if (wwidget->show_dbm) {
-				snprintf(mtext, 128, "%d dBm", x);
-
-				cairo_select_font_face(cr, "Helvetica", 
-									   CAIRO_FONT_SLANT_NORMAL, 
-									   CAIRO_FONT_WEIGHT_BOLD);
-				cairo_set_font_size(cr, 10);
-				cairo_text_extents(cr, mtext, &extents);
-				cairo_move_to(cr, wwidget->g_start_x - wwidget->dbm_w, 
-							  wwidget->g_start_y + py + (extents.height / 2));
-
-				cairo_show_text(cr, mtext);
-			}
-
-		}
+		cairo_set_source_surface(cr, wwidget->static_front, 0, 0);
+		cairo_paint(cr);
 		cairo_restore(cr);
 	}
 
@@ -666,17 +645,140 @@ void spectool_widget_draw(GtkWidget *widget, cairo_t *cr, SpectoolWidget *wwidge
 	cairo_restore(cr);
 }
 
-void spectool_widget_graphics_update(SpectoolWidget *wwidget) {
+/* Draw the layers which only change with the size, the device config or
+ * the dBm scale, and work out the graph geometry for the data layer */
+static void spectool_widget_build_static(SpectoolWidget *wwidget) {
 	cairo_text_extents_t extents;
-	int x, chpix, maxcw, start_db;
+	int x, start_db, w, h;
 	const double dash_onoff[] = {2, 4};
-	const double dash_ononoff[] = {4, 2};
-	cairo_t *offcr;
+	cairo_t *cr;
 	GtkWidget *widget;
 
 	char mtext[128];
 
-	int chanmod;
+	widget = wwidget->draw;
+	w = widget->allocation.width;
+	h = widget->allocation.height;
+
+	if (wwidget->static_back == NULL) {
+		wwidget->static_back = 
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
+		wwidget->static_front = 
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
+	}
+
+	cr = cairo_create(wwidget->static_back);
+
+	cairo_rectangle(cr, 0, 0, w, h);
+	cairo_set_source_rgb(cr, HC2CC(0x50), HC2CC(0x50), HC2CC(0x50));
+	cairo_fill(cr);
+
+	/* Assume we have at most a 3 digit DBM rating, and figure out the scaling.
+	 * We use 000 since they're nice fat digits even with a variable-width font,
+	 * and then we slap another 10% on the result. */
+	cairo_save(cr);
+	snprintf(mtext, 128, "-000 dBm");
+	cairo_select_font_face(cr, "Helvetica", 
+						   CAIRO_FONT_SLANT_NORMAL, 
+						   CAIRO_FONT_WEIGHT_BOLD);
+	cairo_set_font_size(cr, 10);
+	cairo_text_extents(cr, mtext, &extents);
+	wwidget->dbm_w = extents.width + ((double) extents.width * 0.1);
+	cairo_restore(cr);
+
+	/* Figure out a square scaled to the number of samples we have and
+	 * build the size of the animated graph.  wbar ends up being the 
+	 * width of a sample, so we can use that for all sorts of math later */
+	wwidget->wbar = 
+		(double) (w - wwidget->dbm_w - (SPECTOOL_WIDGET_PADDING * 2) - 5) / 
+		(double) (wwidget->sweepcache->latest->num_samples - 1);
+	wwidget->g_len_x = wwidget->wbar * 
+		(wwidget->sweepcache->latest->num_samples - 1);
+	wwidget->g_len_y = h - (SPECTOOL_WIDGET_PADDING * 2);
+	wwidget->g_start_x = SPECTOOL_WIDGET_PADDING + wwidget->dbm_w;
+	wwidget->g_start_y = SPECTOOL_WIDGET_PADDING;
+	wwidget->g_end_x = wwidget->g_start_x + wwidget->g_len_x;
+	wwidget->g_end_y = wwidget->g_start_y + wwidget->g_len_y;
+
+	cairo_rectangle(cr, wwidget->g_start_x, wwidget->g_start_y, 
+					wwidget->g_len_x, wwidget->g_len_y);
+	cairo_set_source_rgb(cr, HC2CC(0x00), HC2CC(0x00), HC2CC(0x00));
+	cairo_fill(cr);
+
+	if (wwidget->static_draw_func != NULL)
+		(*(wwidget->static_draw_func))(widget, cr, wwidget);
+
+	cairo_destroy(cr);
+
+	/* The dBm lines and power labels, over the data */
+	cr = cairo_create(wwidget->static_front);
+
+	cairo_save(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cr);
+	cairo_restore(cr);
+
+	if (wwidget->show_dbm || wwidget->show_dbm_lines) {
+		cairo_set_line_width(cr, 0.5);
+		cairo_set_source_rgb(cr, 1, 1, 1);
+		cairo_select_font_face(cr, "Helvetica", 
+							   CAIRO_FONT_SLANT_NORMAL, 
+							   CAIRO_FONT_WEIGHT_BOLD);
+		cairo_set_font_size(cr, 10);
+
+		start_db = 0;
+		for (x = wwidget->base_db_offset - 1; x > wwidget->min_db_draw;
+			 x--) {
+			if (x % 10 == 0) {
+				start_db = x;
+				break;
+			}
+		}
+		
+		if (start_db == 0)
+			start_db = wwidget->base_db_offset;
+
+		for (x = start_db; x > wwidget->min_db_draw; x -= 10) {
+			int py;
+
+			py = (float) wwidget->g_len_y * 
+				(float) ((float) (abs(x) + wwidget->base_db_offset) /
+						 (float) (abs(wwidget->min_db_draw) +
+								  wwidget->base_db_offset));
+
+			if (wwidget->show_dbm_lines) {
+				cairo_set_dash(cr, dash_onoff, 2, 0);
+				/* .5 hack for pixel alignment */
+				cairo_move_to(cr, wwidget->g_start_x, 
+							  wwidget->g_start_y + py + 0.5);
+				cairo_line_to(cr, wwidget->g_end_x, wwidget->g_start_y + py + 0.5);
+				cairo_stroke(cr);
+			}
+
+			if (wwidget->show_dbm) {
+				snprintf(mtext, 128, "%d dBm", x);
+
+				cairo_text_extents(cr, mtext, &extents);
+				cairo_move_to(cr, wwidget->g_start_x - wwidget->dbm_w, 
+							  wwidget->g_start_y + py + (extents.height / 2));
+
+				cairo_show_text(cr, mtext);
+			}
+		}
+	}
+
+	cairo_destroy(cr);
+
+	wwidget->static_base_db = wwidget->base_db_offset;
+	wwidget->static_min_db = wwidget->min_db_draw;
+	wwidget->static_num_samples = wwidget->sweepcache->latest->num_samples;
+	wwidget->static_valid = 1;
+}
+
+void spectool_widget_graphics_update(SpectoolWidget *wwidget) {
+	cairo_text_extents_t extents;
+	cairo_t *offcr;
+	GtkWidget *widget;
 
 	g_return_if_fail(wwidget != NULL);
 	
@@ -696,82 +798,67 @@ void spectool_widget_graphics_update(SpectoolWidget *wwidget) {
 	}
 	offcr = cairo_create(wwidget->offscreen);
 
-	/* Draw all our base stuff into the offscreen cr */
-	cairo_save(offcr);
-	cairo_rectangle(offcr, 0, 0, widget->allocation.width, widget->allocation.height);
-	cairo_set_source_rgb(offcr, HC2CC(0x50), HC2CC(0x50), HC2CC(0x50));
-	cairo_fill(offcr);
-	cairo_stroke(offcr);
-
-	wwidget->g_len_x = widget->allocation.width - (SPECTOOL_WIDGET_PADDING * 2);
-	wwidget->g_len_y = widget->allocation.height - (SPECTOOL_WIDGET_PADDING * 2);
-	wwidget->g_start_x = SPECTOOL_WIDGET_PADDING;
-	wwidget->g_start_y = SPECTOOL_WIDGET_PADDING;
-	wwidget->g_end_x = wwidget->g_start_x + wwidget->g_len_x;
-	wwidget->g_end_y = wwidget->g_start_y + wwidget->g_len_y;
-
-	/* We haven't been initialized so we don't know... anything */
-	if (wwidget->wdr_slot < 0) {
-		cairo_destroy(offcr);
-		return;
-	}
-
-	/* We haven't calibrated, so we don't know our channels, etc */
-	if (wwidget->sweepcache == NULL ||
+	/* We haven't been initialized so we don't know... anything, or we haven't
+	 * calibrated, so we don't know our channels, etc; nothing worth keeping */
+	if (wwidget->wdr_slot < 0 || wwidget->sweepcache == NULL ||
 		(wwidget->sweepcache != NULL && wwidget->sweepcache->pos < 0)) {
-		cairo_set_source_rgb(offcr, HC2CC(0xFF), HC2CC(0xFF), HC2CC(0xFF));
-		cairo_select_font_face(offcr, "Helvetica", 
-							   CAIRO_FONT_SLANT_NORMAL, 
-							   CAIRO_FONT_WEIGHT_BOLD);
-		cairo_set_font_size(offcr, 16);
-		cairo_text_extents(offcr, "Device calibrating...", &extents);
-		cairo_move_to(offcr, wwidget->g_start_x + (wwidget->g_len_x / 2) - 
-					  (extents.width / 2),
-					  wwidget->g_start_y + (wwidget->g_len_y / 2) - 
-					  (extents.height / 2));
-		cairo_show_text(offcr, "Device calibrating...");
+		wwidget->static_valid = 0;
+
+		cairo_rectangle(offcr, 0, 0, widget->allocation.width, 
+						widget->allocation.height);
+		cairo_set_source_rgb(offcr, HC2CC(0x50), HC2CC(0x50), HC2CC(0x50));
+		cairo_fill(offcr);
+
+		wwidget->g_len_x = widget->allocation.width - (SPECTOOL_WIDGET_PADDING * 2);
+		wwidget->g_len_y = widget->allocation.height - (SPECTOOL_WIDGET_PADDING * 2);
+		wwidget->g_start_x = SPECTOOL_WIDGET_PADDING;
+		wwidget->g_start_y = SPECTOOL_WIDGET_PADDING;
+		wwidget->g_end_x = wwidget->g_start_x + wwidget->g_len_x;
+		wwidget->g_end_y = wwidget->g_start_y + wwidget->g_len_y;
+
+		if (wwidget->wdr_slot >= 0) {
+			cairo_set_source_rgb(offcr, HC2CC(0xFF), HC2CC(0xFF), HC2CC(0xFF));
+			cairo_select_font_face(offcr, "Helvetica", 
+								   CAIRO_FONT_SLANT_NORMAL, 
+								   CAIRO_FONT_WEIGHT_BOLD);
+			cairo_set_font_size(offcr, 16);
+			cairo_text_extents(offcr, "Device calibrating...", &extents);
+			cairo_move_to(offcr, wwidget->g_start_x + (wwidget->g_len_x / 2) - 
+						  (extents.width / 2),
+						  wwidget->g_start_y + (wwidget->g_len_y / 2) - 
+						  (extents.height / 2));
+			cairo_show_text(offcr, "Device calibrating...");
+		}
+
 		cairo_destroy(offcr);
 		return;
 	}
 
-	/* Assume we have at most a 3 digit DBM rating, and figure out the scaling.
-	 * We use 000 since they're nice fat digits even with a variable-width font,
-	 * and then we slap another 10% on the result. 
-	 * We re-use the same string for height calcs for the channel list, just
-	 * new size */
+	/* The drawing area can change size under us without the widget itself
+	 * being reallocated */
+	if (wwidget->static_back != NULL &&
+		(cairo_image_surface_get_width(wwidget->static_back) != 
+		 widget->allocation.width ||
+		 cairo_image_surface_get_height(wwidget->static_back) != 
+		 widget->allocation.height))
+		spectool_widget_free_static(wwidget);
+
+	if (wwidget->static_valid && 
+		(wwidget->static_base_db != wwidget->base_db_offset ||
+		 wwidget->static_min_db != wwidget->min_db_draw ||
+		 wwidget->static_num_samples != wwidget->sweepcache->latest->num_samples))
+		wwidget->static_valid = 0;
+
+	if (wwidget->static_valid == 0)
+		spectool_widget_build_static(wwidget);
+
+	/* Static background, then the data over it */
 	cairo_save(offcr);
-	snprintf(mtext, 128, "-000 dBm");
-	cairo_select_font_face(offcr, "Helvetica", 
-						   CAIRO_FONT_SLANT_NORMAL, 
-						   CAIRO_FONT_WEIGHT_BOLD);
-	cairo_set_font_size(offcr, 10);
-	cairo_text_extents(offcr, mtext, &extents);
-	wwidget->dbm_w = extents.width + ((double) extents.width * 0.1);
-	cairo_set_font_size(offcr, 14);
-	cairo_text_extents(offcr, mtext, &extents);
+	cairo_set_source_surface(offcr, wwidget->static_back, 0, 0);
+	cairo_set_operator(offcr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(offcr);
 	cairo_restore(offcr);
 
-	/* Figure out a square scaled to the number of samples we have and
-	 * build the size of the animated graph.  wbar ends up being the 
-	 * width of a sample, so we can use that for all sorts of math later */
-	wwidget->wbar = 
-		(double) (widget->allocation.width - wwidget->dbm_w -
-		 (SPECTOOL_WIDGET_PADDING * 2) - 5) / 
-		(double) (wwidget->sweepcache->latest->num_samples - 1);
-	wwidget->g_len_x = wwidget->wbar * 
-		(wwidget->sweepcache->latest->num_samples - 1);
-	wwidget->g_len_y = widget->allocation.height - (SPECTOOL_WIDGET_PADDING * 2);
-	wwidget->g_start_x = SPECTOOL_WIDGET_PADDING + wwidget->dbm_w;
-	wwidget->g_start_y = SPECTOOL_WIDGET_PADDING;
-	wwidget->g_end_x = wwidget->g_start_x + wwidget->g_len_x;
-	wwidget->g_end_y = wwidget->g_start_y + wwidget->g_len_y;
-
-	cairo_rectangle(offcr, wwidget->g_start_x, wwidget->g_start_y, 
-					wwidget->g_len_x, wwidget->g_len_y);
-	cairo_set_source_rgb(offcr, HC2CC(0x00), HC2CC(0x00), HC2CC(0x00));
-	cairo_fill_preserve(offcr);
-	cairo_stroke(offcr);
-
 	/* Call the second-level draw */
 	if (wwidget->draw_func != NULL)
 		(*(wwidget->draw_func))(widget, offcr, wwidget);
@@ -1029,6 +1116,7 @@ void spectool_widget_context_channels(gpointer *aux) {
 		wwidget->show_channels = 1;
 	}
 
+	spectool_widget_invalidate_static(wwidget);
 	spectool_widget_update(GTK_WIDGET(wwidget));
 }
 
@@ -1046,6 +1134,7 @@ void spectool_widget_context_dbm(gpointer *aux) {
 		wwidget->show_dbm = 1;
 	}
 
+	spectool_widget_invalidate_static(wwidget);
 	spectool_widget_update(GTK_WIDGET(wwidget));
 }
 
@@ -1063,6 +1152,7 @@ void spectool_widget_context_dbmlines(gpointer *aux) {
 		wwidget->show_dbm_lines = 1;
 	}
 
+	spectool_widget_invalidate_static(wwidget);
 	spectool_widget_update(GTK_WIDGET(wwidget));
 }
 
@@ -86,6 +86,7 @@ struct _SpectoolWidget {
 	/* Conversion data */
 	int amp_offset_mdbm;
 	int amp_res_mdbm;
+	spectool_rssi_lut rssi_lut;
 
 	/* Graph elements we've calculated */
 	int g_start_x, g_start_y, g_end_x, g_end_y,
@@ -134,9 +135,18 @@ struct _SpectoolWidget {
 	cairo_surface_t *offscreen;
 	int old_width, old_height;
 
+	/* Cached static layers: the background, graph frame and anything the
+	 * child draws in static_draw_func go under the data, the dBm scale over
+	 * it.  Only redrawn after a resize, a reconfigure or a scale change */
+	cairo_surface_t *static_back, *static_front;
+	int static_valid;
+	int static_base_db, static_min_db, static_num_samples;
+
 	/* Callbacks for drawing */
 	int draw_timeout;
 	void (* draw_func)(GtkWidget *, cairo_t *, SpectoolWidget *);
+	/* Draws into the static layer under the data, once per invalidation */
+	void (* static_draw_func)(GtkWidget *, cairo_t *, SpectoolWidget *);
 
 	/* Callbacks on size change */
 	void (* sizechange_func)(GtkWidget *, GtkAllocation *);
@@ -187,6 +197,9 @@ void spectool_widget_buildgui(SpectoolWidget *widget);
 
 /* Update the backing graphics */
 void spectool_widget_graphics_update(SpectoolWidget *wwidget);
+/* Redraw the static layers on the next graphics update, for when something
+ * they show has changed */
+void spectool_widget_invalidate_static(SpectoolWidget *wwidget);
 
 SpectoolWidgetController *spectool_widget_buildcontroller(GtkWidget *widget);
 
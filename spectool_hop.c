@@ -0,0 +1,214 @@
+/*
+ * Profile hopping scheduler
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spectool_hop.h"
+
+void spectool_hop_init(spectool_hop *h, spectool_phy *phydev, int cache_sweeps) {
+	memset(h, 0, sizeof(spectool_hop));
+
+	h->phydev = phydev;
+	h->cache_sweeps = cache_sweeps > 0 ? cache_sweeps : 1;
+	h->settle = SPECTOOL_HOP_SETTLE;
+}
+
+void spectool_hop_free(spectool_hop *h) {
+	int x;
+
+	for (x = 0; x < h->num_slots; x++) {
+		if (h->slots[x].cache != NULL)
+			spectool_cache_free(h->slots[x].cache);
+
+		h->slots[x].cache = NULL;
+	}
+
+	h->num_slots = 0;
+}
+
+int spectool_hop_add(spectool_hop *h, int profile, int dwell, char *errstr) {
+	spectool_hop_slot *s;
+
+	if (h->num_slots >= SPECTOOL_HOP_MAX_SLOTS) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Hop schedules are limited to %d "
+				 "entries", SPECTOOL_HOP_MAX_SLOTS);
+		return -1;
+	}
+
+	if (profile < 0 ||
+		profile >= (int) h->phydev->device_spec->num_sweep_ranges) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "%s has no profile %d",
+				 spectool_phy_getname(h->phydev), profile);
+		return -1;
+	}
+
+	if (dwell < 1) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Hop dwell must be at least one "
+				 "sweep");
+		return -1;
+	}
+
+	s = &(h->slots[h->num_slots]);
+
+	s->profile = profile;
+	s->dwell = dwell;
+	s->cache = spectool_cache_alloc(h->cache_sweeps, 1, 1);
+	s->visits = 0;
+	s->sweeps = 0;
+
+	h->num_slots++;
+
+	return 1;
+}
+
+int spectool_hop_parse(spectool_hop *h, const char *spec, char *errstr) {
+	char *dup, *ent, *sp;
+	int profile, dwell;
+
+	dup = strdup(spec);
+
+	for (ent = strtok_r(dup, ",", &sp); ent != NULL; ent = strtok_r(NULL, ",", &sp)) {
+		if (sscanf(ent, "%d:%d", &profile, &dwell) != 2) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "Invalid hop entry '%s', "
+					 "expected profile:dwell", ent);
+			free(dup);
+			return -1;
+		}
+
+		if (spectool_hop_add(h, profile, dwell, errstr) < 0) {
+			free(dup);
+			return -1;
+		}
+	}
+
+	free(dup);
+
+	if (h->num_slots == 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Empty hop schedule");
+		return -1;
+	}
+
+	return 1;
+}
+
+/* Ask the device for a slot's profile and start timing the retune */
+static int spectool_hop_tune(spectool_hop *h, int slot, char *errstr) {
+	h->cur = slot;
+	h->dwell_left = h->slots[slot].dwell;
+	h->settle_left = h->settle;
+	h->slots[slot].visits++;
+
+	gettimeofday(&(h->tm_retune), NULL);
+	h->retuning = 1;
+
+	if (spectool_phy_setposition(h->phydev, h->slots[slot].profile, 0, 0) < 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to move %s to profile %d: "
+				 "%s", spectool_phy_getname(h->phydev), h->slots[slot].profile,
+				 spectool_get_error(h->phydev));
+		return -1;
+	}
+
+	return 1;
+}
+
+int spectool_hop_start(spectool_hop *h, char *errstr) {
+	if (h->num_slots == 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Empty hop schedule");
+		return -1;
+	}
+
+	return spectool_hop_tune(h, 0, errstr);
+}
+
+int spectool_hop_sweep(spectool_hop *h, spectool_sample_sweep *sweep, int *slot,
+					   char *errstr) {
+	spectool_hop_slot *s;
+	spectool_sample_sweep *ran;
+	struct timeval now;
+	double ms;
+
+	if (sweep == NULL || h->num_slots == 0)
+		return 0;
+
+	s = &(h->slots[h->cur]);
+	ran = &(h->phydev->device_spec->supported_ranges[s->profile]);
+
+	/* Left over from the last profile */
+	if (h->settle_left > 0 || sweep->num_samples != ran->num_samples ||
+		sweep->start_khz != ran->start_khz) {
+		if (h->settle_left > 0)
+			h->settle_left--;
+
+		h->stats.settled++;
+		return 0;
+	}
+
+	if (h->retuning) {
+		gettimeofday(&now, NULL);
+
+		ms = (double) (now.tv_sec - h->tm_retune.tv_sec) * 1000 +
+			(double) (now.tv_usec - h->tm_retune.tv_usec) / 1000;
+
+		h->retuning = 0;
+
+		h->stats.retunes++;
+		h->stats.last_ms = ms;
+		if (h->stats.retunes == 1 || ms < h->stats.min_ms)
+			h->stats.min_ms = ms;
+		if (ms > h->stats.max_ms)
+			h->stats.max_ms = ms;
+		h->total_ms += ms;
+		h->stats.avg_ms = h->total_ms / h->stats.retunes;
+	}
+
+	spectool_cache_append(s->cache, sweep);
+	s->sweeps++;
+
+	*slot = h->cur;
+
+	/* Done here, move on.  A schedule of one never retunes */
+	if (--h->dwell_left <= 0) {
+		if (h->num_slots == 1) {
+			h->dwell_left = s->dwell;
+		} else if (spectool_hop_tune(h, (h->cur + 1) % h->num_slots, errstr) < 0) {
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
+spectool_hop_slot *spectool_hop_getslot(spectool_hop *h, int slot) {
+	if (slot < 0 || slot >= h->num_slots)
+		return NULL;
+
+	return &(h->slots[slot]);
+}
+
+spectool_sample_sweep *spectool_hop_getprofile(spectool_hop *h, int slot) {
+	if (slot < 0 || slot >= h->num_slots)
+		return NULL;
+
+	return &(h->phydev->device_spec->supported_ranges[h->slots[slot].profile]);
+}
+
+void spectool_hop_getstats(spectool_hop *h, spectool_hop_stats *stats) {
+	*stats = h->stats;
+}
+
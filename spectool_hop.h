@@ -0,0 +1,109 @@
+/*
+ * Profile hopping scheduler
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SPECTOOL_HOP_H__
+#define __SPECTOOL_HOP_H__
+
+#include "config.h"
+
+#include <sys/time.h>
+
+#include "spectool_container.h"
+
+/*
+ * Cycles one device through a list of its profiles, so a single DBx can
+ * watch 2.4 and 5GHz.  Each entry (slot) in the list stays tuned for its
+ * dwell count of sweeps and then the device is moved on to the next one with
+ * spectool_phy_setposition.  Every slot has its own sweep cache, so averages
+ * and peaks never mix bands.
+ *
+ * Reports already queued when the device is retuned still belong to the old
+ * profile, so the first settle sweeps after a retune are thrown away, as is
+ * any sweep which doesn't have the shape of the new profile.  Retune latency
+ * is the time from asking for the new profile to the first sweep kept from
+ * it, which is what a hop actually costs in lost coverage.
+ *
+ * The application still polls the phydev itself and hands every completed
+ * sweep to spectool_hop_sweep.
+ */
+
+#define SPECTOOL_HOP_SETTLE			1
+#define SPECTOOL_HOP_MAX_SLOTS		16
+
+typedef struct _spectool_hop_slot {
+	int profile;
+	int dwell;
+	spectool_sweep_cache *cache;
+
+	/* Times this slot was tuned, and sweeps kept from it */
+	unsigned long visits;
+	unsigned long sweeps;
+} spectool_hop_slot;
+
+typedef struct _spectool_hop_stats {
+	unsigned long retunes;
+	/* Sweeps thrown away settling after a retune */
+	unsigned long settled;
+	/* Retune latency, in milliseconds */
+	double last_ms, min_ms, max_ms, avg_ms;
+} spectool_hop_stats;
+
+typedef struct _spectool_hop {
+	spectool_phy *phydev;
+
+	spectool_hop_slot slots[SPECTOOL_HOP_MAX_SLOTS];
+	int num_slots;
+	int cache_sweeps;
+	int settle;
+
+	/* Slot the device is tuned to, sweeps left before moving on, and sweeps
+	 * still to throw away */
+	int cur;
+	int dwell_left;
+	int settle_left;
+
+	/* When the current slot was asked for; retuning until its first sweep
+	 * is kept */
+	struct timeval tm_retune;
+	int retuning;
+
+	spectool_hop_stats stats;
+	double total_ms;
+} spectool_hop;
+
+/* Set up an empty schedule, keeping cache_sweeps sweeps per slot */
+void spectool_hop_init(spectool_hop *h, spectool_phy *phydev, int cache_sweeps);
+void spectool_hop_free(spectool_hop *h);
+/* Add a profile to the schedule, dwell sweeps at a time */
+int spectool_hop_add(spectool_hop *h, int profile, int dwell, char *errstr);
+/* Add a schedule given as profile:dwell[,profile:dwell...] */
+int spectool_hop_parse(spectool_hop *h, const char *spec, char *errstr);
+/* Tune the device to the first slot */
+int spectool_hop_start(spectool_hop *h, char *errstr);
+/* Hand over a completed sweep.  Returns 1 and sets slot if the sweep was
+ * kept (and added to the slot cache), 0 if it was thrown away, -1 if moving
+ * the device on to the next slot failed.  Drivers may free their sweep when
+ * they're retuned, so read a kept sweep back from the slot cache's latest */
+int spectool_hop_sweep(spectool_hop *h, spectool_sample_sweep *sweep, int *slot,
+					   char *errstr);
+
+/* Slot a kept sweep came from, and its profile */
+spectool_hop_slot *spectool_hop_getslot(spectool_hop *h, int slot);
+spectool_sample_sweep *spectool_hop_getprofile(spectool_hop *h, int slot);
+
+void spectool_hop_getstats(spectool_hop *h, spectool_hop_stats *stats);
+
+#endif
+
@@ -0,0 +1,140 @@
+/* Spectool network protocol
+ *
+ * Sweep block coding shared by the server and client
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "spectool_container.h"
+#include "spectool_net.h"
+
+#define DELTA_AT(x)		(ref == NULL ? src[(x)] : (src[(x)] ^ ref[(x)]))
+
+int spectool_net_delta_encode(uint8_t *dst, const uint8_t *src, 
+							  const uint8_t *ref, int n) {
+	int x = 0, o = 0, run, lit, start;
+
+	while (x < n) {
+		if (DELTA_AT(x) == 0) {
+			run = 1;
+			while (x + run < n && run < 128 && DELTA_AT(x + run) == 0)
+				run++;
+
+			dst[o++] = 0x80 | (run - 1);
+			x += run;
+			continue;
+		}
+
+		start = o++;
+		lit = 0;
+
+		while (x < n && lit < 128) {
+			/* A lone zero is cheaper to carry as a literal than to end the
+			 * literal for */
+			if (DELTA_AT(x) == 0 && (x + 1 >= n || DELTA_AT(x + 1) == 0))
+				break;
+
+			dst[o++] = DELTA_AT(x);
+			x++;
+			lit++;
+		}
+
+		dst[start] = lit - 1;
+	}
+
+	return o;
+}
+
+int spectool_net_delta_decode(uint8_t *dst, const uint8_t *src, int srclen,
+							  const uint8_t *ref, int n) {
+	int x = 0, i = 0, len;
+	uint8_t c;
+
+	while (x < n && i < srclen) {
+		c = src[i++];
+
+		if ((c & 0x80)) {
+			len = (c & 0x7F) + 1;
+
+			if (x + len > n)
+				return -1;
+
+			while (len-- > 0) {
+				dst[x] = ref == NULL ? 0 : ref[x];
+				x++;
+			}
+		} else {
+			len = c + 1;
+
+			if (x + len > n || i + len > srclen)
+				return -1;
+
+			while (len-- > 0) {
+				dst[x] = ref == NULL ? src[i] : (src[i] ^ ref[x]);
+				x++;
+				i++;
+			}
+		}
+	}
+
+	if (x != n)
+		return -1;
+
+	return 0;
+}
+
+int spectool_net_encode_sweep(uint8_t *buf, uint32_t device_id, uint8_t sweep_type,
+							  spectool_sample_sweep *sweep) {
+	spectool_fr_sweep *fsweep = (spectool_fr_sweep *) buf;
+	int len = spectool_fr_sweep_size(sweep->num_samples);
+
+	fsweep->frame_len = htons(len);
+	fsweep->device_id = htonl(device_id);
+
+	fsweep->sweep_type = sweep_type;
+
+	fsweep->start_sec = htonl(sweep->tm_start.tv_sec);
+	fsweep->start_usec = htonl(sweep->tm_start.tv_usec);
+
+	memcpy(fsweep->sample_data, sweep->sample_data, sweep->num_samples);
+
+	return len;
+}
+
+int spectool_net_encode_sweepdelta(uint8_t *buf, uint32_t device_id, 
+								   uint8_t sweep_type, uint16_t key_seq, 
+								   const uint8_t *key, 
+								   spectool_sample_sweep *sweep) {
+	spectool_fr_sweepdelta *dsweep = (spectool_fr_sweepdelta *) buf;
+	int len;
+
+	dsweep->device_id = htonl(device_id);
+	dsweep->sweep_type = sweep_type;
+	dsweep->delta_flags = key == NULL ? SPECTOOL_NET_DELTA_KEYFRAME : 0;
+	dsweep->key_seq = htons(key_seq);
+	dsweep->start_sec = htonl(sweep->tm_start.tv_sec);
+	dsweep->start_usec = htonl(sweep->tm_start.tv_usec);
+	dsweep->num_samples = htons(sweep->num_samples);
+
+	len = spectool_fr_sweepdelta_size(
+		spectool_net_delta_encode(dsweep->delta_data, sweep->sample_data, key,
+								  sweep->num_samples));
+
+	dsweep->frame_len = htons(len);
+
+	return len;
+}
+
@@ -61,10 +61,15 @@
 #define SPECTOOL_NET_FRAME_SWEEP		0x01
 #define SPECTOOL_NET_FRAME_COMMAND		0x02
 #define SPECTOOL_NET_FRAME_MESSAGE		0x03
+#define SPECTOOL_NET_FRAME_SWEEPDELTA	0x04
+#define SPECTOOL_NET_FRAME_STATS		0x05
 
 #define SPECTOOL_NET_SENTINEL			0xDECAFBAD
 
-#define SPECTOOL_NET_PROTO_VERSION		0x01
+#define SPECTOOL_NET_PROTO_VERSION		0x02
+/* Peers which never negotiate a version are treated as v1, and only ever get
+ * plain SWEEP frames */
+#define SPECTOOL_NET_PROTO_VERSION_V1	0x01
 
 #define SPECTOOL_NET_DEFAULT_PORT		30569
 
@@ -94,6 +99,57 @@ typedef struct _spectool_fr_sweep {
 /* Size of a sweep of N samples */
 #define spectool_fr_sweep_size(x)		(sizeof(spectool_fr_sweep) + (x))
 
+/* Delta sweeps (v2).  Sent instead of plain sweeps to clients which 
+ * negotiated v2 with a PROTO command.
+ *
+ * Keyframes carry the sweep itself, and every other block carries the sweep
+ * XOR the last keyframe from that device, identified by key_seq.  Deltas are
+ * taken against the keyframe rather than the previous sweep so that a client
+ * which skips or drops sweeps can still decode the ones it gets.  Blocks 
+ * against a keyframe the client doesn't have are discarded until the next 
+ * keyframe.
+ *
+ * The data is run length coded in tokens:
+ *   0x00-0x7F  N+1 literal bytes follow
+ *   0x80-0xFF  (N & 0x7F)+1 zero bytes
+ */
+#define SPECTOOL_NET_DELTA_KEYFRAME	0x01
+
+typedef struct _spectool_fr_sweepdelta {
+	uint16_t frame_len;
+	uint32_t device_id;
+	uint8_t sweep_type;
+	uint8_t delta_flags;
+	uint16_t key_seq;
+	uint32_t start_sec;
+	uint32_t start_usec;
+	uint16_t num_samples;
+	uint8_t delta_data[0];
+} __attribute__ ((packed)) spectool_fr_sweepdelta;
+/* Size of a delta sweep of N bytes of coded data */
+#define spectool_fr_sweepdelta_size(x)	(sizeof(spectool_fr_sweepdelta) + (x))
+/* Largest coding of N samples */
+#define spectool_net_delta_max(x)		((x) + 2 * (((x) + 127) / 128))
+
+/* Device pipeline counters, sent periodically for each device a client has
+ * enabled.  Counters are the low 32 bits of the server side totals and wrap;
+ * the sweep rate is in thousandths of a sweep per second.  Older clients 
+ * ignore frame types they don't know, so these go to every client */
+typedef struct _spectool_fr_stats {
+	uint16_t frame_len;
+	uint32_t device_id;
+	uint32_t reports;
+	uint32_t requeues;
+	uint32_t overruns;
+	uint32_t short_reports;
+	uint32_t bad_base;
+	uint32_t discarded;
+	uint32_t sweeps;
+	uint32_t sweeps_dropped;
+	uint32_t sweep_rate_milli;
+} __attribute__ ((packed)) spectool_fr_stats;
+#define spectool_fr_stats_size()		(sizeof(spectool_fr_stats))
+
 #define SPECTOOL_NET_DEVTYPE_USB1		0x01
 #define SPECTOOL_NET_DEVTYPE_USB2		0x02
 #define SPECTOOL_NET_DEVTYPE_LASTDEV	0xFF
@@ -143,6 +199,9 @@ typedef struct _spectool_fr_txtmessage {
 #define SPECTOOL_NET_COMMAND_SETSCAN		0x03
 #define SPECTOOL_NET_COMMAND_LOCK			0x04
 #define SPECTOOL_NET_COMMAND_UNLOCK		0x05
+#define SPECTOOL_NET_COMMAND_PROTO			0x06
+#define SPECTOOL_NET_COMMAND_SUBSCRIBE		0x07
+#define SPECTOOL_NET_COMMAND_SETVIEW		0x08
 typedef struct _spectool_fr_command {
 	uint16_t frame_len;
 	uint8_t command_id;
@@ -181,6 +240,41 @@ typedef struct _spectool_fr_command_unlockdev {
 } __attribute__ ((packed)) spectool_fr_command_unlockdev;
 #define spectool_fr_command_unlockdev_size(x)	(sizeof(spectool_fr_command_unlockdev))
 
+typedef struct _spectool_fr_command_proto {
+	uint8_t proto_version;
+} __attribute__ ((packed)) spectool_fr_command_proto;
+#define spectool_fr_command_proto_size(x)	(sizeof(spectool_fr_command_proto))
+
+/* Pick the sweep streams sent for an enabled device.  AVG and PEAK are 
+ * computed by the server over the last window_sweeps sweeps and sent as 
+ * plain SWEEP blocks of that sweep_type at most every interval_ms.  CUR is 
+ * the normal stream, on when the device is enabled; its window and interval
+ * are ignored.  An interval_ms of 0 turns a stream off. */
+typedef struct _spectool_fr_command_subscribe {
+	uint32_t device_id;
+	uint8_t sweep_type;
+	uint16_t window_sweeps;
+	uint32_t interval_ms;
+} __attribute__ ((packed)) spectool_fr_command_subscribe;
+#define spectool_fr_command_subscribe_size(x)	(sizeof(spectool_fr_command_subscribe))
+
+/* Cut the sweeps sent for an enabled device down to start_khz - end_khz,
+ * and down to at most num_bins bins by taking the max or mean of each run of
+ * neighbouring bins.  0 for the start and end means the whole sweep, and 0
+ * bins the native resolution; all three 0 clears the view.  The server 
+ * answers with a device block giving the resulting start, resolution, and
+ * sample count, and clients with a view get plain (not delta) sweeps */
+#define SPECTOOL_NET_VIEW_MAX			0x00
+#define SPECTOOL_NET_VIEW_MEAN			0x01
+typedef struct _spectool_fr_command_setview {
+	uint32_t device_id;
+	uint32_t start_khz;
+	uint32_t end_khz;
+	uint16_t num_bins;
+	uint8_t reduce;
+} __attribute__ ((packed)) spectool_fr_command_setview;
+#define spectool_fr_command_setview_size(x)	(sizeof(spectool_fr_command_setview))
+
 typedef struct _spectool_fr_broadcast {
 	uint32_t sentinel;
 	uint8_t version;
@@ -190,5 +284,28 @@ typedef struct _spectool_fr_broadcast {
 struct _spectool_server;
 int spectool_netcli_writepoll(struct _spectool_server *sr, char *errstr);
 
+/* Code n samples of src XOR ref (or src alone if ref is NULL) into dst, which
+ * must hold spectool_net_delta_max(n) bytes.  Returns the coded length */
+int spectool_net_delta_encode(uint8_t *dst, const uint8_t *src, 
+							  const uint8_t *ref, int n);
+/* Decode srclen bytes of coded data into n samples, XORing against ref if 
+ * it isn't NULL.  Returns -1 if the data doesn't decode to exactly n 
+ * samples */
+int spectool_net_delta_decode(uint8_t *dst, const uint8_t *src, int srclen,
+							  const uint8_t *ref, int n);
+
+struct _spectool_sample_sweep;
+/* Build a sweep block in buf, which must hold spectool_fr_sweep_size of the
+ * sweep.  Returns the block length */
+int spectool_net_encode_sweep(uint8_t *buf, uint32_t device_id, uint8_t sweep_type,
+							  struct _spectool_sample_sweep *sweep);
+/* Build a delta sweep block in buf against the keyframe key, or a keyframe
+ * if key is NULL.  buf must hold spectool_fr_sweepdelta_size of 
+ * spectool_net_delta_max of the sweep.  Returns the block length */
+int spectool_net_encode_sweepdelta(uint8_t *buf, uint32_t device_id, 
+								   uint8_t sweep_type, uint16_t key_seq, 
+								   const uint8_t *key, 
+								   struct _spectool_sample_sweep *sweep);
+
 #endif
 
@@ -15,6 +15,7 @@
 
 #include "config.h"
 #include "spectool_net_client.h"
+#include "spectool_simd.h"
 
 int spectool_netcli_init(spectool_server *sr, char *url, char *errstr) {
 	int ret;
@@ -29,7 +30,7 @@ int spectool_netcli_init(spectool_server *sr, char *url, char *errstr) {
 	sr->bufferwrite = 1;
 
 	memset(sr->wbuf, 0, CLI_BUF_SZ);
-	memset(sr->rbuf, 0, CLI_BUF_SZ);
+	memset(sr->rbuf, 0, CLI_RBUF_SZ);
 
 	sr->write_pos = 0;
 	sr->read_pos = 0;
@@ -112,6 +113,12 @@ int spectool_netcli_connect(spectool_server *sr, char *errstr) {
 
 	sr->state = SPECTOOL_NET_STATE_CONNECTED;
 
+	if (spectool_netcli_sendproto(sr, errstr) < 0) {
+		close(sr->sock);
+		sr->state = SPECTOOL_NET_STATE_ERROR;
+		return -1;
+	}
+
 	return 1;
 }
 
@@ -120,6 +127,8 @@ int spectool_netcli_close(spectool_server *sr) {
 
 	while (sr->devlist != NULL) {
 		di = sr->devlist->next;
+		if (sr->devlist->key_data != NULL)
+			free(sr->devlist->key_data);
 		free(sr->devlist);
 		sr->devlist = di;
 	}
@@ -184,8 +193,9 @@ int spectool_netcli_poll(spectool_server *sr, char *errstr) {
 			return 0;
 		}
 
+		/* Wait for the rest of the frame */
 		if (ntohs(header->frame_len) > (sr->read_fill - sr->read_pos)) {
-			return 0;
+			break;
 		}
 
 		sr->read_pos += ntohs(header->frame_len);
@@ -214,12 +224,40 @@ int spectool_netcli_poll(spectool_server *sr, char *errstr) {
 			if (res > 0) {
 				ret |= SPECTOOL_NETCLI_POLL_NEWSWEEPS;
 			}
+		} else if (header->block_type == SPECTOOL_NET_FRAME_SWEEPDELTA) {
+			if ((res = spectool_netcli_block_sweepdelta(sr, header, errstr)) < 0) {
+				return -1;
+			}
+
+			if (res > 0) {
+				ret |= SPECTOOL_NETCLI_POLL_NEWSWEEPS;
+			}
+		} else if (header->block_type == SPECTOOL_NET_FRAME_STATS) {
+			if ((res = spectool_netcli_block_stats(sr, header, errstr)) < 0) {
+				return -1;
+			}
+
+			if (res > 0) {
+				ret |= SPECTOOL_NETCLI_POLL_NEWSTATS;
+			}
 		}
 	}
 
+	/* Slide a partial frame down to the start of the buffer so it has room
+	 * to complete, and throw out a frame which can never fit */
+	if (sr->read_pos > 0 && sr->read_pos < sr->read_fill) {
+		memmove(sr->rbuf, &(sr->rbuf[sr->read_pos]), 
+				sr->read_fill - sr->read_pos);
+		sr->read_fill -= sr->read_pos;
+		sr->read_pos = 0;
+	} else if (sr->read_fill >= CLI_RBUF_SZ) {
+		sr->read_fill = 0;
+		sr->read_pos = 0;
+	}
+
 	/* Read as much as we can */
 	if ((res = read(sr->sock, &(sr->rbuf[sr->read_fill]),
-					CLI_BUF_SZ - sr->read_fill)) <= 0) {
+					CLI_RBUF_SZ - sr->read_fill)) <= 0) {
 		if (errno == EAGAIN)
 			return ret;
 
@@ -262,10 +300,11 @@ int spectool_netcli_block_netdev(spectool_server *sr, spectool_fr_header *header
 								 char *errstr) {
 	spectool_fr_device *dev;
 	spectool_net_dev *sni;
+	spectool_sample_sweep *ran;
 	int bsize = ntohs(header->frame_len) - spectool_fr_header_size();
 
 	int num_devices;
-	int x;
+	int x, changed;
 
 	num_devices = header->num_blocks;
 
@@ -297,6 +336,10 @@ int spectool_netcli_block_netdev(spectool_server *sr, spectool_fr_header *header
 		if (sni == NULL) {
 			sni = (spectool_net_dev *) malloc(sizeof(spectool_net_dev));
 			sni->phydev = NULL;
+			sni->key_data = NULL;
+			sni->key_seq = 0;
+			sni->key_valid = 0;
+			sni->stats_valid = 0;
 			sni->next = sr->devlist;
 			sr->devlist = sni;
 		}
@@ -316,22 +359,95 @@ int spectool_netcli_block_netdev(spectool_server *sr, spectool_fr_header *header
 		sni->def_res_hz = ntohl(dev->def_res_hz);
 		sni->def_num_samples = ntohs(dev->def_num_samples);
 
+		changed = (sni->start_khz != ntohl(dev->start_khz) ||
+				   sni->res_hz != ntohl(dev->res_hz) ||
+				   sni->num_samples != ntohs(dev->num_samples));
+
 		sni->start_khz = ntohl(dev->start_khz);
 		sni->res_hz = ntohl(dev->res_hz);
+
+		/* A keyframe of the old size is no use */
+		if (sni->num_samples != ntohs(dev->num_samples))
+			sni->key_valid = 0;
 		sni->num_samples = ntohs(dev->num_samples);
+
+		/* An enabled device whose sweeps changed shape (ie from a view) gets
+		 * reconfigured, so the next poll tells the app */
+		if (changed && sni->phydev != NULL) {
+			ran = &(sni->phydev->device_spec->supported_ranges[0]);
+
+			ran->start_khz = sni->start_khz;
+			ran->res_hz = sni->res_hz;
+			ran->num_samples = sni->num_samples;
+			ran->end_khz = ((sni->res_hz / 1000) * sni->num_samples) + sni->start_khz;
+
+			sni->phydev->state = SPECTOOL_STATE_CONFIGURING;
+			write(((spectool_net_dev_aux *) (sni->phydev->auxptr))->spipe[1], "0", 1);
+		}
 	}
 
 	return 0;
 }
 
+/* Hand a decoded sweep to the phydev linked to a network device */
+void spectool_netcli_post_sweep(spectool_net_dev *sni, int sweep_type,
+								unsigned int start_sec, unsigned int start_usec, 
+								uint8_t *data) {
+	spectool_sample_sweep *auxsweep;
+
+	if ((auxsweep = ((spectool_net_dev_aux *) (sni->phydev->auxptr))->sweep) != NULL) {
+		free(auxsweep);
+	}
+
+	auxsweep = 
+		(spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(sni->num_samples));
+
+	/* Copy data out of our device record (this will change later when the
+	 * spectool internals change) */
+	auxsweep->start_khz = sni->start_khz;
+	auxsweep->res_hz = sni->res_hz;
+	auxsweep->num_samples = sni->num_samples;
+	auxsweep->end_khz =
+		((auxsweep->res_hz / 1000) * auxsweep->num_samples) +
+		auxsweep->start_khz;
+
+	auxsweep->amp_offset_mdbm = sni->amp_offset_mdbm;
+	auxsweep->amp_res_mdbm = sni->amp_res_mdbm;
+	auxsweep->rssi_max = sni->rssi_max;
+
+	/* Lock start and end to the same */
+	auxsweep->tm_start.tv_sec =
+		auxsweep->tm_end.tv_sec =
+		start_sec;
+	auxsweep->tm_start.tv_usec =
+		auxsweep->tm_end.tv_usec =
+		start_usec;
+
+	/* Copy the RSSI data */
+	memcpy(auxsweep->sample_data, data, sni->num_samples);
+
+	sni->phydev->min_rssi_seen =
+		spectool_simd_min_u8(auxsweep->sample_data, sni->num_samples,
+							 sni->phydev->min_rssi_seen);
+
+	auxsweep->min_rssi_seen = sni->phydev->min_rssi_seen;
+
+	auxsweep->phydev = sni->phydev;
+
+	/* Flag that we got a new frame */
+	((spectool_net_dev_aux *) (sni->phydev->auxptr))->new_sweep = 1;
+	((spectool_net_dev_aux *) (sni->phydev->auxptr))->sweep = auxsweep;
+	((spectool_net_dev_aux *) (sni->phydev->auxptr))->sweep_type = sweep_type;
+	write(((spectool_net_dev_aux *) (sni->phydev->auxptr))->spipe[1], "0", 1);
+}
+
 int spectool_netcli_block_sweep(spectool_server *sr, spectool_fr_header *header,
 								char *errstr) {
 	spectool_fr_sweep *sweep;
-	int x, y;
+	int x;
 	int bsize = ntohs(header->frame_len) - spectool_fr_header_size();
 	int pos = 0;
 	spectool_net_dev *sni;
-	spectool_sample_sweep *auxsweep;
 
 	for (x = 0; x < header->num_blocks; x++) {
 		sweep = (spectool_fr_sweep *) &(header->data[pos]);
@@ -380,52 +496,240 @@ int spectool_netcli_block_sweep(spectool_server *sr, spectool_fr_header *header,
 		if (sni->phydev == NULL)
 			continue;
 
-		if ((auxsweep = ((spectool_net_dev_aux *) (sni->phydev->auxptr))->sweep) != NULL) {
-			free(auxsweep);
+		spectool_netcli_post_sweep(sni, sweep->sweep_type, ntohl(sweep->start_sec), 
+								   ntohl(sweep->start_usec), sweep->sample_data);
+	}
+
+	return 1;
+}
+
+int spectool_netcli_block_sweepdelta(spectool_server *sr, 
+									 spectool_fr_header *header, char *errstr) {
+	spectool_fr_sweepdelta *dsweep;
+	int x;
+	int bsize = ntohs(header->frame_len) - spectool_fr_header_size();
+	int pos = 0, flen;
+	spectool_net_dev *sni;
+	uint8_t *samples;
+
+	for (x = 0; x < header->num_blocks; x++) {
+		dsweep = (spectool_fr_sweepdelta *) &(header->data[pos]);
+
+		if (bsize - pos < spectool_fr_sweepdelta_size(0)) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "Got runt delta sweep frame, bailing");
+			return -1;
+		}
+
+		flen = ntohs(dsweep->frame_len);
+
+		if (flen < spectool_fr_sweepdelta_size(0) || flen > bsize - pos) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "Got delta sweep frame with "
+					 "invalid length %d, bailing", flen);
+			return -1;
 		}
 
-		auxsweep = 
-			(spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(sni->num_samples));
-
-		/* Copy data out of our device record (this will change later when the
-		 * spectool internals change) */
-		auxsweep->start_khz = sni->start_khz;
-		auxsweep->res_hz = sni->res_hz;
-		auxsweep->num_samples = sni->num_samples;
-		auxsweep->end_khz =
-			((auxsweep->res_hz / 1000) * auxsweep->num_samples) +
-			auxsweep->start_khz;
-
-		auxsweep->amp_offset_mdbm = sni->amp_offset_mdbm;
-		auxsweep->amp_res_mdbm = sni->amp_res_mdbm;
-		auxsweep->rssi_max = sni->rssi_max;
-
-		/* Lock start and end to the same */
-		auxsweep->tm_start.tv_sec =
-			auxsweep->tm_end.tv_sec =
-			ntohl(sweep->start_sec);
-		auxsweep->tm_start.tv_usec =
-			auxsweep->tm_end.tv_usec =
-			ntohl(sweep->start_usec);
-
-		/* Copy the RSSI data */
-		for (y = 0; y < sni->num_samples; y++) {
-			auxsweep->sample_data[y] = sweep->sample_data[y];
-
-			if (sni->phydev->min_rssi_seen > sweep->sample_data[y])
-				sni->phydev->min_rssi_seen = sweep->sample_data[y];
+		pos += flen;
+
+		sni = sr->devlist;
+		while (sni != NULL) {
+			if (ntohl(dsweep->device_id) == sni->device_id)
+				break;
+
+			sni = sni->next;
+		}
+
+		if (sni == NULL) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "Got sweep frame for device which "
+					 "was not advertised, discarding");
+			return -1;
+		}
+
+		if (ntohs(dsweep->num_samples) != sni->num_samples) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "Got delta sweep frame with %u "
+					 "samples for a device with %u, bailing", 
+					 ntohs(dsweep->num_samples), sni->num_samples);
+			return -1;
+		}
+
+		if (sni->phydev == NULL)
+			continue;
+
+		if ((dsweep->delta_flags & SPECTOOL_NET_DELTA_KEYFRAME)) {
+			if (sni->key_data != NULL)
+				free(sni->key_data);
+			sni->key_data = (uint8_t *) malloc(sni->num_samples);
+			sni->key_valid = 0;
+
+			if (spectool_net_delta_decode(sni->key_data, dsweep->delta_data,
+										  flen - spectool_fr_sweepdelta_size(0),
+										  NULL, sni->num_samples) < 0) {
+				snprintf(errstr, SPECTOOL_ERROR_MAX, "Got corrupt delta keyframe, "
+						 "bailing");
+				return -1;
+			}
+
+			sni->key_seq = ntohs(dsweep->key_seq);
+			sni->key_valid = 1;
+
+			spectool_netcli_post_sweep(sni, dsweep->sweep_type, 
+									   ntohl(dsweep->start_sec),
+									   ntohl(dsweep->start_usec), sni->key_data);
+			continue;
+		}
+
+		/* We missed the keyframe this is against, wait for the next one */
+		if (sni->key_valid == 0 || sni->key_seq != ntohs(dsweep->key_seq))
+			continue;
+
+		samples = (uint8_t *) malloc(sni->num_samples);
+
+		if (spectool_net_delta_decode(samples, dsweep->delta_data,
+									  flen - spectool_fr_sweepdelta_size(0),
+									  sni->key_data, sni->num_samples) < 0) {
+			free(samples);
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "Got corrupt delta sweep, bailing");
+			return -1;
+		}
+
+		spectool_netcli_post_sweep(sni, dsweep->sweep_type, 
+								   ntohl(dsweep->start_sec),
+								   ntohl(dsweep->start_usec), samples);
+
+		free(samples);
+	}
+
+	return 1;
+}
+
+int spectool_netcli_block_stats(spectool_server *sr, spectool_fr_header *header,
+								char *errstr) {
+	spectool_fr_stats *st;
+	int x;
+	int bsize = ntohs(header->frame_len) - spectool_fr_header_size();
+	int pos = 0, ret = 0;
+	spectool_net_dev *sni;
+
+	for (x = 0; x < header->num_blocks; x++) {
+		st = (spectool_fr_stats *) &(header->data[pos]);
+
+		if (bsize - pos < 2 || ntohs(st->frame_len) < spectool_fr_stats_size() ||
+			bsize - pos < ntohs(st->frame_len)) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "Got runt stats frame, bailing");
+			return -1;
+		}
+
+		pos += ntohs(st->frame_len);
+
+		/* Counters are only advisory, don't fail on a device we don't know */
+		sni = sr->devlist;
+		while (sni != NULL) {
+			if (ntohl(st->device_id) == sni->device_id)
+				break;
+
+			sni = sni->next;
 		}
 
-		auxsweep->min_rssi_seen = sni->phydev->min_rssi_seen;
+		if (sni == NULL)
+			continue;
+
+		sni->stats.reports = ntohl(st->reports);
+		sni->stats.requeues = ntohl(st->requeues);
+		sni->stats.overruns = ntohl(st->overruns);
+		sni->stats.short_reports = ntohl(st->short_reports);
+		sni->stats.bad_base = ntohl(st->bad_base);
+		sni->stats.discarded = ntohl(st->discarded);
+		sni->stats.sweeps = ntohl(st->sweeps);
+		sni->stats.sweeps_dropped = ntohl(st->sweeps_dropped);
+		sni->stats.sweep_rate = (double) ntohl(st->sweep_rate_milli) / 1000;
+		sni->stats_valid = 1;
+
+		ret = 1;
+	}
+
+	return ret;
+}
+
+int spectool_netcli_subscribe(spectool_server *sr, spectool_phy *dev, int sweep_type,
+							  int window, int interval_ms, char *errstr) {
+	spectool_fr_header *header;
+	spectool_fr_command *cmd;
+	spectool_fr_command_subscribe *cmds;
+	int sz;
+
+	sz = spectool_fr_header_size() +
+		spectool_fr_command_size(spectool_fr_command_subscribe_size(0));
 
-		auxsweep->phydev = sni->phydev;
+	header = (spectool_fr_header *) malloc(sz);
+
+	cmd = (spectool_fr_command *) header->data;
+	cmds = (spectool_fr_command_subscribe *) cmd->command_data;
+
+	header->sentinel = htonl(SPECTOOL_NET_SENTINEL);
+	header->frame_len = htons(sz);
+	header->proto_version = SPECTOOL_NET_PROTO_VERSION;
+	header->block_type = SPECTOOL_NET_FRAME_COMMAND;
+	header->num_blocks = 1;
 
-		/* Flag that we got a new frame */
-		((spectool_net_dev_aux *) (sni->phydev->auxptr))->new_sweep = 1;
-		((spectool_net_dev_aux *) (sni->phydev->auxptr))->sweep = auxsweep;
-		write(((spectool_net_dev_aux *) (sni->phydev->auxptr))->spipe[1], "0", 1);
+	cmd->frame_len = 
+		htons(spectool_fr_command_size(spectool_fr_command_subscribe_size(0)));
+	cmd->command_id = SPECTOOL_NET_COMMAND_SUBSCRIBE;
+	cmd->command_len = htons(spectool_fr_command_subscribe_size(0));
+
+	cmds->device_id = htonl(spectool_phy_getdevid(dev));
+	cmds->sweep_type = sweep_type;
+	cmds->window_sweeps = htons(window);
+	cmds->interval_ms = htonl(interval_ms);
+
+	if (spectool_netcli_append(sr, (uint8_t *) header, sz, errstr) < 0) {
+		free(header);
+		return -1;
 	}
 
+	free(header);
+
+	return 1;
+}
+
+int spectool_netcli_setview(spectool_server *sr, spectool_phy *dev, 
+							unsigned int start_khz, unsigned int end_khz, 
+							int num_bins, int reduce, char *errstr) {
+	spectool_fr_header *header;
+	spectool_fr_command *cmd;
+	spectool_fr_command_setview *cmdv;
+	int sz;
+
+	sz = spectool_fr_header_size() +
+		spectool_fr_command_size(spectool_fr_command_setview_size(0));
+
+	header = (spectool_fr_header *) malloc(sz);
+
+	cmd = (spectool_fr_command *) header->data;
+	cmdv = (spectool_fr_command_setview *) cmd->command_data;
+
+	header->sentinel = htonl(SPECTOOL_NET_SENTINEL);
+	header->frame_len = htons(sz);
+	header->proto_version = SPECTOOL_NET_PROTO_VERSION;
+	header->block_type = SPECTOOL_NET_FRAME_COMMAND;
+	header->num_blocks = 1;
+
+	cmd->frame_len = 
+		htons(spectool_fr_command_size(spectool_fr_command_setview_size(0)));
+	cmd->command_id = SPECTOOL_NET_COMMAND_SETVIEW;
+	cmd->command_len = htons(spectool_fr_command_setview_size(0));
+
+	cmdv->device_id = htonl(spectool_phy_getdevid(dev));
+	cmdv->start_khz = htonl(start_khz);
+	cmdv->end_khz = htonl(end_khz);
+	cmdv->num_bins = htons(num_bins);
+	cmdv->reduce = reduce;
+
+	if (spectool_netcli_append(sr, (uint8_t *) header, sz, errstr) < 0) {
+		free(header);
+		return -1;
+	}
+
+	free(header);
+
 	return 1;
 }
 
@@ -452,6 +756,43 @@ int spectool_netcli_append(spectool_server *sr, uint8_t *data, int len, char *er
 	return 1;
 }
 
+int spectool_netcli_sendproto(spectool_server *sr, char *errstr) {
+	spectool_fr_header *header;
+	spectool_fr_command *cmd;
+	spectool_fr_command_proto *cmdp;
+	int sz;
+
+	sz = spectool_fr_header_size() +
+		spectool_fr_command_size(spectool_fr_command_proto_size(0));
+
+	header = (spectool_fr_header *) malloc(sz);
+										
+	cmd = (spectool_fr_command *) header->data;
+	cmdp = (spectool_fr_command_proto *) cmd->command_data;
+
+	header->sentinel = htonl(SPECTOOL_NET_SENTINEL);
+	header->frame_len = htons(sz);
+	header->proto_version = SPECTOOL_NET_PROTO_VERSION;
+	header->block_type = SPECTOOL_NET_FRAME_COMMAND;
+	header->num_blocks = 1;
+
+	cmd->frame_len = 
+		htons(spectool_fr_command_size(spectool_fr_command_proto_size(0)));
+	cmd->command_id = SPECTOOL_NET_COMMAND_PROTO;
+	cmd->command_len = htons(spectool_fr_command_proto_size(0));
+
+	cmdp->proto_version = SPECTOOL_NET_PROTO_VERSION;
+
+	if (spectool_netcli_append(sr, (uint8_t *) header, sz, errstr) < 0) {
+		free(header);
+		return -1;
+	}
+
+	free(header);
+
+	return 1;
+}
+
 spectool_phy *spectool_netcli_enabledev(spectool_server *sr, unsigned int dev_id,
 									 char *errstr) {
 	spectool_phy *phyret;
@@ -511,7 +852,10 @@ spectool_phy *spectool_netcli_enabledev(spectool_server *sr, unsigned int dev_id
 	aux = (spectool_net_dev_aux *) malloc(sizeof(spectool_net_dev_aux));
 	phyret->auxptr = aux;
 
+	aux->server = sr;
+	aux->netdev = sni;
 	aux->sweep = NULL;
+	aux->sweep_type = SPECTOOL_NET_SWEEPTYPE_CUR;
 	aux->new_sweep = 0;
 
 	pipe(aux->spipe);
@@ -521,6 +865,7 @@ spectool_phy *spectool_netcli_enabledev(spectool_server *sr, unsigned int dev_id
 
 	phyret->state = SPECTOOL_STATE_CONFIGURING;
 	phyret->min_rssi_seen = -1;
+	spectool_phy_clearstats(phyret);
 
 	phyret->device_spec->device_id = sni->device_id;
 	phyret->device_spec->device_version = sni->device_version;
@@ -667,6 +1012,21 @@ spectool_sample_sweep *spectool_net_getsweep(spectool_phy *phydev) {
 	return ((spectool_net_dev_aux *) phydev->auxptr)->sweep;
 }
 
+int spectool_net_getsweeptype(spectool_phy *phydev) {
+	return ((spectool_net_dev_aux *) phydev->auxptr)->sweep_type;
+}
+
+int spectool_net_getremotestats(spectool_phy *phydev, spectool_phy_stats *stats) {
+	spectool_net_dev *sni = ((spectool_net_dev_aux *) phydev->auxptr)->netdev;
+
+	if (sni == NULL || sni->stats_valid == 0)
+		return -1;
+
+	*stats = sni->stats;
+
+	return 1;
+}
+
 int spectool_net_setposition(spectool_phy *phydev, int in_profile, 
 							 int start_khz, int res_hz) {
 	/* todo - fill this in */
@@ -35,6 +35,9 @@
 #include "spectool_net.h"
 
 #define CLI_BUF_SZ				16384
+/* The read buffer holds the largest frame a server can send; frame_len is 16
+ * bits */
+#define CLI_RBUF_SZ				65536
 
 #define SPECTOOL_NETCLI_URL_MAX	300
 
@@ -64,6 +67,15 @@ typedef struct _spectool_net_dev {
 	/* Local attributes if we're an activated device */
 	spectool_phy *phydev;
 
+	/* Last delta keyframe we got */
+	uint8_t *key_data;
+	unsigned int key_seq;
+	int key_valid;
+
+	/* Server side pipeline counters from the last STATS frame */
+	spectool_phy_stats stats;
+	int stats_valid;
+
 	struct _spectool_net_dev *next;
 } spectool_net_dev;
 
@@ -93,6 +105,7 @@ typedef struct _spectool_net_dev_aux {
 	struct _spectool_server *server;
 	spectool_net_dev *netdev;
 	spectool_sample_sweep *sweep;
+	int sweep_type;
 	int new_sweep;
 	int spipe[2];
 } spectool_net_dev_aux;
@@ -113,7 +126,7 @@ typedef struct _spectool_server {
 	int bufferwrite;
 
 	uint8_t wbuf[CLI_BUF_SZ];
-	uint8_t rbuf[CLI_BUF_SZ];
+	uint8_t rbuf[CLI_RBUF_SZ];
 
 	int write_pos, read_pos, write_fill, read_fill;
 
@@ -139,6 +152,19 @@ int spectool_netcli_poll(spectool_server *sr, char *errstr);
 spectool_phy *spectool_netcli_enabledev(spectool_server *sr, unsigned int dev_id,
 									 char *errstr);
 int spectool_netcli_disabledev(spectool_server *sr, spectool_phy *dev);
+/* Pick the sweep streams the server sends for an enabled device: the 
+ * server side average or peak (SPECTOOL_NET_SWEEPTYPE_AVG/PEAK) of the last
+ * window sweeps, at most every interval_ms, or with SWEEPTYPE_CUR the 
+ * normal sweeps.  interval_ms 0 turns a stream off */
+int spectool_netcli_subscribe(spectool_server *sr, spectool_phy *dev, int sweep_type,
+							  int window, int interval_ms, char *errstr);
+/* Have the server cut an enabled device's sweeps down to start_khz - end_khz
+ * and at most num_bins bins (SPECTOOL_NET_VIEW_MAX/MEAN of merged bins).  0 
+ * leaves that part alone, all 0 clears the view.  The device reports 
+ * SPECTOOL_POLL_CONFIGURED again once the server has answered */
+int spectool_netcli_setview(spectool_server *sr, spectool_phy *dev, 
+							unsigned int start_khz, unsigned int end_khz, 
+							int num_bins, int reduce, char *errstr);
 
 /* Initialize a broadcast listening socket, retval is the socket */
 int spectool_netcli_initbroadcast(short int port, char *errstr);
@@ -154,15 +180,27 @@ int spectool_netcli_pollbroadcast(int sock, char *ret_url, char *errstr);
 #define SPECTOOL_NETCLI_POLL_ADDITIONAL		2
 /* sweep data has been read, devices should be checked */
 #define SPECTOOL_NETCLI_POLL_NEWSWEEPS		4
+/* device counters have been updated */
+#define SPECTOOL_NETCLI_POLL_NEWSTATS		8
 
 /* Parsers */
 int spectool_netcli_block_netdev(spectool_server *sr, spectool_fr_header *header,
 								 char *errstr);
 int spectool_netcli_block_sweep(spectool_server *sr, spectool_fr_header *header,
 								char *errstr);
+int spectool_netcli_block_sweepdelta(spectool_server *sr, 
+									 spectool_fr_header *header, char *errstr);
+int spectool_netcli_block_stats(spectool_server *sr, spectool_fr_header *header,
+								char *errstr);
+void spectool_netcli_post_sweep(spectool_net_dev *sni, int sweep_type,
+								unsigned int start_sec, unsigned int start_usec, 
+								uint8_t *data);
 /* Block management */
 int spectool_netcli_append(spectool_server *sr, uint8_t *data, 
 						   int len, char *errstr);
+/* Ask for the newest protocol we speak; servers which don't know the 
+ * command ignore it and stay at v1 */
+int spectool_netcli_sendproto(spectool_server *sr, char *errstr);
 
 /* Phydev hooks */
 void spectool_net_setcalibration(spectool_phy *phydev, int in_calib);
@@ -174,6 +212,11 @@ spectool_sample_sweep *spectool_net_getsweep(spectool_phy *phydev);
 int spectool_net_setposition(spectool_phy *phydev, int profilenum, int start_khz, 
 							 int res_hz);
 spectool_sample_sweep *spectool_net_getsweep(spectool_phy *phydev);
+/* SPECTOOL_NET_SWEEPTYPE_* of the sweep getsweep returns */
+int spectool_net_getsweeptype(spectool_phy *phydev);
+/* Pipeline counters of the device on the server, which the phydev's own 
+ * counters don't see.  Returns -1 until the server has sent any */
+int spectool_net_getremotestats(spectool_phy *phydev, spectool_phy_stats *stats);
 
 #endif
 
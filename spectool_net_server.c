@@ -23,6 +23,7 @@
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <unistd.h>
@@ -37,36 +38,218 @@
 #include "spectool_container.h"
 #include "spectool_net.h"
 
-/* Size of the client buffer - a packet should never be this large since
+/* Use epoll and a timerfd for the event loop when the system has them,
+ * otherwise fall back to select */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#define WTS_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+/* Size of the client read buffer - a packet should never be this large since
  * it would fragment all over, so this should be fine */
 #define CLI_BUF_SZ		2048
 
+/* Outbound frames queued per client, and the most bytes we'll let back up
+ * behind a slow client */
+#define CLI_WQUEUE_LEN	256
+#define CLI_WQUEUE_SZ	65536
+
+/* Most frames handed to a single writev() */
+#define WTS_IOV_MAX		64
+
+/* Encoded frames we keep around for reuse instead of freeing */
+#define WTS_FRAME_POOL	64
+
+/* Largest frame we can send; frame_len is 16 bits */
+#define WTS_FRAME_MAX	65535
+
+/* What to do with sweeps for a client which isn't keeping up.  Control 
+ * frames are never dropped.
+ *  DROPOLDEST - when the queue is full, throw out the oldest unsent sweeps
+ *  LATEST     - only ever queue the newest sweep from each device
+ *  DECIMATE   - only queue N sweeps a second from each device
+ */
+#define WTS_POLICY_DROPOLDEST	0
+#define WTS_POLICY_LATEST		1
+#define WTS_POLICY_DECIMATE		2
+
+/* Sweeps are batched into multi-block frames.  A batch goes out before its 
+ * frame would grow past WTS_BATCH_SZ bytes, once every device has added a 
+ * sweep, when a device sweeps a second time, or WTS_BATCH_USEC after the 
+ * first sweep was added.  WTS_BATCH_SZ keeps frames well inside the 16k 
+ * client read buffer, which older clients never compact; a sweep bigger than
+ * it is batched alone.  WTS_BATCH_BUF holds the plain and delta encodings
+ * clients asked for; a sweep whose encodings don't fit skips batching and 
+ * goes out plain in a frame of its own, as every sweep did before batching.
+ * WTS_BATCH_MAX fits both num_blocks and the per-client block masks. */
+#define WTS_BATCH_MAX		32
+#define WTS_BATCH_SZ		4096
+#define WTS_BATCH_BUF		16384
+#define WTS_BATCH_USEC		5000
+/* Distinct encodings of a batch kept while handing it out to clients */
+#define WTS_BATCH_CACHE		8
+
+/* Sweeps between delta keyframes for v2 clients */
+#define WTS_DELTA_KEYINT	16
+
+/* Seconds between device STATS frames */
+#define WTS_STATS_SECS		1
+
+/* Limits on AVG and PEAK subscriptions; the window bounds the memory an 
+ * aggregate takes, the interval how often a client can ask for one */
+#define WTS_AGG_WINDOW_MAX		1024
+#define WTS_AGG_INTERVAL_MIN	10
+#define WTS_AGG_TYPES			2
+
+/* An encoded frame.  Frames are built once and queued by reference on every
+ * client they go to, and return to the server pool when the last client
+ * finishes writing them */
+typedef struct _spectool_netframe {
+	int refcount;
+	int len, alloc_len;
+	/* Sweep frames are droppable, and carry the sweep type and the devices
+	 * they hold a sweep from */
+	int sweep;
+	int sweep_type;
+	int num_devices;
+	uint32_t devices[WTS_BATCH_MAX];
+	/* Delta keyframe blocks, a bit per entry in devices */
+	uint32_t key_mask;
+	/* Pool linkage */
+	struct _spectool_netframe *next;
+	uint8_t data[0];
+} spectool_netframe;
+
+struct _spectool_tcpserv;
+
+/* Event source registered with the event loop.  Each fd we watch carries
+ * the handler for its events, so a wakeup only touches the ready fds */
+typedef struct _wts_evsrc {
+	int fd;
+	int (*handler)(struct _spectool_tcpserv *, struct _wts_evsrc *, 
+				   unsigned int, char *);
+	void *aux;
+} wts_evsrc;
+
+/* Event mask bits handed to handlers */
+#define WTS_EV_READ		1
+#define WTS_EV_WRITE	2
+
+/* A sweep block waiting in the batch buffer, as a plain sweep for v1 
+ * clients and a delta sweep for v2 clients.  Either is 0 length if nobody
+ * wanted it when the sweep was added */
+typedef struct _wts_batch_ent {
+	uint32_t device_id;
+	struct timeval ts;
+	int offset, len;
+	int doffset, dlen;
+	/* The delta block is a keyframe */
+	int key;
+} wts_batch_ent;
+
+/* A running AVG or PEAK over a device's last window sweeps, shared by every
+ * client subscribed to the same type and window.  frame holds the encoded
+ * aggregate while a sweep is being handed out */
+typedef struct _wts_agg {
+	int sweep_type;
+	int window;
+	int refcount;
+	spectool_sweep_cache *cache;
+	spectool_netframe *frame;
+	struct _wts_agg *next;
+} wts_agg;
+
+/* A client subscription to an aggregate */
+typedef struct _wts_sub {
+	wts_agg *agg;
+	unsigned int interval_ms;
+	struct timeval last_sent;
+} wts_sub;
+
+/* A client's window and resolution on a device.  Worked out against a sweep
+ * of src_samples starting at src_start_khz as num_out bins, each the max or 
+ * mean of factor sweep bins starting at first; the last may be short */
+typedef struct _wts_view {
+	int active;
+	unsigned int start_khz, end_khz;
+	int num_bins, reduce;
+
+	int src_samples;
+	unsigned int src_start_khz, src_res_hz;
+	int first, last, factor, num_out;
+	unsigned int out_start_khz, out_res_hz;
+} wts_view;
+
 typedef struct _spectool_tcpcli_dev {
 	uint32_t device_id;
+	/* Timestamp of the last sweep queued, for decimation */
+	struct timeval last_queued;
+	/* A delta keyframe for this device was dropped before the client got it,
+	 * so it can't decode deltas until it gets another */
+	int need_key;
+	/* Send the current sweeps, and the AVG and PEAK subscriptions */
+	int cur;
+	wts_sub agg[WTS_AGG_TYPES];
+	/* Cut down view of the sweeps, if the client asked for one */
+	wts_view view;
 	struct _spectool_tcpcli_dev *next;
 } spectool_tcpcli_dev;
 
 typedef struct _spectool_tcpcli {
 	int fd;
-	uint8_t wbuf[CLI_BUF_SZ];
 	uint8_t rbuf[CLI_BUF_SZ];
-	int write_pos;
 	int read_pos;
+	int read_fill;
+
+	/* Ring of frames waiting to be written; wq_offset is how much of the
+	 * head frame has already gone out.  We don't mind so much if we lose
+	 * sweep data, which is the only data which ought to really build up 
+	 * over time */
+	spectool_netframe *wqueue[CLI_WQUEUE_LEN];
+	int wq_head, wq_len, wq_offset;
+	int wq_bytes;
 
-	/* Naive model, we assume that we can write faster than we can fill.
-	 * Also, we don't mind so much if we lose sweep data, which is the 
-	 * only data which ought to really build up over time */
-	int write_fill, read_fill;
+	/* Negotiated protocol version */
+	int proto_version;
+
+	/* Sweep queueing policy, and how many sweeps it has cost this client */
+	int policy, decimate_hz;
+	unsigned int drop_overflow, drop_coalesced, drop_decimated;
 
 	/* List of devices we send sweep data for */
 	spectool_tcpcli_dev *devlist;
 
+	wts_evsrc ev;
+
+	/* Socket is full and we're waiting for it to drain; otherwise queued
+	 * frames get written at the end of the current event loop pass */
+	int wblocked;
+	int flush_pending;
+	struct _spectool_tcpcli *flush_next;
+
 	struct _spectool_tcpcli *next;
 } spectool_tcpcli;
 
 typedef struct _spectool_tcpserv_dev {
 	spectool_phy phydev;
 	int lock_fd;
+	wts_evsrc ev;
+
+	/* Last delta keyframe sent, and when to send the next one */
+	uint8_t *key_data;
+	int key_samples;
+	uint16_t key_seq;
+	int since_key, force_key;
+
+	/* We've logged that this device's sweeps are too big to send */
+	int oversize;
+
+	/* Counters as of the last STATS frame */
+	spectool_phy_stats stats;
+
+	/* Aggregates clients have subscribed to */
+	wts_agg *aggs;
 } spectool_tcpserv_dev;
 
 typedef struct _spectool_tcpserv {
@@ -82,6 +265,35 @@ typedef struct _spectool_tcpserv {
 	spectool_tcpserv_dev *devs;
 
 	int ndev;
+
+	/* Released frames available for reuse */
+	spectool_netframe *frame_pool;
+	int frame_pool_len;
+
+	/* Clients with frames queued since the last flush */
+	spectool_tcpcli *flush_list;
+
+	/* Queueing policy given to new clients */
+	int policy, decimate_hz;
+
+	/* Encoded sweep blocks waiting to go out as one frame */
+	uint8_t batch_buf[WTS_BATCH_BUF];
+	wts_batch_ent batch[WTS_BATCH_MAX];
+	int batch_len, batch_bytes;
+	struct timeval batch_deadline;
+
+	/* Broadcast announce socket and interval */
+	int bcast_sock, bcast_secs;
+	time_t last_bcast;
+
+	/* When the last STATS frames went out, and how often to also log the
+	 * counters locally */
+	time_t last_stats;
+	int stats_log_secs;
+	time_t last_stats_log;
+
+	int epfd;
+	wts_evsrc bind_ev, bcast_ev, stats_ev;
 } spectool_tcpserv;
 
 int wts_init(spectool_tcpserv *wts) {
@@ -94,6 +306,23 @@ int wts_init(spectool_tcpserv *wts) {
 	wts->cli_list = NULL;
 	wts->devs = NULL;
 	wts->ndev = 0;
+	wts->frame_pool = NULL;
+	wts->frame_pool_len = 0;
+	wts->flush_list = NULL;
+	wts->policy = WTS_POLICY_DROPOLDEST;
+	wts->decimate_hz = 0;
+	wts->batch_len = 0;
+	wts->batch_bytes = 0;
+	wts->bcast_sock = -1;
+	wts->bcast_secs = 0;
+	wts->last_bcast = 0;
+	wts->last_stats = 0;
+	wts->stats_log_secs = 0;
+	wts->last_stats_log = 0;
+	wts->epfd = -1;
+	wts->bind_ev.fd = -1;
+	wts->bcast_ev.fd = -1;
+	wts->stats_ev.fd = -1;
 	return 1;
 }
 
@@ -131,7 +360,9 @@ int wts_bind(spectool_tcpserv *wts, char *addr, short int port, char *errstr) {
 		return -1;
 	}
 
+#ifndef WTS_USE_EPOLL
 	FD_SET(wts->bindfd, &(wts->master_fds));
+#endif
 
 	if (wts->maxfd < wts->bindfd)
 		wts->maxfd = wts->bindfd;
@@ -139,23 +370,518 @@ int wts_bind(spectool_tcpserv *wts, char *addr, short int port, char *errstr) {
 	return 1;
 }
 
-int wts_cli_append(spectool_tcpcli *tci, uint8_t *data, int len, char *errstr) {
-	if (tci->write_fill + len >= CLI_BUF_SZ) {
-		snprintf(errstr, SPECTOOL_ERROR_MAX, "client write buffer %d can't fit %d bytes, "
-				 "%d of %d full", tci->fd, len, tci->write_fill, CLI_BUF_SZ);
+spectool_netframe *wts_frame_alloc(spectool_tcpserv *wts, int len) {
+	spectool_netframe *f = wts->frame_pool, *pf = NULL;
+
+	/* Sweeps from a device are all the same size, so the first pooled frame
+	 * big enough is nearly always the head */
+	while (f != NULL) {
+		if (f->alloc_len >= len) {
+			if (pf == NULL)
+				wts->frame_pool = f->next;
+			else
+				pf->next = f->next;
+
+			wts->frame_pool_len--;
+			break;
+		}
+
+		pf = f;
+		f = f->next;
+	}
+
+	if (f == NULL) {
+		f = (spectool_netframe *) malloc(sizeof(spectool_netframe) + len);
+		f->alloc_len = len;
+	}
+
+	f->refcount = 1;
+	f->len = len;
+	f->sweep = 0;
+	f->sweep_type = SPECTOOL_NET_SWEEPTYPE_CUR;
+	f->num_devices = 0;
+	f->key_mask = 0;
+	f->next = NULL;
+
+	return f;
+}
+
+void wts_frame_unref(spectool_tcpserv *wts, spectool_netframe *f) {
+	if (--f->refcount > 0)
+		return;
+
+	if (wts->frame_pool_len >= WTS_FRAME_POOL) {
+		free(f);
+		return;
+	}
+
+	f->next = wts->frame_pool;
+	wts->frame_pool = f;
+	wts->frame_pool_len++;
+}
+
+/* Queue a reference to an encoded frame on a client */
+int wts_cli_queue(spectool_tcpserv *wts, spectool_tcpcli *tci, 
+				  spectool_netframe *f, char *errstr) {
+	if (tci->wq_len >= CLI_WQUEUE_LEN || 
+		tci->wq_bytes + f->len > CLI_WQUEUE_SZ) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "client write queue %d can't fit %d bytes, "
+				 "%d frames %d bytes queued", tci->fd, f->len, tci->wq_len, 
+				 tci->wq_bytes);
+		return -1;
+	}
+
+	tci->wqueue[(tci->wq_head + tci->wq_len) % CLI_WQUEUE_LEN] = f;
+	tci->wq_len++;
+	tci->wq_bytes += f->len;
+	f->refcount++;
+
+	if (tci->flush_pending == 0) {
+		tci->flush_pending = 1;
+		tci->flush_next = wts->flush_list;
+		wts->flush_list = tci;
+	}
+
+	return 1;
+}
+
+/* Remove the frame n places from the head of a client queue.  The head frame
+ * can only be removed if none of it has been written yet. */
+void wts_cli_drop_at(spectool_tcpserv *wts, spectool_tcpcli *tci, int n) {
+	spectool_netframe *f = tci->wqueue[(tci->wq_head + n) % CLI_WQUEUE_LEN];
+	int x;
+
+	for (x = n; x < tci->wq_len - 1; x++) {
+		tci->wqueue[(tci->wq_head + x) % CLI_WQUEUE_LEN] =
+			tci->wqueue[(tci->wq_head + x + 1) % CLI_WQUEUE_LEN];
+	}
+
+	tci->wq_len--;
+	tci->wq_bytes -= f->len;
+
+	wts_frame_unref(wts, f);
+}
+
+/* Find a client's record for a device */
+spectool_tcpcli_dev *wts_cli_find_dev(spectool_tcpcli *tci, uint32_t device_id) {
+	spectool_tcpcli_dev *di;
+
+	for (di = tci->devlist; di != NULL; di = di->next) {
+		if (di->device_id == device_id)
+			break;
+	}
+
+	return di;
+}
+
+/* Track the delta keyframes in a frame a client was given or lost.  Losing
+ * one leaves every delta after it undecodable, so the client waits on a new
+ * keyframe for that device */
+void wts_cli_track_keys(spectool_tcpcli *tci, spectool_netframe *f, int lost) {
+	spectool_tcpcli_dev *di;
+	int x;
+
+	if (f->key_mask == 0)
+		return;
+
+	for (x = 0; x < f->num_devices; x++) {
+		if ((f->key_mask & (1 << x)) == 0)
+			continue;
+
+		if ((di = wts_cli_find_dev(tci, f->devices[x])) != NULL)
+			di->need_key = lost;
+	}
+}
+
+/* Does frame f hold a sweep from every device queued frame qf does? */
+int wts_frame_covers(spectool_netframe *f, spectool_netframe *qf) {
+	int x, y;
+
+	if (f->sweep_type != qf->sweep_type)
+		return 0;
+
+	for (x = 0; x < qf->num_devices; x++) {
+		for (y = 0; y < f->num_devices; y++) {
+			if (f->devices[y] == qf->devices[x])
+				break;
+		}
+
+		if (y == f->num_devices)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Queue a sweep frame on a client according to its queueing policy.  Returns
+ * 1 if the sweep was queued, 0 if the policy threw it (or an older one)
+ * away */
+int wts_cli_queue_sweep(spectool_tcpserv *wts, spectool_tcpcli *tci, 
+						spectool_netframe *f, char *errstr) {
+	spectool_netframe *qf;
+	int x, first;
+
+	/* Never touch the head frame if it's partly written */
+	first = tci->wq_offset > 0 ? 1 : 0;
+
+	if (tci->policy == WTS_POLICY_LATEST) {
+		/* Replace an unsent frame holding nothing but older sweeps from the
+		 * same devices in place */
+		for (x = first; x < tci->wq_len; x++) {
+			int pos = (tci->wq_head + x) % CLI_WQUEUE_LEN;
+			qf = tci->wqueue[pos];
+
+			if (qf->sweep == 0 || wts_frame_covers(f, qf) == 0)
+				continue;
+
+			tci->wqueue[pos] = f;
+			f->refcount++;
+			tci->wq_bytes += f->len - qf->len;
+			tci->drop_coalesced += qf->num_devices;
+			wts_cli_track_keys(tci, qf, 1);
+			wts_cli_track_keys(tci, f, 0);
+			wts_frame_unref(wts, qf);
+
+			return 0;
+		}
+	}
+
+	/* Make room by throwing out the oldest sweeps which haven't started
+	 * going out yet */
+	x = first;
+	while ((tci->wq_len >= CLI_WQUEUE_LEN || 
+			tci->wq_bytes + f->len > CLI_WQUEUE_SZ) && x < tci->wq_len) {
+		qf = tci->wqueue[(tci->wq_head + x) % CLI_WQUEUE_LEN];
+
+		if (qf->sweep == 0) {
+			x++;
+			continue;
+		}
+
+		tci->drop_overflow += qf->num_devices;
+		wts_cli_track_keys(tci, qf, 1);
+		wts_cli_drop_at(wts, tci, x);
+	}
+
+	if (wts_cli_queue(wts, tci, f, errstr) < 0) {
+		tci->drop_overflow += f->num_devices;
+		wts_cli_track_keys(tci, f, 1);
+		return 0;
+	}
+
+	wts_cli_track_keys(tci, f, 0);
+
+	return 1;
+}
+
+/* Is a sweep taken at ts due under a client's decimation rate */
+int wts_cli_decimate_due(spectool_tcpcli *tci, spectool_tcpcli_dev *di,
+						 struct timeval *ts) {
+	long delta;
+
+	if (tci->policy == WTS_POLICY_DECIMATE && tci->decimate_hz > 0 &&
+		di->last_queued.tv_sec != 0) {
+		delta = (ts->tv_sec - di->last_queued.tv_sec) * 1000000L +
+			(ts->tv_usec - di->last_queued.tv_usec);
+
+		if (delta >= 0 && delta < 1000000L / tci->decimate_hz)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Check a sweep against a client's decimation rate, returns 1 if the client 
+ * should skip it */
+int wts_cli_decimate(spectool_tcpcli *tci, spectool_tcpcli_dev *di,
+					 struct timeval *ts) {
+	if (wts_cli_decimate_due(tci, di, ts) == 0) {
+		tci->drop_decimated++;
+		return 1;
+	}
+
+	di->last_queued = *ts;
+
+	return 0;
+}
+
+spectool_tcpserv_dev *wts_find_dev(spectool_tcpserv *wts, uint32_t device_id) {
+	int x;
+
+	for (x = 0; x < wts->ndev; x++) {
+		if (wts->devs[x].phydev.device_spec->device_id == device_id)
+			return &(wts->devs[x]);
+	}
+
+	return NULL;
+}
+
+/* Find or start the aggregate of a type and window on a device */
+wts_agg *wts_agg_get(spectool_tcpserv_dev *dev, int sweep_type, int window) {
+	wts_agg *a;
+
+	for (a = dev->aggs; a != NULL; a = a->next) {
+		if (a->sweep_type == sweep_type && a->window == window) {
+			a->refcount++;
+			return a;
+		}
+	}
+
+	a = (wts_agg *) malloc(sizeof(wts_agg));
+	a->sweep_type = sweep_type;
+	a->window = window;
+	a->refcount = 1;
+	a->cache = spectool_cache_alloc(window, 
+									sweep_type == SPECTOOL_NET_SWEEPTYPE_PEAK,
+									sweep_type == SPECTOOL_NET_SWEEPTYPE_AVG);
+	a->frame = NULL;
+	a->next = dev->aggs;
+	dev->aggs = a;
+
+	return a;
+}
+
+void wts_agg_release(spectool_tcpserv_dev *dev, wts_agg *a) {
+	wts_agg **ap;
+
+	if (--a->refcount > 0)
+		return;
+
+	for (ap = &(dev->aggs); *ap != NULL; ap = &((*ap)->next)) {
+		if (*ap == a) {
+			*ap = a->next;
+			break;
+		}
+	}
+
+	spectool_cache_free(a->cache);
+	free(a);
+}
+
+/* Free a client device record and anything it's subscribed to */
+void wts_cli_dev_free(spectool_tcpserv *wts, spectool_tcpcli_dev *di) {
+	spectool_tcpserv_dev *dev = wts_find_dev(wts, di->device_id);
+	int t;
+
+	for (t = 0; t < WTS_AGG_TYPES; t++) {
+		if (di->agg[t].agg != NULL && dev != NULL)
+			wts_agg_release(dev, di->agg[t].agg);
+	}
+
+	free(di);
+}
+
+/* Work out which bins of a sweep a view takes.  Returns -1 if the view 
+ * doesn't overlap the sweep at all */
+int wts_view_fit(wts_view *v, spectool_sample_sweep *ran) {
+	long long base_hz = (long long) ran->start_khz * 1000;
+	long long hz;
+	int first = 0, last = ran->num_samples;
+
+	if (ran->res_hz == 0 || ran->num_samples == 0)
+		return -1;
+
+	if (v->start_khz != 0 && (hz = (long long) v->start_khz * 1000 - base_hz) > 0)
+		first = (hz + ran->res_hz - 1) / ran->res_hz;
+
+	if (v->end_khz != 0) {
+		if ((hz = (long long) v->end_khz * 1000 - base_hz) < 0)
+			return -1;
+
+		if (hz / ran->res_hz + 1 < last)
+			last = hz / ran->res_hz + 1;
+	}
+
+	if (first >= last)
 		return -1;
+
+	v->factor = 1;
+	if (v->num_bins > 0 && v->num_bins < last - first)
+		v->factor = (last - first + v->num_bins - 1) / v->num_bins;
+
+	v->src_samples = ran->num_samples;
+	v->src_start_khz = ran->start_khz;
+	v->src_res_hz = ran->res_hz;
+	v->first = first;
+	v->last = last;
+	v->num_out = (last - first + v->factor - 1) / v->factor;
+	v->out_start_khz = ran->start_khz + ((long long) first * ran->res_hz) / 1000;
+	v->out_res_hz = ran->res_hz * v->factor;
+
+	return 1;
+}
+
+/* Was a view worked out against a sweep of a different range */
+int wts_view_stale(wts_view *v, spectool_sample_sweep *sweep) {
+	return sweep->num_samples != v->src_samples || 
+		sweep->start_khz != v->src_start_khz || sweep->res_hz != v->src_res_hz;
+}
+
+/* Is view b the same cut of a sweep as view a */
+int wts_view_same(wts_view *a, wts_view *b) {
+	return a->src_samples == b->src_samples && 
+		a->src_start_khz == b->src_start_khz && a->src_res_hz == b->src_res_hz &&
+		a->first == b->first && a->last == b->last && a->factor == b->factor && 
+		a->reduce == b->reduce;
+}
+
+/* Can a sweep frame of len bytes from a device be sent at all.  Logs the 
+ * first one which can't; the sweep is dropped, not the server */
+int wts_frame_fits(spectool_tcpserv_dev *dev, int len) {
+	if (len <= WTS_FRAME_MAX)
+		return 1;
+
+	if (dev->oversize == 0) {
+		fprintf(stderr, "Device %u sweep frames of %d bytes are too large to "
+				"send, dropping them\n", dev->phydev.device_spec->device_id, len);
+		dev->oversize = 1;
+	}
+
+	return 0;
+}
+
+/* Build a one block SWEEP frame of a sweep cut down to a view */
+spectool_netframe *wts_view_encode(spectool_tcpserv *wts, spectool_tcpserv_dev *dev,
+								   wts_view *v, int sweep_type, 
+								   spectool_sample_sweep *sweep) {
+	spectool_netframe *f;
+	spectool_fr_header *hdr;
+	spectool_fr_sweep *fsweep;
+	uint32_t device_id = dev->phydev.device_spec->device_id;
+	unsigned int sum;
+	uint8_t m;
+	int b, e, i, o;
+
+	/* Callers refit the view first, so the client knows the new geometry */
+	if (wts_view_stale(v, sweep))
+		return NULL;
+
+	if (wts_frame_fits(dev, spectool_fr_header_size() + 
+					   spectool_fr_sweep_size(v->num_out)) == 0)
+		return NULL;
+
+	f = wts_frame_alloc(wts, spectool_fr_header_size() + 
+						spectool_fr_sweep_size(v->num_out));
+	f->sweep = 1;
+	f->sweep_type = sweep_type;
+	f->devices[f->num_devices++] = device_id;
+
+	hdr = (spectool_fr_header *) f->data;
+
+	hdr->sentinel = htonl(SPECTOOL_NET_SENTINEL);
+	hdr->frame_len = htons(f->len);
+	hdr->proto_version = SPECTOOL_NET_PROTO_VERSION;
+	hdr->block_type = SPECTOOL_NET_FRAME_SWEEP;
+	hdr->num_blocks = 1;
+
+	fsweep = (spectool_fr_sweep *) hdr->data;
+
+	fsweep->frame_len = htons(spectool_fr_sweep_size(v->num_out));
+	fsweep->device_id = htonl(device_id);
+	fsweep->sweep_type = sweep_type;
+	fsweep->start_sec = htonl(sweep->tm_start.tv_sec);
+	fsweep->start_usec = htonl(sweep->tm_start.tv_usec);
+
+	for (o = 0, b = v->first; o < v->num_out; o++, b += v->factor) {
+		if ((e = b + v->factor) > v->last)
+			e = v->last;
+
+		if (v->reduce == SPECTOOL_NET_VIEW_MEAN) {
+			for (sum = 0, i = b; i < e; i++)
+				sum += sweep->sample_data[i];
+
+			fsweep->sample_data[o] = sum / (e - b);
+		} else {
+			for (m = sweep->sample_data[b], i = b + 1; i < e; i++) {
+				if (sweep->sample_data[i] > m)
+					m = sweep->sample_data[i];
+			}
+
+			fsweep->sample_data[o] = m;
+		}
+	}
+
+	return f;
+}
+
+/* Drop everything queued on a client */
+void wts_cli_purge(spectool_tcpserv *wts, spectool_tcpcli *tci) {
+	while (tci->wq_len > 0) {
+		wts_frame_unref(wts, tci->wqueue[tci->wq_head]);
+		tci->wq_head = (tci->wq_head + 1) % CLI_WQUEUE_LEN;
+		tci->wq_len--;
+	}
+
+	tci->wq_head = 0;
+	tci->wq_offset = 0;
+	tci->wq_bytes = 0;
+}
+
+/* Write queued frames until the queue is empty or the socket is full, a
+ * writev at a time.  Returns 1 when the queue drained, 0 when the socket 
+ * would block, -1 on error */
+int wts_cli_flush(spectool_tcpserv *wts, spectool_tcpcli *tci, char *errstr) {
+	struct iovec iov[WTS_IOV_MAX];
+	int niov, x, res;
+	spectool_netframe *f;
+
+	while (tci->wq_len > 0) {
+		for (niov = 0; niov < tci->wq_len && niov < WTS_IOV_MAX; niov++) {
+			f = tci->wqueue[(tci->wq_head + niov) % CLI_WQUEUE_LEN];
+
+			if (niov == 0) {
+				iov[niov].iov_base = f->data + tci->wq_offset;
+				iov[niov].iov_len = f->len - tci->wq_offset;
+			} else {
+				iov[niov].iov_base = f->data;
+				iov[niov].iov_len = f->len;
+			}
+		}
+
+		if ((res = writev(tci->fd, iov, niov)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				tci->wblocked = 1;
+				return 0;
+			}
+
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "write() failed on fd %d %s",
+					 tci->fd, strerror(errno));
+			return -1;
+		}
+
+		tci->wq_bytes -= res;
+
+		/* Release every frame which went out completely */
+		for (x = 0; x < niov; x++) {
+			f = tci->wqueue[tci->wq_head];
+
+			if (res < f->len - tci->wq_offset) {
+				tci->wq_offset += res;
+				break;
+			}
+
+			res -= f->len - tci->wq_offset;
+			tci->wq_offset = 0;
+
+			wts_frame_unref(wts, f);
+			tci->wq_head = (tci->wq_head + 1) % CLI_WQUEUE_LEN;
+			tci->wq_len--;
+		}
 	}
 
-	memcpy(&(tci->wbuf[tci->write_fill]), data, len);
-	tci->write_fill += len;
+	tci->wblocked = 0;
 
 	return 1;
 }
 
 int wts_send_devblock(spectool_tcpserv *wts, spectool_tcpcli *tci, char *errstr) {
+	spectool_netframe *f;
 	spectool_fr_header *hdr;
 	spectool_fr_device *dev;
-	spectool_fr_sweep *sweep;
+	spectool_tcpcli_dev *di;
 
 	int devblen = 0, x = 0, r = 0;
 	spectool_sample_sweep *ran;
@@ -167,8 +893,8 @@ int wts_send_devblock(spectool_tcpserv *wts, spectool_tcpcli *tci, char *errstr)
 	devblen += spectool_fr_device_size();
 
 	/* Big allocation of the entire block */
-	hdr = (spectool_fr_header *) malloc(spectool_fr_header_size() +
-									 devblen);
+	f = wts_frame_alloc(wts, spectool_fr_header_size() + devblen);
+	hdr = (spectool_fr_header *) f->data;
 
 	hdr->sentinel = htonl(SPECTOOL_NET_SENTINEL);
 	hdr->frame_len = htons(spectool_fr_header_size() + devblen);
@@ -207,6 +933,18 @@ int wts_send_devblock(spectool_tcpserv *wts, spectool_tcpcli *tci, char *errstr)
 			dev->start_khz = dev->def_start_khz;
 			dev->res_hz = dev->def_res_hz;
 			dev->num_samples = dev->def_num_samples;
+
+			/* What this client gets through its view */
+			for (di = tci->devlist; di != NULL; di = di->next) {
+				if (di->device_id == d->phydev.device_spec->device_id)
+					break;
+			}
+
+			if (di != NULL && di->view.active) {
+				dev->start_khz = htonl(di->view.out_start_khz);
+				dev->res_hz = htonl(di->view.out_res_hz);
+				dev->num_samples = htons(di->view.num_out);
+			}
 		/*
 		} else {
 			dev->start_khz =
@@ -226,16 +964,33 @@ int wts_send_devblock(spectool_tcpserv *wts, spectool_tcpcli *tci, char *errstr)
 	dev->frame_len = htons(spectool_fr_device_size());
 	dev->device_version = SPECTOOL_NET_DEVTYPE_LASTDEV;
 
-	if (wts_cli_append(tci, (uint8_t *) hdr,
-					   spectool_fr_header_size() + devblen,
-					   errstr) < 0)
-		return -1;
+	r = wts_cli_queue(wts, tci, f, errstr);
 
-	free(hdr);
+	wts_frame_unref(wts, f);
+
+	if (r < 0)
+		return -1;
 	
 	return 1;
 }
 
+/* Refit a client's view to a sweep whose range has changed, and send the 
+ * client the new geometry ahead of the first sweep cut to it.  Returns -1 if
+ * the view doesn't overlap the sweep */
+int wts_cli_view_refit(spectool_tcpserv *wts, spectool_tcpcli *tci, 
+					   spectool_tcpcli_dev *di, spectool_sample_sweep *sweep,
+					   char *errstr) {
+	if (wts_view_stale(&(di->view), sweep) == 0)
+		return 1;
+
+	if (wts_view_fit(&(di->view), sweep) < 0)
+		return -1;
+
+	wts_send_devblock(wts, tci, errstr);
+
+	return 1;
+}
+
 int wts_send_devblock_all(spectool_tcpserv *wts, char *errstr) {
 	spectool_tcpcli *tci = wts->cli_list;
 
@@ -248,6 +1003,105 @@ int wts_send_devblock_all(spectool_tcpserv *wts, char *errstr) {
 	return 1;
 }
 
+/* Snapshot the device counters, send each client the ones for the devices
+ * it has enabled, and log them if we've been asked to.  A client without 
+ * room in its queue just misses this round */
+int wts_send_stats(spectool_tcpserv *wts, char *errstr) {
+	spectool_tcpcli *tci;
+	spectool_tcpcli_dev *di;
+	spectool_tcpserv_dev *d;
+	spectool_netframe *f;
+	spectool_fr_header *hdr;
+	spectool_fr_stats *st;
+	time_t now = time(0);
+	int x, n;
+
+	wts->last_stats = now;
+
+	for (x = 0; x < wts->ndev; x++)
+		spectool_phy_getstats(&(wts->devs[x].phydev), &(wts->devs[x].stats));
+
+	for (tci = wts->cli_list; tci != NULL; tci = tci->next) {
+		n = 0;
+		for (di = tci->devlist; di != NULL; di = di->next)
+			n++;
+
+		if (n == 0)
+			continue;
+
+		f = wts_frame_alloc(wts, spectool_fr_header_size() + 
+							spectool_fr_stats_size() * n);
+		hdr = (spectool_fr_header *) f->data;
+		st = (spectool_fr_stats *) hdr->data;
+		n = 0;
+
+		for (di = tci->devlist; di != NULL; di = di->next) {
+			for (x = 0; x < wts->ndev; x++) {
+				if (wts->devs[x].phydev.device_spec->device_id == di->device_id)
+					break;
+			}
+
+			if (x >= wts->ndev)
+				continue;
+
+			d = &(wts->devs[x]);
+
+			st->frame_len = htons(spectool_fr_stats_size());
+			st->device_id = htonl(di->device_id);
+			st->reports = htonl(d->stats.reports);
+			st->requeues = htonl(d->stats.requeues);
+			st->overruns = htonl(d->stats.overruns);
+			st->short_reports = htonl(d->stats.short_reports);
+			st->bad_base = htonl(d->stats.bad_base);
+			st->discarded = htonl(d->stats.discarded);
+			st->sweeps = htonl(d->stats.sweeps);
+			st->sweeps_dropped = htonl(d->stats.sweeps_dropped);
+			st->sweep_rate_milli = htonl((uint32_t) (d->stats.sweep_rate * 1000));
+
+			st++;
+			n++;
+		}
+
+		f->len = spectool_fr_header_size() + spectool_fr_stats_size() * n;
+
+		hdr->sentinel = htonl(SPECTOOL_NET_SENTINEL);
+		hdr->frame_len = htons(f->len);
+		hdr->proto_version = SPECTOOL_NET_PROTO_VERSION;
+		hdr->block_type = SPECTOOL_NET_FRAME_STATS;
+		hdr->num_blocks = n;
+
+		if (n > 0)
+			wts_cli_queue(wts, tci, f, errstr);
+
+		wts_frame_unref(wts, f);
+	}
+
+	if (wts->stats_log_secs <= 0 || now - wts->last_stats_log < wts->stats_log_secs)
+		return 1;
+
+	wts->last_stats_log = now;
+
+	for (x = 0; x < wts->ndev; x++) {
+		d = &(wts->devs[x]);
+
+		fprintf(stderr, "Device %u: %lu reports, %lu requeues, %lu overruns, "
+				"%lu short, %lu bad base, %lu discarded, %lu sweeps, "
+				"%lu dropped, %.1f sweeps/sec\n", 
+				d->phydev.device_spec->device_id, d->stats.reports, 
+				d->stats.requeues, d->stats.overruns, d->stats.short_reports,
+				d->stats.bad_base, d->stats.discarded, d->stats.sweeps,
+				d->stats.sweeps_dropped, d->stats.sweep_rate);
+	}
+
+	return 1;
+}
+
+int wts_client_event(spectool_tcpserv *wts, wts_evsrc *ev, unsigned int events,
+					 char *errstr);
+#ifdef WTS_USE_EPOLL
+int wts_epoll_add(spectool_tcpserv *wts, wts_evsrc *ev, int edge, char *errstr);
+#endif
+
 spectool_tcpcli *wts_accept(spectool_tcpserv *wts, char *errstr) {
 	int newfd;
 	spectool_tcpcli *tc;
@@ -269,19 +1123,47 @@ spectool_tcpcli *wts_accept(spectool_tcpserv *wts, char *errstr) {
 
 	tc->fd = newfd;
 
-	tc->write_pos = 0;
 	tc->read_pos = 0;
-	tc->write_fill = 0;
 	tc->read_fill = 0;
+	tc->wq_head = 0;
+	tc->wq_len = 0;
+	tc->wq_offset = 0;
+	tc->wq_bytes = 0;
 	tc->devlist = NULL;
 
-	tc->next = wts->cli_list;
-	wts->cli_list = tc;
+	tc->proto_version = SPECTOOL_NET_PROTO_VERSION_V1;
+
+	tc->policy = wts->policy;
+	tc->decimate_hz = wts->decimate_hz;
+	tc->drop_overflow = 0;
+	tc->drop_coalesced = 0;
+	tc->drop_decimated = 0;
+
+	tc->wblocked = 0;
+	tc->flush_pending = 0;
+	tc->flush_next = NULL;
+
+	tc->ev.fd = newfd;
+	tc->ev.handler = &wts_client_event;
+	tc->ev.aux = tc;
 
 	save_mode = fcntl(tc->fd, F_GETFL, 0);
 	fcntl(tc->fd, F_SETFL, save_mode | O_NONBLOCK);
 
+#ifdef WTS_USE_EPOLL
+	/* Clients are edge triggered; we always read and write until the socket
+	 * would block */
+	if (wts->epfd >= 0 && wts_epoll_add(wts, &(tc->ev), 1, errstr) < 0) {
+		close(newfd);
+		free(tc);
+		return NULL;
+	}
+#else
 	FD_SET(newfd, &(wts->master_fds));
+#endif
+
+	tc->next = wts->cli_list;
+	wts->cli_list = tc;
 
 	return tc;
 }
@@ -289,6 +1171,7 @@ spectool_tcpcli *wts_accept(spectool_tcpserv *wts, char *errstr) {
 void wts_remove(spectool_tcpserv *wts, spectool_tcpcli *tc, char *errstr) {
 	spectool_tcpcli *tci = wts->cli_list;
 	spectool_tcpcli *tcb = NULL;
+	spectool_tcpcli_dev *di;
 	int x, dchange;
 
 	/* Unlock any devices they controlled */
@@ -300,11 +1183,42 @@ void wts_remove(spectool_tcpserv *wts, spectool_tcpcli *tc, char *errstr) {
 		}
 	}
 
+	if (tc->drop_overflow + tc->drop_coalesced + tc->drop_decimated > 0) {
+		fprintf(stderr, "Client fd %d dropped %u sweeps: %u overflow, "
+				"%u replaced by newer, %u decimated\n", tc->fd,
+				tc->drop_overflow + tc->drop_coalesced + tc->drop_decimated,
+				tc->drop_overflow, tc->drop_coalesced, tc->drop_decimated);
+	}
+
+	/* Closing the socket also takes it out of the epoll set */
 	if (tc->fd >= 0) {
+#ifndef WTS_USE_EPOLL
 		FD_CLR(tc->fd, &(wts->master_fds));
+#endif
 		close(tc->fd);
 	}
 
+	wts_cli_purge(wts, tc);
+
+	while (tc->devlist != NULL) {
+		di = tc->devlist;
+		tc->devlist = di->next;
+		wts_cli_dev_free(wts, di);
+	}
+
+	if (tc->flush_pending) {
+		spectool_tcpcli **fp = &(wts->flush_list);
+
+		while (*fp != NULL) {
+			if (*fp == tc) {
+				*fp = tc->flush_next;
+				break;
+			}
+
+			fp = &((*fp)->flush_next);
+		}
+	}
+
 	if (tc == tci) {
 		wts->cli_list = tci->next;
 		free(tc);
@@ -319,6 +1233,7 @@ void wts_remove(spectool_tcpserv *wts, spectool_tcpcli *tc, char *errstr) {
 		if (tci == tc) {
 			tcb->next = tci->next;
 			free(tci);
+			break;
 		}
 	}
 
@@ -337,7 +1252,7 @@ int wts_fdset(spectool_tcpserv *wts, fd_set *rfd, fd_set *wfd) {
 	while (tci != NULL) {
 		FD_SET(tci->fd, rfd);
 
-		if (tci->write_fill > 0) {
+		if (tci->wq_len > 0) {
 			FD_SET(tci->fd, wfd);
 		}
 
@@ -358,65 +1273,591 @@ int wts_fdset(spectool_tcpserv *wts, fd_set *rfd, fd_set *wfd) {
 	return 1;
 }
 
+/* Build a SWEEP frame, or a SWEEPDELTA frame for v2 clients, from the 
+ * batched blocks selected in mask */
+spectool_netframe *wts_batch_encode(spectool_tcpserv *wts, uint32_t mask, 
+									int delta) {
+	spectool_netframe *f;
+	spectool_fr_header *hdr;
+	int x, len, pos, boffset, blen;
+
+	len = spectool_fr_header_size();
+	for (x = 0; x < wts->batch_len; x++) {
+		if ((mask & (1 << x)))
+			len += delta ? wts->batch[x].dlen : wts->batch[x].len;
+	}
+
+	f = wts_frame_alloc(wts, len);
+	f->sweep = 1;
+
+	hdr = (spectool_fr_header *) f->data;
+
+	hdr->sentinel = htonl(SPECTOOL_NET_SENTINEL);
+	hdr->frame_len = htons(f->len);
+	hdr->proto_version = SPECTOOL_NET_PROTO_VERSION;
+	hdr->block_type = 
+		delta ? SPECTOOL_NET_FRAME_SWEEPDELTA : SPECTOOL_NET_FRAME_SWEEP;
+
+	pos = 0;
+	for (x = 0; x < wts->batch_len; x++) {
+		if ((mask & (1 << x)) == 0)
+			continue;
+
+		boffset = delta ? wts->batch[x].doffset : wts->batch[x].offset;
+		blen = delta ? wts->batch[x].dlen : wts->batch[x].len;
+
+		memcpy(&(hdr->data[pos]), &(wts->batch_buf[boffset]), blen);
+		pos += blen;
+
+		if (delta && wts->batch[x].key)
+			f->key_mask |= (1 << f->num_devices);
+
+		f->devices[f->num_devices++] = wts->batch[x].device_id;
+	}
+
+	hdr->num_blocks = f->num_devices;
+
+	return f;
+}
+
+/* Send the batched sweeps.  Each client gets a frame holding only the blocks
+ * it wants; clients wanting the same blocks share one encoding */
+void wts_batch_flush(spectool_tcpserv *wts, char *errstr) {
+	spectool_netframe *cache[WTS_BATCH_CACHE], *f;
+	uint32_t cache_mask[WTS_BATCH_CACHE], mask;
+	int cache_delta[WTS_BATCH_CACHE];
+	int ncache = 0;
+	spectool_tcpcli *tci;
+	spectool_tcpcli_dev *di;
+	int x, c, delta;
+
+	if (wts->batch_len == 0)
+		return;
+
+	for (tci = wts->cli_list; tci != NULL; tci = tci->next) {
+		mask = 0;
+		delta = tci->proto_version >= 2;
+
+		for (x = 0; x < wts->batch_len; x++) {
+			/* Subscribed after this sweep was encoded */
+			if ((delta ? wts->batch[x].dlen : wts->batch[x].len) == 0)
+				continue;
+
+			for (di = tci->devlist; di != NULL; di = di->next) {
+				if (di->device_id == wts->batch[x].device_id)
+					break;
+			}
+
+			if (di == NULL || di->cur == 0 || di->view.active)
+				continue;
+
+			if (wts_cli_decimate(tci, di, &(wts->batch[x].ts))) {
+				if (delta && wts->batch[x].key)
+					di->need_key = 1;
+				continue;
+			}
+
+			mask |= (1 << x);
+		}
+
+		if (mask == 0)
+			continue;
+
+		f = NULL;
+		for (c = 0; c < ncache; c++) {
+			if (cache_mask[c] == mask && cache_delta[c] == delta) {
+				f = cache[c];
+				break;
+			}
+		}
+
+		if (f != NULL) {
+			wts_cli_queue_sweep(wts, tci, f, errstr);
+			continue;
+		}
+
+		f = wts_batch_encode(wts, mask, delta);
+		wts_cli_queue_sweep(wts, tci, f, errstr);
+
+		if (ncache < WTS_BATCH_CACHE) {
+			cache[ncache] = f;
+			cache_mask[ncache] = mask;
+			cache_delta[ncache] = delta;
+			ncache++;
+		} else {
+			wts_frame_unref(wts, f);
+		}
+	}
+
+	for (c = 0; c < ncache; c++)
+		wts_frame_unref(wts, cache[c]);
+
+	wts->batch_len = 0;
+	wts->batch_bytes = 0;
+}
+
+/* Length of the largest frame the batch encodes to */
+int wts_batch_frame_len(spectool_tcpserv *wts) {
+	int x, len = 0, dlen = 0;
+
+	for (x = 0; x < wts->batch_len; x++) {
+		len += wts->batch[x].len;
+		dlen += wts->batch[x].dlen;
+	}
+
+	return spectool_fr_header_size() + (len > dlen ? len : dlen);
+}
+
+/* Flush the batch if its deadline has passed */
+void wts_batch_check(spectool_tcpserv *wts, char *errstr) {
+	struct timeval now;
+
+	if (wts->batch_len == 0)
+		return;
+
+	gettimeofday(&now, NULL);
+
+	if (timercmp(&now, &(wts->batch_deadline), >=))
+		wts_batch_flush(wts, errstr);
+}
+
+/* Microseconds until the batch deadline, or -1 if nothing is batched */
+long wts_batch_timeout(spectool_tcpserv *wts) {
+	struct timeval now;
+	long usec;
+
+	if (wts->batch_len == 0)
+		return -1;
+
+	gettimeofday(&now, NULL);
+
+	usec = (wts->batch_deadline.tv_sec - now.tv_sec) * 1000000L +
+		(wts->batch_deadline.tv_usec - now.tv_usec);
+
+	if (usec < 0)
+		return 0;
+
+	return usec;
+}
+
+/* Code a sweep as a delta block against the device keyframe, sending a new 
+ * keyframe when it's due.  key is set if this block is a keyframe */
+int wts_encode_delta(spectool_tcpserv_dev *dev, spectool_sample_sweep *sweep,
+					 uint8_t *buf, int *key) {
+	*key = 0;
+
+	if (dev->key_data == NULL || dev->key_samples != sweep->num_samples ||
+		dev->since_key >= WTS_DELTA_KEYINT || dev->force_key) {
+		if (dev->key_samples != sweep->num_samples) {
+			free(dev->key_data);
+			dev->key_data = (uint8_t *) malloc(sweep->num_samples);
+			dev->key_samples = sweep->num_samples;
+		}
+
+		memcpy(dev->key_data, sweep->sample_data, sweep->num_samples);
+		dev->key_seq++;
+		dev->since_key = 0;
+		dev->force_key = 0;
+		*key = 1;
+	} else {
+		dev->since_key++;
+	}
+
+	return spectool_net_encode_sweepdelta(buf, dev->phydev.device_spec->device_id,
+										  SPECTOOL_NET_SWEEPTYPE_CUR, dev->key_seq,
+										  *key ? NULL : dev->key_data, sweep);
+}
+
+/* Send a sweep to the clients with a view on its device, sharing the 
+ * encoding between clients with the same view */
+void wts_send_views(spectool_tcpserv *wts, spectool_tcpserv_dev *dev,
+					spectool_sample_sweep *sweep, char *errstr) {
+	spectool_netframe *cache[WTS_BATCH_CACHE], *f;
+	wts_view *cache_view[WTS_BATCH_CACHE];
+	int ncache = 0, c;
+	spectool_tcpcli *tci;
+	spectool_tcpcli_dev *di;
+	uint32_t device_id = dev->phydev.device_spec->device_id;
+
+	for (tci = wts->cli_list; tci != NULL; tci = tci->next) {
+		for (di = tci->devlist; di != NULL; di = di->next) {
+			if (di->device_id == device_id)
+				break;
+		}
+
+		if (di == NULL || di->cur == 0 || di->view.active == 0 ||
+			wts_cli_decimate(tci, di, &(sweep->tm_start)))
+			continue;
+
+		if (wts_cli_view_refit(wts, tci, di, sweep, errstr) < 0)
+			continue;
+
+		f = NULL;
+		for (c = 0; c < ncache; c++) {
+			if (wts_view_same(cache_view[c], &(di->view))) {
+				f = cache[c];
+				break;
+			}
+		}
+
+		if (f != NULL) {
+			wts_cli_queue_sweep(wts, tci, f, errstr);
+			continue;
+		}
+
+		if ((f = wts_view_encode(wts, dev, &(di->view), SPECTOOL_NET_SWEEPTYPE_CUR,
+								 sweep)) == NULL)
+			continue;
+
+		wts_cli_queue_sweep(wts, tci, f, errstr);
+
+		if (ncache < WTS_BATCH_CACHE) {
+			cache[ncache] = f;
+			cache_view[ncache] = &(di->view);
+			ncache++;
+		} else {
+			wts_frame_unref(wts, f);
+		}
+	}
+
+	for (c = 0; c < ncache; c++)
+		wts_frame_unref(wts, cache[c]);
+}
+
+/* Send a sweep whose encodings don't fit the batch buffer in a plain SWEEP 
+ * frame of its own.  Delta clients get it plain too, which leaves their 
+ * keyframe alone */
+void wts_send_unbatched(spectool_tcpserv *wts, spectool_tcpserv_dev *dev,
+						spectool_sample_sweep *sweep, char *errstr) {
+	spectool_netframe *f;
+	spectool_fr_header *hdr;
+	spectool_tcpcli *tci;
+	spectool_tcpcli_dev *di;
+	uint32_t device_id = dev->phydev.device_spec->device_id;
+
+	f = wts_frame_alloc(wts, spectool_fr_header_size() + 
+						spectool_fr_sweep_size(sweep->num_samples));
+	f->sweep = 1;
+	f->devices[f->num_devices++] = device_id;
+
+	hdr = (spectool_fr_header *) f->data;
+
+	hdr->sentinel = htonl(SPECTOOL_NET_SENTINEL);
+	hdr->frame_len = htons(f->len);
+	hdr->proto_version = SPECTOOL_NET_PROTO_VERSION;
+	hdr->block_type = SPECTOOL_NET_FRAME_SWEEP;
+	hdr->num_blocks = 1;
+
+	spectool_net_encode_sweep(hdr->data, device_id, SPECTOOL_NET_SWEEPTYPE_CUR,
+							  sweep);
+
+	for (tci = wts->cli_list; tci != NULL; tci = tci->next) {
+		if ((di = wts_cli_find_dev(tci, device_id)) == NULL || di->cur == 0 || 
+			di->view.active || wts_cli_decimate(tci, di, &(sweep->tm_start)))
+			continue;
+
+		wts_cli_queue_sweep(wts, tci, f, errstr);
+	}
+
+	wts_frame_unref(wts, f);
+}
+
 int wts_send_sweepblock(spectool_tcpserv *wts, 
-						spectool_phy *phydev, spectool_sample_sweep *sweep, 
+						spectool_tcpserv_dev *dev, spectool_sample_sweep *sweep, 
 						char *errstr) {
-	spectool_fr_header *hdr;
-	spectool_fr_sweep *fsweep;
 	spectool_tcpcli *tci = NULL;
+	spectool_tcpcli_dev *di;
+	wts_batch_ent *be;
+	uint32_t device_id = dev->phydev.device_spec->device_id;
+	int len = spectool_fr_sweep_size(sweep->num_samples);
+	int dmax = spectool_fr_sweepdelta_size(spectool_net_delta_max(sweep->num_samples));
+	int need, blen;
+	int want_v1 = 0, want_v2 = 0;
 	int x;
 
-	/* Big allocation */
-	hdr = (spectool_fr_header *) malloc(spectool_fr_header_size() +
-									 spectool_fr_sweep_size(sweep->num_samples));
+	wts_send_views(wts, dev, sweep, errstr);
+
+	/* Don't bother encoding sweeps nobody wants, or in a version nobody
+	 * wants */
+	for (tci = wts->cli_list; tci != NULL; tci = tci->next) {
+		for (di = tci->devlist; di != NULL; di = di->next) {
+			if (di->device_id == device_id)
+				break;
+		}
+
+		if (di == NULL || di->cur == 0 || di->view.active)
+			continue;
+
+		if (tci->proto_version >= 2) {
+			want_v2 = 1;
+
+			/* Key this sweep for a client which lost its keyframe, unless it
+			 * would only be decimated away again */
+			if (di->need_key && wts_cli_decimate_due(tci, di, &(sweep->tm_start)))
+				dev->force_key = 1;
+		} else {
+			want_v1 = 1;
+		}
+	}
+
+	if (want_v1 == 0 && want_v2 == 0)
+		return 1;
+
+	if (wts_frame_fits(dev, spectool_fr_header_size() + len) == 0)
+		return 1;
+
+	/* Batch space for the encodings somebody wants, and the most either adds
+	 * to a frame */
+	need = (want_v1 ? len : 0) + (want_v2 ? dmax : 0);
+	blen = want_v2 && dmax > len ? dmax : len;
+
+	/* Too big to batch; flush first so sweeps still go out in order */
+	if (need > WTS_BATCH_BUF) {
+		wts_batch_flush(wts, errstr);
+		wts_send_unbatched(wts, dev, sweep, errstr);
+		return 1;
+	}
+
+	/* A batch only holds one sweep per device, and has to fit */
+	for (x = 0; x < wts->batch_len; x++) {
+		if (wts->batch[x].device_id == device_id)
+			break;
+	}
+
+	if (x < wts->batch_len || wts->batch_len >= WTS_BATCH_MAX ||
+		wts->batch_bytes + need > WTS_BATCH_BUF ||
+		(wts->batch_len > 0 && wts_batch_frame_len(wts) + blen > WTS_BATCH_SZ))
+		wts_batch_flush(wts, errstr);
+
+	if (wts->batch_len == 0) {
+		gettimeofday(&(wts->batch_deadline), NULL);
+		wts->batch_deadline.tv_usec += WTS_BATCH_USEC;
+		if (wts->batch_deadline.tv_usec >= 1000000) {
+			wts->batch_deadline.tv_sec++;
+			wts->batch_deadline.tv_usec -= 1000000;
+		}
+	}
+
+	be = &(wts->batch[wts->batch_len++]);
+	be->device_id = device_id;
+	be->ts = sweep->tm_start;
+	be->offset = be->doffset = wts->batch_bytes;
+	be->len = be->dlen = 0;
+	be->key = 0;
+
+	if (want_v1) {
+		be->len = spectool_net_encode_sweep(&(wts->batch_buf[wts->batch_bytes]),
+											device_id, SPECTOOL_NET_SWEEPTYPE_CUR,
+											sweep);
+		wts->batch_bytes += be->len;
+	}
+
+	if (want_v2) {
+		be->doffset = wts->batch_bytes;
+		be->dlen = wts_encode_delta(dev, sweep, 
+									&(wts->batch_buf[wts->batch_bytes]),
+									&(be->key));
+		wts->batch_bytes += be->dlen;
+	}
+
+	/* Don't hold a batch another sweep this size couldn't join */
+	if (wts_batch_frame_len(wts) + blen > WTS_BATCH_SZ || 
+		wts->batch_len >= wts->ndev)
+		wts_batch_flush(wts, errstr);
+
+	return 1;
+}
+
+/* Change which of a device's sweep streams a client gets */
+int wts_cli_subscribe(spectool_tcpserv_dev *dev, spectool_tcpcli_dev *di,
+					  int sweep_type, int window, unsigned int interval_ms) {
+	wts_sub *sub;
+
+	if (sweep_type == SPECTOOL_NET_SWEEPTYPE_CUR) {
+		di->cur = interval_ms != 0;
+		return 1;
+	}
+
+	if (sweep_type != SPECTOOL_NET_SWEEPTYPE_AVG &&
+		sweep_type != SPECTOOL_NET_SWEEPTYPE_PEAK)
+		return -1;
+
+	sub = &(di->agg[sweep_type - SPECTOOL_NET_SWEEPTYPE_AVG]);
+
+	if (sub->agg != NULL) {
+		wts_agg_release(dev, sub->agg);
+		sub->agg = NULL;
+	}
+
+	if (interval_ms == 0)
+		return 1;
+
+	if (window < 1)
+		window = 1;
+	if (window > WTS_AGG_WINDOW_MAX)
+		window = WTS_AGG_WINDOW_MAX;
+	if (interval_ms < WTS_AGG_INTERVAL_MIN)
+		interval_ms = WTS_AGG_INTERVAL_MIN;
+
+	sub->agg = wts_agg_get(dev, sweep_type, window);
+	sub->interval_ms = interval_ms;
+	timerclear(&(sub->last_sent));
+
+	return 1;
+}
+
+spectool_sample_sweep *wts_agg_sweep(wts_agg *a) {
+	if (a->sweep_type == SPECTOOL_NET_SWEEPTYPE_AVG)
+		return a->cache->avg;
+
+	return a->cache->roll_peak;
+}
+
+/* Set or clear a client's view of a device */
+int wts_cli_setview(spectool_tcpserv_dev *dev, spectool_tcpcli_dev *di,
+					unsigned int start_khz, unsigned int end_khz, int num_bins,
+					int reduce) {
+	wts_view v;
+
+	if (start_khz == 0 && end_khz == 0 && num_bins == 0) {
+		/* Back on the shared delta stream, which may have rekeyed since */
+		if (di->view.active)
+			di->need_key = 1;
+		di->view.active = 0;
+		return 1;
+	}
+
+	memset(&v, 0, sizeof(wts_view));
+
+	v.active = 1;
+	v.start_khz = start_khz;
+	v.end_khz = end_khz;
+	v.num_bins = num_bins;
+	v.reduce = 
+		reduce == SPECTOOL_NET_VIEW_MEAN ? SPECTOOL_NET_VIEW_MEAN : SPECTOOL_NET_VIEW_MAX;
+
+	if (wts_view_fit(&v, spectool_phy_getcurprofile(&(dev->phydev))) < 0)
+		return -1;
+
+	di->view = v;
+
+	return 1;
+}
+
+/* Build a one block SWEEP frame holding an aggregate */
+spectool_netframe *wts_agg_encode(spectool_tcpserv *wts, spectool_tcpserv_dev *dev,
+								  wts_agg *a) {
+	spectool_netframe *f;
+	spectool_fr_header *hdr;
+	spectool_sample_sweep *sweep = wts_agg_sweep(a);
+	uint32_t device_id = dev->phydev.device_spec->device_id;
+
+	if (wts_frame_fits(dev, spectool_fr_header_size() + 
+					   spectool_fr_sweep_size(sweep->num_samples)) == 0)
+		return NULL;
+
+	f = wts_frame_alloc(wts, spectool_fr_header_size() + 
+						spectool_fr_sweep_size(sweep->num_samples));
+	f->sweep = 1;
+	f->sweep_type = a->sweep_type;
+	f->devices[f->num_devices++] = device_id;
+
+	hdr = (spectool_fr_header *) f->data;
 
 	hdr->sentinel = htonl(SPECTOOL_NET_SENTINEL);
-	hdr->frame_len = htons(spectool_fr_header_size() + 
-						   spectool_fr_sweep_size(sweep->num_samples));
+	hdr->frame_len = htons(f->len);
 	hdr->proto_version = SPECTOOL_NET_PROTO_VERSION;
 	hdr->block_type = SPECTOOL_NET_FRAME_SWEEP;
 	hdr->num_blocks = 1;
 
-	fsweep = (spectool_fr_sweep *) hdr->data;
+	spectool_net_encode_sweep(hdr->data, device_id, a->sweep_type, sweep);
+
+	return f;
+}
 
-	fsweep->frame_len = htons(spectool_fr_sweep_size(sweep->num_samples));
-	fsweep->device_id = htonl(phydev->device_spec->device_id);
+/* Fold a sweep into the device aggregates, and send them to the subscribers
+ * whose interval is up.  Each aggregate is encoded at most once per sweep 
+ * however many clients get it */
+int wts_send_aggregates(spectool_tcpserv *wts, spectool_tcpserv_dev *dev,
+						spectool_sample_sweep *sweep, char *errstr) {
+	spectool_tcpcli *tci;
+	spectool_tcpcli_dev *di;
+	wts_sub *sub;
+	wts_agg *a;
+	spectool_netframe *f;
+	struct timeval now;
+	uint32_t device_id = dev->phydev.device_spec->device_id;
+	long elapsed;
+	int t;
+
+	if (dev->aggs == NULL)
+		return 1;
+
+	for (a = dev->aggs; a != NULL; a = a->next) {
+		/* A new profile starts the window over */
+		if (a->cache->latest != NULL && 
+			a->cache->latest->num_samples != sweep->num_samples)
+			spectool_cache_clear(a->cache);
+
+		spectool_cache_append(a->cache, sweep);
+	}
 
-	fsweep->sweep_type = SPECTOOL_NET_SWEEPTYPE_CUR;
+	gettimeofday(&now, NULL);
 
-	fsweep->start_sec = htonl(sweep->tm_start.tv_sec);
-	fsweep->start_usec = htonl(sweep->tm_start.tv_usec);
+	for (tci = wts->cli_list; tci != NULL; tci = tci->next) {
+		for (di = tci->devlist; di != NULL; di = di->next) {
+			if (di->device_id == device_id)
+				break;
+		}
 
-	for (x = 0; x < sweep->num_samples; x++)
-		fsweep->sample_data[x] = sweep->sample_data[x];
+		if (di == NULL)
+			continue;
 
-	tci = wts->cli_list;
-	while (tci != NULL) {
-		int send = 0;
+		for (t = 0; t < WTS_AGG_TYPES; t++) {
+			sub = &(di->agg[t]);
 
-		spectool_tcpcli_dev *di = tci->devlist;
-		while (di != NULL) {
-			if (di->device_id == phydev->device_spec->device_id) {
-				send = 1;
-				break;
+			if (sub->agg == NULL)
+				continue;
+
+			elapsed = (now.tv_sec - sub->last_sent.tv_sec) * 1000L +
+				(now.tv_usec - sub->last_sent.tv_usec) / 1000L;
+
+			if (timerisset(&(sub->last_sent)) && elapsed >= 0 &&
+				elapsed < sub->interval_ms)
+				continue;
+
+			sub->last_sent = now;
+
+			/* Views get their own cut of the aggregate */
+			if (di->view.active) {
+				if (wts_cli_view_refit(wts, tci, di, wts_agg_sweep(sub->agg),
+									   errstr) < 0)
+					continue;
+
+				if ((f = wts_view_encode(wts, dev, &(di->view), sub->agg->sweep_type,
+										 wts_agg_sweep(sub->agg))) != NULL) {
+					wts_cli_queue_sweep(wts, tci, f, errstr);
+					wts_frame_unref(wts, f);
+				}
+
+				continue;
 			}
 
-			di = di->next;
-		}
+			if (sub->agg->frame == NULL &&
+				(sub->agg->frame = wts_agg_encode(wts, dev, sub->agg)) == NULL)
+				continue;
 
-		if (send) {
-			if (wts_cli_append(tci, (uint8_t *) hdr,
-							   spectool_fr_header_size() + 
-							   spectool_fr_sweep_size(sweep->num_samples),
-							   errstr) < 0)
-				printf("Failure to send\n");
+			wts_cli_queue_sweep(wts, tci, sub->agg->frame, errstr);
 		}
+	}
 
-		tci = tci->next;
+	for (a = dev->aggs; a != NULL; a = a->next) {
+		if (a->frame != NULL) {
+			wts_frame_unref(wts, a->frame);
+			a->frame = NULL;
+		}
 	}
 
-	free(hdr);
-	
 	return 1;
 }
 
@@ -425,7 +1866,7 @@ int wts_handle_command(spectool_tcpserv *wts, spectool_tcpcli *tci,
 	int blk, offt = 0;
 	spectool_fr_command *ch;
 	spectool_tcpcli_dev *di, *pdi;
-	int did, x;
+	int did, x, t;
 
 	if (ntohs(frh->frame_len) < spectool_fr_command_size(0)) {
 		fprintf(stderr, "Short command frame, something is wrong, "
@@ -487,8 +1928,19 @@ int wts_handle_command(spectool_tcpserv *wts, spectool_tcpcli *tci,
 			di = (spectool_tcpcli_dev *) malloc(sizeof(spectool_tcpcli_dev));
 			di->next = tci->devlist;
 			di->device_id = ntohl(ce->device_id);
+			di->last_queued.tv_sec = 0;
+			di->last_queued.tv_usec = 0;
+			di->need_key = 0;
+			di->cur = 1;
+			for (t = 0; t < WTS_AGG_TYPES; t++)
+				di->agg[t].agg = NULL;
+			di->view.active = 0;
 			tci->devlist = di;
 
+			/* Give a new delta client something to decode against */
+			if (tci->proto_version >= 2)
+				wts->devs[x].force_key = 1;
+
 		} else if (ch->command_id == SPECTOOL_NET_COMMAND_DISABLEDEV) {
 			spectool_fr_command_disabledev *cd;
 			int matched = 0;
@@ -501,10 +1953,11 @@ int wts_handle_command(spectool_tcpserv *wts, spectool_tcpcli *tci,
 
 			cd = (spectool_fr_command_disabledev *) ch->command_data;
 
-			/* Shortcut removing the only device */
+			/* Shortcut removing the first device */
 			if (tci->devlist != NULL && tci->devlist->device_id == ntohl(cd->device_id)) {
-				free(tci->devlist);
-				tci->devlist = NULL;
+				di = tci->devlist;
+				tci->devlist = di->next;
+				wts_cli_dev_free(wts, di);
 				continue;
 			}
 
@@ -514,9 +1967,9 @@ int wts_handle_command(spectool_tcpserv *wts, spectool_tcpcli *tci,
 				pdi = di;
 				di = di->next;
 
-				if (di->device_id == ntohl(cd->device_id)) {
+				if (di != NULL && di->device_id == ntohl(cd->device_id)) {
 					pdi->next = di->next;
-					free(di);
+					wts_cli_dev_free(wts, di);
 					break;
 				}
 			}
@@ -527,103 +1980,278 @@ int wts_handle_command(spectool_tcpserv *wts, spectool_tcpcli *tci,
 				fprintf(stderr, "Short setscan frame, something is wrong, skipping\n");
 				continue;
 			}
-		}
-	}
+		} else if (ch->command_id == SPECTOOL_NET_COMMAND_SUBSCRIBE) {
+			spectool_fr_command_subscribe *cs;
+			spectool_tcpserv_dev *dev;
 
-	return 1;
-}
+			if (ntohs(ch->frame_len) < 
+				spectool_fr_command_size(spectool_fr_command_subscribe_size())) {
+				fprintf(stderr, "Short subscribe frame, something is wrong, skipping\n");
+				continue;
+			}
 
-int wts_poll(spectool_tcpserv *wts, fd_set *rfd, fd_set *wfd, char *errstr) {
-	spectool_tcpcli *tci = NULL, *tcb = NULL;
-	int x = 0, r = 0;
+			cs = (spectool_fr_command_subscribe *) ch->command_data;
 
-	tci = wts->cli_list;
-	while (tci != NULL) {
-		tcb = tci;
-		tci = tci->next;
+			for (di = tci->devlist; di != NULL; di = di->next) {
+				if (di->device_id == ntohl(cs->device_id))
+					break;
+			}
+
+			if (di == NULL || (dev = wts_find_dev(wts, di->device_id)) == NULL) {
+				fprintf(stderr, "Subscribe for a device which isn't enabled, "
+						"skipping\n");
+				continue;
+			}
 
-		if (FD_ISSET(tcb->fd, wfd)) {
-			int res;
+			if (wts_cli_subscribe(dev, di, cs->sweep_type, ntohs(cs->window_sweeps),
+								  ntohl(cs->interval_ms)) < 0) {
+				fprintf(stderr, "Subscribe for unknown sweep type %u, skipping\n",
+						cs->sweep_type);
+				continue;
+			}
+		} else if (ch->command_id == SPECTOOL_NET_COMMAND_SETVIEW) {
+			spectool_fr_command_setview *cv;
+			spectool_tcpserv_dev *dev;
+			char errstr[SPECTOOL_ERROR_MAX];
 
-			if ((res = write(tcb->fd, &(tcb->wbuf[tcb->write_pos]),
-							 tcb->write_fill - tcb->write_pos)) < 0) {
-				snprintf(errstr, SPECTOOL_ERROR_MAX, "write() failed on fd %d %s",
-						 tcb->fd, strerror(errno));
-				wts_remove(wts, tcb, errstr);
-				return 0;
+			if (ntohs(ch->frame_len) < 
+				spectool_fr_command_size(spectool_fr_command_setview_size())) {
+				fprintf(stderr, "Short setview frame, something is wrong, skipping\n");
+				continue;
 			}
 
-			tcb->write_pos += res;
+			cv = (spectool_fr_command_setview *) ch->command_data;
 
-			if (tcb->write_pos >= tcb->write_fill) {
-				tcb->write_fill = 0;
-				tcb->write_pos = 0;
+			for (di = tci->devlist; di != NULL; di = di->next) {
+				if (di->device_id == ntohl(cv->device_id))
+					break;
 			}
-		}
 
-		if (FD_ISSET(tcb->fd, rfd)) {
-			int res;
+			if (di == NULL || (dev = wts_find_dev(wts, di->device_id)) == NULL) {
+				fprintf(stderr, "Setview for a device which isn't enabled, "
+						"skipping\n");
+				continue;
+			}
 
-			if ((res = read(tcb->fd, 
-							&(tcb->rbuf[tcb->read_fill]),
-							CLI_BUF_SZ - tcb->read_fill)) <= 0) {
-				if (errno == EAGAIN)
-					continue;
+			if (wts_cli_setview(dev, di, ntohl(cv->start_khz), ntohl(cv->end_khz),
+								ntohs(cv->num_bins), cv->reduce) < 0) {
+				fprintf(stderr, "Setview outside the device sweep, skipping\n");
+				continue;
+			}
 
-				snprintf(errstr, SPECTOOL_ERROR_MAX, 
-						 "fd %d read error %s\n", tcb->fd, strerror(errno));
+			/* Tell the client what the sweeps will look like now */
+			if (wts_send_devblock(wts, tci, errstr) < 0) {
+				fprintf(stderr, "%s\n", errstr);
+				return -1;
+			}
+		} else if (ch->command_id == SPECTOOL_NET_COMMAND_PROTO) {
+			spectool_fr_command_proto *cp;
 
-				wts_remove(wts, tcb, errstr);
-				return 0;
+			if (ntohs(ch->frame_len) < 
+				spectool_fr_command_size(spectool_fr_command_proto_size())) {
+				fprintf(stderr, "Short proto frame, something is wrong, skipping\n");
+				continue;
 			}
 
-			tcb->read_fill += res;
+			cp = (spectool_fr_command_proto *) ch->command_data;
 
-			/* Process incoming packets */
-			while (tcb->read_pos < tcb->read_fill &&
-				   tcb->read_fill - tcb->read_pos > spectool_fr_header_size()) {
-				spectool_fr_header *frh = (spectool_fr_header *) &(tcb->rbuf[tcb->read_pos]);
+			/* Speak the newest version we both know */
+			if (cp->proto_version < SPECTOOL_NET_PROTO_VERSION)
+				tci->proto_version = cp->proto_version;
+			else
+				tci->proto_version = SPECTOOL_NET_PROTO_VERSION;
+		}
+	}
 
-				if (ntohl(frh->sentinel) != SPECTOOL_NET_SENTINEL) {
-					tcb->read_fill = 0;
-					tcb->read_pos = 0;
-					/* Yes, I know, 'goto'.  Go away. */
-					goto read_done;
-				}
+	return 1;
+}
 
-				/* Look for a complete frame */
-				if (ntohs(frh->frame_len) > (tcb->read_fill - tcb->read_pos)) {
-					goto read_done;
-				}
+/* Read everything pending from a client and process any complete frames.
+ * Returns -1 if the client should be dropped */
+int wts_cli_read(spectool_tcpserv *wts, spectool_tcpcli *tcb, char *errstr) {
+	int res;
+
+	while (1) {
+		/* A frame which can't fit in the buffer is junk, throw it out */
+		if (tcb->read_fill >= CLI_BUF_SZ) {
+			tcb->read_fill = 0;
+			tcb->read_pos = 0;
+		}
 
-				/* advance to the end of the frame */
-				tcb->read_pos += ntohs(frh->frame_len);
+		if ((res = read(tcb->fd, 
+						&(tcb->rbuf[tcb->read_fill]),
+						CLI_BUF_SZ - tcb->read_fill)) <= 0) {
+			if (res < 0 && errno == EINTR)
+				continue;
 
-				if (frh->block_type == SPECTOOL_NET_FRAME_COMMAND) {
-					wts_handle_command(wts, tcb, frh);
-				}
+			if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 1;
 
-				/* Ignore other block types */
+			snprintf(errstr, SPECTOOL_ERROR_MAX, 
+					 "fd %d read error %s\n", tcb->fd, 
+					 res == 0 ? "connection closed" : strerror(errno));
 
+			return -1;
+		}
+
+		tcb->read_fill += res;
+
+		/* Process incoming packets */
+		while (tcb->read_pos < tcb->read_fill &&
+			   tcb->read_fill - tcb->read_pos > spectool_fr_header_size()) {
+			spectool_fr_header *frh = (spectool_fr_header *) &(tcb->rbuf[tcb->read_pos]);
+
+			if (ntohl(frh->sentinel) != SPECTOOL_NET_SENTINEL) {
+				tcb->read_fill = 0;
+				tcb->read_pos = 0;
+				break;
+			}
+
+			/* Look for a complete frame */
+			if (ntohs(frh->frame_len) > (tcb->read_fill - tcb->read_pos)) {
+				break;
+			}
+
+			/* advance to the end of the frame */
+			tcb->read_pos += ntohs(frh->frame_len);
+
+			if (frh->block_type == SPECTOOL_NET_FRAME_COMMAND) {
+				wts_handle_command(wts, tcb, frh);
 			}
+
+			/* Ignore other block types */
 		}
 
-		/* Yes, goto is bad.  But it also makes sense here when we have multiply 
-		 * nested loops processing data blocks */
-read_done:
-		/* reset the frame buffer if we've processed everything */
+		/* reset the frame buffer if we've processed everything, otherwise
+		 * slide the partial frame down to make room */
 		if (tcb->read_pos >= tcb->read_fill) {
 			tcb->read_pos = 0;
 			tcb->read_fill = 0;
+		} else if (tcb->read_pos > 0) {
+			memmove(tcb->rbuf, &(tcb->rbuf[tcb->read_pos]), 
+					tcb->read_fill - tcb->read_pos);
+			tcb->read_fill -= tcb->read_pos;
+			tcb->read_pos = 0;
 		}
 	}
 
-	if (FD_ISSET(wts->bindfd, rfd)) {
-		if ((tci = wts_accept(wts, errstr)) == NULL)
+	return 1;
+}
+
+/* Client socket handler.  A client failing only drops that client */
+int wts_client_event(spectool_tcpserv *wts, wts_evsrc *ev, unsigned int events,
+					 char *errstr) {
+	spectool_tcpcli *tcb = (spectool_tcpcli *) ev->aux;
+
+	if ((events & WTS_EV_WRITE)) {
+		if (wts_cli_flush(wts, tcb, errstr) < 0) {
+			wts_remove(wts, tcb, errstr);
+			return 0;
+		}
+	}
+
+	if ((events & WTS_EV_READ)) {
+		if (wts_cli_read(wts, tcb, errstr) < 0) {
+			wts_remove(wts, tcb, errstr);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Listening socket handler */
+int wts_accept_event(spectool_tcpserv *wts, wts_evsrc *ev, unsigned int events,
+					 char *errstr) {
+	spectool_tcpcli *tci;
+
+	if ((tci = wts_accept(wts, errstr)) == NULL)
+		return -1;
+
+	/* Send them a device block */
+	if (wts_send_devblock(wts, tci, errstr) < 0)
+		return -1;
+
+	return 1;
+}
+
+/* Device poll handler */
+int wts_device_event(spectool_tcpserv *wts, wts_evsrc *ev, unsigned int events,
+					 char *errstr) {
+	spectool_tcpserv_dev *dev = (spectool_tcpserv_dev *) ev->aux;
+	int x = dev - wts->devs;
+	int r;
+
+	if (spectool_get_state(&(dev->phydev)) == SPECTOOL_STATE_ERROR) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Spectool phy %d in error state: %s", 
+				 x, spectool_get_error(&(dev->phydev)));
+		return -1;
+	}
+
+	do {
+		r = spectool_phy_poll(&(dev->phydev));
+
+		if ((r & SPECTOOL_POLL_ERROR)) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "Spectool phy %d poll failed: %s", 
+					 x, spectool_get_error(&(dev->phydev)));
 			return -1;
+		}
+
+		if ((r & SPECTOOL_POLL_SWEEPCOMPLETE)) {
+			if (wts_send_sweepblock(wts, dev,
+									spectool_phy_getsweep(&(dev->phydev)),
+									errstr) < 0)
+				return -1;
+
+			wts_send_aggregates(wts, dev, spectool_phy_getsweep(&(dev->phydev)),
+								errstr);
+		}
+	} while ((r & SPECTOOL_POLL_ADDITIONAL));
+
+	return 1;
+}
+
+/* Write out everything queued since the last pass, for any client which 
+ * isn't already waiting on a full socket */
+void wts_flush_pending(spectool_tcpserv *wts, char *errstr) {
+	spectool_tcpcli *tci;
+
+	while ((tci = wts->flush_list) != NULL) {
+		wts->flush_list = tci->flush_next;
+		tci->flush_pending = 0;
+		tci->flush_next = NULL;
+
+		if (tci->wblocked || tci->wq_len == 0)
+			continue;
+
+		if (wts_cli_flush(wts, tci, errstr) < 0)
+			wts_remove(wts, tci, errstr);
+	}
+}
+
+int wts_poll(spectool_tcpserv *wts, fd_set *rfd, fd_set *wfd, char *errstr) {
+	spectool_tcpcli *tci = NULL, *tcb = NULL;
+	unsigned int events;
+	int x = 0;
+
+	tci = wts->cli_list;
+	while (tci != NULL) {
+		tcb = tci;
+		tci = tci->next;
 
-		/* Send them a device block */
-		if (wts_send_devblock(wts, tci, errstr) < 0)
+		events = 0;
+
+		if (FD_ISSET(tcb->fd, wfd))
+			events |= WTS_EV_WRITE;
+		if (FD_ISSET(tcb->fd, rfd))
+			events |= WTS_EV_READ;
+
+		if (events)
+			wts_client_event(wts, &(tcb->ev), events, errstr);
+	}
+
+	if (FD_ISSET(wts->bindfd, rfd)) {
+		if (wts_accept_event(wts, NULL, WTS_EV_READ, errstr) < 0)
 			return -1;
 	}
 
@@ -637,24 +2265,13 @@ read_done:
 		if (FD_ISSET(spectool_phy_getpollfd(&(wts->devs[x].phydev)), rfd) == 0)
 			continue;
 
-		do {
-			r = spectool_phy_poll(&(wts->devs[x].phydev));
-
-			if ((r & SPECTOOL_POLL_ERROR)) {
-				snprintf(errstr, SPECTOOL_ERROR_MAX, "Spectool phy %d poll failed: %s", 
-						 x, spectool_get_error(&(wts->devs[x].phydev)));
-				return -1;
-			}
-
-			if ((r & SPECTOOL_POLL_SWEEPCOMPLETE)) {
-				if (wts_send_sweepblock(wts, &(wts->devs[x].phydev),
-										spectool_phy_getsweep(&(wts->devs[x].phydev)),
-										errstr) < 0)
-					return -1;
-			}
-		} while ((r & SPECTOOL_POLL_ADDITIONAL));
+		if (wts_device_event(wts, &(wts->devs[x].ev), WTS_EV_READ, errstr) < 0)
+			return -1;
 	}
 
+	wts_batch_check(wts, errstr);
+	wts_flush_pending(wts, errstr);
+
 	return 1;
 }
 
@@ -664,11 +2281,19 @@ void wts_shutdown(spectool_tcpserv *wts) {
 	while (tci != NULL) {
 		spectool_tcpcli *tcb = tci;
 		close(tci->fd);
+		wts_cli_purge(wts, tci);
 		tci = tci->next;
 		free(tcb);
 	}
 
 	close(wts->bindfd);
+
+	if (wts->bcast_ev.fd >= 0)
+		close(wts->bcast_ev.fd);
+	if (wts->stats_ev.fd >= 0)
+		close(wts->stats_ev.fd);
+	if (wts->epfd >= 0)
+		close(wts->epfd);
 }
 
 int wts_init_bcast(char *errstr, int port) {
@@ -733,13 +2358,190 @@ int wts_send_bcast(int sock, short int port, char *errstr) {
 	return 1;
 }
 
+#ifdef WTS_USE_EPOLL
+/* Most events handled per epoll_wait */
+#define WTS_EPOLL_EVENTS	64
+
+int wts_epoll_add(spectool_tcpserv *wts, wts_evsrc *ev, int edge, char *errstr) {
+	struct epoll_event eev;
+
+	memset(&eev, 0, sizeof(struct epoll_event));
+
+	eev.events = EPOLLIN;
+	if (edge)
+		eev.events |= EPOLLOUT | EPOLLET;
+	eev.data.ptr = ev;
+
+	if (epoll_ctl(wts->epfd, EPOLL_CTL_ADD, ev->fd, &eev) < 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "epoll_ctl() failed on fd %d %s",
+				 ev->fd, strerror(errno));
+		return -1;
+	}
+
+	return 1;
+}
+
+/* Broadcast timer handler */
+int wts_bcast_event(spectool_tcpserv *wts, wts_evsrc *ev, unsigned int events,
+					char *errstr) {
+	uint64_t expirations;
+
+	if (read(ev->fd, &expirations, sizeof(uint64_t)) < 0) {
+		if (errno == EAGAIN)
+			return 1;
+
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "broadcast timer read() failed %s",
+				 strerror(errno));
+		return -1;
+	}
+
+	return wts_send_bcast(wts->bcast_sock, wts->port, errstr);
+}
+
+/* Stats timer handler */
+int wts_stats_event(spectool_tcpserv *wts, wts_evsrc *ev, unsigned int events,
+					char *errstr) {
+	uint64_t expirations;
+
+	if (read(ev->fd, &expirations, sizeof(uint64_t)) < 0) {
+		if (errno == EAGAIN)
+			return 1;
+
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "stats timer read() failed %s",
+				 strerror(errno));
+		return -1;
+	}
+
+	return wts_send_stats(wts, errstr);
+}
+
+/* Register the listen socket, devices, and timers once; clients are added 
+ * as they're accepted */
+int wts_epoll_init(spectool_tcpserv *wts, char *errstr) {
+	struct itimerspec its;
+	int x;
+
+	if ((wts->epfd = epoll_create(WTS_EPOLL_EVENTS)) < 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "epoll_create() failed %s", 
+				 strerror(errno));
+		return -1;
+	}
+
+	wts->bind_ev.fd = wts->bindfd;
+	wts->bind_ev.handler = &wts_accept_event;
+	wts->bind_ev.aux = NULL;
+
+	if (wts_epoll_add(wts, &(wts->bind_ev), 0, errstr) < 0)
+		return -1;
+
+	for (x = 0; x < wts->ndev; x++) {
+		if (wts_epoll_add(wts, &(wts->devs[x].ev), 0, errstr) < 0)
+			return -1;
+	}
+
+	if (wts->bcast_sock >= 0 && wts->bcast_secs > 0) {
+		if ((wts->bcast_ev.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "timerfd_create() failed %s",
+					 strerror(errno));
+			return -1;
+		}
+
+		memset(&its, 0, sizeof(struct itimerspec));
+		its.it_value.tv_sec = wts->bcast_secs;
+		its.it_interval.tv_sec = wts->bcast_secs;
+
+		if (timerfd_settime(wts->bcast_ev.fd, 0, &its, NULL) < 0) {
+			snprintf(errstr, SPECTOOL_ERROR_MAX, "timerfd_settime() failed %s",
+					 strerror(errno));
+			return -1;
+		}
+
+		wts->bcast_ev.handler = &wts_bcast_event;
+		wts->bcast_ev.aux = NULL;
+
+		if (wts_epoll_add(wts, &(wts->bcast_ev), 0, errstr) < 0)
+			return -1;
+	}
+
+	if ((wts->stats_ev.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "timerfd_create() failed %s",
+				 strerror(errno));
+		return -1;
+	}
+
+	memset(&its, 0, sizeof(struct itimerspec));
+	its.it_value.tv_sec = WTS_STATS_SECS;
+	its.it_interval.tv_sec = WTS_STATS_SECS;
+
+	if (timerfd_settime(wts->stats_ev.fd, 0, &its, NULL) < 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "timerfd_settime() failed %s",
+				 strerror(errno));
+		return -1;
+	}
+
+	wts->stats_ev.handler = &wts_stats_event;
+	wts->stats_ev.aux = NULL;
+
+	if (wts_epoll_add(wts, &(wts->stats_ev), 0, errstr) < 0)
+		return -1;
+
+	return 1;
+}
+
+/* Wait for events and dispatch only the ready fds to their handlers */
+int wts_epoll_poll(spectool_tcpserv *wts, char *errstr) {
+	struct epoll_event events[WTS_EPOLL_EVENTS];
+	wts_evsrc *ev;
+	unsigned int mask;
+	long timeout;
+	int n, x;
+
+	/* Wake up in time to send a pending batch, rounding up to a full ms */
+	if ((timeout = wts_batch_timeout(wts)) > 0)
+		timeout = (timeout + 999) / 1000;
+
+	if ((n = epoll_wait(wts->epfd, events, WTS_EPOLL_EVENTS, (int) timeout)) < 0) {
+		if (errno == EINTR)
+			return 1;
+
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "epoll_wait() failed %s", 
+				 strerror(errno));
+		return -1;
+	}
+
+	for (x = 0; x < n; x++) {
+		ev = (wts_evsrc *) events[x].data.ptr;
+		mask = 0;
+
+		if ((events[x].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			mask |= WTS_EV_READ;
+		if ((events[x].events & EPOLLOUT))
+			mask |= WTS_EV_WRITE;
+
+		if ((*(ev->handler))(wts, ev, mask, errstr) < 0)
+			return -1;
+	}
+
+	wts_batch_check(wts, errstr);
+	wts_flush_pending(wts, errstr);
+
+	return 1;
+}
+#endif
+
 void Usage() {
 	printf("spectool_net [-b <secs>] [-p <port>] [-a <bind address>]\n"
 		   " --broadcast/-b  <secs>	    Send broadcast announce\n"
 		   " --port/-p <port>           Use alternate port\n"
 		   " --bindaddr/-a <address>    Bind to specific address\n"
 		   " -l / --list				  List devices and ranges only\n"
-		   " -r / --range [device:]range  Configure a device for a specific range\n");
+		   " -r / --range [device:]range  Configure a device for a specific range\n"
+		   " -q / --queue <policy>        Sweep policy for slow clients:\n"
+		   "                              oldest      drop oldest queued (default)\n"
+		   "                              latest      only newest sweep per device\n"
+		   "                              decimate:N  N sweeps/sec per device\n"
+		   " -s / --stats <secs>          Log device pipeline counters every\n"
+		   "                              <secs> seconds\n");
 }
 
 void sigcatch(int sig) {
@@ -750,8 +2552,11 @@ void sigcatch(int sig) {
 int main(int argc, char *argv[]) {
 	spectool_tcpserv wts;
 	char errstr[SPECTOOL_ERROR_MAX];
+#ifndef WTS_USE_EPOLL
 	fd_set sel_r_fds, sel_w_fds;
 	struct timeval tm;
+	time_t last_bcast = 0;
+#endif
 	
 	spectool_device_list list;
 	spectool_tcpserv_dev *devs = NULL;
@@ -766,6 +2571,8 @@ int main(int argc, char *argv[]) {
 		{ "help", no_argument, 0, 'h' },
 		{ "list", no_argument, 0, 'l' },
 		{ "range", required_argument, 0, 'r' },
+		{ "queue", required_argument, 0, 'q' },
+		{ "stats", required_argument, 0, 's' },
 		{ 0, 0, 0, 0 }
 	};
 	int option_index;
@@ -774,10 +2581,13 @@ int main(int argc, char *argv[]) {
 	short int bindport = SPECTOOL_NET_DEFAULT_PORT;
 
 	int broadcast = 0, bcast_sock = -1;
-	time_t last_bcast = 0;
 
 	int list_only = 0;
 
+	int policy = WTS_POLICY_DROPOLDEST, decimate_hz = 0;
+
+	int stats_secs = 0;
+
 	ndev = spectool_device_scan(&list);
 
 	int *rangeset = NULL;
@@ -787,7 +2597,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	while (1) {
-		int o = getopt_long(argc, argv, "p:a:b:lr:h",
+		int o = getopt_long(argc, argv, "p:a:b:lr:q:s:h",
 							long_options, &option_index);
 
 		if (o < 0)
@@ -813,6 +2623,26 @@ int main(int argc, char *argv[]) {
 			}
 		} else if (o == 'l') {
 			list_only = 1;
+		} else if (o == 's') {
+			if (sscanf(optarg, "%d", &stats_secs) != 1 || stats_secs <= 0) {
+				fprintf(stderr, "Expected stats interval in seconds\n");
+				Usage();
+				exit(-1);
+			}
+		} else if (o == 'q') {
+			if (strcmp(optarg, "oldest") == 0) {
+				policy = WTS_POLICY_DROPOLDEST;
+			} else if (strcmp(optarg, "latest") == 0) {
+				policy = WTS_POLICY_LATEST;
+			} else if (sscanf(optarg, "decimate:%d", &decimate_hz) == 1 &&
+					   decimate_hz > 0) {
+				policy = WTS_POLICY_DECIMATE;
+			} else {
+				fprintf(stderr, "Invalid queue policy, expected oldest, latest, "
+						"or decimate:N\n");
+				Usage();
+				exit(-1);
+			}
 		} else if (o == 'r' && ndev > 0) {
 			if (sscanf(optarg, "%d:%d", &x, &r) != 2) {
 				if (sscanf(optarg, "%d", &r) != 1) {
@@ -884,6 +2714,15 @@ int main(int argc, char *argv[]) {
 				list.list[x].name, list.list[x].device_id);
 
 		devs[x].lock_fd = -1;
+		devs[x].key_data = NULL;
+		devs[x].key_samples = 0;
+		devs[x].key_seq = 0;
+		devs[x].since_key = 0;
+		devs[x].force_key = 0;
+		devs[x].oversize = 0;
+		devs[x].aggs = NULL;
+		devs[x].ev.handler = &wts_device_event;
+		devs[x].ev.aux = &(devs[x]);
 
 		if (spectool_device_init(&(devs[x].phydev), &(list.list[x])) < 0) {
 			fprintf(stderr, "Error initializing WiSPY device %s id %u\n",
@@ -903,6 +2742,8 @@ int main(int argc, char *argv[]) {
 
 		/* configure the default sweep block */
 		spectool_phy_setposition(&(devs[x].phydev), rangeset[x], 0, 0);
+
+		devs[x].ev.fd = spectool_phy_getpollfd(&(devs[x].phydev));
 	}
 	spectool_device_scan_free(&list);
 
@@ -914,11 +2755,19 @@ int main(int argc, char *argv[]) {
 			exit(1);
 		}
 
+#ifndef WTS_USE_EPOLL
 		last_bcast = time(0);
+#endif
 	}
 
 	wts.devs = devs;
 	wts.ndev = ndev;
+	wts.bcast_sock = bcast_sock;
+	wts.bcast_secs = broadcast;
+	wts.policy = policy;
+	wts.decimate_hz = decimate_hz;
+	wts.stats_log_secs = stats_secs;
+	wts.last_stats = wts.last_stats_log = time(0);
 
 	if (wts_bind(&wts, bindaddr, bindport, errstr) < 0) {
 		fprintf(stderr, "TCP bind failed: %s\n", errstr);
@@ -934,7 +2783,24 @@ int main(int argc, char *argv[]) {
 				bindport, broadcast);
 	}
 
+#ifdef WTS_USE_EPOLL
+	if (wts_epoll_init(&wts, errstr) < 0) {
+		fprintf(stderr, "Event loop init failed: %s\n", errstr);
+		wts_shutdown(&wts);
+		exit(1);
+	}
+
+	while (1) {
+		if (wts_epoll_poll(&wts, errstr) < 0) {
+			fprintf(stderr, "Polling failed: %s\n", errstr);
+			wts_shutdown(&wts);
+			exit(1);
+		}
+	}
+#else
 	while (1) {
+		long batch_usec;
+
 		FD_ZERO(&sel_r_fds);
 		FD_ZERO(&sel_w_fds);
 
@@ -943,6 +2809,9 @@ int main(int argc, char *argv[]) {
 		tm.tv_sec = 0;
 		tm.tv_usec = 100000;
 
+		if ((batch_usec = wts_batch_timeout(&wts)) >= 0 && batch_usec < tm.tv_usec)
+			tm.tv_usec = batch_usec;
+
 		if (broadcast > 0 && time(0) - last_bcast > broadcast) {
 			if (wts_send_bcast(bcast_sock, bindport, errstr) < 0) {
 				fprintf(stderr, "Sending broadcast packet failed, %s\n", errstr);
@@ -953,6 +2822,9 @@ int main(int argc, char *argv[]) {
 			last_bcast = time(0);
 		}
 
+		if (time(0) - wts.last_stats >= WTS_STATS_SECS)
+			wts_send_stats(&wts, errstr);
+
 		if (select(wts.maxfd + 1, &sel_r_fds, &sel_w_fds, NULL, &tm) < 0) {
 			fprintf(stderr, "Select() failed: %s\n", strerror(errno));
 			wts_shutdown(&wts);
@@ -965,5 +2837,6 @@ int main(int argc, char *argv[]) {
 			exit(1);
 		}
 	}
+#endif
 }
 
@@ -35,10 +35,127 @@
 
 #include "spectool_container.h"
 #include "spectool_net_client.h"
+#include "spectool_capture.h"
+#include "spectool_hop.h"
 
 spectool_phy *devs = NULL;
 int ndev = 0;
 
+/* Hop schedules, one per local device when hopping */
+typedef struct _raw_hop {
+	spectool_phy *phydev;
+	spectool_hop hop;
+	struct _raw_hop *next;
+} raw_hop;
+
+raw_hop *hops = NULL;
+char *hop_spec = NULL;
+
+#define RAW_HOP_CACHE		10
+
+spectool_hop *find_hop(spectool_phy *phydev) {
+	raw_hop *h;
+
+	for (h = hops; h != NULL; h = h->next) {
+		if (h->phydev == phydev)
+			return &(h->hop);
+	}
+
+	return NULL;
+}
+
+/* Binary captures, one per device and profile (or hop slot) */
+typedef struct _raw_capture {
+	spectool_phy *phydev;
+	int slot;
+	spectool_capture_writer writer;
+	unsigned int seq;
+	struct _raw_capture *next;
+} raw_capture;
+
+raw_capture *captures = NULL;
+char *capture_prefix = NULL;
+
+void capture_finish_all(void) {
+	raw_capture *c;
+	char errstr[SPECTOOL_ERROR_MAX];
+
+	for (c = captures; c != NULL; c = c->next) {
+		if (spectool_capture_finish(&(c->writer), errstr) < 0)
+			printf("%s\n", errstr);
+	}
+}
+
+/* Write a sweep to the device's capture, starting a new capture the first 
+ * time and whenever the profile changes.  Hopping devices keep a capture
+ * going per hop slot */
+int capture_sweep(spectool_phy *phydev, int slot, spectool_sample_sweep *sb, 
+				  char *errstr) {
+	raw_capture *c;
+	char path[1024];
+
+	for (c = captures; c != NULL; c = c->next) {
+		if (c->phydev == phydev && c->slot == slot)
+			break;
+	}
+
+	if (c == NULL) {
+		c = (raw_capture *) malloc(sizeof(raw_capture));
+		memset(c, 0, sizeof(raw_capture));
+		c->phydev = phydev;
+		c->slot = slot;
+		c->next = captures;
+		captures = c;
+	}
+
+	if (c->writer.file != NULL && 
+		(sb->num_samples != c->writer.header.num_samples ||
+		 sb->start_khz != c->writer.header.start_khz)) {
+		if (spectool_capture_finish(&(c->writer), errstr) < 0)
+			return -1;
+	}
+
+	if (c->writer.file == NULL) {
+		snprintf(path, 1024, "%s-%u-%u.spcap", capture_prefix, 
+				 spectool_phy_getdevid(phydev), c->seq++);
+
+		if (spectool_capture_create(&(c->writer), path, phydev->device_spec,
+									sb, errstr) < 0)
+			return -1;
+
+		printf("Writing %s to %s\n", spectool_phy_getname(phydev), path);
+	}
+
+	return spectool_capture_write(&(c->writer), sb, errstr);
+}
+
+void print_stats(char *what, spectool_phy *phydev, spectool_phy_stats *st) {
+	fprintf(stderr, "%s %s: %lu reports, %lu requeues, %lu overruns, "
+			"%lu short, %lu bad base, %lu discarded, %lu sweeps, %lu dropped, "
+			"%.1f sweeps/sec\n", what, spectool_phy_getname(phydev), 
+			st->reports, st->requeues, st->overruns, st->short_reports, 
+			st->bad_base, st->discarded, st->sweeps, st->sweeps_dropped, 
+			st->sweep_rate);
+}
+
+void print_hop_stats(spectool_phy *phydev, spectool_hop *hop) {
+	spectool_hop_stats st;
+	spectool_hop_slot *s;
+	int x;
+
+	spectool_hop_getstats(hop, &st);
+
+	fprintf(stderr, "Hop stats %s: %lu retunes, %.1f/%.1f/%.1f/%.1f ms "
+			"last/min/avg/max, %lu settling sweeps thrown away\n",
+			spectool_phy_getname(phydev), st.retunes, st.last_ms, st.min_ms, 
+			st.avg_ms, st.max_ms, st.settled);
+
+	for (x = 0; (s = spectool_hop_getslot(hop, x)) != NULL; x++) {
+		fprintf(stderr, "    %d: \"%s\" %lu visits, %lu sweeps\n", x,
+				spectool_hop_getprofile(hop, x)->name, s->visits, s->sweeps);
+	}
+}
+
 void sighandle(int sig) {
 	int x;
 
@@ -53,7 +170,24 @@ void Usage(void) {
 		   " -b / --broadcast             Listen for (and connect to) broadcast servers\n"
 		   " -l / --list				  List devices and ranges only\n"
 		   " -r / --range [device:]range  Configure a device for a specific range\n"
-		   "                              local USB devices\n");
+		   "                              local USB devices\n"
+		   " -w / --write prefix          Write sweeps to binary capture files\n"
+		   "                              (prefix-device-N.spcap) instead of\n"
+		   "                              printing them\n"
+		   " -s / --stats secs            Print device pipeline counters to\n"
+		   "                              stderr every secs seconds\n"
+		   " -A / --aggregate avg|peak:sweeps:ms\n"
+		   "                              With a network server, get only the\n"
+		   "                              server's average or peak of the last\n"
+		   "                              N sweeps, once every ms milliseconds\n"
+		   " -V / --view start_khz:end_khz:bins:max|mean\n"
+		   "                              With a network server, get sweeps cut\n"
+		   "                              down to a frequency window and at most\n"
+		   "                              bins bins (0 for the whole range or\n"
+		   "                              every bin)\n"
+		   " -H / --hop profile:dwell[,profile:dwell...]\n"
+		   "                              Cycle local devices through ranges,\n"
+		   "                              dwell sweeps at a time\n");
 	return;
 }
 
@@ -61,6 +195,8 @@ int main(int argc, char *argv[]) {
 	spectool_device_list list;
 	int x = 0, r = 0;
 	spectool_sample_sweep *sb;
+	/* Conversion table for the amplitude settings of the last sweep printed */
+	spectool_rssi_lut lut;
 	spectool_server sr;
 	char errstr[SPECTOOL_ERROR_MAX];
 	int ret;
@@ -71,6 +207,11 @@ int main(int argc, char *argv[]) {
 		{ "broadcast", no_argument, 0, 'b' },
 		{ "list", no_argument, 0, 'l' },
 		{ "range", required_argument, 0, 'r' },
+		{ "write", required_argument, 0, 'w' },
+		{ "stats", required_argument, 0, 's' },
+		{ "aggregate", required_argument, 0, 'A' },
+		{ "view", required_argument, 0, 'V' },
+		{ "hop", required_argument, 0, 'H' },
 		{ "help", no_argument, 0, 'h' },
 		{ 0, 0, 0, 0 }
 	};
@@ -84,6 +225,19 @@ int main(int argc, char *argv[]) {
 
 	int list_only = 0;
 
+	int stats_secs = 0;
+	time_t last_stats = time(0);
+	spectool_phy_stats st;
+
+	int agg_type = 0, agg_window = 0, agg_ms = 0;
+	char agg_name[8];
+
+	int view_set = 0, view_bins = 0, view_reduce = SPECTOOL_NET_VIEW_MAX;
+	unsigned int view_start = 0, view_end = 0;
+	char view_name[8];
+
+	lut.valid = 0;
+
 	ndev = spectool_device_scan(&list);
 
 	int *rangeset = NULL;
@@ -93,7 +247,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	while (1) {
-		int o = getopt_long(argc, argv, "n:bhr:l",
+		int o = getopt_long(argc, argv, "n:bhr:lw:s:A:V:H:",
 							long_options, &option_index);
 
 		if (o < 0)
@@ -110,6 +264,49 @@ int main(int argc, char *argv[]) {
 			continue;
 		} else if (o == 'l') {
 			list_only = 1;
+		} else if (o == 'w') {
+			capture_prefix = strdup(optarg);
+		} else if (o == 'H') {
+			hop_spec = strdup(optarg);
+		} else if (o == 'A') {
+			if (sscanf(optarg, "%7[^:]:%d:%d", agg_name, &agg_window, 
+					   &agg_ms) != 3 || agg_window <= 0 || agg_ms <= 0) {
+				fprintf(stderr, "Invalid aggregate, expected avg|peak:sweeps:ms\n");
+				exit(-1);
+			}
+
+			if (strcmp(agg_name, "avg") == 0) {
+				agg_type = SPECTOOL_NET_SWEEPTYPE_AVG;
+			} else if (strcmp(agg_name, "peak") == 0) {
+				agg_type = SPECTOOL_NET_SWEEPTYPE_PEAK;
+			} else {
+				fprintf(stderr, "Invalid aggregate, expected avg or peak\n");
+				exit(-1);
+			}
+		} else if (o == 'V') {
+			if (sscanf(optarg, "%u:%u:%d:%7s", &view_start, &view_end, &view_bins,
+					   view_name) != 4 || view_bins < 0 ||
+				(view_end != 0 && view_end <= view_start)) {
+				fprintf(stderr, "Invalid view, expected "
+						"start_khz:end_khz:bins:max|mean\n");
+				exit(-1);
+			}
+
+			if (strcmp(view_name, "max") == 0) {
+				view_reduce = SPECTOOL_NET_VIEW_MAX;
+			} else if (strcmp(view_name, "mean") == 0) {
+				view_reduce = SPECTOOL_NET_VIEW_MEAN;
+			} else {
+				fprintf(stderr, "Invalid view, expected max or mean\n");
+				exit(-1);
+			}
+
+			view_set = 1;
+		} else if (o == 's') {
+			if (sscanf(optarg, "%d", &stats_secs) != 1 || stats_secs <= 0) {
+				fprintf(stderr, "Invalid stats interval, expected seconds\n");
+				exit(-1);
+			}
 		} else if (o == 'r' && ndev > 0) {
 			if (sscanf(optarg, "%d:%d", &x, &r) != 2) {
 				if (sscanf(optarg, "%d", &r) != 1) {
@@ -132,6 +329,10 @@ int main(int argc, char *argv[]) {
 
 	signal(SIGINT, sighandle);
 
+	/* However we go down, leave the captures with their index */
+	if (capture_prefix != NULL)
+		atexit(capture_finish_all);
+
 	if (list_only) {
 		if (ndev <= 0) {
 			printf("No spectool devices found, bailing\n");
@@ -231,6 +432,27 @@ int main(int argc, char *argv[]) {
 #endif
 			spectool_phy_setcalibration(pi, 1);
 
+			/* Hopping devices are tuned by their schedule */
+			if (hop_spec != NULL) {
+				raw_hop *h = (raw_hop *) malloc(sizeof(raw_hop));
+
+				h->phydev = pi;
+				spectool_hop_init(&(h->hop), pi, RAW_HOP_CACHE);
+
+				if (spectool_hop_parse(&(h->hop), hop_spec, errstr) < 0 ||
+					spectool_hop_start(&(h->hop), errstr) < 0) {
+					printf("Error setting up hopping on %s id %u\n",
+						   list.list[x].name, list.list[x].device_id);
+					printf("%s\n", errstr);
+					exit(1);
+				}
+
+				h->next = hops;
+				hops = h;
+
+				continue;
+			}
+
 			/* configure the default sweep block */
 #ifdef _DEBUG
 			fprintf(stderr, "debug - spectool_phy_setposition\n");
@@ -336,6 +558,13 @@ int main(int argc, char *argv[]) {
 			if ((ret & SPECTOOL_NETCLI_POLL_NEWDEVS)) {
 				spectool_net_dev *ndi = sr.devlist;
 				while (ndi != NULL) {
+					/* Device blocks are resent when a view changes, don't 
+					 * enable the same device twice */
+					if (ndi->phydev != NULL) {
+						ndi = ndi->next;
+						continue;
+					}
+
 					printf("Enabling network device: %s (%u)\n", ndi->device_name,
 						   ndi->device_id);
 					pi = spectool_netcli_enabledev(&sr, ndi->device_id, errstr);
@@ -343,6 +572,24 @@ int main(int argc, char *argv[]) {
 					pi->next = devs;
 					devs = pi;
 
+					/* Swap the sweeps for the server side aggregate */
+					if (agg_type != 0 &&
+						(spectool_netcli_subscribe(&sr, pi, agg_type, agg_window,
+												   agg_ms, errstr) < 0 ||
+						 spectool_netcli_subscribe(&sr, pi, 
+												   SPECTOOL_NET_SWEEPTYPE_CUR,
+												   0, 0, errstr) < 0)) {
+						printf("Error subscribing to aggregate: %s\n", errstr);
+						exit(1);
+					}
+
+					if (view_set &&
+						spectool_netcli_setview(&sr, pi, view_start, view_end, 
+												view_bins, view_reduce, errstr) < 0) {
+						printf("Error setting view: %s\n", errstr);
+						exit(1);
+					}
+
 					ndi = ndi->next;
 				}
 
@@ -352,6 +599,8 @@ int main(int argc, char *argv[]) {
 		pi = devs;
 		while (pi != NULL) {
 			spectool_phy *di = pi;
+			spectool_hop *hop = find_hop(di);
+			int slot = 0, kept;
 			pi = pi->next;
 
 			if (spectool_phy_getpollfd(di) < 0) {
@@ -373,6 +622,15 @@ int main(int argc, char *argv[]) {
 				r = spectool_phy_poll(di);
 
 				if ((r & SPECTOOL_POLL_CONFIGURED)) {
+					spectool_hop_stats hst;
+
+					/* Every hop reconfigures, only say so the first time */
+					if (hop != NULL) {
+						spectool_hop_getstats(hop, &hst);
+						if (hst.retunes > 0)
+							continue;
+					}
+
 					printf("Configured device %u (%s)\n", 
 						   spectool_phy_getdevid(di), 
 						   spectool_phy_getname(di),
@@ -407,12 +665,49 @@ int main(int argc, char *argv[]) {
 					sb = spectool_phy_getsweep(di);
 					if (sb == NULL)
 						continue;
-					printf("%s: ", spectool_phy_getname(di));
+
+					if (hop != NULL) {
+						if ((kept = spectool_hop_sweep(hop, sb, &slot, errstr)) < 0) {
+							printf("Error hopping %s: %s\n", 
+								   spectool_phy_getname(di), errstr);
+							exit(1);
+						} else if (kept == 0) {
+							/* Still settling from the last hop */
+							continue;
+						}
+
+						/* The phy may have dropped its sweep retuning */
+						sb = spectool_hop_getslot(hop, slot)->cache->latest;
+					}
+
+					if (capture_prefix != NULL) {
+						if (capture_sweep(di, slot, sb, errstr) < 0) {
+							printf("Error writing capture: %s\n", errstr);
+							exit(1);
+						}
+
+						continue;
+					}
+
+					/* Convert with the sweep's own settings; a hop may 
+					 * already have retuned the phy to the next profile */
+					if (lut.valid == 0 || 
+						lut.amp_offset_mdbm != sb->amp_offset_mdbm ||
+						lut.amp_res_mdbm != sb->amp_res_mdbm)
+						spectool_rssi_lut_build(&lut, sb->amp_offset_mdbm,
+												sb->amp_res_mdbm);
+
+					if (neturl != NULL && spectool_net_getsweeptype(di) !=
+						SPECTOOL_NET_SWEEPTYPE_CUR)
+						printf("%s [%s]: ", spectool_phy_getname(di), agg_name);
+					else if (hop != NULL)
+						printf("%s [%s]: ", spectool_phy_getname(di),
+							   spectool_hop_getprofile(hop, slot)->name);
+					else
+						printf("%s: ", spectool_phy_getname(di));
 					for (r = 0; r < sb->num_samples; r++) {
 						// printf("[%d %d %d %d] ", sb->sample_data[r], sb->amp_offset_mdbm, sb->amp_res_mdbm, sb->sample_data[r] * (sb->amp_res_mdbm / 1000) + (sb->amp_offset_mdbm / 1000));
-						printf("%d ", 
-							SPECTOOL_RSSI_CONVERT(sb->amp_offset_mdbm, sb->amp_res_mdbm,
-											   sb->sample_data[r]));
+						printf("%d ", SPECTOOL_RSSI_LUT(&lut, sb->sample_data[r]));
 					}
 					printf("\n");
 					fflush(stdout);
@@ -420,6 +715,22 @@ int main(int argc, char *argv[]) {
 			} while ((r & SPECTOOL_POLL_ADDITIONAL));
 
 		}
+
+		if (stats_secs > 0 && time(0) - last_stats >= stats_secs) {
+			last_stats = time(0);
+
+			for (pi = devs; pi != NULL; pi = pi->next) {
+				spectool_phy_getstats(pi, &st);
+				print_stats("Stats", pi, &st);
+
+				if (find_hop(pi) != NULL)
+					print_hop_stats(pi, find_hop(pi));
+
+				/* Network devices have the real counters on the server */
+				if (neturl != NULL && spectool_net_getremotestats(pi, &st) > 0)
+					print_stats("Server stats", pi, &st);
+			}
+		}
 	}
 
 	return 0;
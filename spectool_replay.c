@@ -0,0 +1,452 @@
+/*
+ * Capture replay phy
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#include "spectool_container.h"
+#include "spectool_capture.h"
+#include "spectool_replay.h"
+#include "wispy_hw_24x.h"
+
+typedef struct _spectool_replay_aux {
+	char path[SPECTOOL_REPLAY_PATH_MAX];
+	double speed;
+	int loop;
+
+	spectool_capture cap;
+
+	/* have we pushed a configure event */
+	int configured;
+
+	/* Next record to play, and the last one played */
+	uint64_t next;
+	spectool_sample_sweep *sweep;
+
+	/* The pacing thread writes a byte to wake for each sweep as it comes 
+	 * due; at max speed a single byte is left in it for good */
+	int wake[2];
+	int stop[2];
+	pthread_t thread;
+	int thread_alive;
+
+	spectool_phy *phydev;
+} spectool_replay_aux;
+
+int spectool_replay_open(spectool_phy *);
+int spectool_replay_close(spectool_phy *);
+int spectool_replay_poll(spectool_phy *);
+int spectool_replay_getpollfd(spectool_phy *);
+void spectool_replay_setcalibration(spectool_phy *, int);
+int spectool_replay_setposition(spectool_phy *, int, int, int);
+spectool_sample_sweep *spectool_replay_getsweep(spectool_phy *);
+
+static uint32_t replay_device_id(const char *path) {
+	char idpath[SPECTOOL_REPLAY_PATH_MAX];
+
+	memset(idpath, 0, SPECTOOL_REPLAY_PATH_MAX);
+	snprintf(idpath, SPECTOOL_REPLAY_PATH_MAX, "%s", path);
+
+	return wispy24x_adler_checksum(idpath, SPECTOOL_REPLAY_PATH_MAX);
+}
+
+int spectool_replay_device_scan(spectool_device_list *list) {
+	char *env, *ents, *ent, *sp, *speed;
+	char errstr[SPECTOOL_ERROR_MAX];
+	spectool_replay_rec *rrec;
+	spectool_capture cap;
+	int num_found = 0;
+
+	if ((env = getenv(SPECTOOL_REPLAY_ENV)) == NULL)
+		return 0;
+
+	ents = strdup(env);
+
+	for (ent = strtok_r(ents, ",", &sp); ent != NULL; 
+		 ent = strtok_r(NULL, ",", &sp)) {
+		/* If we're full up, break */
+		if (list->num_devs == list->max_devs - 1)
+			break;
+
+		rrec = (spectool_replay_rec *) malloc(sizeof(spectool_replay_rec));
+
+		rrec->speed = 1;
+		rrec->loop = (getenv(SPECTOOL_REPLAY_LOOP_ENV) != NULL);
+
+		if ((speed = strrchr(ent, '@')) != NULL) {
+			*speed = '\0';
+			speed++;
+
+			if (strcmp(speed, "max") == 0)
+				rrec->speed = 0;
+			else if (sscanf(speed, "%lf", &(rrec->speed)) != 1 || 
+					 rrec->speed < 0)
+				rrec->speed = 1;
+		}
+
+		snprintf(rrec->path, SPECTOOL_REPLAY_PATH_MAX, "%s", ent);
+
+		/* Skip anything we can't read, the same as a device we can't open
+		 * on the bus */
+		if (spectool_capture_open(&cap, rrec->path, errstr) < 0) {
+			fprintf(stderr, "Skipping replay: %s\n", errstr);
+			free(rrec);
+			continue;
+		}
+
+		/* Fill in the list elements */
+		list->list[list->num_devs].device_id = replay_device_id(rrec->path);
+		snprintf(list->list[list->num_devs].name, SPECTOOL_PHY_NAME_MAX,
+				 "Replay %u (%s)", list->list[list->num_devs].device_id,
+				 cap.header->device_name);
+
+		list->list[list->num_devs].init_func = spectool_replay_init;
+		list->list[list->num_devs].hw_rec = rrec;
+
+		list->list[list->num_devs].num_sweep_ranges = 1;
+		list->list[list->num_devs].supported_ranges =
+			(spectool_sample_sweep *) malloc(sizeof(spectool_sample_sweep));
+
+		memcpy(list->list[list->num_devs].supported_ranges, &(cap.profile),
+			   sizeof(spectool_sample_sweep));
+		list->list[list->num_devs].supported_ranges[0].name = 
+			strdup(cap.header->device_name);
+
+		spectool_capture_close(&cap);
+
+		list->num_devs++;
+
+		num_found++;
+	}
+
+	free(ents);
+
+	return num_found;
+}
+
+int spectool_replay_init(spectool_phy *phydev, spectool_device_rec *rec) {
+	spectool_replay_rec *rrec = (spectool_replay_rec *) rec->hw_rec;
+
+	if (rrec == NULL)
+		return -1;
+
+	return spectool_replay_init_path(phydev, rrec->path, rrec->speed, rrec->loop);
+}
+
+int spectool_replay_init_path(spectool_phy *phydev, char *path, double speed, 
+							  int loop) {
+	spectool_replay_aux *auxptr = NULL;
+	spectool_capture cap;
+
+	if (spectool_capture_open(&cap, path, phydev->errstr) < 0)
+		return -1;
+
+	/* Build the device record with the captured profile */
+	phydev->device_spec = (spectool_dev_spec *) malloc(sizeof(spectool_dev_spec));
+
+	phydev->device_spec->device_id = replay_device_id(path);
+
+	snprintf(phydev->device_spec->device_name, SPECTOOL_PHY_NAME_MAX,
+			 "Replay %u (%s)", phydev->device_spec->device_id, 
+			 cap.header->device_name);
+
+	/* State */
+	phydev->state = SPECTOOL_STATE_CLOSED;
+
+	phydev->min_rssi_seen = -1;
+
+	phydev->device_spec->device_version = cap.header->device_version;
+	phydev->device_spec->device_flags = SPECTOOL_DEV_FL_NONE;
+
+	phydev->device_spec->num_sweep_ranges = 1;
+	phydev->device_spec->supported_ranges =
+		(spectool_sample_sweep *) malloc(sizeof(spectool_sample_sweep));
+
+	phydev->device_spec->default_range = phydev->device_spec->supported_ranges;
+
+	memcpy(phydev->device_spec->default_range, &(cap.profile), 
+		   sizeof(spectool_sample_sweep));
+	phydev->device_spec->default_range->name = strdup(cap.header->device_name);
+
+	phydev->device_spec->cur_profile = 0;
+
+	spectool_capture_close(&cap);
+
+	/* Set up the aux state */
+	auxptr = malloc(sizeof(spectool_replay_aux));
+	memset(auxptr, 0, sizeof(spectool_replay_aux));
+	phydev->auxptr = auxptr;
+
+	snprintf(auxptr->path, SPECTOOL_REPLAY_PATH_MAX, "%s", path);
+	auxptr->speed = speed;
+	auxptr->loop = loop;
+
+	auxptr->cap.fd = -1;
+	auxptr->wake[0] = auxptr->wake[1] = -1;
+	auxptr->stop[0] = auxptr->stop[1] = -1;
+	auxptr->phydev = phydev;
+
+	phydev->open_func = &spectool_replay_open;
+	phydev->close_func = &spectool_replay_close;
+	phydev->poll_func = &spectool_replay_poll;
+	phydev->pollfd_func = &spectool_replay_getpollfd;
+	phydev->setcalib_func = &spectool_replay_setcalibration;
+	phydev->getsweep_func = &spectool_replay_getsweep;
+	phydev->setposition_func = &spectool_replay_setposition;
+
+	phydev->draw_agg_suggestion = 1;
+
+	return 0;
+}
+
+/* Wait for fd to be ready, or for a stop.  Returns 0 on a stop */
+static int replay_wait(spectool_replay_aux *auxptr, int wfd, struct timeval *tm) {
+	fd_set rfds, wfds;
+	int max;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+
+	FD_SET(auxptr->stop[0], &rfds);
+	max = auxptr->stop[0];
+
+	if (wfd >= 0) {
+		FD_SET(wfd, &wfds);
+		if (wfd > max)
+			max = wfd;
+	}
+
+	if (select(max + 1, &rfds, &wfds, NULL, tm) < 0)
+		return 1;
+
+	return FD_ISSET(auxptr->stop[0], &rfds) == 0;
+}
+
+void *spectool_replay_thread(void *aux) {
+	spectool_replay_aux *auxptr = (spectool_replay_aux *) aux;
+	struct timeval anchor, cap_anchor, rec, now, tm;
+	sigset_t signal_set;
+	uint64_t n = 0;
+	double due;
+
+	/* We don't want to see any signals in the child thread */
+	sigfillset(&signal_set);
+	pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
+
+	gettimeofday(&anchor, NULL);
+	spectool_capture_time(&(auxptr->cap), 0, &cap_anchor);
+
+	while (1) {
+		if (n >= spectool_capture_count(&(auxptr->cap))) {
+			/* One more wakeup so the poller sees the end */
+			if (auxptr->loop == 0 || n == 0) {
+				if (replay_wait(auxptr, auxptr->wake[1], NULL))
+					write(auxptr->wake[1], "0", 1);
+				break;
+			}
+
+			n = 0;
+			gettimeofday(&anchor, NULL);
+			spectool_capture_time(&(auxptr->cap), 0, &cap_anchor);
+		}
+
+		/* Seconds from now until this sweep is due */
+		spectool_capture_time(&(auxptr->cap), n, &rec);
+		gettimeofday(&now, NULL);
+
+		due = ((double) (rec.tv_sec - cap_anchor.tv_sec) + 
+			   (double) (rec.tv_usec - cap_anchor.tv_usec) / 1000000) / 
+			auxptr->speed;
+		due -= (double) (now.tv_sec - anchor.tv_sec) + 
+			(double) (now.tv_usec - anchor.tv_usec) / 1000000;
+
+		if (due > 0) {
+			tm.tv_sec = (long) due;
+			tm.tv_usec = (long) ((due - tm.tv_sec) * 1000000);
+
+			if (replay_wait(auxptr, -1, &tm) == 0)
+				break;
+		}
+
+		/* If the poller is that far behind, wait for it */
+		while (write(auxptr->wake[1], "0", 1) <= 0) {
+			if (replay_wait(auxptr, auxptr->wake[1], NULL) == 0)
+				return NULL;
+		}
+
+		n++;
+	}
+
+	return NULL;
+}
+
+int spectool_replay_getpollfd(spectool_phy *phydev) {
+	spectool_replay_aux *auxptr = (spectool_replay_aux *) phydev->auxptr;
+
+	return auxptr->wake[0];
+}
+
+int spectool_replay_open(spectool_phy *phydev) {
+	spectool_replay_aux *auxptr = (spectool_replay_aux *) phydev->auxptr;
+
+	if (spectool_capture_open(&(auxptr->cap), auxptr->path, phydev->errstr) < 0)
+		return -1;
+
+	if (pipe(auxptr->wake) < 0 || pipe(auxptr->stop) < 0) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "spectool_replay failed to make wakeup pipe: %s", strerror(errno));
+		spectool_replay_close(phydev);
+		return -1;
+	}
+
+	fcntl(auxptr->wake[0], F_SETFL, fcntl(auxptr->wake[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(auxptr->wake[1], F_SETFL, fcntl(auxptr->wake[1], F_GETFL, 0) | O_NONBLOCK);
+
+	auxptr->next = 0;
+	auxptr->sweep = NULL;
+
+	if (auxptr->speed <= 0) {
+		write(auxptr->wake[1], "0", 1);
+	} else {
+		auxptr->thread_alive = 1;
+
+		if (pthread_create(&(auxptr->thread), NULL, 
+						   spectool_replay_thread, auxptr) != 0) {
+			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+					 "spectool_replay failed to create thread: %s",
+					 strerror(errno));
+			auxptr->thread_alive = 0;
+			spectool_replay_close(phydev);
+			return -1;
+		}
+	}
+
+	/* Update the state */
+	phydev->state = SPECTOOL_STATE_CONFIGURING;
+
+	return 1;
+}
+
+int spectool_replay_close(spectool_phy *phydev) {
+	spectool_replay_aux *aux;
+	int x;
+
+	if (phydev == NULL)
+		return 0;
+
+	aux = (spectool_replay_aux *) phydev->auxptr;
+
+	if (aux == NULL)
+		return 0;
+
+	if (aux->thread_alive) {
+		write(aux->stop[1], "0", 1);
+		pthread_join(aux->thread, NULL);
+		aux->thread_alive = 0;
+	}
+
+	for (x = 0; x < 2; x++) {
+		if (aux->wake[x] >= 0)
+			close(aux->wake[x]);
+		if (aux->stop[x] >= 0)
+			close(aux->stop[x]);
+
+		aux->wake[x] = aux->stop[x] = -1;
+	}
+
+	spectool_capture_close(&(aux->cap));
+	aux->sweep = NULL;
+
+	return 1;
+}
+
+spectool_sample_sweep *spectool_replay_getsweep(spectool_phy *phydev) {
+	spectool_replay_aux *auxptr = (spectool_replay_aux *) phydev->auxptr;
+
+	return auxptr->sweep;
+}
+
+void spectool_replay_setcalibration(spectool_phy *phydev, int in_calib) {
+	phydev->state = SPECTOOL_STATE_RUNNING;
+}
+
+int spectool_replay_setposition(spectool_phy *phydev, int in_profile, 
+								int start_khz, int res_hz) {
+	if (in_profile != 0 || start_khz != 0 || res_hz != 0) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "spectool_replay can only play back the captured range");
+		return -1;
+	}
+
+	return 1;
+}
+
+int spectool_replay_poll(spectool_phy *phydev) {
+	spectool_replay_aux *auxptr = (spectool_replay_aux *) phydev->auxptr;
+	spectool_sample_sweep *sweep;
+	struct timeval now, len;
+	char c;
+
+	/* Push a configure event before anything else */
+	if (auxptr->configured == 0) {
+		auxptr->configured = 1;
+		return SPECTOOL_POLL_CONFIGURED;
+	}
+
+	/* One byte a sweep from the pacing thread */
+	if (auxptr->speed > 0 && read(auxptr->wake[0], &c, 1) <= 0)
+		return SPECTOOL_POLL_NONE;
+
+	if (auxptr->next >= spectool_capture_count(&(auxptr->cap))) {
+		if (auxptr->loop == 0 || auxptr->next == 0) {
+			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+					 "spectool_replay reached the end of %.*s", 
+					 SPECTOOL_ERROR_MAX - 64, auxptr->path);
+			phydev->state = SPECTOOL_STATE_ERROR;
+			return SPECTOOL_POLL_ERROR;
+		}
+
+		auxptr->next = 0;
+	}
+
+	sweep = spectool_capture_sweep(&(auxptr->cap), auxptr->next++);
+
+	/* Make it look live */
+	gettimeofday(&now, NULL);
+	timersub(&(sweep->tm_end), &(sweep->tm_start), &len);
+	sweep->tm_start = now;
+	timeradd(&now, &len, &(sweep->tm_end));
+
+	sweep->phydev = phydev;
+
+	if (sweep->min_rssi_seen < phydev->min_rssi_seen)
+		phydev->min_rssi_seen = sweep->min_rssi_seen;
+
+	auxptr->sweep = sweep;
+
+	return SPECTOOL_POLL_SWEEPCOMPLETE;
+}
+
@@ -0,0 +1,54 @@
+/*
+ * Capture replay phy
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SPECTOOL_REPLAY_H__
+#define __SPECTOOL_REPLAY_H__
+
+#include "spectool_container.h"
+
+/*
+ * Plays a capture file back as a device.  Sweeps come out spaced as they
+ * were recorded, divided by the speed, or as fast as the caller polls with
+ * a speed of 0.  Sweeps are stamped with the time they're played.
+ *
+ * spectool_device_scan lists the captures named in the environment:
+ *
+ *   SPECTOOL_REPLAY=file[@speed][,file[@speed]...]
+ *
+ * where speed is a multiple of real time, or "max".  With 
+ * SPECTOOL_REPLAY_LOOP set, captures start again from the top when they
+ * run out instead of failing the device.
+ */
+
+#define SPECTOOL_REPLAY_ENV			"SPECTOOL_REPLAY"
+#define SPECTOOL_REPLAY_LOOP_ENV	"SPECTOOL_REPLAY_LOOP"
+
+#define SPECTOOL_REPLAY_PATH_MAX	1024
+
+/* Replay scan results */
+typedef struct _spectool_replay_rec {
+	char path[SPECTOOL_REPLAY_PATH_MAX];
+	double speed;
+	int loop;
+} spectool_replay_rec;
+
+int spectool_replay_device_scan(spectool_device_list *list);
+
+int spectool_replay_init_path(spectool_phy *phydev, char *path, double speed, 
+							  int loop);
+int spectool_replay_init(spectool_phy *phydev, spectool_device_rec *rec);
+
+#endif
+
@@ -0,0 +1,192 @@
+/*
+ * Single producer, single consumer report ring between a USB service thread
+ * and the phy poll function
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "spectool_ring.h"
+
+/*
+ * The producer publishes head and then looks at tail to decide if the ring
+ * was empty; the consumer publishes tail and then looks at head to decide if
+ * it is empty.  Both pairs are sequentially consistent, so at least one side
+ * always sees the other's update: either the producer signals, or the 
+ * consumer sees the new report.  Relaxed loads are fine for each side's own
+ * position.
+ */
+
+void spectool_ring_init(spectool_ring *r) {
+	r->head = 0;
+	r->tail = 0;
+	r->sigfd[0] = -1;
+	r->sigfd[1] = -1;
+}
+
+int spectool_ring_open(spectool_ring *r, char *errstr) {
+	r->head = 0;
+	r->tail = 0;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	if ((r->sigfd[0] = eventfd(0, EFD_NONBLOCK)) < 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to create report ring "
+				 "eventfd: %s", strerror(errno));
+		return -1;
+	}
+
+	r->sigfd[1] = r->sigfd[0];
+#else
+	if (pipe(r->sigfd) < 0) {
+		snprintf(errstr, SPECTOOL_ERROR_MAX, "Failed to create report ring "
+				 "pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	fcntl(r->sigfd[0], F_SETFL, fcntl(r->sigfd[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(r->sigfd[1], F_SETFL, fcntl(r->sigfd[1], F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+	return 1;
+}
+
+void spectool_ring_close(spectool_ring *r) {
+	if (r->sigfd[1] >= 0 && r->sigfd[1] != r->sigfd[0])
+		close(r->sigfd[1]);
+
+	if (r->sigfd[0] >= 0)
+		close(r->sigfd[0]);
+
+	r->sigfd[0] = -1;
+	r->sigfd[1] = -1;
+}
+
+int spectool_ring_getpollfd(spectool_ring *r) {
+	return r->sigfd[0];
+}
+
+void spectool_ring_signal(spectool_ring *r) {
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+
+	write(r->sigfd[1], &one, sizeof(uint64_t));
+#else
+	write(r->sigfd[1], "0", 1);
+#endif
+}
+
+/* Consume any pending wakeup */
+static void spectool_ring_clear(spectool_ring *r) {
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t count;
+
+	read(r->sigfd[0], &count, sizeof(uint64_t));
+#else
+	char junk[64];
+
+	while (read(r->sigfd[0], junk, 64) > 0)
+		;
+#endif
+}
+
+int spectool_ring_put(spectool_ring *r, const void *data, int len) {
+	unsigned int head = __atomic_load_n(&(r->head), __ATOMIC_RELAXED);
+	unsigned int tail = __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE);
+	unsigned int s;
+
+	if (head - tail >= SPECTOOL_RING_SLOTS)
+		return 0;
+
+	if (len > SPECTOOL_RING_SLOT_SZ)
+		len = SPECTOOL_RING_SLOT_SZ;
+
+	s = head & (SPECTOOL_RING_SLOTS - 1);
+	memcpy(r->slot[s], data, len);
+	r->slot_len[s] = len;
+
+	__atomic_store_n(&(r->head), head + 1, __ATOMIC_SEQ_CST);
+
+	/* Only wake the consumer if it may have seen the ring empty */
+	if (__atomic_load_n(&(r->tail), __ATOMIC_SEQ_CST) == head)
+		spectool_ring_signal(r);
+
+	return 1;
+}
+
+uint8_t *spectool_ring_peek(spectool_ring *r, int *len) {
+	unsigned int tail = __atomic_load_n(&(r->tail), __ATOMIC_RELAXED);
+	unsigned int s;
+
+	if (__atomic_load_n(&(r->head), __ATOMIC_SEQ_CST) == tail) {
+		/* Clear the wakeup and look again, in case a report landed after
+		 * we looked but before the clear */
+		spectool_ring_clear(r);
+
+		if (__atomic_load_n(&(r->head), __ATOMIC_SEQ_CST) == tail)
+			return NULL;
+	}
+
+	s = tail & (SPECTOOL_RING_SLOTS - 1);
+	*len = r->slot_len[s];
+
+	return r->slot[s];
+}
+
+void spectool_ring_advance(spectool_ring *r) {
+	unsigned int tail = __atomic_load_n(&(r->tail), __ATOMIC_RELAXED);
+
+	__atomic_store_n(&(r->tail), tail + 1, __ATOMIC_SEQ_CST);
+}
+
+int spectool_ring_drain(spectool_ring *r, spectool_phy *phydev,
+						int (*report_func)(spectool_phy *, uint8_t *, int),
+						int *count) {
+	uint8_t *report;
+	int len, ret = SPECTOOL_POLL_NONE;
+
+	*count = 0;
+
+	while ((report = spectool_ring_peek(r, &len)) != NULL) {
+		ret = (*report_func)(phydev, report, len);
+		spectool_ring_advance(r);
+		(*count)++;
+
+		if (ret != SPECTOOL_POLL_NONE) {
+			/* The producer won't signal a ring which isn't empty, so keep the
+			 * fd readable for callers which wait on it instead of looping on
+			 * ADDITIONAL */
+			if (__atomic_load_n(&(r->head), __ATOMIC_SEQ_CST) != 
+				__atomic_load_n(&(r->tail), __ATOMIC_RELAXED)) {
+				ret |= SPECTOOL_POLL_ADDITIONAL;
+				spectool_ring_signal(r);
+			}
+			break;
+		}
+	}
+
+	if (*count > 0)
+		SPECTOOL_PHY_COUNT_N(phydev, reports, *count);
+
+	return ret;
+}
+
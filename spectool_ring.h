@@ -0,0 +1,87 @@
+/*
+ * Single producer, single consumer report ring between a USB service thread
+ * and the phy poll function
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SPECTOOL_RING_H__
+#define __SPECTOOL_RING_H__
+
+#include "config.h"
+
+#ifdef HAVE_STDINT
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+
+#include "spectool_container.h"
+
+/*
+ * The service thread copies each USB report into the next free slot and the
+ * poll function works on the reports in place, without any syscalls per
+ * report.  The poll side is woken through an eventfd (or a pipe, where
+ * there is no eventfd), which is only written when a report lands in an
+ * empty ring, so a burst of reports costs one wakeup.
+ *
+ * Slot count must be a power of two.
+ */
+#define SPECTOOL_RING_SLOTS			256
+#define SPECTOOL_RING_SLOT_SZ		64
+
+typedef struct _spectool_ring {
+	uint8_t slot[SPECTOOL_RING_SLOTS][SPECTOOL_RING_SLOT_SZ];
+	int slot_len[SPECTOOL_RING_SLOTS];
+
+	/* Free-running positions; head is only written by the producer and tail
+	 * only by the consumer, and they're kept on separate cache lines */
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+
+	/* Wakeup fds, both the same eventfd or the two ends of a pipe */
+	int sigfd[2];
+} spectool_ring;
+
+/* Set up an unopened ring */
+void spectool_ring_init(spectool_ring *r);
+/* Empty the ring and create the wakeup fd */
+int spectool_ring_open(spectool_ring *r, char *errstr);
+void spectool_ring_close(spectool_ring *r);
+
+/* Fd the consumer waits on */
+int spectool_ring_getpollfd(spectool_ring *r);
+
+/* Producer: copy a report in.  Returns 0 if the ring is full */
+int spectool_ring_put(spectool_ring *r, const void *data, int len);
+/* Producer: wake the consumer regardless, ie when the thread is going away */
+void spectool_ring_signal(spectool_ring *r);
+
+/* Consumer: the oldest report, or NULL if the ring is empty */
+uint8_t *spectool_ring_peek(spectool_ring *r, int *len);
+/* Consumer: release the report returned by peek */
+void spectool_ring_advance(spectool_ring *r);
+
+/* Consumer: hand pending reports to a driver report handler, which returns 
+ * SPECTOOL_POLL_* flags.  Stops after the first report which produces 
+ * anything other than SPECTOOL_POLL_NONE so the caller can collect the sweep,
+ * flagging SPECTOOL_POLL_ADDITIONAL and leaving the fd readable if reports 
+ * are still waiting.  The number
+ * of reports handled is returned in count */
+int spectool_ring_drain(spectool_ring *r, spectool_phy *phydev,
+						int (*report_func)(spectool_phy *, uint8_t *, int),
+						int *count);
+
+#endif
+
@@ -0,0 +1,392 @@
+/*
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "config.h"
+#include "spectool_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPECTOOL_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Dispatch table, filled in once by spectool_simd_init on first use */
+typedef struct _spectool_simd_ops {
+	void (*max_u8)(uint8_t *, const uint8_t *, unsigned int);
+	void (*add_u8_u32)(uint32_t *, const uint8_t *, unsigned int);
+	void (*sub_u8_u32)(uint32_t *, const uint8_t *, unsigned int);
+	unsigned int (*sum_u8)(const uint8_t *, unsigned int);
+	unsigned int (*min_u8)(const uint8_t *, unsigned int, unsigned int);
+	void (*lut_u8_int)(int *, const uint8_t *, const int *, unsigned int);
+} spectool_simd_ops;
+
+static spectool_simd_ops simd_ops;
+static int simd_level = SPECTOOL_SIMD_NONE;
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+/* Portable versions, also used for the tails of the vector versions */
+static void c_max_u8(uint8_t *dst, const uint8_t *src, unsigned int n) {
+	unsigned int x;
+
+	for (x = 0; x < n; x++) {
+		if (src[x] > dst[x])
+			dst[x] = src[x];
+	}
+}
+
+static void c_add_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n) {
+	unsigned int x;
+
+	for (x = 0; x < n; x++)
+		acc[x] += src[x];
+}
+
+static void c_sub_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n) {
+	unsigned int x;
+
+	for (x = 0; x < n; x++)
+		acc[x] -= src[x];
+}
+
+static unsigned int c_sum_u8(const uint8_t *src, unsigned int n) {
+	unsigned int x, sum = 0;
+
+	for (x = 0; x < n; x++)
+		sum += src[x];
+
+	return sum;
+}
+
+static unsigned int c_min_u8(const uint8_t *src, unsigned int n,
+							 unsigned int min) {
+	unsigned int x;
+
+	for (x = 0; x < n; x++) {
+		if (src[x] < min)
+			min = src[x];
+	}
+
+	return min;
+}
+
+static void c_lut_u8_int(int *dst, const uint8_t *src, const int *table,
+						 unsigned int n) {
+	unsigned int x;
+
+	for (x = 0; x < n; x++)
+		dst[x] = table[src[x]];
+}
+
+#ifdef SPECTOOL_SIMD_X86
+
+/* SSE2, 16 samples per step */
+__attribute__((target("sse2")))
+static void sse2_max_u8(uint8_t *dst, const uint8_t *src, unsigned int n) {
+	unsigned int x;
+
+	for (x = 0; x + 16 <= n; x += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (dst + x));
+		__m128i b = _mm_loadu_si128((const __m128i *) (src + x));
+		_mm_storeu_si128((__m128i *) (dst + x), _mm_max_epu8(a, b));
+	}
+
+	c_max_u8(dst + x, src + x, n - x);
+}
+
+__attribute__((target("sse2")))
+/* Widen 16 samples into 4 vectors of 32 bit values and add or subtract them
+ * from the accumulator */
+__attribute__((target("sse2")))
+static void sse2_addsub_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n,
+							   int sub) {
+	unsigned int x;
+	int v;
+	__m128i zero = _mm_setzero_si128();
+
+	for (x = 0; x + 16 <= n; x += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *) (src + x));
+		__m128i w[4];
+		__m128i s16;
+
+		s16 = _mm_unpacklo_epi8(s, zero);
+		w[0] = _mm_unpacklo_epi16(s16, zero);
+		w[1] = _mm_unpackhi_epi16(s16, zero);
+		s16 = _mm_unpackhi_epi8(s, zero);
+		w[2] = _mm_unpacklo_epi16(s16, zero);
+		w[3] = _mm_unpackhi_epi16(s16, zero);
+
+		for (v = 0; v < 4; v++) {
+			__m128i a = _mm_loadu_si128((const __m128i *) (acc + x + (v * 4)));
+
+			if (sub)
+				a = _mm_sub_epi32(a, w[v]);
+			else
+				a = _mm_add_epi32(a, w[v]);
+
+			_mm_storeu_si128((__m128i *) (acc + x + (v * 4)), a);
+		}
+	}
+
+	if (sub)
+		c_sub_u8_u32(acc + x, src + x, n - x);
+	else
+		c_add_u8_u32(acc + x, src + x, n - x);
+}
+
+static void sse2_add_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n) {
+	sse2_addsub_u8_u32(acc, src, n, 0);
+}
+
+static void sse2_sub_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n) {
+	sse2_addsub_u8_u32(acc, src, n, 1);
+}
+
+__attribute__((target("sse2")))
+static unsigned int sse2_sum_u8(const uint8_t *src, unsigned int n) {
+	unsigned int x;
+	__m128i zero = _mm_setzero_si128();
+	__m128i sum = _mm_setzero_si128();
+
+	/* psadbw against zero gives two 64 bit partial sums per step */
+	for (x = 0; x + 16 <= n; x += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *) (src + x));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(s, zero));
+	}
+
+	return (unsigned int) (_mm_cvtsi128_si32(sum) +
+						   _mm_cvtsi128_si32(_mm_srli_si128(sum, 8))) +
+		c_sum_u8(src + x, n - x);
+}
+
+__attribute__((target("sse2")))
+static unsigned int sse2_min_u8(const uint8_t *src, unsigned int n,
+								unsigned int min) {
+	unsigned int x;
+	uint8_t lanes[16];
+	__m128i m = _mm_set1_epi8((char) 0xFF);
+
+	for (x = 0; x + 16 <= n; x += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *) (src + x));
+		m = _mm_min_epu8(m, s);
+	}
+
+	if (x > 0) {
+		_mm_storeu_si128((__m128i *) lanes, m);
+		min = c_min_u8(lanes, 16, min);
+	}
+
+	return c_min_u8(src + x, n - x, min);
+}
+
+/* AVX2, 32 samples per step where the widening allows */
+__attribute__((target("avx2")))
+static void avx2_max_u8(uint8_t *dst, const uint8_t *src, unsigned int n) {
+	unsigned int x;
+
+	for (x = 0; x + 32 <= n; x += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (dst + x));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (src + x));
+		_mm256_storeu_si256((__m256i *) (dst + x), _mm256_max_epu8(a, b));
+	}
+
+	c_max_u8(dst + x, src + x, n - x);
+}
+
+__attribute__((target("avx2")))
+__attribute__((target("avx2")))
+static void avx2_add_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n) {
+	unsigned int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m256i s =
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + x)));
+		__m256i a = _mm256_loadu_si256((const __m256i *) (acc + x));
+		_mm256_storeu_si256((__m256i *) (acc + x), _mm256_add_epi32(a, s));
+	}
+
+	c_add_u8_u32(acc + x, src + x, n - x);
+}
+
+__attribute__((target("avx2")))
+static void avx2_sub_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n) {
+	unsigned int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m256i s =
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + x)));
+		__m256i a = _mm256_loadu_si256((const __m256i *) (acc + x));
+		_mm256_storeu_si256((__m256i *) (acc + x), _mm256_sub_epi32(a, s));
+	}
+
+	c_sub_u8_u32(acc + x, src + x, n - x);
+}
+
+__attribute__((target("avx2")))
+static unsigned int avx2_sum_u8(const uint8_t *src, unsigned int n) {
+	unsigned int x;
+	uint64_t lanes[4];
+	__m256i zero = _mm256_setzero_si256();
+	__m256i sum = _mm256_setzero_si256();
+
+	for (x = 0; x + 32 <= n; x += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i *) (src + x));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(s, zero));
+	}
+
+	_mm256_storeu_si256((__m256i *) lanes, sum);
+
+	return (unsigned int) (lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+		c_sum_u8(src + x, n - x);
+}
+
+__attribute__((target("avx2")))
+static unsigned int avx2_min_u8(const uint8_t *src, unsigned int n,
+								unsigned int min) {
+	unsigned int x;
+	uint8_t lanes[32];
+	__m256i m = _mm256_set1_epi8((char) 0xFF);
+
+	for (x = 0; x + 32 <= n; x += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i *) (src + x));
+		m = _mm256_min_epu8(m, s);
+	}
+
+	if (x > 0) {
+		_mm256_storeu_si256((__m256i *) lanes, m);
+		min = c_min_u8(lanes, 32, min);
+	}
+
+	return c_min_u8(src + x, n - x, min);
+}
+
+/* Table lookups via gather, 8 samples per step */
+__attribute__((target("avx2")))
+static void avx2_lut_u8_int(int *dst, const uint8_t *src, const int *table,
+							unsigned int n) {
+	unsigned int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m256i idx =
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + x)));
+		_mm256_storeu_si256((__m256i *) (dst + x),
+							_mm256_i32gather_epi32(table, idx, 4));
+	}
+
+	c_lut_u8_int(dst + x, src + x, table, n - x);
+}
+
+__attribute__((target("avx2")))
+#endif
+
+static const char *simd_level_name(int level) {
+	switch (level) {
+		case SPECTOOL_SIMD_AVX2:
+			return "avx2";
+		case SPECTOOL_SIMD_SSE2:
+			return "sse2";
+	}
+
+	return "generic";
+}
+
+static void spectool_simd_init(void) {
+	spectool_simd_ops ops;
+	int level = SPECTOOL_SIMD_NONE;
+
+	ops.max_u8 = c_max_u8;
+	ops.add_u8_u32 = c_add_u8_u32;
+	ops.sub_u8_u32 = c_sub_u8_u32;
+	ops.sum_u8 = c_sum_u8;
+	ops.min_u8 = c_min_u8;
+	ops.lut_u8_int = c_lut_u8_int;
+
+#ifdef SPECTOOL_SIMD_X86
+	__builtin_cpu_init();
+
+	/* SSE2 has no gather, so the lookups stay portable until AVX2 */
+	if (__builtin_cpu_supports("sse2")) {
+		level = SPECTOOL_SIMD_SSE2;
+		ops.max_u8 = sse2_max_u8;
+		ops.add_u8_u32 = sse2_add_u8_u32;
+		ops.sub_u8_u32 = sse2_sub_u8_u32;
+		ops.sum_u8 = sse2_sum_u8;
+		ops.min_u8 = sse2_min_u8;
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		level = SPECTOOL_SIMD_AVX2;
+		ops.max_u8 = avx2_max_u8;
+		ops.add_u8_u32 = avx2_add_u8_u32;
+		ops.sub_u8_u32 = avx2_sub_u8_u32;
+		ops.sum_u8 = avx2_sum_u8;
+		ops.min_u8 = avx2_min_u8;
+		ops.lut_u8_int = avx2_lut_u8_int;
+	}
+#endif
+
+	/* Only ever run under pthread_once, which also publishes the table to
+	 * every thread which uses it afterwards */
+	simd_ops = ops;
+	simd_level = level;
+
+#ifdef _DEBUG
+	/* Not spectool_simd_name, which would wait on the pthread_once we're 
+	 * running under */
+	fprintf(stderr, "debug - sweep kernels using %s\n", simd_level_name(level));
+#endif
+}
+
+static inline spectool_simd_ops *simd_get(void) {
+	pthread_once(&simd_once, spectool_simd_init);
+
+	return &simd_ops;
+}
+
+int spectool_simd_level(void) {
+	pthread_once(&simd_once, spectool_simd_init);
+
+	return simd_level;
+}
+
+const char *spectool_simd_name(void) {
+	return simd_level_name(spectool_simd_level());
+}
+
+void spectool_simd_max_u8(uint8_t *dst, const uint8_t *src, unsigned int n) {
+	(*(simd_get()->max_u8))(dst, src, n);
+}
+
+void spectool_simd_add_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n) {
+	(*(simd_get()->add_u8_u32))(acc, src, n);
+}
+
+void spectool_simd_sub_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n) {
+	(*(simd_get()->sub_u8_u32))(acc, src, n);
+}
+
+unsigned int spectool_simd_sum_u8(const uint8_t *src, unsigned int n) {
+	return (*(simd_get()->sum_u8))(src, n);
+}
+
+unsigned int spectool_simd_min_u8(const uint8_t *src, unsigned int n,
+								  unsigned int min) {
+	return (*(simd_get()->min_u8))(src, n, min);
+}
+
+void spectool_simd_lut_u8_int(int *dst, const uint8_t *src, const int *table,
+							  unsigned int n) {
+	(*(simd_get()->lut_u8_int))(dst, src, table, n);
+}
+
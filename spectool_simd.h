@@ -0,0 +1,68 @@
+/*
+ * Vectorized kernels for aggregating sweeps of uint8 RSSI samples
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SPECTOOL_SIMD_H__
+#define __SPECTOOL_SIMD_H__
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#ifdef HAVE_STDINT
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+
+/*
+ * Each kernel has a portable C version and, on x86 with GCC-compatible
+ * compilers, SSE2 and AVX2 versions.  The best version the CPU supports is
+ * picked via cpuid the first time any kernel is called.  No alignment is
+ * required of any of the arrays.
+ */
+
+/* Implementation levels */
+#define SPECTOOL_SIMD_NONE		0
+#define SPECTOOL_SIMD_SSE2		1
+#define SPECTOOL_SIMD_AVX2		2
+
+/* Implementation level in use, and a printable name for it */
+int spectool_simd_level(void);
+const char *spectool_simd_name(void);
+
+/* dst[x] = max(dst[x], src[x]) */
+void spectool_simd_max_u8(uint8_t *dst, const uint8_t *src, unsigned int n);
+
+/* acc[x] += src[x], and acc[x] -= src[x], widening into 32 bit
+ * accumulators */
+void spectool_simd_add_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n);
+void spectool_simd_sub_u8_u32(uint32_t *acc, const uint8_t *src, unsigned int n);
+
+/* Sum of src[0..n) */
+unsigned int spectool_simd_sum_u8(const uint8_t *src, unsigned int n);
+
+/* Smallest of src[0..n) and 'min'; passing the running minimum in lets
+ * callers track min_rssi_seen across sweeps.  Returns min when n is 0 */
+unsigned int spectool_simd_min_u8(const uint8_t *src, unsigned int n,
+								  unsigned int min);
+
+/* dst[x] = table[src[x]], for a 256 entry conversion table */
+void spectool_simd_lut_u8_int(int *dst, const uint8_t *src, const int *table,
+							  unsigned int n);
+
+#endif
+
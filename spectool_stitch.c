@@ -0,0 +1,629 @@
+/*
+ * Wideband stitching phy
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "spectool_container.h"
+#include "spectool_stitch.h"
+
+#define STITCH_ID_BASE			0x53540000
+
+typedef struct _spectool_stitch_member {
+	spectool_phy phydev;
+	int profile;
+
+	/* Sample count we expect from the member's range */
+	unsigned int src_samples;
+
+	/* Wide sweep bins this member fills, and the member bins each one is
+	 * taken from (the max of src_num of them from src_idx) */
+	int num_owned;
+	int *out_idx;
+	int *src_idx;
+	int *src_num;
+
+	/* Member RSSI to wide sweep RSSI */
+	uint8_t remap[256];
+
+	/* Has swept since the last wide sweep */
+	int fresh;
+} spectool_stitch_member;
+
+typedef struct _spectool_stitch_aux {
+	int num_members;
+	spectool_stitch_member members[SPECTOOL_STITCH_MAX_MEMBERS];
+
+	/* have we pushed a configure event */
+	int configured;
+
+	int epfd;
+
+	/* Members which have swept since the last wide sweep, and when the
+	 * first of them did */
+	int num_fresh;
+	struct timeval tm_first_fresh;
+
+	spectool_sample_sweep *sweepbuf;
+} spectool_stitch_aux;
+
+int spectool_stitch_open(spectool_phy *);
+int spectool_stitch_close(spectool_phy *);
+int spectool_stitch_poll(spectool_phy *);
+int spectool_stitch_getpollfd(spectool_phy *);
+void spectool_stitch_setcalibration(spectool_phy *, int);
+int spectool_stitch_setposition(spectool_phy *, int, int, int);
+spectool_sample_sweep *spectool_stitch_getsweep(spectool_phy *);
+
+/* Work out the wide sweep covering a set of member ranges */
+static void stitch_geometry(spectool_sample_sweep **ranges, int num,
+							spectool_sample_sweep *out) {
+	long long start_hz = -1, end_hz = 0, span_hz, hz;
+	unsigned int res_hz = 0, bins;
+	int x;
+
+	for (x = 0; x < num; x++) {
+		hz = (long long) ranges[x]->start_khz * 1000;
+
+		if (start_hz < 0 || hz < start_hz)
+			start_hz = hz;
+
+		hz += (long long) ranges[x]->num_samples * ranges[x]->res_hz;
+
+		if (hz > end_hz)
+			end_hz = hz;
+
+		if (res_hz == 0 || ranges[x]->res_hz < res_hz)
+			res_hz = ranges[x]->res_hz;
+	}
+
+	span_hz = end_hz - start_hz;
+
+	if (res_hz == 0)
+		res_hz = 1;
+
+	/* Coarsen the whole thing rather than go past what a sweep can hold */
+	if ((span_hz + res_hz - 1) / res_hz > SPECTOOL_STITCH_MAX_BINS)
+		res_hz = (span_hz + SPECTOOL_STITCH_MAX_BINS - 1) / SPECTOOL_STITCH_MAX_BINS;
+
+	bins = (span_hz + res_hz - 1) / res_hz;
+
+	memset(out, 0, sizeof(spectool_sample_sweep));
+
+	out->name = strdup("Stitched wideband");
+
+	out->amp_offset_mdbm = ranges[0]->amp_offset_mdbm;
+	out->amp_res_mdbm = ranges[0]->amp_res_mdbm;
+	out->rssi_max = ranges[0]->rssi_max;
+
+	out->start_khz = start_hz / 1000;
+	out->res_hz = res_hz;
+	out->num_samples = bins;
+	out->end_khz = out->start_khz + ((long long) bins * res_hz) / 1000;
+}
+
+int spectool_stitch_device_scan(spectool_device_list *list) {
+	char *env, *spec, *ent, *sp;
+	spectool_stitch_rec *srec;
+	spectool_sample_sweep *ranges[SPECTOOL_STITCH_MAX_MEMBERS];
+	int taken[MAX_SCAN_RESULT];
+	unsigned int device_id;
+	int profile, x, y, n;
+
+	if ((env = getenv(SPECTOOL_STITCH_ENV)) == NULL)
+		return 0;
+
+#ifndef HAVE_SYS_EPOLL_H
+	fprintf(stderr, "Stitching devices needs epoll, ignoring %s\n",
+			SPECTOOL_STITCH_ENV);
+	return 0;
+#endif
+
+	srec = (spectool_stitch_rec *) malloc(sizeof(spectool_stitch_rec));
+	srec->num_members = 0;
+
+	memset(taken, 0, sizeof(taken));
+
+	spec = strdup(env);
+
+	for (ent = strtok_r(spec, "+", &sp); ent != NULL;
+		 ent = strtok_r(NULL, "+", &sp)) {
+		profile = 0;
+
+		if (strcmp(ent, "all") == 0) {
+			device_id = 0;
+		} else if (sscanf(ent, "%u:%d", &device_id, &profile) < 1) {
+			fprintf(stderr, "Ignoring stitch member '%s', expected "
+					"device_id[:range]\n", ent);
+			continue;
+		}
+
+		for (x = 0; x < list->num_devs; x++) {
+			if (taken[x] || (device_id != 0 && list->list[x].device_id != device_id))
+				continue;
+
+			if (srec->num_members >= SPECTOOL_STITCH_MAX_MEMBERS) {
+				fprintf(stderr, "Only stitching the first %d devices\n",
+						SPECTOOL_STITCH_MAX_MEMBERS);
+				break;
+			}
+
+			if (profile < 0 || profile >= (int) list->list[x].num_sweep_ranges) {
+				fprintf(stderr, "Device %u has no range %d, stitching range 0\n",
+						list->list[x].device_id, profile);
+				profile = 0;
+			}
+
+			taken[x] = 1;
+
+			srec->members[srec->num_members] = list->list[x];
+			srec->profiles[srec->num_members] = profile;
+			ranges[srec->num_members] = &(list->list[x].supported_ranges[profile]);
+			srec->num_members++;
+
+			if (device_id != 0)
+				break;
+		}
+
+		if (device_id != 0 && x == list->num_devs)
+			fprintf(stderr, "Ignoring stitch member %u, no such device\n",
+					device_id);
+	}
+
+	free(spec);
+
+	if (srec->num_members < 2) {
+		fprintf(stderr, "Stitching needs at least two devices, found %d\n",
+				srec->num_members);
+		free(srec);
+		return 0;
+	}
+
+	/* Members belong to the stitched device now */
+	for (x = 0, n = 0; x < list->num_devs; x++) {
+		if (taken[x])
+			continue;
+
+		list->list[n++] = list->list[x];
+	}
+
+	list->num_devs = n;
+
+	y = list->num_devs;
+
+	list->list[y].device_id = STITCH_ID_BASE;
+	list->list[y].init_func = spectool_stitch_init;
+	list->list[y].hw_rec = srec;
+
+	list->list[y].num_sweep_ranges = 1;
+	list->list[y].supported_ranges =
+		(spectool_sample_sweep *) malloc(sizeof(spectool_sample_sweep));
+
+	stitch_geometry(ranges, srec->num_members, list->list[y].supported_ranges);
+
+	snprintf(list->list[y].name, SPECTOOL_PHY_NAME_MAX, "Stitched %u-%uMHz",
+			 list->list[y].supported_ranges->start_khz / 1000,
+			 list->list[y].supported_ranges->end_khz / 1000);
+
+	list->num_devs++;
+
+	return 1;
+}
+
+/* Decide which member feeds each wide sweep bin: the one with the finest
+ * resolution covering it, or the first of equals */
+static void stitch_map(spectool_stitch_aux *aux, spectool_sample_sweep *out) {
+	spectool_sample_sweep *r;
+	spectool_stitch_member *m;
+	long long f, ms, me;
+	int *owner;
+	int x, b, best, lo, hi;
+
+	owner = (int *) malloc(sizeof(int) * out->num_samples);
+
+	for (b = 0; b < (int) out->num_samples; b++) {
+		f = (long long) out->start_khz * 1000 + (long long) b * out->res_hz;
+		best = -1;
+
+		for (x = 0; x < aux->num_members; x++) {
+			r = spectool_phy_getcurprofile(&(aux->members[x].phydev));
+
+			ms = (long long) r->start_khz * 1000;
+			me = ms + (long long) r->num_samples * r->res_hz;
+
+			if (f < ms || f >= me)
+				continue;
+
+			if (best < 0 || r->res_hz <
+				spectool_phy_getcurprofile(&(aux->members[best].phydev))->res_hz)
+				best = x;
+		}
+
+		owner[b] = best;
+
+		if (best >= 0)
+			aux->members[best].num_owned++;
+	}
+
+	for (x = 0; x < aux->num_members; x++) {
+		m = &(aux->members[x]);
+
+		m->out_idx = (int *) malloc(sizeof(int) * (m->num_owned + 1));
+		m->src_idx = (int *) malloc(sizeof(int) * (m->num_owned + 1));
+		m->src_num = (int *) malloc(sizeof(int) * (m->num_owned + 1));
+		m->num_owned = 0;
+	}
+
+	for (b = 0; b < (int) out->num_samples; b++) {
+		if (owner[b] < 0)
+			continue;
+
+		m = &(aux->members[owner[b]]);
+		r = spectool_phy_getcurprofile(&(m->phydev));
+
+		f = (long long) out->start_khz * 1000 + (long long) b * out->res_hz -
+			(long long) r->start_khz * 1000;
+
+		/* Every member bin under this wide bin */
+		lo = f / r->res_hz;
+		hi = (f + out->res_hz + r->res_hz - 1) / r->res_hz;
+
+		if (hi > (int) r->num_samples)
+			hi = r->num_samples;
+		if (hi <= lo)
+			hi = lo + 1;
+
+		m->out_idx[m->num_owned] = b;
+		m->src_idx[m->num_owned] = lo;
+		m->src_num[m->num_owned] = hi - lo;
+		m->num_owned++;
+	}
+
+	free(owner);
+}
+
+/* Member RSSI to the RSSI scale of the wide sweep */
+static void stitch_remap(spectool_stitch_member *m, spectool_sample_sweep *out) {
+	spectool_sample_sweep *r = spectool_phy_getcurprofile(&(m->phydev));
+	double dbm, v;
+	int x;
+
+	for (x = 0; x < 256; x++) {
+		if (r->amp_offset_mdbm == out->amp_offset_mdbm &&
+			r->amp_res_mdbm == out->amp_res_mdbm) {
+			m->remap[x] = x;
+			continue;
+		}
+
+		dbm = SPECTOOL_RSSI_CONVERT(r->amp_offset_mdbm, r->amp_res_mdbm, x);
+		v = (dbm - (double) out->amp_offset_mdbm / 1000) * 1000 /
+			out->amp_res_mdbm + 0.5;
+
+		if (v < 0)
+			v = 0;
+		if (v > out->rssi_max)
+			v = out->rssi_max;
+
+		m->remap[x] = (uint8_t) v;
+	}
+}
+
+int spectool_stitch_init(spectool_phy *phydev, spectool_device_rec *rec) {
+	spectool_stitch_rec *srec = (spectool_stitch_rec *) rec->hw_rec;
+	spectool_stitch_aux *auxptr;
+	spectool_stitch_member *m;
+	int x;
+
+	if (srec == NULL)
+		return -1;
+
+	phydev->device_spec = (spectool_dev_spec *) malloc(sizeof(spectool_dev_spec));
+
+	phydev->device_spec->device_id = rec->device_id;
+	snprintf(phydev->device_spec->device_name, SPECTOOL_PHY_NAME_MAX, "%s",
+			 rec->name);
+
+	phydev->state = SPECTOOL_STATE_CLOSED;
+	phydev->min_rssi_seen = -1;
+
+	phydev->device_spec->device_version = 0x03;
+	phydev->device_spec->device_flags = SPECTOOL_DEV_FL_NONE;
+
+	phydev->device_spec->num_sweep_ranges = 1;
+	phydev->device_spec->supported_ranges =
+		(spectool_sample_sweep *) malloc(sizeof(spectool_sample_sweep));
+	memcpy(phydev->device_spec->supported_ranges, rec->supported_ranges,
+		   sizeof(spectool_sample_sweep));
+	phydev->device_spec->supported_ranges->name =
+		strdup(rec->supported_ranges->name);
+
+	phydev->device_spec->default_range = phydev->device_spec->supported_ranges;
+	phydev->device_spec->cur_profile = 0;
+
+	auxptr = (spectool_stitch_aux *) malloc(sizeof(spectool_stitch_aux));
+	memset(auxptr, 0, sizeof(spectool_stitch_aux));
+	phydev->auxptr = auxptr;
+
+	auxptr->epfd = -1;
+	auxptr->num_members = srec->num_members;
+
+	for (x = 0; x < srec->num_members; x++) {
+		m = &(auxptr->members[x]);
+
+		if (spectool_device_init(&(m->phydev), &(srec->members[x])) < 0) {
+			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX, "Stitch member %s: %s",
+					 srec->members[x].name, spectool_get_error(&(m->phydev)));
+			return -1;
+		}
+
+		m->profile = srec->profiles[x];
+
+		/* Map against the range the member is going to sweep */
+		m->phydev.device_spec->cur_profile = m->profile;
+		m->src_samples = spectool_phy_getcurprofile(&(m->phydev))->num_samples;
+
+		stitch_remap(m, phydev->device_spec->default_range);
+	}
+
+	stitch_map(auxptr, phydev->device_spec->default_range);
+
+	auxptr->sweepbuf = (spectool_sample_sweep *)
+		malloc(SPECTOOL_SWEEP_SIZE(phydev->device_spec->default_range->num_samples));
+	memcpy(auxptr->sweepbuf, phydev->device_spec->default_range,
+		   sizeof(spectool_sample_sweep));
+	auxptr->sweepbuf->name = NULL;
+	auxptr->sweepbuf->phydev = phydev;
+	memset(auxptr->sweepbuf->sample_data, 0, auxptr->sweepbuf->num_samples);
+
+	phydev->open_func = &spectool_stitch_open;
+	phydev->close_func = &spectool_stitch_close;
+	phydev->poll_func = &spectool_stitch_poll;
+	phydev->pollfd_func = &spectool_stitch_getpollfd;
+	phydev->setcalib_func = &spectool_stitch_setcalibration;
+	phydev->getsweep_func = &spectool_stitch_getsweep;
+	phydev->setposition_func = &spectool_stitch_setposition;
+
+	phydev->draw_agg_suggestion = 1;
+
+	return 0;
+}
+
+int spectool_stitch_open(spectool_phy *phydev) {
+#ifdef HAVE_SYS_EPOLL_H
+	spectool_stitch_aux *auxptr = (spectool_stitch_aux *) phydev->auxptr;
+	spectool_stitch_member *m;
+	struct epoll_event eev;
+	int x;
+
+	if ((auxptr->epfd = epoll_create(auxptr->num_members)) < 0) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX, "spectool_stitch "
+				 "epoll_create() failed: %s", strerror(errno));
+		phydev->state = SPECTOOL_STATE_ERROR;
+		return -1;
+	}
+
+	for (x = 0; x < auxptr->num_members; x++) {
+		m = &(auxptr->members[x]);
+
+		if (spectool_phy_open(&(m->phydev)) < 0 ||
+			spectool_phy_setposition(&(m->phydev), m->profile, 0, 0) < 0) {
+			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX, "Stitch member %s: %s",
+					 spectool_phy_getname(&(m->phydev)),
+					 spectool_get_error(&(m->phydev)));
+			phydev->state = SPECTOOL_STATE_ERROR;
+			return -1;
+		}
+
+		memset(&eev, 0, sizeof(struct epoll_event));
+		eev.events = EPOLLIN;
+		eev.data.u32 = x;
+
+		if (epoll_ctl(auxptr->epfd, EPOLL_CTL_ADD,
+					  spectool_phy_getpollfd(&(m->phydev)), &eev) < 0) {
+			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX, "spectool_stitch "
+					 "epoll_ctl() failed for %s: %s",
+					 spectool_phy_getname(&(m->phydev)), strerror(errno));
+			phydev->state = SPECTOOL_STATE_ERROR;
+			return -1;
+		}
+	}
+
+	auxptr->configured = 0;
+	auxptr->num_fresh = 0;
+
+	phydev->state = SPECTOOL_STATE_CONFIGURING;
+
+	return 1;
+#else
+	snprintf(phydev->errstr, SPECTOOL_ERROR_MAX, "spectool_stitch needs epoll");
+	phydev->state = SPECTOOL_STATE_ERROR;
+	return -1;
+#endif
+}
+
+int spectool_stitch_close(spectool_phy *phydev) {
+	spectool_stitch_aux *auxptr = (spectool_stitch_aux *) phydev->auxptr;
+	int x;
+
+	if (auxptr == NULL)
+		return 0;
+
+	for (x = 0; x < auxptr->num_members; x++)
+		spectool_phy_close(&(auxptr->members[x].phydev));
+
+	if (auxptr->epfd >= 0)
+		close(auxptr->epfd);
+
+	auxptr->epfd = -1;
+
+	return 1;
+}
+
+int spectool_stitch_getpollfd(spectool_phy *phydev) {
+	spectool_stitch_aux *auxptr = (spectool_stitch_aux *) phydev->auxptr;
+
+	return auxptr->epfd;
+}
+
+void spectool_stitch_setcalibration(spectool_phy *phydev, int in_calib) {
+	spectool_stitch_aux *auxptr = (spectool_stitch_aux *) phydev->auxptr;
+	int x;
+
+	for (x = 0; x < auxptr->num_members; x++)
+		spectool_phy_setcalibration(&(auxptr->members[x].phydev), in_calib);
+
+	phydev->state = SPECTOOL_STATE_RUNNING;
+}
+
+int spectool_stitch_setposition(spectool_phy *phydev, int in_profile,
+								int start_khz, int res_hz) {
+	if (in_profile != 0 || start_khz != 0 || res_hz != 0) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "spectool_stitch only sweeps its stitched range");
+		return -1;
+	}
+
+	return 1;
+}
+
+spectool_sample_sweep *spectool_stitch_getsweep(spectool_phy *phydev) {
+	spectool_stitch_aux *auxptr = (spectool_stitch_aux *) phydev->auxptr;
+
+	return auxptr->sweepbuf;
+}
+
+/* Write a member sweep into its part of the wide sweep */
+static void stitch_member_sweep(spectool_stitch_aux *auxptr,
+								spectool_stitch_member *m) {
+	spectool_sample_sweep *s = spectool_phy_getsweep(&(m->phydev));
+	spectool_sample_sweep *out = auxptr->sweepbuf;
+	uint8_t *d, v;
+	int x, y;
+
+	/* Not the range we mapped, ie the member is still settling */
+	if (s == NULL || s->num_samples != m->src_samples)
+		return;
+
+	for (x = 0; x < m->num_owned; x++) {
+		d = &(s->sample_data[m->src_idx[x]]);
+		v = d[0];
+
+		for (y = 1; y < m->src_num[x]; y++) {
+			if (d[y] > v)
+				v = d[y];
+		}
+
+		out->sample_data[m->out_idx[x]] = m->remap[v];
+	}
+
+	/* First sweep into this wide sweep sets the start, every one can push
+	 * the end out */
+	if (auxptr->num_fresh == 0) {
+		gettimeofday(&(auxptr->tm_first_fresh), NULL);
+		out->tm_start = s->tm_start;
+		out->tm_end = s->tm_end;
+	} else {
+		if (timercmp(&(s->tm_start), &(out->tm_start), <))
+			out->tm_start = s->tm_start;
+		if (timercmp(&(s->tm_end), &(out->tm_end), >))
+			out->tm_end = s->tm_end;
+	}
+
+	if (m->fresh == 0) {
+		m->fresh = 1;
+		auxptr->num_fresh++;
+	}
+}
+
+int spectool_stitch_poll(spectool_phy *phydev) {
+#ifdef HAVE_SYS_EPOLL_H
+	spectool_stitch_aux *auxptr = (spectool_stitch_aux *) phydev->auxptr;
+	struct epoll_event evs[SPECTOOL_STITCH_MAX_MEMBERS];
+	spectool_stitch_member *m;
+	struct timeval now;
+	long waited_ms;
+	int n, x, r;
+
+	/* Push a configure event before anything else */
+	if (auxptr->configured == 0) {
+		auxptr->configured = 1;
+		return SPECTOOL_POLL_CONFIGURED;
+	}
+
+	if ((n = epoll_wait(auxptr->epfd, evs, SPECTOOL_STITCH_MAX_MEMBERS, 0)) < 0) {
+		if (errno == EINTR)
+			return SPECTOOL_POLL_NONE;
+
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX, "spectool_stitch "
+				 "epoll_wait() failed: %s", strerror(errno));
+		phydev->state = SPECTOOL_STATE_ERROR;
+		return SPECTOOL_POLL_ERROR;
+	}
+
+	for (x = 0; x < n; x++) {
+		m = &(auxptr->members[evs[x].data.u32]);
+
+		do {
+			r = spectool_phy_poll(&(m->phydev));
+
+			if ((r & SPECTOOL_POLL_ERROR)) {
+				snprintf(phydev->errstr, SPECTOOL_ERROR_MAX, "Stitch member %s: %s",
+						 spectool_phy_getname(&(m->phydev)),
+						 spectool_get_error(&(m->phydev)));
+				phydev->state = SPECTOOL_STATE_ERROR;
+				return SPECTOOL_POLL_ERROR;
+			}
+
+			if ((r & SPECTOOL_POLL_SWEEPCOMPLETE))
+				stitch_member_sweep(auxptr, m);
+		} while ((r & SPECTOOL_POLL_ADDITIONAL));
+	}
+
+	if (auxptr->num_fresh == 0)
+		return SPECTOOL_POLL_NONE;
+
+	/* Don't hold everything up for a stalled member */
+	if (auxptr->num_fresh < auxptr->num_members) {
+		gettimeofday(&now, NULL);
+
+		waited_ms = (now.tv_sec - auxptr->tm_first_fresh.tv_sec) * 1000 +
+			(now.tv_usec - auxptr->tm_first_fresh.tv_usec) / 1000;
+
+		if (waited_ms < SPECTOOL_STITCH_MAX_WAIT_MS)
+			return SPECTOOL_POLL_NONE;
+	}
+
+	for (x = 0; x < auxptr->num_members; x++)
+		auxptr->members[x].fresh = 0;
+
+	auxptr->num_fresh = 0;
+
+	return SPECTOOL_POLL_SWEEPCOMPLETE;
+#else
+	return SPECTOOL_POLL_ERROR;
+#endif
+}
+
@@ -0,0 +1,66 @@
+/*
+ * Wideband stitching phy
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SPECTOOL_STITCH_H__
+#define __SPECTOOL_STITCH_H__
+
+#include "spectool_container.h"
+
+/*
+ * Merges several devices covering neighbouring (or overlapping) ranges into
+ * one virtual device with a single wide sweep, which anything that takes a
+ * phy - caches, spectool_net, the GUI - can use as it is.
+ *
+ * spectool_device_scan builds the virtual device when asked to in the
+ * environment, and takes its members out of the device list:
+ *
+ *   SPECTOOL_STITCH=all
+ *   SPECTOOL_STITCH=device_id[:range]+device_id[:range]...
+ *
+ * Members sweep their given range (the first one by default).  The wide
+ * sweep runs from the lowest start to the highest end at the finest member
+ * resolution; where members overlap, the finer one wins, and bins nobody
+ * covers read as the lowest RSSI.  Members with a different RSSI scale are
+ * converted to the scale of the first member through a lookup table.
+ *
+ * Each member sweep is written straight into the wide sweep once, so the
+ * cost doesn't grow with the number of members, and the wide sweep is
+ * complete as soon as every member has swept once since the last one, or
+ * SPECTOOL_STITCH_MAX_WAIT_MS after the first member did if another has
+ * stalled (leaving the stalled member's last data in place).  Its start and
+ * end times are the earliest start and latest end of the member sweeps in
+ * it.
+ *
+ * Members are watched through one epoll fd, so stitching needs epoll.
+ */
+
+#define SPECTOOL_STITCH_ENV			"SPECTOOL_STITCH"
+
+#define SPECTOOL_STITCH_MAX_MEMBERS	8
+#define SPECTOOL_STITCH_MAX_BINS	65535
+#define SPECTOOL_STITCH_MAX_WAIT_MS	250
+
+/* Stitch scan results */
+typedef struct _spectool_stitch_rec {
+	int num_members;
+	spectool_device_rec members[SPECTOOL_STITCH_MAX_MEMBERS];
+	int profiles[SPECTOOL_STITCH_MAX_MEMBERS];
+} spectool_stitch_rec;
+
+int spectool_stitch_device_scan(spectool_device_list *list);
+int spectool_stitch_init(spectool_phy *phydev, spectool_device_rec *rec);
+
+#endif
+
@@ -0,0 +1,568 @@
+/*
+ * Synthetic spectrum phy
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#include "spectool_container.h"
+#include "spectool_synth.h"
+
+/* Same scale as the Wi-Spy DBx: dbm = rssi / 2 - 134 */
+#define SYNTH_OFFSET_MDBM		-134000
+#define SYNTH_RES_MDBM			500
+#define SYNTH_RSSI_MAX			255
+
+#define SYNTH_START_KHZ			2400000
+#define SYNTH_END_KHZ			2483500
+
+#define SYNTH_DBM(d)			(((d) + 134) * 2)
+#define SYNTH_DB(d)				((d) * 2)
+
+#define SYNTH_ID_BASE			0x53590000
+
+typedef struct _spectool_synth_aux {
+	int instance;
+	int bins;
+	double rate;
+	int signals;
+
+	/* have we pushed a configure event */
+	int configured;
+
+	/* Sweeps generated, and the time the first one was due */
+	unsigned long num_sweeps;
+	struct timeval start;
+
+	uint32_t rand;
+
+	spectool_sample_sweep *sweepbuf;
+
+	/* The pacing thread writes a byte to wake for each sweep as it comes 
+	 * due; at rate 0 a single byte is left in it for good */
+	int wake[2];
+	int stop[2];
+	pthread_t thread;
+	int thread_alive;
+
+	spectool_phy *phydev;
+} spectool_synth_aux;
+
+int spectool_synth_open(spectool_phy *);
+int spectool_synth_close(spectool_phy *);
+int spectool_synth_poll(spectool_phy *);
+int spectool_synth_getpollfd(spectool_phy *);
+void spectool_synth_setcalibration(spectool_phy *, int);
+int spectool_synth_setposition(spectool_phy *, int, int, int);
+spectool_sample_sweep *spectool_synth_getsweep(spectool_phy *);
+
+static void synth_range(spectool_sample_sweep *range, int bins) {
+	memset(range, 0, sizeof(spectool_sample_sweep));
+
+	range->name = strdup("2.4GHz ISM (synthetic)");
+
+	range->num_samples = bins;
+
+	range->amp_offset_mdbm = SYNTH_OFFSET_MDBM;
+	range->amp_res_mdbm = SYNTH_RES_MDBM;
+	range->rssi_max = SYNTH_RSSI_MAX;
+
+	range->start_khz = SYNTH_START_KHZ;
+	range->res_hz = (int) (((double) (SYNTH_END_KHZ - SYNTH_START_KHZ) * 1000) / 
+						   bins);
+	range->end_khz = SYNTH_START_KHZ + 
+		(int) (((double) range->res_hz * bins) / 1000);
+}
+
+int spectool_synth_device_scan(spectool_device_list *list) {
+	char *env, *opts, *opt, *sp, *val;
+	int count = 1, bins = SPECTOOL_SYNTH_DEF_BINS, signals = 0;
+	double rate = SPECTOOL_SYNTH_DEF_RATE;
+	spectool_synth_rec *srec;
+	int x, num_found = 0;
+
+	if ((env = getenv(SPECTOOL_SYNTH_ENV)) == NULL)
+		return 0;
+
+	opts = strdup(env);
+
+	for (opt = strtok_r(opts, ",", &sp); opt != NULL; 
+		 opt = strtok_r(NULL, ",", &sp)) {
+		if ((val = strchr(opt, '=')) == NULL) {
+			fprintf(stderr, "Ignoring synthetic device option '%s', expected "
+					"key=value\n", opt);
+			continue;
+		}
+
+		*val = '\0';
+		val++;
+
+		if (strcmp(opt, "count") == 0) {
+			count = atoi(val);
+		} else if (strcmp(opt, "bins") == 0) {
+			bins = atoi(val);
+		} else if (strcmp(opt, "rate") == 0) {
+			rate = atof(val);
+		} else if (strcmp(opt, "signals") == 0) {
+			if (strstr(val, "wifi") != NULL)
+				signals |= SPECTOOL_SYNTH_SIG_WIFI;
+			if (strstr(val, "bt") != NULL)
+				signals |= SPECTOOL_SYNTH_SIG_BT;
+			if (strstr(val, "oven") != NULL)
+				signals |= SPECTOOL_SYNTH_SIG_OVEN;
+			if (strstr(val, "none") != NULL)
+				signals = -1;
+		} else {
+			fprintf(stderr, "Ignoring unknown synthetic device option '%s'\n", 
+					opt);
+		}
+	}
+
+	free(opts);
+
+	if (signals == 0)
+		signals = SPECTOOL_SYNTH_SIG_ALL;
+	else if (signals < 0)
+		signals = 0;
+
+	if (bins < 1 || bins > SPECTOOL_SYNTH_MAX_BINS) {
+		fprintf(stderr, "Synthetic devices need 1 to %d bins, using %d\n",
+				SPECTOOL_SYNTH_MAX_BINS, SPECTOOL_SYNTH_DEF_BINS);
+		bins = SPECTOOL_SYNTH_DEF_BINS;
+	}
+
+	if (rate < 0)
+		rate = SPECTOOL_SYNTH_DEF_RATE;
+
+	for (x = 0; x < count; x++) {
+		/* If we're full up, break */
+		if (list->num_devs == list->max_devs - 1)
+			break;
+
+		srec = (spectool_synth_rec *) malloc(sizeof(spectool_synth_rec));
+
+		srec->instance = x;
+		srec->bins = bins;
+		srec->rate = rate;
+		srec->signals = signals;
+
+		/* Fill in the list elements */
+		list->list[list->num_devs].device_id = SYNTH_ID_BASE + x;
+		snprintf(list->list[list->num_devs].name, SPECTOOL_PHY_NAME_MAX,
+				 "Synthetic %u", list->list[list->num_devs].device_id);
+
+		list->list[list->num_devs].init_func = spectool_synth_init;
+		list->list[list->num_devs].hw_rec = srec;
+
+		list->list[list->num_devs].num_sweep_ranges = 1;
+		list->list[list->num_devs].supported_ranges =
+			(spectool_sample_sweep *) malloc(sizeof(spectool_sample_sweep));
+
+		synth_range(list->list[list->num_devs].supported_ranges, bins);
+
+		list->num_devs++;
+
+		num_found++;
+	}
+
+	return num_found;
+}
+
+int spectool_synth_init(spectool_phy *phydev, spectool_device_rec *rec) {
+	spectool_synth_rec *srec = (spectool_synth_rec *) rec->hw_rec;
+
+	if (srec == NULL)
+		return -1;
+
+	return spectool_synth_init_params(phydev, srec->instance, srec->bins, 
+									  srec->rate, srec->signals);
+}
+
+int spectool_synth_init_params(spectool_phy *phydev, int instance, int bins,
+							   double rate, int signals) {
+	spectool_synth_aux *auxptr = NULL;
+
+	if (bins < 1 || bins > SPECTOOL_SYNTH_MAX_BINS) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "spectool_synth needs 1 to %d bins", SPECTOOL_SYNTH_MAX_BINS);
+		return -1;
+	}
+
+	/* Build the device record with one sweep capability */
+	phydev->device_spec = (spectool_dev_spec *) malloc(sizeof(spectool_dev_spec));
+
+	phydev->device_spec->device_id = SYNTH_ID_BASE + instance;
+
+	snprintf(phydev->device_spec->device_name, SPECTOOL_PHY_NAME_MAX,
+			 "Synthetic %u", phydev->device_spec->device_id);
+
+	/* State */
+	phydev->state = SPECTOOL_STATE_CLOSED;
+
+	phydev->min_rssi_seen = -1;
+
+	phydev->device_spec->device_version = 0x03;
+	phydev->device_spec->device_flags = SPECTOOL_DEV_FL_NONE;
+
+	phydev->device_spec->num_sweep_ranges = 1;
+	phydev->device_spec->supported_ranges =
+		(spectool_sample_sweep *) malloc(sizeof(spectool_sample_sweep));
+
+	phydev->device_spec->default_range = phydev->device_spec->supported_ranges;
+
+	synth_range(phydev->device_spec->default_range, bins);
+
+	phydev->device_spec->cur_profile = 0;
+
+	/* Set up the aux state */
+	auxptr = malloc(sizeof(spectool_synth_aux));
+	memset(auxptr, 0, sizeof(spectool_synth_aux));
+	phydev->auxptr = auxptr;
+
+	auxptr->instance = instance;
+	auxptr->bins = bins;
+	auxptr->rate = rate;
+	auxptr->signals = signals;
+
+	/* Every instance gets its own, repeatable, noise */
+	auxptr->rand = 2463534242U + instance * 7919;
+
+	auxptr->sweepbuf = 
+		(spectool_sample_sweep *) malloc(SPECTOOL_SWEEP_SIZE(bins));
+	memcpy(auxptr->sweepbuf, phydev->device_spec->default_range,
+		   sizeof(spectool_sample_sweep));
+	auxptr->sweepbuf->name = NULL;
+	auxptr->sweepbuf->phydev = phydev;
+
+	auxptr->wake[0] = auxptr->wake[1] = -1;
+	auxptr->stop[0] = auxptr->stop[1] = -1;
+	auxptr->phydev = phydev;
+
+	phydev->open_func = &spectool_synth_open;
+	phydev->close_func = &spectool_synth_close;
+	phydev->poll_func = &spectool_synth_poll;
+	phydev->pollfd_func = &spectool_synth_getpollfd;
+	phydev->setcalib_func = &spectool_synth_setcalibration;
+	phydev->getsweep_func = &spectool_synth_getsweep;
+	phydev->setposition_func = &spectool_synth_setposition;
+
+	phydev->draw_agg_suggestion = 1;
+
+	return 0;
+}
+
+static inline uint32_t synth_rand(spectool_synth_aux *auxptr) {
+	/* xorshift32, cheap enough to run per bin at thousands of sweeps a 
+	 * second */
+	auxptr->rand ^= auxptr->rand << 13;
+	auxptr->rand ^= auxptr->rand >> 17;
+	auxptr->rand ^= auxptr->rand << 5;
+
+	return auxptr->rand;
+}
+
+/* Raise the bins between two frequencies to a level, with a little noise */
+static void synth_band(spectool_synth_aux *auxptr, int lo_khz, int hi_khz, 
+					   int level) {
+	spectool_sample_sweep *s = auxptr->sweepbuf;
+	int lo, hi, x, v;
+
+	lo = (int) (((double) (lo_khz - (int) s->start_khz) * 1000) / s->res_hz);
+	hi = (int) (((double) (hi_khz - (int) s->start_khz) * 1000) / s->res_hz);
+
+	if (lo < 0)
+		lo = 0;
+	if (hi >= (int) s->num_samples)
+		hi = s->num_samples - 1;
+
+	for (x = lo; x <= hi; x++) {
+		v = level + (int) (synth_rand(auxptr) & 7) - 4;
+
+		if (v > SYNTH_RSSI_MAX)
+			v = SYNTH_RSSI_MAX;
+
+		if (v > s->sample_data[x])
+			s->sample_data[x] = v;
+	}
+}
+
+/* Fill the sweep buffer for time t, in seconds since the device opened */
+static void synth_generate(spectool_synth_aux *auxptr, double t) {
+	spectool_sample_sweep *s = auxptr->sweepbuf;
+	static const int wifi_khz[3] = { 2412000, 2437000, 2462000 };
+	int x, level, hops, centre;
+	double phase;
+
+	/* Noise floor around -95dBm */
+	s->min_rssi_seen = SYNTH_RSSI_MAX;
+
+	for (x = 0; x < (int) s->num_samples; x++) {
+		s->sample_data[x] = SYNTH_DBM(-95) + (int) (synth_rand(auxptr) & 15) - 8;
+
+		if (s->sample_data[x] < s->min_rssi_seen)
+			s->min_rssi_seen = s->sample_data[x];
+	}
+
+	/* 802.11 on 1, 6 and 11, each transmitting in about a third of the sweeps,
+	 * with the shoulders of the spectral mask */
+	if ((auxptr->signals & SPECTOOL_SYNTH_SIG_WIFI)) {
+		for (x = 0; x < 3; x++) {
+			if ((synth_rand(auxptr) % 3) != 0)
+				continue;
+
+			level = SYNTH_DBM(-45 - x * 8);
+
+			synth_band(auxptr, wifi_khz[x] - 20000, wifi_khz[x] + 20000, 
+					   level - SYNTH_DB(28));
+			synth_band(auxptr, wifi_khz[x] - 11000, wifi_khz[x] + 11000, 
+					   level - SYNTH_DB(10));
+			synth_band(auxptr, wifi_khz[x] - 9000, wifi_khz[x] + 9000, level);
+		}
+	}
+
+	/* Bluetooth hops 1600 times a second over 79 1MHz channels; show the
+	 * hops which land in this sweep, up to a handful */
+	if ((auxptr->signals & SPECTOOL_SYNTH_SIG_BT)) {
+		hops = auxptr->rate > 0 ? (int) (1600 / auxptr->rate) : 1;
+
+		if (hops < 1)
+			hops = 1;
+		if (hops > 20)
+			hops = 20;
+
+		for (x = 0; x < hops; x++) {
+			centre = 2402000 + (synth_rand(auxptr) % 79) * 1000;
+			synth_band(auxptr, centre - 500, centre + 500, SYNTH_DBM(-55));
+		}
+	}
+
+	/* A microwave oven runs on half of each mains cycle, sweeping up through
+	 * the top of the band as it goes */
+	if ((auxptr->signals & SPECTOOL_SYNTH_SIG_OVEN)) {
+		phase = (t * 60) - floor(t * 60);
+
+		if (phase < 0.5) {
+			centre = 2440000 + (int) (phase * 2 * 30000);
+			synth_band(auxptr, centre - 8000, centre + 8000, SYNTH_DBM(-60));
+			synth_band(auxptr, centre - 3000, centre + 3000, SYNTH_DBM(-40));
+		}
+	}
+}
+
+/* Wait for fd to be ready, or for a stop.  Returns 0 on a stop */
+static int synth_wait(spectool_synth_aux *auxptr, int wfd, struct timeval *tm) {
+	fd_set rfds, wfds;
+	int max;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+
+	FD_SET(auxptr->stop[0], &rfds);
+	max = auxptr->stop[0];
+
+	if (wfd >= 0) {
+		FD_SET(wfd, &wfds);
+		if (wfd > max)
+			max = wfd;
+	}
+
+	if (select(max + 1, &rfds, &wfds, NULL, tm) < 0)
+		return 1;
+
+	return FD_ISSET(auxptr->stop[0], &rfds) == 0;
+}
+
+void *spectool_synth_thread(void *aux) {
+	spectool_synth_aux *auxptr = (spectool_synth_aux *) aux;
+	struct timeval now, tm;
+	sigset_t signal_set;
+	unsigned long n;
+	double due;
+
+	/* We don't want to see any signals in the child thread */
+	sigfillset(&signal_set);
+	pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
+
+	/* Sweeps are due on a fixed schedule from the start, so a slow wakeup
+	 * doesn't push every later sweep back */
+	for (n = 1; ; n++) {
+		gettimeofday(&now, NULL);
+
+		due = (double) n / auxptr->rate - 
+			((double) (now.tv_sec - auxptr->start.tv_sec) + 
+			 (double) (now.tv_usec - auxptr->start.tv_usec) / 1000000);
+
+		if (due > 0) {
+			tm.tv_sec = (long) due;
+			tm.tv_usec = (long) ((due - tm.tv_sec) * 1000000);
+
+			if (synth_wait(auxptr, -1, &tm) == 0)
+				break;
+		}
+
+		/* If the poller is that far behind, wait for it */
+		while (write(auxptr->wake[1], "0", 1) <= 0) {
+			if (synth_wait(auxptr, auxptr->wake[1], NULL) == 0)
+				return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+int spectool_synth_getpollfd(spectool_phy *phydev) {
+	spectool_synth_aux *auxptr = (spectool_synth_aux *) phydev->auxptr;
+
+	return auxptr->wake[0];
+}
+
+int spectool_synth_open(spectool_phy *phydev) {
+	spectool_synth_aux *auxptr = (spectool_synth_aux *) phydev->auxptr;
+
+	if (pipe(auxptr->wake) < 0 || pipe(auxptr->stop) < 0) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "spectool_synth failed to make wakeup pipe: %s", strerror(errno));
+		spectool_synth_close(phydev);
+		return -1;
+	}
+
+	fcntl(auxptr->wake[0], F_SETFL, fcntl(auxptr->wake[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(auxptr->wake[1], F_SETFL, fcntl(auxptr->wake[1], F_GETFL, 0) | O_NONBLOCK);
+
+	auxptr->num_sweeps = 0;
+	gettimeofday(&(auxptr->start), NULL);
+
+	if (auxptr->rate <= 0) {
+		write(auxptr->wake[1], "0", 1);
+	} else {
+		auxptr->thread_alive = 1;
+
+		if (pthread_create(&(auxptr->thread), NULL, 
+						   spectool_synth_thread, auxptr) != 0) {
+			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+					 "spectool_synth failed to create thread: %s",
+					 strerror(errno));
+			auxptr->thread_alive = 0;
+			spectool_synth_close(phydev);
+			return -1;
+		}
+	}
+
+	/* Update the state */
+	phydev->state = SPECTOOL_STATE_CONFIGURING;
+
+	return 1;
+}
+
+int spectool_synth_close(spectool_phy *phydev) {
+	spectool_synth_aux *aux;
+	int x;
+
+	if (phydev == NULL)
+		return 0;
+
+	aux = (spectool_synth_aux *) phydev->auxptr;
+
+	if (aux == NULL)
+		return 0;
+
+	if (aux->thread_alive) {
+		write(aux->stop[1], "0", 1);
+		pthread_join(aux->thread, NULL);
+		aux->thread_alive = 0;
+	}
+
+	for (x = 0; x < 2; x++) {
+		if (aux->wake[x] >= 0)
+			close(aux->wake[x]);
+		if (aux->stop[x] >= 0)
+			close(aux->stop[x]);
+
+		aux->wake[x] = aux->stop[x] = -1;
+	}
+
+	return 1;
+}
+
+spectool_sample_sweep *spectool_synth_getsweep(spectool_phy *phydev) {
+	spectool_synth_aux *auxptr = (spectool_synth_aux *) phydev->auxptr;
+
+	return auxptr->sweepbuf;
+}
+
+void spectool_synth_setcalibration(spectool_phy *phydev, int in_calib) {
+	phydev->state = SPECTOOL_STATE_RUNNING;
+}
+
+int spectool_synth_setposition(spectool_phy *phydev, int in_profile, 
+							   int start_khz, int res_hz) {
+	if (in_profile != 0 || start_khz != 0 || res_hz != 0) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "spectool_synth only generates its default range");
+		return -1;
+	}
+
+	return 1;
+}
+
+int spectool_synth_poll(spectool_phy *phydev) {
+	spectool_synth_aux *auxptr = (spectool_synth_aux *) phydev->auxptr;
+	struct timeval now;
+	double t;
+	char c;
+
+	/* Push a configure event before anything else */
+	if (auxptr->configured == 0) {
+		auxptr->configured = 1;
+		return SPECTOOL_POLL_CONFIGURED;
+	}
+
+	/* One byte a sweep from the pacing thread */
+	if (auxptr->rate > 0 && read(auxptr->wake[0], &c, 1) <= 0)
+		return SPECTOOL_POLL_NONE;
+
+	gettimeofday(&now, NULL);
+
+	/* Signals run on the sweep schedule, so they look the same however late
+	 * the sweep is polled; unpaced they run on the clock */
+	if (auxptr->rate > 0)
+		t = (double) (auxptr->num_sweeps + 1) / auxptr->rate;
+	else
+		t = (double) (now.tv_sec - auxptr->start.tv_sec) + 
+			(double) (now.tv_usec - auxptr->start.tv_usec) / 1000000;
+
+	auxptr->sweepbuf->tm_start = now;
+	synth_generate(auxptr, t);
+	gettimeofday(&(auxptr->sweepbuf->tm_end), NULL);
+
+	auxptr->num_sweeps++;
+
+	if (auxptr->sweepbuf->min_rssi_seen < phydev->min_rssi_seen)
+		phydev->min_rssi_seen = auxptr->sweepbuf->min_rssi_seen;
+
+	return SPECTOOL_POLL_SWEEPCOMPLETE;
+}
+
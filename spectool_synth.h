@@ -0,0 +1,63 @@
+/*
+ * Synthetic spectrum phy
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SPECTOOL_SYNTH_H__
+#define __SPECTOOL_SYNTH_H__
+
+#include "spectool_container.h"
+
+/*
+ * Generates a 2.4GHz ISM band with a noise floor and any of 802.11 bursts
+ * on channels 1, 6 and 11, a Bluetooth hopper and a microwave oven, at any
+ * number of bins and any sweep rate, for load testing without hardware.
+ *
+ * spectool_device_scan lists synthetic devices when asked to in the 
+ * environment:
+ *
+ *   SPECTOOL_SYNTH=count=4,bins=4096,rate=1000,signals=wifi+bt+oven
+ *
+ * All keys are optional; the defaults are one device of 
+ * SPECTOOL_SYNTH_DEF_BINS bins at SPECTOOL_SYNTH_DEF_RATE sweeps a second
+ * with every signal.  A rate of 0 generates as fast as the caller polls.
+ */
+
+#define SPECTOOL_SYNTH_ENV			"SPECTOOL_SYNTH"
+
+#define SPECTOOL_SYNTH_DEF_BINS		256
+#define SPECTOOL_SYNTH_DEF_RATE		30
+/* Bin counts are 16 bits in the network protocol */
+#define SPECTOOL_SYNTH_MAX_BINS		65535
+
+#define SPECTOOL_SYNTH_SIG_WIFI		1
+#define SPECTOOL_SYNTH_SIG_BT		2
+#define SPECTOOL_SYNTH_SIG_OVEN		4
+#define SPECTOOL_SYNTH_SIG_ALL		7
+
+/* Synthetic scan results */
+typedef struct _spectool_synth_rec {
+	int instance;
+	int bins;
+	double rate;
+	int signals;
+} spectool_synth_rec;
+
+int spectool_synth_device_scan(spectool_device_list *list);
+
+int spectool_synth_init_params(spectool_phy *phydev, int instance, int bins,
+							   double rate, int signals);
+int spectool_synth_init(spectool_phy *phydev, spectool_device_rec *rec);
+
+#endif
+
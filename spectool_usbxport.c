@@ -0,0 +1,290 @@
+/*
+ * Shared asynchronous USB transport
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#include "spectool_usbxport.h"
+
+#ifdef SPECTOOL_USBXPORT
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+/* Devices being served, and the thread serving them.  The thread exits on 
+ * its own once the list is empty */
+static pthread_mutex_t xport_lock = PTHREAD_MUTEX_INITIALIZER;
+static spectool_usbxport *xport_list = NULL;
+static int xport_running = 0;
+static int xport_wake[2] = { -1, -1 };
+static int xport_depth = SPECTOOL_USBXPORT_DEPTH;
+
+/* The front of a libusb 0.1 handle, the same trick wispy_usb_detach_hack 
+ * relies on */
+struct xport_usb_handle {
+	int fd;
+};
+
+void spectool_usbxport_setdepth(int depth) {
+	if (depth < 1)
+		depth = 1;
+	if (depth > SPECTOOL_USBXPORT_MAXDEPTH)
+		depth = SPECTOOL_USBXPORT_MAXDEPTH;
+
+	xport_depth = depth;
+}
+
+static void xport_signal(void) {
+	write(xport_wake[1], "0", 1);
+}
+
+static int xport_submit(spectool_usbxport *x, int n) {
+	struct usbdevfs_urb *u = &(x->urbs[n]);
+
+	memset(u, 0, sizeof(struct usbdevfs_urb));
+	memset(x->buf[n], 0, x->report_len);
+
+	if (x->type == SPECTOOL_USBXPORT_BULK)
+		u->type = USBDEVFS_URB_TYPE_BULK;
+	else
+		u->type = USBDEVFS_URB_TYPE_INTERRUPT;
+
+	u->endpoint = x->endpoint;
+	u->buffer = x->buf[n];
+	u->buffer_length = x->report_len;
+
+	return ioctl(x->fd, USBDEVFS_SUBMITURB, u);
+}
+
+/* Fail a device the same way a driver service thread does; the poller picks
+ * it up from the alive flag */
+static void xport_fail(spectool_usbxport *x, const char *what, int err) {
+	snprintf(x->phydev->errstr, SPECTOOL_ERROR_MAX,
+			 "USB transport failed to %s: %s", what, strerror(err));
+	*(x->alive) = 0;
+	x->phydev->state = SPECTOOL_STATE_ERROR;
+	spectool_ring_signal(x->ring);
+}
+
+/* Move every completed transfer into the ring and put it back in flight */
+static void xport_reap(spectool_usbxport *x) {
+	struct usbdevfs_urb *u;
+
+	while (ioctl(x->fd, USBDEVFS_REAPURBNDELAY, &u) == 0) {
+		if (*(x->alive) == 0)
+			continue;
+
+		if (u->status != 0) {
+			xport_fail(x, "read USB data", -(u->status));
+			continue;
+		}
+
+		if (u->actual_length > 0 &&
+			spectool_ring_put(x->ring, u->buffer, x->report_len) == 0)
+			SPECTOOL_PHY_COUNT(x->phydev, overruns);
+
+		if (xport_submit(x, u - x->urbs) < 0)
+			xport_fail(x, "resubmit USB transfer", errno);
+	}
+
+	if (errno != EAGAIN && *(x->alive))
+		xport_fail(x, "reap USB transfer", errno);
+}
+
+static void *xport_thread(void *arg) {
+	struct pollfd pfd[SPECTOOL_USBXPORT_MAXDEV + 1];
+	spectool_usbxport *x;
+	sigset_t signal_set;
+	char junk[64];
+	int n, i;
+
+	/* We don't want to see any signals in the transport thread */
+	sigfillset(&signal_set);
+	pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
+
+	while (1) {
+		pthread_mutex_lock(&xport_lock);
+
+		if (xport_list == NULL) {
+			xport_running = 0;
+			pthread_mutex_unlock(&xport_lock);
+			break;
+		}
+
+		pfd[0].fd = xport_wake[0];
+		pfd[0].events = POLLIN;
+		n = 1;
+
+		/* usbfs flags completed transfers as writable.  Failed devices are
+		 * left out, a removed device is always in error */
+		for (x = xport_list; x != NULL && n <= SPECTOOL_USBXPORT_MAXDEV; 
+			 x = x->next) {
+			if (*(x->alive) == 0)
+				continue;
+
+			pfd[n].fd = x->fd;
+			pfd[n].events = POLLOUT;
+			n++;
+		}
+
+		pthread_mutex_unlock(&xport_lock);
+
+		if (poll(pfd, n, -1) < 0)
+			continue;
+
+		if ((pfd[0].revents & POLLIN)) {
+			while (read(xport_wake[0], junk, 64) > 0)
+				;
+		}
+
+		/* Devices closed while we were waiting are gone from the list */
+		pthread_mutex_lock(&xport_lock);
+
+		for (x = xport_list; x != NULL; x = x->next) {
+			for (i = 1; i < n; i++) {
+				if (pfd[i].fd == x->fd)
+					break;
+			}
+
+			if (i < n && pfd[i].revents != 0)
+				xport_reap(x);
+		}
+
+		pthread_mutex_unlock(&xport_lock);
+	}
+
+	return NULL;
+}
+
+int spectool_usbxport_open(spectool_usbxport *x, struct usb_dev_handle *devhdl,
+						   int endpoint, int type, int report_len, 
+						   spectool_ring *ring, int *alive, spectool_phy *phydev) {
+	struct usbdevfs_connectinfo ci;
+	struct stat st;
+	pthread_t thread;
+	pthread_attr_t attr;
+	int n, ndev = 0;
+	spectool_usbxport *l;
+
+	x->active = 0;
+	x->fd = ((struct xport_usb_handle *) devhdl)->fd;
+
+	/* Make sure the handle really holds a usbfs fd */
+	if (fstat(x->fd, &st) < 0 || S_ISCHR(st.st_mode) == 0 ||
+		ioctl(x->fd, USBDEVFS_CONNECTINFO, &ci) < 0)
+		return -1;
+
+	if (report_len > SPECTOOL_RING_SLOT_SZ)
+		return -1;
+
+	x->endpoint = endpoint;
+	x->type = type;
+	x->report_len = report_len;
+	x->depth = xport_depth;
+	x->ring = ring;
+	x->alive = alive;
+	x->phydev = phydev;
+
+	pthread_mutex_lock(&xport_lock);
+
+	for (l = xport_list; l != NULL; l = l->next)
+		ndev++;
+
+	if (ndev >= SPECTOOL_USBXPORT_MAXDEV) {
+		pthread_mutex_unlock(&xport_lock);
+		return -1;
+	}
+
+	if (xport_wake[0] < 0) {
+		if (pipe(xport_wake) < 0) {
+			pthread_mutex_unlock(&xport_lock);
+			return -1;
+		}
+
+		fcntl(xport_wake[0], F_SETFL, fcntl(xport_wake[0], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(xport_wake[1], F_SETFL, fcntl(xport_wake[1], F_GETFL, 0) | O_NONBLOCK);
+	}
+
+	for (n = 0; n < x->depth; n++) {
+		if (xport_submit(x, n) < 0) {
+			while (--n >= 0)
+				ioctl(x->fd, USBDEVFS_DISCARDURB, &(x->urbs[n]));
+			pthread_mutex_unlock(&xport_lock);
+			return -1;
+		}
+	}
+
+	if (xport_running == 0) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		if (pthread_create(&thread, &attr, xport_thread, NULL) != 0) {
+			pthread_attr_destroy(&attr);
+			for (n = 0; n < x->depth; n++)
+				ioctl(x->fd, USBDEVFS_DISCARDURB, &(x->urbs[n]));
+			pthread_mutex_unlock(&xport_lock);
+			return -1;
+		}
+
+		pthread_attr_destroy(&attr);
+		xport_running = 1;
+	}
+
+	x->next = xport_list;
+	xport_list = x;
+	x->active = 1;
+
+	pthread_mutex_unlock(&xport_lock);
+
+	xport_signal();
+
+	return 1;
+}
+
+void spectool_usbxport_close(spectool_usbxport *x) {
+	spectool_usbxport **p;
+	int n;
+
+	if (x->active == 0)
+		return;
+
+	pthread_mutex_lock(&xport_lock);
+
+	for (p = &xport_list; *p != NULL; p = &((*p)->next)) {
+		if (*p == x) {
+			*p = x->next;
+			break;
+		}
+	}
+
+	x->active = 0;
+
+	for (n = 0; n < x->depth; n++)
+		ioctl(x->fd, USBDEVFS_DISCARDURB, &(x->urbs[n]));
+
+	pthread_mutex_unlock(&xport_lock);
+
+	xport_signal();
+}
+
+#endif
+
@@ -0,0 +1,87 @@
+/*
+ * Shared asynchronous USB transport
+ *
+ * This code is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This code is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef __SPECTOOL_USBXPORT_H__
+#define __SPECTOOL_USBXPORT_H__
+
+#include "config.h"
+
+#include "spectool_container.h"
+#include "spectool_ring.h"
+
+/*
+ * libusb 0.1 only does blocking transfers, so each device used to need its
+ * own thread with a single read outstanding.  On Linux we can go around it
+ * to usbfs: the transport keeps a queue of interrupt (or bulk) URBs in 
+ * flight on every device and one thread reaps completions for all of them,
+ * resubmitting each URB as soon as its report is in the device ring.
+ *
+ * It only works with the real libusb 0.1, which keeps the usbfs fd at the
+ * front of its handle; with anything else open fails and drivers fall back
+ * to their own service thread.
+ */
+#if defined(SYS_LINUX) && defined(HAVE_LINUX_DEVDISCONNECT)
+#define SPECTOOL_USBXPORT
+
+#ifndef __user
+#define __user
+#endif
+#include <linux/usbdevice_fs.h>
+
+#define SPECTOOL_USBXPORT_INTERRUPT		0
+#define SPECTOOL_USBXPORT_BULK			1
+
+/* Transfers kept in flight per device by default, and at most */
+#define SPECTOOL_USBXPORT_DEPTH			4
+#define SPECTOOL_USBXPORT_MAXDEPTH		16
+
+/* Most devices the transport thread will serve */
+#define SPECTOOL_USBXPORT_MAXDEV		32
+
+struct usb_dev_handle;
+
+typedef struct _spectool_usbxport {
+	int active;
+
+	int fd;
+	int endpoint, type, report_len, depth;
+
+	struct usbdevfs_urb urbs[SPECTOOL_USBXPORT_MAXDEPTH];
+	uint8_t buf[SPECTOOL_USBXPORT_MAXDEPTH][SPECTOOL_RING_SLOT_SZ];
+
+	/* Where reports go, and the driver state to fail on an error */
+	spectool_ring *ring;
+	int *alive;
+	spectool_phy *phydev;
+
+	struct _spectool_usbxport *next;
+} spectool_usbxport;
+
+/* Set the number of transfers in flight for devices opened after this */
+void spectool_usbxport_setdepth(int depth);
+
+/* Start reading reports of report_len from an endpoint into the ring.  On 
+ * a failure *alive is cleared and the phy put in the error state.  Returns
+ * -1 if the transport can't be used with this handle */
+int spectool_usbxport_open(spectool_usbxport *x, struct usb_dev_handle *devhdl,
+						   int endpoint, int type, int report_len, 
+						   spectool_ring *ring, int *alive, spectool_phy *phydev);
+/* Stop reading.  Cancelled transfers are cleaned up when the handle closes */
+void spectool_usbxport_close(spectool_usbxport *x);
+
+#endif
+
+#endif
+
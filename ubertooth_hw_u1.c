@@ -81,6 +81,8 @@
 #define UBERTOOTH_U1_DEF_H_STEPS		78
 
 #include "spectool_container.h"
+#include "spectool_ring.h"
+#include "spectool_usbxport.h"
 #include "ubertooth_hw_u1.h"
 #include "wispy_hw_24x.h"
 
@@ -145,7 +147,13 @@ typedef struct _ubertooth_u1_aux {
 	/* peak samples */
 	spectool_sweep_cache *peak_cache;
 
-	int sockpair[2];
+	/* Reports from the service thread */
+	spectool_ring ring;
+
+#ifdef SPECTOOL_USBXPORT
+	/* Async transfers, when we aren't running our own service thread */
+	spectool_usbxport xport;
+#endif
 
 	int sweepbase;
 
@@ -415,8 +423,10 @@ int ubertooth_u1_init_path(spectool_phy *phydev, char *buspath, char *devpath) {
 	auxptr->dev = dev;
 	auxptr->devhdl = NULL;
 	auxptr->phydev = phydev;
-	auxptr->sockpair[0] = -1;
-	auxptr->sockpair[1] = -1;
+	spectool_ring_init(&(auxptr->ring));
+#ifdef SPECTOOL_USBXPORT
+	auxptr->xport.active = 0;
+#endif
 
 	/* Will be filled in by setposition later */
 	auxptr->sweepbuf_initialized = 0;
@@ -441,22 +451,14 @@ int ubertooth_u1_init_path(spectool_phy *phydev, char *buspath, char *devpath) {
 void *ubertooth_u1_servicethread(void *aux) {
 	ubertooth_u1_aux *auxptr = (ubertooth_u1_aux *) aux;
 
-	int sock;
 	struct usb_device *dev;
 	struct usb_dev_handle *u1;
 
 	char buf[64];
-	int x = 0, error = 0;
-	fd_set wset;
-
 	struct timeval tm;
 
 	sigset_t signal_set;
 
-	error = 0;
-
-	sock = auxptr->sockpair[1];
-
 	dev = auxptr->dev;
 	u1 = auxptr->devhdl;
 
@@ -465,68 +467,40 @@ void *ubertooth_u1_servicethread(void *aux) {
 	pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
 
 	while (1) {
-		/* wait until we're able to write out to the IPC socket, go into a blocking
-		 * select */
-		FD_ZERO(&wset);
-		FD_SET(sock, &wset);
-
-		if (select(sock + 1, NULL, &wset, NULL, NULL) < 0) {
-			snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-					 "ubertooth_u1 poller failed on IPC write select(): %s",
-					 strerror(errno));
-			auxptr->usb_thread_alive = 0;
-			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-			pthread_exit(NULL);
-		}
-
 		if (auxptr->usb_thread_alive == 0) {
 			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
 			pthread_exit(NULL);
 		}
 
-		if (FD_ISSET(sock, &wset) == 0)
-			continue;
+		memset(buf, 0, 64);
 
-		/* Get new data only if we haven't requeued */
-		if (error == 0) {
-			memset(buf, 0, 64);
+		if (usb_bulk_read(u1, 0x82, buf, 64, TIMEOUT) <= 0) {
+			if (errno == EAGAIN)
+				continue;
 
-			if (usb_bulk_read(u1, 0x82, buf, 64, TIMEOUT) <= 0) {
-				if (errno == EAGAIN)
-					continue;
+			snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
+					 "ubertooth_u1 poller failed to read USB data: %s",
+					 strerror(errno));
+			auxptr->usb_thread_alive = 0;
+			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
+			spectool_ring_signal(&(auxptr->ring));
+			pthread_exit(NULL);
+		}
 
-				snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-						 "ubertooth_u1 poller failed to read USB data: %s",
-						 strerror(errno));
-				auxptr->usb_thread_alive = 0;
-				auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-				pthread_exit(NULL);
-			}
+		/* Hand it to the poller, waiting for room if it has fallen behind */
+		while (spectool_ring_put(&(auxptr->ring), buf, 64) == 0) {
+			SPECTOOL_PHY_COUNT(auxptr->phydev, requeues);
 
-			/* Send it to the IPC remote, re-queue on enobufs */
-			if (send(sock, buf, 64, 0) < 0) {
-				if (errno == ENOBUFS) {
-					error = 1;
-					continue;
-				}
-
-				snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-						 "ubertooth_u1 poller failed on IPC send: %s",
-						 strerror(errno));
-				auxptr->usb_thread_alive = 0;
+			if (auxptr->usb_thread_alive == 0) {
 				auxptr->phydev->state = SPECTOOL_STATE_ERROR;
 				pthread_exit(NULL);
 			}
 
+			tm.tv_sec = 0;
+			tm.tv_usec = 1000;
+			select(0, NULL, NULL, NULL, &tm);
 		}
-
-		error = 0;
 	}
-
-	auxptr->usb_thread_alive = 0;
-	send(sock, buf, 64, 0);
-	auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-	pthread_exit(NULL);
 }
 
 int ubertooth_u1_getpollfd(spectool_phy *phydev) {
@@ -537,20 +511,16 @@ int ubertooth_u1_getpollfd(spectool_phy *phydev) {
 		return -1;
 	}
 
-	return auxptr->sockpair[0];
+	return spectool_ring_getpollfd(&(auxptr->ring));
 }
 
 int ubertooth_u1_open(spectool_phy *phydev) {
-	int pid_status;
+	int pid_status, async;
 	ubertooth_u1_aux *auxptr = (ubertooth_u1_aux *) phydev->auxptr;
 
-	/* Make the client/server socketpair */
-	if (socketpair(PF_UNIX, SOCK_DGRAM, 0, auxptr->sockpair) < 0) {
-		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-				 "ubertooth_u1 open failed to create socket pair for capture "
-				 "process: %s", strerror(errno));
+	/* Make the ring the service thread hands reports over in */
+	if (spectool_ring_open(&(auxptr->ring), phydev->errstr) < 0)
 		return -1;
-	}
 
 	if ((auxptr->devhdl = usb_open(auxptr->dev)) == NULL) {
 		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
@@ -582,7 +552,16 @@ int ubertooth_u1_open(spectool_phy *phydev) {
 
 	auxptr->last_read = time(0);
 
-	if (pthread_create(&(auxptr->usb_thread), NULL, 
+	async = 0;
+#ifdef SPECTOOL_USBXPORT
+	if (spectool_usbxport_open(&(auxptr->xport), auxptr->devhdl, 0x82, 
+							   SPECTOOL_USBXPORT_BULK, 64,
+							   &(auxptr->ring), &(auxptr->usb_thread_alive),
+							   phydev) >= 0)
+		async = 1;
+#endif
+
+	if (async == 0 && pthread_create(&(auxptr->usb_thread), NULL, 
 					   ubertooth_u1_servicethread, auxptr) < 0) {
 		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
 				 "ubertooth_u1 capture failed to create thread: %s",
@@ -613,6 +592,14 @@ int ubertooth_u1_close(spectool_phy *phydev) {
 	if (aux == NULL)
 		return 0;
 
+	/* Async transfers just get cancelled, there's no thread to wait for */
+#ifdef SPECTOOL_USBXPORT
+	if (aux->xport.active) {
+		spectool_usbxport_close(&(aux->xport));
+		aux->usb_thread_alive = 0;
+	}
+#endif
+
 	/* If the thread is still alive, don't take away the devices it might
 	 * still be reading, wait for it to error down */
 	if (aux->usb_thread_alive) {
@@ -625,15 +612,7 @@ int ubertooth_u1_close(spectool_phy *phydev) {
 		aux->devhdl = NULL;
 	}
 
-	if (aux->sockpair[0] >= 0) {
-		close(aux->sockpair[0]);
-		aux->sockpair[0] = -1;
-	}
-
-	if (aux->sockpair[1] >= 0) {
-		close(aux->sockpair[1]);
-		aux->sockpair[1] = -1;
-	}
+	spectool_ring_close(&(aux->ring));
 
 	return 1;
 }
@@ -649,50 +628,22 @@ void ubertooth_u1_setcalibration(spectool_phy *phydev, int in_calib) {
 	phydev->state = SPECTOOL_STATE_RUNNING;
 }
 
-int ubertooth_u1_poll(spectool_phy *phydev) {
+/* Handle one report from the service thread */
+int ubertooth_u1_handle_report(spectool_phy *phydev, uint8_t *lbuf, int ret) {
 	ubertooth_u1_aux *auxptr = (ubertooth_u1_aux *) phydev->auxptr;
-	char lbuf[64];
-	int x, freq, ret, full = 0, rssi;
+	int x, freq, full = 0, rssi;
 	ubertooth_u1_report *report = (ubertooth_u1_report *) lbuf;
 
-	/* Push a configure event before anything else */
-	if (auxptr->configured == 0) {
-		auxptr->configured = 1;
-		return SPECTOOL_POLL_CONFIGURED;
-	}
-
-	/* Use the error set by the polling thread */
-	if (auxptr->usb_thread_alive == 0) {
-		phydev->state = SPECTOOL_STATE_ERROR;
-		ubertooth_u1_close(phydev);
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if ((ret = recv(auxptr->sockpair[0], lbuf, 64, 0)) < 0) {
-		if (auxptr->usb_thread_alive != 0)
-			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-					 "ubertooth_u1 IPC receiver failed to read signal data: %s",
-					 strerror(errno));
-		phydev->state = SPECTOOL_STATE_ERROR;
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if (time(0) - auxptr->last_read > 3) {
-		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-				 "ubertooth_u1 didn't see any data for more than 3 seconds, "
-				 "something has gone wrong (was the device removed?)");
-		phydev->state = SPECTOOL_STATE_ERROR;
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if (ret > 0)
-		auxptr->last_read = time(0);
-
 	// If we don't have a sweepbuf we're not configured, barf
 	if (auxptr->sweepbuf == NULL) {
 		return SPECTOOL_POLL_NONE;
 	}
 
+	if (ret < sizeof(ubertooth_u1_report)) {
+		SPECTOOL_PHY_COUNT(phydev, short_reports);
+		return SPECTOOL_POLL_NONE;
+	}
+
 	// If we're full entering a read we need to wipe out
 	if (auxptr->peak_cache->num_used >= UBERTOOTH_U1_AVG_SAMPLES) {
 		// spectool_cache_clear(auxptr->peak_cache);
@@ -714,7 +665,10 @@ int ubertooth_u1_poll(spectool_phy *phydev) {
 		// printf("%u = %d ", freq, rssi);
 
 		if (freq < 0 || freq >= auxptr->sweepbuf->num_samples) {
-			printf("debug - sample freq %d not in range\n", freq);
+#ifdef _DEBUG
+			fprintf(stderr, "debug - sample freq %d not in range\n", freq);
+#endif
+			SPECTOOL_PHY_COUNT(phydev, bad_base);
 			continue;
 		}
 
@@ -808,6 +762,41 @@ int ubertooth_u1_poll(spectool_phy *phydev) {
 	return SPECTOOL_POLL_NONE;
 }
 
+int ubertooth_u1_poll(spectool_phy *phydev) {
+	ubertooth_u1_aux *auxptr = (ubertooth_u1_aux *) phydev->auxptr;
+	int ret, count;
+
+	/* Push a configure event before anything else */
+	if (auxptr->configured == 0) {
+		auxptr->configured = 1;
+		return SPECTOOL_POLL_CONFIGURED;
+	}
+
+	/* Use the error set by the polling thread */
+	if (auxptr->usb_thread_alive == 0) {
+		phydev->state = SPECTOOL_STATE_ERROR;
+		ubertooth_u1_close(phydev);
+		return SPECTOOL_POLL_ERROR;
+	}
+
+	if (time(0) - auxptr->last_read > 3) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "ubertooth_u1 didn't see any data for more than 3 seconds, "
+				 "something has gone wrong (was the device removed?)");
+		phydev->state = SPECTOOL_STATE_ERROR;
+		return SPECTOOL_POLL_ERROR;
+	}
+
+	/* Handle everything the service thread has queued, up to the end of a
+	 * sweep */
+	ret = spectool_ring_drain(&(auxptr->ring), phydev, &ubertooth_u1_handle_report, &count);
+
+	if (count > 0)
+		auxptr->last_read = time(0);
+
+	return ret;
+}
+
 spectool_sample_sweep *ubertooth_u1_build_sweepbuf(spectool_phy *phydev) {
 	spectool_sample_sweep *r;
 
@@ -109,6 +109,8 @@
 */
 
 #include "spectool_container.h"
+#include "spectool_ring.h"
+#include "spectool_usbxport.h"
 #include "wispy_hw_24x.h"
 
 #define endian_swap32(x) \
@@ -144,7 +146,13 @@ typedef struct _wispy24x_usb_aux {
 	/* Sweep buffer we maintain and return */
 	spectool_sample_sweep *sweepbuf;
 
-	int sockpair[2];
+	/* Reports from the service thread */
+	spectool_ring ring;
+
+#ifdef SPECTOOL_USBXPORT
+	/* Async transfers, when we aren't running our own service thread */
+	spectool_usbxport xport;
+#endif
 
 	int sweepbase;
 
@@ -426,8 +434,10 @@ int wispy24x_usb_init_path(spectool_phy *phydev, char *buspath, char *devpath) {
 	auxptr->dev = dev;
 	auxptr->devhdl = NULL;
 	auxptr->phydev = phydev;
-	auxptr->sockpair[0] = -1;
-	auxptr->sockpair[1] = -1;
+	spectool_ring_init(&(auxptr->ring));
+#ifdef SPECTOOL_USBXPORT
+	auxptr->xport.active = 0;
+#endif
 
 	/* Will be filled in by setposition later */
 	auxptr->sweepbuf_initialized = 0;
@@ -449,22 +459,14 @@ int wispy24x_usb_init_path(spectool_phy *phydev, char *buspath, char *devpath) {
 void *wispy24x_usb_servicethread(void *aux) {
 	wispy24x_usb_aux *auxptr = (wispy24x_usb_aux *) aux;
 
-	int sock;
 	struct usb_device *dev;
 	struct usb_dev_handle *wispy;
 
 	char buf[64];
-	int x = 0, error = 0;
-	fd_set wset;
-
 	struct timeval tm;
 
 	sigset_t signal_set;
 
-	error = 0;
-
-	sock = auxptr->sockpair[1];
-
 	dev = auxptr->dev;
 	wispy = auxptr->devhdl;
 
@@ -473,68 +475,40 @@ void *wispy24x_usb_servicethread(void *aux) {
 	pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
 
 	while (1) {
-		/* wait until we're able to write out to the IPC socket, go into a blocking
-		 * select */
-		FD_ZERO(&wset);
-		FD_SET(sock, &wset);
-
-		if (select(sock + 1, NULL, &wset, NULL, NULL) < 0) {
-			snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-					 "wispy24x_usb poller failed on IPC write select(): %s",
-					 strerror(errno));
-			auxptr->usb_thread_alive = 0;
+		if (auxptr->usb_thread_alive == 0) {
 			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
 			pthread_exit(NULL);
 		}
 
-		if (auxptr->usb_thread_alive == 0) {
+		memset(buf, 0, 64);
+
+		if (usb_interrupt_read(wispy, 0x81, buf, 64, TIMEOUT) <= 0) {
+			if (errno == EAGAIN)
+				continue;
+
+			snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
+					 "wispy24x_usb poller failed to read USB data: %s",
+					 strerror(errno));
+			auxptr->usb_thread_alive = 0;
 			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
+			spectool_ring_signal(&(auxptr->ring));
 			pthread_exit(NULL);
 		}
 
-		if (FD_ISSET(sock, &wset) == 0)
-			continue;
-
-		/* Get new data only if we haven't requeued */
-		if (error == 0) {
-			memset(buf, 0, 64);
+		/* Hand it to the poller, waiting for room if it has fallen behind */
+		while (spectool_ring_put(&(auxptr->ring), buf, 64) == 0) {
+			SPECTOOL_PHY_COUNT(auxptr->phydev, requeues);
 
-			if (usb_interrupt_read(wispy, 0x81, buf, 64, TIMEOUT) <= 0) {
-				if (errno == EAGAIN)
-					continue;
-
-				snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-						 "wispy24x_usb poller failed to read USB data: %s",
-						 strerror(errno));
-				auxptr->usb_thread_alive = 0;
-				auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-				pthread_exit(NULL);
-			}
-
-			/* Send it to the IPC remote, re-queue on enobufs */
-			if (send(sock, buf, 64, 0) < 0) {
-				if (errno == ENOBUFS) {
-					error = 1;
-					continue;
-				}
-
-				snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-						 "wispy24x_usb poller failed on IPC send: %s",
-						 strerror(errno));
-				auxptr->usb_thread_alive = 0;
+			if (auxptr->usb_thread_alive == 0) {
 				auxptr->phydev->state = SPECTOOL_STATE_ERROR;
 				pthread_exit(NULL);
 			}
 
+			tm.tv_sec = 0;
+			tm.tv_usec = 1000;
+			select(0, NULL, NULL, NULL, &tm);
 		}
-
-		error = 0;
 	}
-
-	auxptr->usb_thread_alive = 0;
-	send(sock, buf, 64, 0);
-	auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-	pthread_exit(NULL);
 }
 
 int wispy24x_usb_getpollfd(spectool_phy *phydev) {
@@ -545,20 +519,16 @@ int wispy24x_usb_getpollfd(spectool_phy *phydev) {
 		return -1;
 	}
 
-	return auxptr->sockpair[0];
+	return spectool_ring_getpollfd(&(auxptr->ring));
 }
 
 int wispy24x_usb_open(spectool_phy *phydev) {
-	int pid_status;
+	int pid_status, async;
 	wispy24x_usb_aux *auxptr = (wispy24x_usb_aux *) phydev->auxptr;
 
-	/* Make the client/server socketpair */
-	if (socketpair(PF_UNIX, SOCK_DGRAM, 0, auxptr->sockpair) < 0) {
-		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-				 "wispy24x_usb open failed to create socket pair for capture "
-				 "process: %s", strerror(errno));
+	/* Make the ring the service thread hands reports over in */
+	if (spectool_ring_open(&(auxptr->ring), phydev->errstr) < 0)
 		return -1;
-	}
 
 	if ((auxptr->devhdl = usb_open(auxptr->dev)) == NULL) {
 		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
@@ -590,7 +560,16 @@ int wispy24x_usb_open(spectool_phy *phydev) {
 
 	auxptr->last_read = time(0);
 
-	if (pthread_create(&(auxptr->usb_thread), NULL, 
+	async = 0;
+#ifdef SPECTOOL_USBXPORT
+	if (spectool_usbxport_open(&(auxptr->xport), auxptr->devhdl, 0x81, 
+							   SPECTOOL_USBXPORT_INTERRUPT, 64,
+							   &(auxptr->ring), &(auxptr->usb_thread_alive),
+							   phydev) >= 0)
+		async = 1;
+#endif
+
+	if (async == 0 && pthread_create(&(auxptr->usb_thread), NULL, 
 					   wispy24x_usb_servicethread, auxptr) < 0) {
 		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
 				 "wispy24x_usb capture failed to create thread: %s",
@@ -621,6 +600,14 @@ int wispy24x_usb_close(spectool_phy *phydev) {
 	if (aux == NULL)
 		return 0;
 
+	/* Async transfers just get cancelled, there's no thread to wait for */
+#ifdef SPECTOOL_USBXPORT
+	if (aux->xport.active) {
+		spectool_usbxport_close(&(aux->xport));
+		aux->usb_thread_alive = 0;
+	}
+#endif
+
 	/* If the thread is still alive, don't take away the devices it might
 	 * still be reading, wait for it to error down */
 	if (aux->usb_thread_alive) {
@@ -633,15 +620,7 @@ int wispy24x_usb_close(spectool_phy *phydev) {
 		aux->devhdl = NULL;
 	}
 
-	if (aux->sockpair[0] >= 0) {
-		close(aux->sockpair[0]);
-		aux->sockpair[0] = -1;
-	}
-
-	if (aux->sockpair[1] >= 0) {
-		close(aux->sockpair[1]);
-		aux->sockpair[1] = -1;
-	}
+	spectool_ring_close(&(aux->ring));
 
 	return 1;
 }
@@ -656,52 +635,19 @@ void wispy24x_usb_setcalibration(spectool_phy *phydev, int in_calib) {
 	phydev->state = SPECTOOL_STATE_RUNNING;
 }
 
-int wispy24x_usb_poll(spectool_phy *phydev) {
+/* Handle one report from the service thread */
+int wispy24x_usb_handle_report(spectool_phy *phydev, uint8_t *lbuf, int ret) {
 	wispy24x_usb_aux *auxptr = (wispy24x_usb_aux *) phydev->auxptr;
-	char lbuf[64];
-	int base, res, ret, x;
+	int base, res, x;
 	wispy24x_report *report;
 
-	/* Push a configure event before anything else */
-	if (auxptr->configured == 0) {
-		auxptr->configured = 1;
-		return SPECTOOL_POLL_CONFIGURED;
-	}
-
-	/* Use the error set by the polling thread */
-	if (auxptr->usb_thread_alive == 0) {
-		phydev->state = SPECTOOL_STATE_ERROR;
-		wispy24x_usb_close(phydev);
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if ((ret = recv(auxptr->sockpair[0], lbuf, 64, 0)) < 0) {
-		if (auxptr->usb_thread_alive != 0)
-			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-					 "wispy24x_usb IPC receiver failed to read signal data: %s",
-					 strerror(errno));
-		phydev->state = SPECTOOL_STATE_ERROR;
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if (time(0) - auxptr->last_read > 3) {
-		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-				 "wispy1_usb didn't see any data for more than 3 seconds, "
-				 "something has gone wrong (was the device removed?)");
-		phydev->state = SPECTOOL_STATE_ERROR;
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if (ret > 0)
-		auxptr->last_read = time(0);
-
 	// If we don't have a sweepbuf we're not configured, barf
 	if (auxptr->sweepbuf == NULL) {
 		return SPECTOOL_POLL_NONE;
 	}
 
 	if (ret < sizeof(wispy24x_report)) {
-		printf("Short report\n");
+		SPECTOOL_PHY_COUNT(phydev, short_reports);
 		return SPECTOOL_POLL_NONE;
 	}
 
@@ -722,13 +668,20 @@ int wispy24x_usb_poll(spectool_phy *phydev) {
 		base = (base) / ((float) auxptr->sweepbuf->res_hz / 1000);
 	*/
 	
-	if (base == 0)
+	if (base == 0) {
+		/* Starting over before the last sweep filled loses it */
+		if (auxptr->sweepbuf_initialized && auxptr->sweepbase > 0 &&
+			auxptr->sweepbase < auxptr->sweepbuf->num_samples)
+			SPECTOOL_PHY_COUNT(phydev, sweeps_dropped);
+
 		auxptr->sweepbase = 0;
-	else
+	} else {
 		base = auxptr->sweepbase;
+	}
 
 	if (base < 0 || base > auxptr->sweepbuf->num_samples) {
 		/* Bunk data, throw it out */
+		SPECTOOL_PHY_COUNT(phydev, bad_base);
 		return SPECTOOL_POLL_NONE;
 	}
 
@@ -742,6 +695,7 @@ int wispy24x_usb_poll(spectool_phy *phydev) {
 		/* Init the timestamp for sweep begin */
 		gettimeofday(&(auxptr->sweepbuf->tm_start), NULL);
 	} else if (auxptr->sweepbuf_initialized == 0) {
+		SPECTOOL_PHY_COUNT(phydev, discarded);
 		return SPECTOOL_POLL_NONE;
 	}
 
@@ -772,6 +726,41 @@ int wispy24x_usb_poll(spectool_phy *phydev) {
 	return SPECTOOL_POLL_NONE;
 }
 
+int wispy24x_usb_poll(spectool_phy *phydev) {
+	wispy24x_usb_aux *auxptr = (wispy24x_usb_aux *) phydev->auxptr;
+	int ret, count;
+
+	/* Push a configure event before anything else */
+	if (auxptr->configured == 0) {
+		auxptr->configured = 1;
+		return SPECTOOL_POLL_CONFIGURED;
+	}
+
+	/* Use the error set by the polling thread */
+	if (auxptr->usb_thread_alive == 0) {
+		phydev->state = SPECTOOL_STATE_ERROR;
+		wispy24x_usb_close(phydev);
+		return SPECTOOL_POLL_ERROR;
+	}
+
+	if (time(0) - auxptr->last_read > 3) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "wispy1_usb didn't see any data for more than 3 seconds, "
+				 "something has gone wrong (was the device removed?)");
+		phydev->state = SPECTOOL_STATE_ERROR;
+		return SPECTOOL_POLL_ERROR;
+	}
+
+	/* Handle everything the service thread has queued, up to the end of a
+	 * sweep */
+	ret = spectool_ring_drain(&(auxptr->ring), phydev, &wispy24x_usb_handle_report, &count);
+
+	if (count > 0)
+		auxptr->last_read = time(0);
+
+	return ret;
+}
+
 int wispy24x_usb_setposition(spectool_phy *phydev, int in_profile, 
 							 int start_khz, int res_hz) {
 	int temp_d, temp_m;
@@ -133,6 +133,8 @@
 #define WISPYDBx_MODEL_DBxV3	7
 
 #include "spectool_container.h"
+#include "spectool_ring.h"
+#include "spectool_usbxport.h"
 #include "wispy_hw_dbx.h"
 
 #define endian_swap32(x) \
@@ -176,7 +178,13 @@ typedef struct _wispydbx_usb_aux {
 	/* Sweep buffer we maintain and return */
 	spectool_sample_sweep *sweepbuf;
 
-	int sockpair[2];
+	/* Reports from the service thread */
+	spectool_ring ring;
+
+#ifdef SPECTOOL_USBXPORT
+	/* Async transfers, when we aren't running our own service thread */
+	spectool_usbxport xport;
+#endif
 
 	int sweepbase;
 
@@ -748,8 +756,10 @@ int wispydbx_usb_init_path(spectool_phy *phydev, char *buspath, char *devpath) {
 	auxptr->dev = dev;
 	auxptr->devhdl = NULL;
 	auxptr->phydev = phydev;
-	auxptr->sockpair[0] = -1;
-	auxptr->sockpair[1] = -1;
+	spectool_ring_init(&(auxptr->ring));
+#ifdef SPECTOOL_USBXPORT
+	auxptr->xport.active = 0;
+#endif
 
 	/* Will be filled in by setposition later */
 	auxptr->sweepbuf_initialized = 0;
@@ -771,7 +781,6 @@ int wispydbx_usb_init_path(spectool_phy *phydev, char *buspath, char *devpath) {
 void *wispydbx_usb_servicethread(void *aux) {
 	wispydbx_usb_aux *auxptr = (wispydbx_usb_aux *) aux;
 
-	int sock;
 	struct usb_device *dev;
 	struct usb_dev_handle *wispy;
 
@@ -779,17 +788,10 @@ void *wispydbx_usb_servicethread(void *aux) {
 	char buf[sizeof(wispydbx_report_v2)];
 	int bufsz;
 
-	int x = 0, error = 0;
-	fd_set wset;
-
 	struct timeval tm;
 
 	sigset_t signal_set;
 
-	error = 0;
-
-	sock = auxptr->sockpair[1];
-
 	// Size report based on v1 or v2 protocol
 	if (auxptr->protocol == 2)
 		bufsz = sizeof(wispydbx_report_v2);
@@ -808,26 +810,7 @@ void *wispydbx_usb_servicethread(void *aux) {
 #endif
 
 	while (1) {
-		/* wait until we're able to write out to the IPC socket, go into a blocking
-		 * select */
-		FD_ZERO(&wset);
-		FD_SET(sock, &wset);
-
-#ifdef _DEBUG
-		fprintf(stderr, "debug - about to enter blocking select\n");
-#endif
-		if (select(sock + 1, NULL, &wset, NULL, NULL) < 0) {
-			snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-					 "wispydbx_usb poller failed on IPC write select(): %s",
-					 strerror(errno));
-			auxptr->usb_thread_alive = 0;
-			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-			pthread_exit(NULL);
-		}
-
-#ifdef _DEBUG
-		fprintf(stderr, "debug - blocking select completed\n");
-#endif
+		int len = 0;
 
 		if (auxptr->usb_thread_alive == 0) {
 #ifdef _DEBUG
@@ -837,68 +820,60 @@ void *wispydbx_usb_servicethread(void *aux) {
 			pthread_exit(NULL);
 		}
 
-		if (FD_ISSET(sock, &wset) == 0) {
+		/* Don't read until the device is configured */
+		if (auxptr->phydev->state != SPECTOOL_STATE_RUNNING) {
+			tm.tv_sec = 0;
+			tm.tv_usec = 10000;
+			select(0, NULL, NULL, NULL, &tm);
 			continue;
 		}
 
-		/* Get new data only if we haven't requeued */
-		if (error == 0 && auxptr->phydev->state == SPECTOOL_STATE_RUNNING) {
-			int len = 0;
-			memset(buf, 0, bufsz);
+		memset(buf, 0, bufsz);
 
 #ifdef _DEBUG
-			fprintf(stderr, "debug - usb_interrupt_read\n");
+		fprintf(stderr, "debug - usb_interrupt_read\n");
 #endif
-			if ((len = usb_interrupt_read(wispy, 0x82, buf, 
-								   bufsz, TIMEOUT)) <= 0) {
-				if (errno == EAGAIN) {
+		if ((len = usb_interrupt_read(wispy, 0x82, buf, 
+									  bufsz, TIMEOUT)) <= 0) {
+			if (errno == EAGAIN) {
 #ifdef _DEBUG
-					fprintf(stderr, "debug - eagain on usb_interrupt_read\n");
+				fprintf(stderr, "debug - eagain on usb_interrupt_read\n");
 #endif
-					continue;
-				}
+				continue;
+			}
 
 #ifdef _DEBUG
-				fprintf(stderr, "debug - failed - %s\n", strerror(errno));
-				fprintf(stderr, "debug - %s\n", usb_strerror());
+			fprintf(stderr, "debug - failed - %s\n", strerror(errno));
+			fprintf(stderr, "debug - %s\n", usb_strerror());
 #endif
 
-				snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-						 "wispydbx_usb poller failed to read USB data: %s",
-						 strerror(errno));
-				auxptr->usb_thread_alive = 0;
-				auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-				pthread_exit(NULL);
-			}
+			snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
+					 "wispydbx_usb poller failed to read USB data: %s",
+					 strerror(errno));
+			auxptr->usb_thread_alive = 0;
+			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
+			spectool_ring_signal(&(auxptr->ring));
+			pthread_exit(NULL);
+		}
 
 #ifdef _DEBUG
-			fprintf(stderr, "debug - usb read return %d\n", len);
+		fprintf(stderr, "debug - usb read return %d\n", len);
 #endif
 
-			/* Send it to the IPC remote, re-queue on enobufs */
-			if (send(sock, buf, bufsz, 0) < 0) {
-				if (errno == ENOBUFS) {
-					error = 1;
-					continue;
-				}
+		/* Hand it to the poller, waiting for room if it has fallen behind */
+		while (spectool_ring_put(&(auxptr->ring), buf, bufsz) == 0) {
+			SPECTOOL_PHY_COUNT(auxptr->phydev, requeues);
 
-				snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-						 "wispydbx_usb poller failed on IPC send: %s",
-						 strerror(errno));
-				auxptr->usb_thread_alive = 0;
+			if (auxptr->usb_thread_alive == 0) {
 				auxptr->phydev->state = SPECTOOL_STATE_ERROR;
 				pthread_exit(NULL);
 			}
 
+			tm.tv_sec = 0;
+			tm.tv_usec = 1000;
+			select(0, NULL, NULL, NULL, &tm);
 		}
-
-		error = 0;
 	}
-
-	auxptr->usb_thread_alive = 0;
-	send(sock, buf, bufsz, 0);
-	auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-	pthread_exit(NULL);
 }
 
 int wispydbx_usb_getpollfd(spectool_phy *phydev) {
@@ -911,22 +886,18 @@ int wispydbx_usb_getpollfd(spectool_phy *phydev) {
 	}
 
 	// fprintf(stderr, "debug - auxptr sockpair 0 %d\n", auxptr->sockpair[0]);
-	return auxptr->sockpair[0];
+	return spectool_ring_getpollfd(&(auxptr->ring));
 }
 
 int wispydbx_usb_open(spectool_phy *phydev) {
-	int pid_status;
+	int pid_status, async;
 	struct usb_dev_handle *wispy;
 	wispydbx_usb_aux *auxptr = (wispydbx_usb_aux *) phydev->auxptr;
 	wispydbx_startsweep startcmd;
 
-	/* Make the client/server socketpair */
-	if (socketpair(PF_UNIX, SOCK_DGRAM, 0, auxptr->sockpair) < 0) {
-		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-				 "wispydbx_usb open failed to create socket pair for capture "
-				 "process: %s", strerror(errno));
+	/* Make the ring the service thread hands reports over in */
+	if (spectool_ring_open(&(auxptr->ring), phydev->errstr) < 0)
 		return -1;
-	}
 
 	if ((auxptr->devhdl = usb_open(auxptr->dev)) == NULL) {
 		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
@@ -962,7 +933,18 @@ int wispydbx_usb_open(spectool_phy *phydev) {
 
 	// printf("debug - creating thread\n");
 
-	if (pthread_create(&(auxptr->usb_thread), NULL, 
+	async = 0;
+#ifdef SPECTOOL_USBXPORT
+	if (spectool_usbxport_open(&(auxptr->xport), auxptr->devhdl, 0x82, 
+							   SPECTOOL_USBXPORT_INTERRUPT,
+							   auxptr->protocol == 2 ? sizeof(wispydbx_report_v2) :
+							   sizeof(wispydbx_report),
+							   &(auxptr->ring), &(auxptr->usb_thread_alive),
+							   phydev) >= 0)
+		async = 1;
+#endif
+
+	if (async == 0 && pthread_create(&(auxptr->usb_thread), NULL, 
 					   wispydbx_usb_servicethread, auxptr) < 0) {
 		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
 				 "wispydbx_usb capture failed to create thread: %s",
@@ -1029,6 +1011,14 @@ int wispydbx_usb_close(spectool_phy *phydev) {
 	if (aux == NULL)
 		return 0;
 
+	/* Async transfers just get cancelled, there's no thread to wait for */
+#ifdef SPECTOOL_USBXPORT
+	if (aux->xport.active) {
+		spectool_usbxport_close(&(aux->xport));
+		aux->usb_thread_alive = 0;
+	}
+#endif
+
 	/* If the thread is still alive, don't take away the devices it might
 	 * still be reading, wait for it to error down */
 	if (aux->usb_thread_alive) {
@@ -1041,15 +1031,7 @@ int wispydbx_usb_close(spectool_phy *phydev) {
 		aux->devhdl = NULL;
 	}
 
-	if (aux->sockpair[0] >= 0) {
-		close(aux->sockpair[0]);
-		aux->sockpair[0] = -1;
-	}
-
-	if (aux->sockpair[1] >= 0) {
-		close(aux->sockpair[1]);
-		aux->sockpair[1] = -1;
-	}
+	spectool_ring_close(&(aux->ring));
 
 	return 1;
 }
@@ -1064,16 +1046,14 @@ void wispydbx_usb_setcalibration(spectool_phy *phydev, int in_calib) {
 	phydev->state = SPECTOOL_STATE_RUNNING;
 }
 
-int wispydbx_usb_poll(spectool_phy *phydev) {
+/* Handle one report from the service thread */
+int wispydbx_usb_handle_report(spectool_phy *phydev, uint8_t *lbuf, int ret) {
 	wispydbx_usb_aux *auxptr = (wispydbx_usb_aux *) phydev->auxptr;
 
-	// Use v2 report size as it is larger
-	char lbuf[sizeof(wispydbx_report_v2)];
 	int bufsz;
 
 	int x;
 	int base = 0;
-	int ret = 0;
 	int sweep_full = 0;
 
 	wispydbx_report *report;
@@ -1083,10 +1063,6 @@ int wispydbx_usb_poll(spectool_phy *phydev) {
 	uint8_t *data;
 	unsigned int nsamples;
 
-#ifdef _DEBUG
-	fprintf(stderr, "debug - dbx_usb_poll\n");
-#endif
-
 	if (auxptr->protocol == 2) {
 		bufsz = sizeof(wispydbx_report_v2);
 		nsamples = 59;
@@ -1095,48 +1071,15 @@ int wispydbx_usb_poll(spectool_phy *phydev) {
 		nsamples = 61;
 	}
 
-	// printf("debug - usb poll\n");
-
-	/* Push a configure event before anything else */
-	if (auxptr->configured == 0) {
-		auxptr->configured = 1;
-		// printf("debug - usb poll return configured\n");
-		return SPECTOOL_POLL_CONFIGURED;
-	}
-
-	/* Use the error set by the polling thread */
-	if (auxptr->usb_thread_alive == 0) {
-		phydev->state = SPECTOOL_STATE_ERROR;
-		wispydbx_usb_close(phydev);
-		// printf("debug - usb poll return error\n");
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if ((ret = recv(auxptr->sockpair[0], lbuf, bufsz, 0)) < 0) {
-		// printf("debug - usb poll return recv error\n");
-		if (auxptr->usb_thread_alive != 0)
-			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-					 "wispydbx_usb IPC receiver failed to read signal data: %s",
-					 strerror(errno));
-		phydev->state = SPECTOOL_STATE_ERROR;
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if (time(0) - auxptr->last_read > 3) {
-		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-				 "wispydbx_usb didn't see any data for more than 3 seconds, "
-				 "something has gone wrong (was the device removed?)");
-		phydev->state = SPECTOOL_STATE_ERROR;
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if (ret > 0)
-		auxptr->last_read = time(0);
+	/* The async transport reads from open on; reports from before we're 
+	 * configured are no good to us, same as the service thread skipping them */
+	if (phydev->state != SPECTOOL_STATE_RUNNING)
+		return SPECTOOL_POLL_NONE;
 
 	// printf("debug usb poll recv len %d\n", ret);
 	//
 	if (ret < bufsz) {
-		printf("Short report\n");
+		SPECTOOL_PHY_COUNT(phydev, short_reports);
 		return SPECTOOL_POLL_NONE;
 	}
 
@@ -1164,16 +1107,23 @@ int wispydbx_usb_poll(spectool_phy *phydev) {
 	base = packet_index;
 #endif
 
-	if (base == 0)
+	if (base == 0) {
+		/* Starting over before the last sweep filled loses it */
+		if (auxptr->sweepbuf_initialized && auxptr->sweepbase > 0 &&
+			auxptr->sweepbase < auxptr->sweepbuf->num_samples)
+			SPECTOOL_PHY_COUNT(phydev, sweeps_dropped);
+
 		auxptr->sweepbase = 0;
-	else
+	} else {
 		base = auxptr->sweepbase;
+	}
 
 	if (base < 0 || base > auxptr->sweepbuf->num_samples) {
 #ifdef _DEBUG
 		fprintf(stderr, "debug - bunk data, base %d\n", base);
 #endif
 		/* Bunk data, throw it out */
+		SPECTOOL_PHY_COUNT(phydev, bad_base);
 		return SPECTOOL_POLL_NONE;
 	}
 
@@ -1190,6 +1140,7 @@ int wispydbx_usb_poll(spectool_phy *phydev) {
 #ifdef _DEBUG
 		fprintf(stderr, "debug - sweepbuf unitialized\n");
 #endif
+		SPECTOOL_PHY_COUNT(phydev, discarded);
 		return SPECTOOL_POLL_NONE;
 	}
 
@@ -1222,6 +1173,47 @@ int wispydbx_usb_poll(spectool_phy *phydev) {
 	return SPECTOOL_POLL_NONE;
 }
 
+int wispydbx_usb_poll(spectool_phy *phydev) {
+	wispydbx_usb_aux *auxptr = (wispydbx_usb_aux *) phydev->auxptr;
+	int ret, count;
+
+#ifdef _DEBUG
+	fprintf(stderr, "debug - dbx_usb_poll\n");
+#endif
+
+	/* Push a configure event before anything else */
+	if (auxptr->configured == 0) {
+		auxptr->configured = 1;
+		// printf("debug - usb poll return configured\n");
+		return SPECTOOL_POLL_CONFIGURED;
+	}
+
+	/* Use the error set by the polling thread */
+	if (auxptr->usb_thread_alive == 0) {
+		phydev->state = SPECTOOL_STATE_ERROR;
+		wispydbx_usb_close(phydev);
+		// printf("debug - usb poll return error\n");
+		return SPECTOOL_POLL_ERROR;
+	}
+
+	if (time(0) - auxptr->last_read > 3) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "wispydbx_usb didn't see any data for more than 3 seconds, "
+				 "something has gone wrong (was the device removed?)");
+		phydev->state = SPECTOOL_STATE_ERROR;
+		return SPECTOOL_POLL_ERROR;
+	}
+
+	/* Handle everything the service thread has queued, up to the end of a
+	 * sweep */
+	ret = spectool_ring_drain(&(auxptr->ring), phydev, &wispydbx_usb_handle_report, &count);
+
+	if (count > 0)
+		auxptr->last_read = time(0);
+
+	return ret;
+}
+
 int wispydbx_usb_setposition(spectool_phy *phydev, int in_profile, 
 							 int start_khz, int res_hz) {
 	struct usb_dev_handle *wispy;
@@ -87,6 +87,7 @@
 #define WISPY1_USB_CALIBRATE_SWEEPS			10
 
 #include "spectool_container.h"
+#include "spectool_ring.h"
 #include "wispy_hw_gen1.h"
 #include "wispy_hw_24x.h"
 
@@ -120,7 +121,8 @@ typedef struct _wispy1_usb_aux {
 	/* Only allocated during calibration */
 	int8_t *calibrationbuf;
 
-	int sockpair[2];
+	/* Reports from the service thread */
+	spectool_ring ring;
 
 	spectool_phy *phydev;
 } wispy1_usb_aux;
@@ -372,8 +374,7 @@ int wispy1_usb_init_path(spectool_phy *phydev, char *buspath, char *devpath) {
 	auxptr->dev = dev;
 	auxptr->devhdl = NULL;
 	auxptr->phydev = phydev;
-	auxptr->sockpair[0] = -1;
-	auxptr->sockpair[1] = -1;
+	spectool_ring_init(&(auxptr->ring));
 	auxptr->sweepbuf_initialized = 0;
 
 	auxptr->sweepbuf = 
@@ -411,21 +412,14 @@ int wispy1_usb_init_path(spectool_phy *phydev, char *buspath, char *devpath) {
 void *wispy1_usb_servicethread(void *aux) {
 	wispy1_usb_aux *auxptr = (wispy1_usb_aux *) aux;
 
-	int sock;
 	struct usb_device *dev;
 	struct usb_dev_handle *wispy;
 
 	char buf[8];
 	struct timeval tm;
-	int x = 0, error = 0;
-	fd_set wset;
 
 	sigset_t signal_set;
 
-	error = 0;
-
-	sock = auxptr->sockpair[1];
-
 	dev = auxptr->dev;
 	wispy = auxptr->devhdl;
 
@@ -434,82 +428,56 @@ void *wispy1_usb_servicethread(void *aux) {
 	pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
 
 	while (1) {
-		/* wait until we're able to write out to the IPC socket, go into a blocking
-		 * select */
-		FD_ZERO(&wset);
-		FD_SET(sock, &wset);
+		if (auxptr->usb_thread_alive == 0) {
+			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
+			pthread_exit(NULL);
+		}
 
-		if (select(sock + 1, NULL, &wset, NULL, NULL) < 0) {
+		buf[0] = (char) 0xFF;
+
+		/* grab a HID control */
+		if (usb_control_msg(wispy,
+							USB_ENDPOINT_IN + USB_TYPE_CLASS + USB_RECIP_INTERFACE,
+							HID_GET_REPORT, (HID_RT_FEATURE << 8),
+							0, buf, 8, TIMEOUT) == 0) {
 			snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-					 "wispy1_usb poller failed on IPC write select(): %s",
-					 strerror(errno));
+					 "wispy1_usb poller failed on usb_control_msg "
+					 "HID cmd: %s", strerror(errno));
 			auxptr->usb_thread_alive = 0;
 			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
+			spectool_ring_signal(&(auxptr->ring));
 			pthread_exit(NULL);
 		}
 
-		if (auxptr->usb_thread_alive == 0) {
+		if (buf[0] == (char) 0xFF) {
+			snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
+					 "wispy1_usb poller failed on usb_control_msg "
+					 "HID cmd, no data returned, was the device removed?");
+			auxptr->usb_thread_alive = 0;
 			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
+			spectool_ring_signal(&(auxptr->ring));
 			pthread_exit(NULL);
 		}
 
-		if (FD_ISSET(sock, &wset) == 0)
-			continue;
-
-		/* Get new data only if we haven't requeued */
-		if (error == 0) {
-			buf[0] = (char) 0xFF;
-
-			/* grab a HID control */
-			if (usb_control_msg(wispy,
-								USB_ENDPOINT_IN + USB_TYPE_CLASS + USB_RECIP_INTERFACE,
-								HID_GET_REPORT, (HID_RT_FEATURE << 8),
-								0, buf, 8, TIMEOUT) == 0) {
-				snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-						 "wispy1_usb poller failed on usb_control_msg "
-						 "HID cmd: %s", strerror(errno));
-				auxptr->usb_thread_alive = 0;
-				auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-				pthread_exit(NULL);
-			}
+		/* Hand it to the poller, waiting for room if it has fallen behind */
+		while (spectool_ring_put(&(auxptr->ring), buf, 8) == 0) {
+			SPECTOOL_PHY_COUNT(auxptr->phydev, requeues);
 
-			if (buf[0] == (char) 0xFF) {
-				snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-						 "wispy1_usb poller failed on usb_control_msg "
-						 "HID cmd, no data returned, was the device removed?");
-				auxptr->usb_thread_alive = 0;
-				send(sock, buf, 8, 0);
+			if (auxptr->usb_thread_alive == 0) {
 				auxptr->phydev->state = SPECTOOL_STATE_ERROR;
 				pthread_exit(NULL);
 			}
-		}
 
-		/* Send it to the IPC remote, re-queue on enobufs */
-		if (send(sock, buf, 8, 0) < 0) {
-			if (errno == ENOBUFS) {
-				error = 1;
-				continue;
-			}
-
-			snprintf(auxptr->phydev->errstr, SPECTOOL_ERROR_MAX,
-					 "wispy1_usb poller failed on IPC send: %s",
-					 strerror(errno));
-			auxptr->usb_thread_alive = 0;
-			auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-			pthread_exit(NULL);
+			tm.tv_sec = 0;
+			tm.tv_usec = 1000;
+			select(0, NULL, NULL, NULL, &tm);
 		}
 
-		/* Flush and use select as a usleep to wait before reading from USB again */
-		error = 0;
+		/* Use select as a usleep to wait before reading from USB again */
 		tm.tv_sec = 0;
 		tm.tv_usec = 7100;
 		select(0, NULL, NULL, NULL, &tm);
 	}
-
-	auxptr->usb_thread_alive = 0;
-	send(sock, buf, 8, 0);
-	auxptr->phydev->state = SPECTOOL_STATE_ERROR;
-	pthread_exit(NULL);
 }
 
 int wispy1_usb_getpollfd(spectool_phy *phydev) {
@@ -520,20 +488,16 @@ int wispy1_usb_getpollfd(spectool_phy *phydev) {
 		return -1;
 	}
 
-	return auxptr->sockpair[0];
+	return spectool_ring_getpollfd(&(auxptr->ring));
 }
 
 int wispy1_usb_open(spectool_phy *phydev) {
 	int pid_status;
 	wispy1_usb_aux *auxptr = (wispy1_usb_aux *) phydev->auxptr;
 
-	/* Make the client/server socketpair */
-	if (socketpair(PF_UNIX, SOCK_DGRAM, 0, auxptr->sockpair) < 0) {
-		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-				 "wispy1_usb open failed to create socket pair for capture "
-				 "process: %s", strerror(errno));
+	/* Make the ring the service thread hands reports over in */
+	if (spectool_ring_open(&(auxptr->ring), phydev->errstr) < 0)
 		return -1;
-	}
 
 	if ((auxptr->devhdl = usb_open(auxptr->dev)) == NULL) {
 		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
@@ -615,15 +579,7 @@ int wispy1_usb_close(spectool_phy *phydev) {
 		aux->devhdl = NULL;
 	}
 
-	if (aux->sockpair[0] >= 0) {
-		close(aux->sockpair[0]);
-		aux->sockpair[0] = -1;
-	}
-
-	if (aux->sockpair[1] >= 0) {
-		close(aux->sockpair[1]);
-		aux->sockpair[1] = -1;
-	}
+	spectool_ring_close(&(aux->ring));
 
 	return 1;
 }
@@ -655,46 +611,13 @@ void wispy1_usb_setcalibration(spectool_phy *phydev, int in_calib) {
 	}
 }
 
-int wispy1_usb_poll(spectool_phy *phydev) {
+/* Handle one report from the service thread */
+int wispy1_usb_handle_report(spectool_phy *phydev, uint8_t *lbuf, int ret) {
 	wispy1_usb_aux *auxptr = (wispy1_usb_aux *) phydev->auxptr;
-	unsigned char lbuf[8];
-	int x, pos, calfreqs, ret;
+	int x, pos, calfreqs;
 	long amptotal;
 	int adjusted_rssi;
 
-	/* Push a configure event before anything else */
-	if (auxptr->configured == 0) {
-		auxptr->configured = 1;
-		return SPECTOOL_POLL_CONFIGURED;
-	}
-
-	/* Use the error set by the polling thread */
-	if (auxptr->usb_thread_alive == 0) {
-		phydev->state = SPECTOOL_STATE_ERROR;
-		wispy1_usb_close(phydev);
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if ((ret = recv(auxptr->sockpair[0], lbuf, 8, 0)) < 0) {
-		if (auxptr->usb_thread_alive != 0)
-			snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-					 "wispy1_usb IPC receiver failed to read signal data: %s",
-					 strerror(errno));
-		phydev->state = SPECTOOL_STATE_ERROR;
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if (time(0) - auxptr->last_read > 3) {
-		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
-				 "wispy1_usb didn't see any data for more than 3 seconds, "
-				 "something has gone wrong (was the device removed?)");
-		phydev->state = SPECTOOL_STATE_ERROR;
-		return SPECTOOL_POLL_ERROR;
-	}
-
-	if (ret > 0)
-		auxptr->last_read = time(0);
-
 	/* Initialize the sweep buffer when we get to it 
 	 * If we haven't gotten around to a 0 state to initialize the buffer, we throw
 	 * out the sample data until we do. */
@@ -739,6 +662,7 @@ int wispy1_usb_poll(spectool_phy *phydev) {
 		}
 
 	} else if (auxptr->sweepbuf_initialized == 0) {
+		SPECTOOL_PHY_COUNT(phydev, discarded);
 		return SPECTOOL_POLL_NONE;
 	}
 
@@ -781,3 +705,38 @@ int wispy1_usb_poll(spectool_phy *phydev) {
 	return SPECTOOL_POLL_NONE;
 }
 
+int wispy1_usb_poll(spectool_phy *phydev) {
+	wispy1_usb_aux *auxptr = (wispy1_usb_aux *) phydev->auxptr;
+	int ret, count;
+
+	/* Push a configure event before anything else */
+	if (auxptr->configured == 0) {
+		auxptr->configured = 1;
+		return SPECTOOL_POLL_CONFIGURED;
+	}
+
+	/* Use the error set by the polling thread */
+	if (auxptr->usb_thread_alive == 0) {
+		phydev->state = SPECTOOL_STATE_ERROR;
+		wispy1_usb_close(phydev);
+		return SPECTOOL_POLL_ERROR;
+	}
+
+	if (time(0) - auxptr->last_read > 3) {
+		snprintf(phydev->errstr, SPECTOOL_ERROR_MAX,
+				 "wispy1_usb didn't see any data for more than 3 seconds, "
+				 "something has gone wrong (was the device removed?)");
+		phydev->state = SPECTOOL_STATE_ERROR;
+		return SPECTOOL_POLL_ERROR;
+	}
+
+	/* Handle everything the service thread has queued, up to the end of a
+	 * sweep */
+	ret = spectool_ring_drain(&(auxptr->ring), phydev, &wispy1_usb_handle_report, &count);
+
+	if (count > 0)
+		auxptr->last_read = time(0);
+
+	return ret;
+}
+